@@ -0,0 +1,322 @@
+#include "capture.hpp"
+#include <stdexcept>
+
+#ifdef __linux__
+
+#include "lib_utils/format.hpp"
+#include "lib_utils/log.hpp"
+#include <algorithm> // min
+#include <chrono>
+#include <cstdio> // snprintf
+#include <cstring> // memcpy, strerror
+#include <memory>
+#include <thread>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace {
+
+auto const MAX_DATAGRAM_SIZE = 9216; // jumbo frames
+auto const CONTROL_SIZE = CMSG_SPACE(sizeof(timespec)) + CMSG_SPACE(sizeof(uint32_t));
+
+struct Fd {
+	~Fd() {
+		if (fd >= 0)
+			close(fd);
+	}
+	int fd = -1;
+};
+
+sockaddr_in parseGroup(string const& group) {
+	sockaddr_in addr {};
+	addr.sin_family = AF_INET;
+	auto const colon = group.rfind(':');
+	if (colon == string::npos || !inet_aton(group.substr(0, colon).c_str(), &addr.sin_addr))
+		throw runtime_error(format("invalid group '%s', expected <mcast address>:<UDP port>", group));
+	addr.sin_port = htons(atoi(group.c_str() + colon + 1));
+	return addr;
+}
+
+struct LogHost : Modules::KHost {
+	void log(int level, char const* msg) override {
+		g_Log->log((Level)level, msg);
+	}
+	void activate(bool) override {
+	}
+	int32_t* getStatsEntry(char const*) override {
+		return nullptr;
+	}
+};
+
+// One multicast group: its socket, its receive buffers and its capture files.
+struct Group {
+	Group(string const& name, CaptureConfig const& cfg, FileWriter* writer_) : m_cfg(cfg), writer(writer_) {
+		stats.group = name;
+		auto const addr = parseGroup(name);
+
+		socket.fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+		if (socket.fd < 0)
+			throw runtime_error("socket failed");
+
+		int one = 1;
+		setsockopt(socket.fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+		setsockopt(socket.fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof one);
+		setsockopt(socket.fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof one);
+
+		// SO_RCVBUF is capped by net.core.rmem_max, SO_RCVBUFFORCE isn't (privileged)
+		if (setsockopt(socket.fd, SOL_SOCKET, SO_RCVBUFFORCE, &cfg.socketBufferSize, sizeof cfg.socketBufferSize) < 0)
+			setsockopt(socket.fd, SOL_SOCKET, SO_RCVBUF, &cfg.socketBufferSize, sizeof cfg.socketBufferSize);
+		int size = 0;
+		socklen_t sizeLen = sizeof size;
+		getsockopt(socket.fd, SOL_SOCKET, SO_RCVBUF, &size, &sizeLen);
+		if (size / 2 < cfg.socketBufferSize) // the kernel doubles the requested value
+			g_Log->log(Warning, format("%s: asked for a %s bytes socket buffer but was allocated only %s (see net.core.rmem_max)", name, cfg.socketBufferSize, size / 2).c_str());
+
+		if (bind(socket.fd, (sockaddr*)&addr, sizeof addr) < 0)
+			throw runtime_error(format("%s: bind failed: %s", name, strerror(errno)));
+
+		ip_mreq mreq {};
+		mreq.imr_multiaddr = addr.sin_addr;
+		if (!inet_aton(cfg.interfaceAddr.c_str(), &mreq.imr_interface))
+			throw runtime_error(format("invalid interface address '%s'", cfg.interfaceAddr));
+		if (setsockopt(socket.fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof mreq) < 0)
+			throw runtime_error(format("%s: can't join the multicast group: %s", name, strerror(errno)));
+
+		// <path>_<address>_<port>_<index><ext>
+		auto const path = cfg.outputPath;
+		auto const dot = path.rfind('.');
+		auto const hasExt = dot != string::npos && (path.rfind('/') == string::npos || dot > path.rfind('/'));
+		filePrefix = format("%s_%s_%s_", hasExt ? path.substr(0, dot) : path, inet_ntoa(addr.sin_addr), (int)ntohs(addr.sin_port));
+		fileExt = hasExt ? path.substr(dot) : "";
+
+		auto const n = max(1, cfg.batchSize);
+		buffers.resize(n * MAX_DATAGRAM_SIZE);
+		control.resize(n * CONTROL_SIZE);
+		iovs.resize(n);
+		msgs.resize(n);
+		for (int i = 0; i < n; ++i) {
+			iovs[i].iov_base = &buffers[i * MAX_DATAGRAM_SIZE];
+			iovs[i].iov_len = MAX_DATAGRAM_SIZE;
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_control = &control[i * CONTROL_SIZE];
+		}
+	}
+
+	// one batch. Returns false when the socket is drained.
+	bool receive() {
+		for (auto& msg : msgs)
+			msg.msg_hdr.msg_controllen = CONTROL_SIZE;
+
+		auto const n = recvmmsg(socket.fd, msgs.data(), msgs.size(), MSG_DONTWAIT, nullptr);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return false;
+			throw runtime_error(format("%s: recvmmsg failed: %s", stats.group, strerror(errno)));
+		}
+
+		for (int i = 0; i < n; ++i)
+			onDatagram(msgs[i], &buffers[i * MAX_DATAGRAM_SIZE]);
+
+		return n == (int)msgs.size();
+	}
+
+	Fd socket;
+	GroupStats stats;
+	unique_ptr<AsyncFile> file; // closed asynchronously
+
+private:
+	void onDatagram(mmsghdr& msg, uint8_t const* payload) {
+		int64_t timeInNs = 0;
+		for (auto c = CMSG_FIRSTHDR(&msg.msg_hdr); c; c = CMSG_NXTHDR(&msg.msg_hdr, c)) {
+			if (c->cmsg_level != SOL_SOCKET)
+				continue;
+			if (c->cmsg_type == SCM_TIMESTAMPNS) {
+				timespec ts;
+				memcpy(&ts, CMSG_DATA(c), sizeof ts);
+				timeInNs = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+			} else if (c->cmsg_type == SO_RXQ_OVFL) {
+				uint32_t drops;
+				memcpy(&drops, CMSG_DATA(c), sizeof drops);
+				stats.kernelDrops = drops; // cumulative
+			}
+		}
+
+		if (lastTimeInNs && timeInNs)
+			stats.maxGapInUs = max(stats.maxGapInUs, (timeInNs - lastTimeInNs) / 1000);
+		lastTimeInNs = timeInNs;
+
+		if (msg.msg_hdr.msg_flags & MSG_TRUNC)
+			stats.truncated++;
+		auto const len = min<size_t>(msg.msg_len, MAX_DATAGRAM_SIZE);
+		stats.datagrams++;
+		stats.bytes += len;
+
+		if (!writer)
+			return;
+
+		auto const full = m_cfg.maxFileSize && fileSize + (int64_t)len > m_cfg.maxFileSize;
+		auto const old = m_cfg.maxFileDurationInMs && timeInNs - fileStartInNs >= m_cfg.maxFileDurationInMs * 1000000;
+		if (file && (full || old))
+			file.reset();
+
+		if (!file) {
+			char index[16];
+			snprintf(index, sizeof index, "%04d", (int)stats.files);
+			file = writer->open(filePrefix + index + fileExt);
+			stats.files++;
+			fileSize = 0;
+			fileStartInNs = timeInNs;
+		}
+
+		file->write({ payload, len });
+		fileSize += len;
+	}
+
+	CaptureConfig const& m_cfg;
+	FileWriter* const writer;
+	string filePrefix, fileExt;
+	int64_t fileSize = 0, fileStartInNs = 0, lastTimeInNs = 0;
+
+	vector<uint8_t> buffers; // MAX_DATAGRAM_SIZE per datagram of a batch
+	vector<uint8_t> control;
+	vector<iovec> iovs;
+	vector<mmsghdr> msgs;
+};
+
+}
+
+void runCapture(CaptureConfig const& cfg, std::atomic<bool> const& stop, std::function<void(std::vector<GroupStats> const&)> onReport) {
+	if (cfg.groups.empty())
+		throw runtime_error("no multicast group to capture");
+
+	LogHost host;
+	unique_ptr<FileWriter> writer;
+	if (!cfg.outputPath.empty())
+		writer = createFileWriter(cfg.writer, &host);
+
+	vector<unique_ptr<Group>> groups;
+	for (auto& name : cfg.groups)
+		groups.push_back(make_unique<Group>(name, cfg, writer.get()));
+
+	auto getStats = [&]() {
+		vector<GroupStats> r;
+		for (auto& g : groups)
+			r.push_back(g->stats);
+		return r;
+	};
+
+	Fd epoll;
+	epoll.fd = epoll_create1(0);
+	if (epoll.fd < 0)
+		throw runtime_error("epoll_create1 failed");
+	for (size_t i = 0; i < groups.size(); ++i) {
+		epoll_event ev {};
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		if (epoll_ctl(epoll.fd, EPOLL_CTL_ADD, groups[i]->socket.fd, &ev) < 0)
+			throw runtime_error("epoll_ctl failed");
+	}
+
+	auto nextReport = chrono::steady_clock::now() + chrono::seconds(1);
+	vector<epoll_event> events(groups.size());
+	while (!stop) {
+		auto const n = epoll_wait(epoll.fd, events.data(), events.size(), 100);
+		// a few batches per ready socket: the level-triggered epoll brings us back to the busy ones
+		for (int i = 0; i < n; ++i)
+			for (int batch = 0; batch < 16 && groups[events[i].data.u32]->receive(); ++batch) {
+			}
+
+		if (chrono::steady_clock::now() >= nextReport) {
+			onReport(getStats());
+			nextReport += chrono::seconds(1);
+		}
+	}
+
+	for (auto& g : groups)
+		g->file.reset();
+	if (writer) {
+		writer->waitForCompletion();
+		auto const errors = writer->getStats().errors;
+		if (errors)
+			g_Log->log(Error, format("%s capture file write errors", errors).c_str());
+	}
+	onReport(getStats());
+}
+
+int64_t runSender(std::vector<std::string> const& groups, int datagramSize, int64_t rateInMbps, std::atomic<bool> const& stop) {
+	auto const BATCH = 64;
+	atomic<int64_t> sent(0);
+
+	auto sendToGroup = [&](string const& group) {
+		auto const addr = parseGroup(group);
+		Fd s;
+		s.fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+		in_addr loopback {};
+		inet_aton("127.0.0.1", &loopback);
+		setsockopt(s.fd, IPPROTO_IP, IP_MULTICAST_IF, &loopback, sizeof loopback);
+		if (connect(s.fd, (sockaddr const*)&addr, sizeof addr) < 0) {
+			g_Log->log(Error, format("%s: connect failed: %s", group, strerror(errno)).c_str());
+			return;
+		}
+
+		// TS packets: sync byte and null PID
+		vector<uint8_t> payload(datagramSize, 0xff);
+		for (int i = 0; i + 188 <= datagramSize; i += 188) {
+			payload[i + 0] = 0x47;
+			payload[i + 1] = 0x1f;
+			payload[i + 2] = 0xff;
+			payload[i + 3] = 0x10;
+		}
+		iovec iov { payload.data(), payload.size() };
+		vector<mmsghdr> msgs(BATCH);
+		for (auto& msg : msgs) {
+			msg.msg_hdr.msg_iov = &iov;
+			msg.msg_hdr.msg_iovlen = 1;
+		}
+
+		auto const bytesPerSecond = rateInMbps * 1000000.0 / 8 / groups.size();
+		auto const start = chrono::steady_clock::now();
+		int64_t bytes = 0;
+		while (!stop) {
+			if (bytesPerSecond > 0)
+				this_thread::sleep_until(start + chrono::microseconds((int64_t)(bytes * 1000000.0 / bytesPerSecond)));
+
+			auto const n = sendmmsg(s.fd, msgs.data(), msgs.size(), 0);
+			if (n < 0) {
+				if (errno == ENOBUFS || errno == EAGAIN || errno == EINTR)
+					continue;
+				g_Log->log(Error, format("%s: sendmmsg failed: %s", group, strerror(errno)).c_str());
+				return;
+			}
+			bytes += n * datagramSize;
+			sent += n;
+		}
+	};
+
+	vector<thread> threads;
+	for (auto& group : groups)
+		threads.push_back(thread(sendToGroup, group));
+	for (auto& t : threads)
+		t.join();
+	return sent;
+}
+
+#else
+
+void runCapture(CaptureConfig const&, std::atomic<bool> const&, std::function<void(std::vector<GroupStats> const&)>) {
+	throw std::runtime_error("the capture mode is only supported on Linux");
+}
+
+int64_t runSender(std::vector<std::string> const&, int, int64_t, std::atomic<bool> const&) {
+	throw std::runtime_error("the capture mode is only supported on Linux");
+}
+
+#endif
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "lib_media/common/file_writer.hpp"
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+// High-rate multicast capture (Linux): one socket per group, batched reception,
+// no allocation per datagram. Each group is written to its own rotating capture files
+// through the asynchronous file writer.
+struct CaptureConfig {
+	std::vector<std::string> groups; // <mcast address>:<UDP port>
+	std::string interfaceAddr = "0.0.0.0"; // the groups are joined on this interface
+	std::string outputPath; // <path>_<address>_<port>_<index><ext>. Empty: nothing is written
+	int64_t maxFileSize = 0; // bytes. 0: no limit
+	int64_t maxFileDurationInMs = 0; // measured with the kernel receive timestamps. 0: no limit
+	int batchSize = 64; // datagrams per recvmmsg() call
+	int socketBufferSize = 32 * 1024 * 1024;
+	FileWriterConfig writer;
+};
+
+struct GroupStats {
+	std::string group;
+	int64_t datagrams = 0;
+	int64_t bytes = 0;
+	int64_t kernelDrops = 0; // SO_RXQ_OVFL: dropped because the socket buffer was full
+	int64_t truncated = 0; // larger than the receive buffers
+	int64_t maxGapInUs = 0; // longest interval between two receive timestamps
+	int64_t files = 0;
+};
+
+// Runs until 'stop' is set. 'onReport' is called about every second, and once at the end.
+void runCapture(CaptureConfig const& cfg, std::atomic<bool> const& stop, std::function<void(std::vector<GroupStats> const&)> onReport);
+
+// Benchmark: sends TS-like datagrams to the groups, on loopback.
+// 'rateInMbps' is the total rate, 0 means as fast as possible. Returns the number of datagrams sent.
+int64_t runSender(std::vector<std::string> const& groups, int datagramSize, int64_t rateInMbps, std::atomic<bool> const& stop);
@@ -3,6 +3,10 @@
 #include "plugins/SocketInput/socket_input.hpp"
 #include "lib_media/out/file.hpp"
 #include "lib_media/out/null.hpp"
+#include "capture.hpp"
+#include <chrono>
+#include <csignal>
+#include <thread>
 
 using namespace std;
 using namespace Modules;
@@ -12,6 +16,18 @@ struct Config {
 	SocketInputConfig mcast;
 	std::string outputPath;
 	bool help = false;
+
+	// capture mode
+	bool capture = false;
+	std::vector<std::string> groups;
+	std::string interfaceAddr = "0.0.0.0";
+	int maxFileSizeInMB = 0;
+	int maxFileDurationInSec = 0;
+	int durationInSec = 0;
+	int batchSize = 64;
+	bool directIo = false;
+	int benchmarkInSec = 0;
+	int benchmarkRateInMbps = 0;
 };
 
 namespace {
@@ -23,15 +39,38 @@ Config parseCommandLine(int argc, char const* argv[]) {
 	CmdLineOptions opt;
 	opt.addFlag("h", "help", &cfg.help, "Print usage and exit");
 	opt.add("o", "output", &cfg.outputPath, "Output file path");
+	opt.addFlag("c", "capture", &cfg.capture, "High-rate capture mode (Linux): several groups, batched reception, rotating files named <output>_<address>_<port>_<index>");
+	opt.add("i", "interface", &cfg.interfaceAddr, "[capture] Address of the interface the groups are joined on");
+	opt.add("s", "max-file-size", &cfg.maxFileSizeInMB, "[capture] Maximum capture file size, in MB");
+	opt.add("t", "max-file-duration", &cfg.maxFileDurationInSec, "[capture] Maximum capture file duration, in seconds");
+	opt.add("d", "duration", &cfg.durationInSec, "[capture] Stop after this many seconds");
+	opt.add("b", "batch", &cfg.batchSize, "[capture] Datagrams received per system call");
+	opt.addFlag("D", "direct-io", &cfg.directIo, "[capture] Write the capture files with O_DIRECT");
+	opt.add("B", "benchmark", &cfg.benchmarkInSec, "[capture] Self-contained benchmark: sends to the groups on loopback for this many seconds");
+	opt.add("r", "benchmark-rate", &cfg.benchmarkRateInMbps, "[capture] Benchmark total send rate in Mbps (default: as fast as possible)");
 
 	auto files = opt.parse(argc, argv);
 
 	if(cfg.help) {
-		printf("Usage: %s [options] <mcast address>:<UDP port>\nOptions:\n", argv[0]);
+		printf("Usage: %s [options] <mcast address>:<UDP port> [<mcast address>:<UDP port> ...]\nOptions:\n", argv[0]);
 		opt.printHelp();
 		return cfg;
 	}
 
+	if(cfg.benchmarkInSec) {
+		cfg.capture = true;
+		cfg.interfaceAddr = "127.0.0.1";
+		if(files.empty())
+			files = { "239.255.0.1:5001", "239.255.0.2:5002", "239.255.0.3:5003", "239.255.0.4:5004" };
+	}
+
+	if(cfg.capture) {
+		if(files.empty())
+			throw std::runtime_error("invalid command line, use --help");
+		cfg.groups = files;
+		return cfg;
+	}
+
 	if (files.size() != 1)
 		throw std::runtime_error("invalid command line, use --help");
 
@@ -55,6 +94,81 @@ void declarePipeline(Config const& cfg, Pipeline& pipeline) {
 	pipeline.connect(receiver, sink);
 }
 
+std::atomic<bool> g_stop(false);
+
+void onSignal(int) {
+	g_stop = true;
+}
+
+void runCaptureMode(Config const& cfg) {
+	CaptureConfig capture;
+	capture.groups = cfg.groups;
+	capture.interfaceAddr = cfg.interfaceAddr;
+	capture.outputPath = cfg.outputPath;
+	capture.maxFileSize = (int64_t)cfg.maxFileSizeInMB * 1024 * 1024;
+	capture.maxFileDurationInMs = (int64_t)cfg.maxFileDurationInSec * 1000;
+	capture.batchSize = cfg.batchSize;
+	capture.writer.directIo = cfg.directIo;
+
+	std::signal(SIGINT, onSignal);
+	std::signal(SIGTERM, onSignal);
+
+	std::atomic<bool> stopSender(false);
+	int64_t sent = 0;
+	std::thread sender;
+
+	auto lastTime = std::chrono::steady_clock::now();
+	std::vector<GroupStats> last(cfg.groups.size());
+	int seconds = 0;
+
+	runCapture(capture, g_stop, [&](std::vector<GroupStats> const& stats) {
+		auto const now = std::chrono::steady_clock::now();
+		auto const elapsed = std::chrono::duration<double>(now - lastTime).count();
+		for(size_t i = 0; i < stats.size(); ++i) {
+			auto& s = stats[i];
+			fprintf(stderr, "%s: %8.1f Mbps, %8.0f datagrams/s, kernel drops %lld, truncated %lld, max receive gap %lld us, files %lld\n",
+			    s.group.c_str(),
+			    (s.bytes - last[i].bytes) * 8 / elapsed / 1e6,
+			    (s.datagrams - last[i].datagrams) / elapsed,
+			    (long long)s.kernelDrops, (long long)s.truncated, (long long)s.maxGapInUs, (long long)s.files);
+		}
+		last = stats;
+		lastTime = now;
+
+		if(cfg.benchmarkInSec) {
+			// the groups are joined: start sending. Then let the receiver drain for one second
+			if(seconds == 0)
+				sender = std::thread([&]() {
+				sent = runSender(cfg.groups, 7 * 188, cfg.benchmarkRateInMbps, stopSender);
+			});
+			else if(seconds == cfg.benchmarkInSec)
+				stopSender = true;
+			else if(seconds > cfg.benchmarkInSec)
+				g_stop = true;
+		} else if(cfg.durationInSec && seconds + 1 >= cfg.durationInSec) {
+			g_stop = true;
+		}
+		++seconds;
+	});
+
+	stopSender = true;
+	if(sender.joinable())
+		sender.join();
+
+	if(cfg.benchmarkInSec) {
+		int64_t received = 0, bytes = 0, drops = 0;
+		for(auto& s : last) {
+			received += s.datagrams;
+			bytes += s.bytes;
+			drops += s.kernelDrops;
+		}
+		printf("Benchmark: %d groups, sent %lld datagrams, received %lld (%.3f%% lost, kernel drops %lld), %.2f Gbps\n",
+		    (int)cfg.groups.size(), (long long)sent, (long long)received,
+		    sent ? (sent - received) * 100.0 / sent : 0.0, (long long)drops,
+		    bytes * 8.0 / cfg.benchmarkInSec / 1e9);
+	}
+}
+
 }
 
 int safeMain(int argc, char const* argv[]) {
@@ -62,6 +176,11 @@ int safeMain(int argc, char const* argv[]) {
 	if(cfg.help)
 		return 0;
 
+	if(cfg.capture) {
+		runCaptureMode(cfg);
+		return 0;
+	}
+
 	Pipeline pipeline(nullptr, true);
 	declarePipeline(cfg, pipeline);
 	pipeline.start();
@@ -6,6 +6,7 @@ EXE_MCASTDUMP_SRCS:=\
   $(LIB_PIPELINE_SRCS)\
   $(LIB_UTILS_SRCS)\
   $(LIB_APPCOMMON_SRCS)\
+  $(MYDIR)/capture.cpp\
   $(MYDIR)/main.cpp\
 
 $(BIN)/mcastdump.exe: $(EXE_MCASTDUMP_SRCS:%=$(BIN)/%.o)
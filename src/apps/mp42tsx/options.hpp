@@ -6,6 +6,7 @@ struct mp42tsXOptions {
 	std::string url;
 	std::string output = "output.ts";
 	bool isLive = false;
+	bool vbr = false;
 };
 
 mp42tsXOptions parseCommandLine(int argc, char const* argv[]);
@@ -16,6 +16,7 @@ void declarePipeline(Pipeline &pipeline, const mp42tsXOptions &opt) {
 
 	TsMuxerConfig muxCfg {};
 	muxCfg.muxRate = 5 * 1000 * 1000;
+	muxCfg.vbr = opt.vbr;
 	auto mux = pipeline.add("TsMuxer", &muxCfg);
 	for (int i = 0; i < demux->getNumOutputs(); ++i) {
 		auto flow = GetOutputPin(demux, i);
@@ -54,9 +54,7 @@ struct Restamper : Module {
 
 			auto dataOut = dataIn->clone();
 			dataOut->set(PresentationTime{restampedTime});
-			try {
-				dataOut->set(DecodingTime{dataIn->get<DecodingTime>().time - startTime + shift});
-			} catch(...) {}
+			dataOut->set(DecodingTime{restampedTime});
 
 			outputs[idx]->post(dataOut);
 		}
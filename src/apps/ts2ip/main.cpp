@@ -23,6 +23,7 @@ Config parseCommandLine(int argc, char const* argv[]) {
 	CmdLineOptions opt;
 	opt.addFlag("h", "help", &cfg.help, "Print usage and exit.");
 	opt.add("b", "bitrate", &cfg.bitrate, "Set sending bitrate (default: 50Mbps)");
+	opt.addFlag("p", "paced", &cfg.udpConfig.paced, "Pace each datagram (SO_TXTIME, or sub-millisecond user-space pacing) instead of regulating per millisecond.");
 
 	auto files = opt.parse(argc, argv);
 
@@ -71,7 +72,9 @@ int safeMain(int argc, char const* argv[]) {
 	FileInputConfig fileInputConfig;
 	fileInputConfig.filename = cfg.path;
 	fileInputConfig.blockSize = 7 * 188;
-	auto file = regulate(restamp(pipeline.add("FileInput", &fileInputConfig)));
+	auto file = restamp(pipeline.add("FileInput", &fileInputConfig));
+	if(!cfg.udpConfig.paced)
+		file = regulate(file);
 	auto sender = pipeline.add("UdpOutput", &cfg.udpConfig);
 	pipeline.connect(file, sender);
 	pipeline.start();
@@ -0,0 +1,48 @@
+#include "crc.hpp"
+
+// Slice-by-8: table[k][i] is the CRC of byte 'i' followed by 'k' zero bytes.
+// Processes 8 bytes per iteration with independent lookups.
+struct CrcTables {
+	uint32_t data[8][256];
+};
+
+static constexpr CrcTables initCrc(int bits, uint32_t poly) {
+	CrcTables r {};
+	for (int i = 0; i < 256; i++) {
+		uint32_t c = i << 24;
+		for (int j = 0; j < 8; j++)
+			c = (c << 1) ^ ((poly << (32 - bits)) & (((int32_t) c) >> 31));
+		r.data[0][i] = c;
+	}
+
+	for (int k = 1; k < 8; k++)
+		for (int i = 0; i < 256; i++)
+			r.data[k][i] = (r.data[k-1][i] << 8) ^ r.data[0][r.data[k-1][i] >> 24];
+
+	return r;
+}
+
+static uint32_t readBE32(const uint8_t* p) {
+	return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+uint32_t Crc32(SpanC data) {
+	static constexpr auto tables = initCrc(32, 0x04C11DB7);
+	auto const& t = tables.data;
+	uint32_t r = 0xffffffff;
+
+	auto p = data.ptr;
+	auto n = data.len;
+
+	for(; n >= 8; p += 8, n -= 8) {
+		auto const hi = r ^ readBE32(p);
+		auto const lo = readBE32(p + 4);
+		r = t[7][hi >> 24] ^ t[6][(hi >> 16) & 0xff] ^ t[5][(hi >> 8) & 0xff] ^ t[4][hi & 0xff]
+		    ^ t[3][lo >> 24] ^ t[2][(lo >> 16) & 0xff] ^ t[1][(lo >> 8) & 0xff] ^ t[0][lo & 0xff];
+	}
+
+	for(; n > 0; ++p, --n)
+		r = (r << 8) ^ t[0][((r >> 24) ^ *p) & 0xff];
+
+	return r;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstdint>
+#include "lib_modules/core/buffer.hpp" // SpanC
+
+// MPEG-2 CRC32 (ISO/IEC 13818-1, annex A): used by PSI sections.
+// Computed over a whole section (CRC included), the result is zero.
+uint32_t Crc32(SpanC data);
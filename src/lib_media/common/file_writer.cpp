@@ -0,0 +1,825 @@
+#include "file_writer.hpp"
+#include "lib_utils/format.hpp"
+#include "lib_utils/log_sink.hpp" // Error
+#include "lib_utils/os.hpp" // dirExists, mkdir
+#include "lib_utils/threadpool.hpp"
+#include <algorithm> // std::min
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib> // free
+#include <cstring> // memcpy, strerror
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#include <malloc.h> // _aligned_malloc
+#else
+#include <unistd.h>
+#endif
+
+#ifndef O_DIRECT
+#define O_DIRECT 0 // not supported: buffered writes
+#endif
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace Modules;
+
+namespace {
+
+auto const ALIGNMENT = 4096;
+
+#ifdef _WIN32
+uint8_t* allocAligned(size_t size) {
+	return (uint8_t*)_aligned_malloc(size, ALIGNMENT);
+}
+void freeAligned(uint8_t* p) {
+	_aligned_free(p);
+}
+// the operations on a file are never concurrent
+int64_t pwrite(int fd, void const* ptr, size_t len, int64_t offset) {
+	if (_lseeki64(fd, offset, SEEK_SET) < 0)
+		return -1;
+	return _write(fd, ptr, (unsigned)len);
+}
+int fsync(int fd) {
+	return _commit(fd);
+}
+#define O_CLOEXEC O_BINARY
+#else
+uint8_t* allocAligned(size_t size) {
+	void* p = nullptr;
+	if (posix_memalign(&p, ALIGNMENT, size))
+		return nullptr;
+	return (uint8_t*)p;
+}
+void freeAligned(uint8_t* p) {
+	free(p);
+}
+#endif
+
+std::string dirName(std::string path) {
+	auto i = path.rfind('/');
+	if(i == std::string::npos)
+		return "";
+	return path.substr(0, i);
+}
+
+struct Buffer {
+	uint8_t* ptr;
+	int refs; // the file filling it, and the writes
+	int pendingWrites;
+};
+
+struct Op {
+	enum Type { Open, Fallocate, Write, Fsync, Close, Unlink } type;
+	bool direct = false; // on the O_DIRECT descriptor
+	Buffer* buffer = nullptr;
+	uint8_t const* ptr = nullptr;
+	size_t len = 0;
+	int64_t offset = 0;
+};
+
+// the operations on a path, performed one at a time
+struct FileState {
+	std::string path;
+	int fd = -1, directFd = -1;
+	bool failed = false; // the open failed: the writes are skipped
+	bool busy = false;
+	int handles = 0;
+	Op current;
+	std::deque<Op> ops;
+
+	int getFd(Op const& op) const {
+		if (op.direct && directFd >= 0)
+			return directFd;
+		return op.type == Op::Close && op.direct ? -1 : fd;
+	}
+};
+
+// returns the result, or -errno
+int64_t execute(FileState const* file, Op const& op, int fd) {
+	int64_t res = 0;
+	switch (op.type) {
+	case Op::Open:
+		res = ::open(file->path.c_str(), op.direct ? O_WRONLY | O_CLOEXEC | O_DIRECT : O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		break;
+	case Op::Fallocate:
+#ifdef __linux__
+		res = fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, op.offset);
+#endif
+		break;
+	case Op::Write:
+		res = pwrite(fd, op.ptr, op.len, op.offset);
+		break;
+	case Op::Fsync:
+		res = fsync(fd);
+		break;
+	case Op::Close:
+		res = ::close(fd);
+		break;
+	case Op::Unlink:
+		res = unlink(file->path.c_str());
+		break;
+	}
+	return res < 0 ? -errno : res;
+}
+
+struct Backend {
+	virtual ~Backend() = default;
+	// performs 'file->current' on 'fd', then calls onComplete
+	virtual void submit(FileState* file, int fd) = 0;
+};
+
+using CompletionFunc = std::function<void(FileState*, int64_t)>;
+using FailureFunc = std::function<void(std::string const&)>; // the backend can't be used anymore
+
+struct ThreadPoolBackend : Backend {
+		ThreadPoolBackend(CompletionFunc onComplete, int numThreads)
+			: onComplete(onComplete), pool("FileWriter", numThreads) {
+		}
+
+		void submit(FileState* file, int fd) override {
+			auto const op = file->current;
+			pool.submit([this, file, op, fd]() {
+				onComplete(file, execute(file, op, fd));
+			});
+		}
+
+	private:
+		CompletionFunc const onComplete;
+		ThreadPool pool;
+};
+
+#ifdef __linux__
+// io_uring without liburing: a single thread submits and reaps the completions.
+// When io_uring_enter() fails, onFailure is called, then the requests not completed yet are failed.
+struct IoUringBackend : Backend {
+		static std::unique_ptr<Backend> create(CompletionFunc onComplete, FailureFunc onFailure) {
+			std::unique_ptr<IoUringBackend> r(new IoUringBackend(onComplete, onFailure));
+			if (!r->init())
+				return nullptr;
+			r->thread = std::thread(&IoUringBackend::run, r.get());
+			return std::unique_ptr<Backend>(r.release());
+		}
+
+		~IoUringBackend() {
+			if (thread.joinable()) {
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					stopping = true;
+				}
+				wakeUp();
+				thread.join();
+			}
+			if (sqes)
+				munmap(sqes, numEntries * sizeof(io_uring_sqe));
+			if (cqRing && cqRing != sqRing)
+				munmap(cqRing, cqRingSize);
+			if (sqRing)
+				munmap(sqRing, sqRingSize);
+			if (ringFd >= 0)
+				::close(ringFd);
+			if (eventFd >= 0)
+				::close(eventFd);
+		}
+
+		void submit(FileState* file, int fd) override {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				pending.push_back(new Request{ file, file->current, fd });
+			}
+			wakeUp();
+		}
+
+	private:
+		struct Request {
+			FileState* file;
+			Op op;
+			int fd;
+		};
+
+		static const unsigned ENTRIES = 128;
+
+		IoUringBackend(CompletionFunc onComplete, FailureFunc onFailure) : onComplete(onComplete), onFailure(onFailure) {
+		}
+
+		bool init() {
+			io_uring_params p {};
+			ringFd = (int)syscall(__NR_io_uring_setup, ENTRIES, &p);
+			if (ringFd < 0)
+				return false;
+
+			// the kernel must support all the operations we need
+			{
+				std::vector<uint8_t> mem(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+				auto probe = (io_uring_probe*)mem.data();
+				if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, probe, 256) < 0)
+					return false;
+				for (auto op : { IORING_OP_OPENAT, IORING_OP_FALLOCATE, IORING_OP_WRITE, IORING_OP_FSYNC, IORING_OP_CLOSE, IORING_OP_UNLINKAT, IORING_OP_READ })
+					if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+						return false;
+			}
+
+			numEntries = p.sq_entries;
+			sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+			cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+			if (p.features & IORING_FEAT_SINGLE_MMAP)
+				sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+			sqRing = (uint8_t*)mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+			if (sqRing == MAP_FAILED) {
+				sqRing = nullptr;
+				return false;
+			}
+			if (p.features & IORING_FEAT_SINGLE_MMAP) {
+				cqRing = sqRing;
+			} else {
+				cqRing = (uint8_t*)mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+				if (cqRing == MAP_FAILED) {
+					cqRing = nullptr;
+					return false;
+				}
+			}
+			sqes = (io_uring_sqe*)mmap(nullptr, numEntries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+			if (sqes == MAP_FAILED) {
+				sqes = nullptr;
+				return false;
+			}
+
+			sqTail = (unsigned*)(sqRing + p.sq_off.tail);
+			localTail = *sqTail;
+			sqMask = *(unsigned*)(sqRing + p.sq_off.ring_mask);
+			sqArray = (unsigned*)(sqRing + p.sq_off.array);
+			cqHead = (unsigned*)(cqRing + p.cq_off.head);
+			cqTail = (unsigned*)(cqRing + p.cq_off.tail);
+			cqMask = *(unsigned*)(cqRing + p.cq_off.ring_mask);
+			cqes = (io_uring_cqe*)(cqRing + p.cq_off.cqes);
+
+			eventFd = eventfd(0, EFD_CLOEXEC);
+			return eventFd >= 0;
+		}
+
+		void wakeUp() {
+			uint64_t one = 1;
+			if (::write(eventFd, &one, sizeof one) < 0) {
+				// the counter can't overflow
+			}
+		}
+
+		io_uring_sqe* getSqe() {
+			auto const idx = localTail & sqMask;
+			sqArray[idx] = idx;
+			localTail++;
+			unsubmitted++;
+			auto sqe = &sqes[idx];
+			memset(sqe, 0, sizeof *sqe);
+			return sqe;
+		}
+
+		void prepare(Request* req) {
+			auto sqe = getSqe();
+			sqe->user_data = (uint64_t)(uintptr_t)req;
+			sqe->fd = req->fd;
+			auto const& op = req->op;
+			switch (op.type) {
+			case Op::Open:
+				sqe->opcode = IORING_OP_OPENAT;
+				sqe->fd = AT_FDCWD;
+				sqe->addr = (uint64_t)(uintptr_t)req->file->path.c_str();
+				sqe->len = 0644;
+				sqe->open_flags = op.direct ? O_WRONLY | O_CLOEXEC | O_DIRECT : O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+				break;
+			case Op::Fallocate:
+				sqe->opcode = IORING_OP_FALLOCATE;
+				sqe->addr = (uint64_t)op.offset;
+				sqe->len = FALLOC_FL_KEEP_SIZE;
+				break;
+			case Op::Write:
+				sqe->opcode = IORING_OP_WRITE;
+				sqe->addr = (uint64_t)(uintptr_t)op.ptr;
+				sqe->len = (unsigned)op.len;
+				sqe->off = (uint64_t)op.offset;
+				break;
+			case Op::Fsync:
+				sqe->opcode = IORING_OP_FSYNC;
+				break;
+			case Op::Close:
+				sqe->opcode = IORING_OP_CLOSE;
+				break;
+			case Op::Unlink:
+				sqe->opcode = IORING_OP_UNLINKAT;
+				sqe->fd = AT_FDCWD;
+				sqe->addr = (uint64_t)(uintptr_t)req->file->path.c_str();
+				break;
+			}
+		}
+
+		void prepareWakeUp() {
+			auto sqe = getSqe();
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = eventFd;
+			sqe->addr = (uint64_t)(uintptr_t)&eventValue;
+			sqe->len = sizeof eventValue;
+			sqe->user_data = 0;
+		}
+
+		void run() {
+			int inFlight = 1;
+			prepareWakeUp();
+			while (true) {
+				std::vector<Request*> reqs;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					// bounded by the SQ size: the CQ (twice larger) can't overflow
+					while (!pending.empty() && inFlight < (int)numEntries) {
+						reqs.push_back(pending.front());
+						pending.pop_front();
+						inFlight++;
+					}
+					if (stopping && pending.empty() && inFlight == 1)
+						break;
+				}
+				for (auto req : reqs) {
+					prepare(req);
+					inRing.insert(req);
+				}
+
+				__atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+				auto const ret = syscall(__NR_io_uring_enter, ringFd, unsubmitted, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+				if (ret >= 0) {
+					unsubmitted -= (unsigned)ret;
+				} else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+					fail(errno);
+					return;
+				}
+
+				auto head = *cqHead;
+				auto const tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+				std::vector<std::pair<Request*, int64_t>> completed;
+				for (; head != tail; ++head) {
+					auto const& cqe = cqes[head & cqMask];
+					if (cqe.user_data == 0)
+						prepareWakeUp();
+					else
+						completed.push_back({ (Request*)(uintptr_t)cqe.user_data, cqe.res });
+				}
+				__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+				inFlight -= (int)completed.size();
+				for (auto& c : completed) {
+					inRing.erase(c.first);
+					onComplete(c.first->file, c.second);
+					delete c.first;
+				}
+			}
+		}
+
+		// we can't wait for the ring anymore: the requests still in it are reported as failed
+		void fail(int err) {
+			onFailure(format("io_uring_enter: %s", strerror(err))); // no new requests after this
+			std::vector<Request*> reqs(inRing.begin(), inRing.end());
+			inRing.clear();
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				reqs.insert(reqs.end(), pending.begin(), pending.end());
+				pending.clear();
+			}
+			for (auto req : reqs) {
+				onComplete(req->file, -err);
+				delete req;
+			}
+		}
+
+		CompletionFunc const onComplete;
+		FailureFunc const onFailure;
+		std::thread thread;
+		std::set<Request*> inRing; // prepared, not completed
+
+		std::mutex mutex;
+		std::deque<Request*> pending;
+		bool stopping = false;
+
+		int ringFd = -1, eventFd = -1;
+		uint64_t eventValue = 0;
+		unsigned numEntries = 0, localTail = 0, unsubmitted = 0;
+		uint8_t *sqRing = nullptr, *cqRing = nullptr;
+		size_t sqRingSize = 0, cqRingSize = 0;
+		io_uring_sqe* sqes = nullptr;
+		unsigned *sqTail = nullptr, *sqArray = nullptr, *cqHead = nullptr, *cqTail = nullptr;
+		unsigned sqMask = 0, cqMask = 0;
+		io_uring_cqe* cqes = nullptr;
+};
+#endif
+
+class Writer;
+
+class File : public AsyncFile {
+	public:
+		File(Writer* writer, FileState* state);
+		~File();
+		void write(SpanC data) override;
+		void flush() override;
+
+	private:
+		void submit(bool last);
+
+		Writer* const writer;
+		FileState* const state;
+		Buffer* buffer = nullptr;
+		size_t used = 0;
+		int64_t offset = 0; // of the buffer in the file
+};
+
+class Writer : public FileWriter {
+	public:
+		Writer(FileWriterConfig const& cfg, KHost* log)
+			: cfg(cfg), bufferSize((cfg.bufferSize + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1)), m_log(log) {
+#ifdef __linux__
+			if (cfg.useIoUring)
+				backend = IoUringBackend::create(onComplete, [this](std::string const& msg) {
+				fallBack(msg);
+			});
+			ioUring = backend != nullptr;
+#endif
+			if (!backend)
+				backend.reset(new ThreadPoolBackend(onComplete, cfg.numThreads));
+		}
+
+		~Writer() {
+			waitForCompletion();
+			backend.reset();
+			failedBackend.reset();
+			for (auto b : freeBuffers) {
+				freeAligned(b->ptr);
+				delete b;
+			}
+		}
+
+		std::unique_ptr<AsyncFile> open(std::string const& path) override {
+			ensureDir(dirName(path));
+
+			std::unique_lock<std::mutex> lock(mutex);
+			auto file = getState(path);
+			file->handles++;
+			Op op { Op::Open };
+			push(file, op);
+			if (cfg.directIo) {
+				op.direct = true;
+				push(file, op);
+			}
+			if (cfg.preallocateSize) {
+				Op alloc { Op::Fallocate };
+				alloc.offset = cfg.preallocateSize;
+				push(file, alloc);
+			}
+			return std::unique_ptr<AsyncFile>(new File(this, file));
+		}
+
+		void remove(std::string const& path) override {
+			std::unique_lock<std::mutex> lock(mutex);
+			push(getState(path), Op { Op::Unlink });
+		}
+
+		void waitForCompletion() override {
+			std::unique_lock<std::mutex> lock(mutex);
+			idle.wait(lock, [&]() {
+				return pendingOps == 0;
+			});
+		}
+
+		FileWriterStats getStats() override {
+			std::unique_lock<std::mutex> lock(mutex);
+			return stats;
+		}
+
+		bool usesIoUring() const override {
+			return ioUring;
+		}
+
+	private:
+		friend class File;
+
+		Buffer* acquireBuffer() {
+			std::unique_lock<std::mutex> lock(mutex);
+			if (!freeBuffers.empty()) {
+				auto b = freeBuffers.back();
+				freeBuffers.pop_back();
+				b->refs = 1;
+				return b;
+			}
+			auto ptr = allocAligned(bufferSize);
+			if (!ptr)
+				throw std::runtime_error("FileWriter: can't allocate a staging buffer");
+			return new Buffer { ptr, 1, 0 };
+		}
+
+		// a buffer referenced by writes is pending
+		void releaseBuffer(Buffer* b) {
+			if (--b->refs)
+				return;
+			if ((int)freeBuffers.size() < cfg.maxPendingBuffers) {
+				freeBuffers.push_back(b);
+			} else {
+				freeAligned(b->ptr);
+				delete b;
+			}
+		}
+
+		// called from the files
+		void pushWrites(FileState* file, std::vector<Op> const& writes, Buffer* buffer) {
+			std::unique_lock<std::mutex> lock(mutex);
+			if (pendingBuffers >= cfg.maxPendingBuffers) {
+				auto const t0 = std::chrono::steady_clock::now();
+				bufferReleased.wait(lock, [&]() {
+					return pendingBuffers < cfg.maxPendingBuffers;
+				});
+				auto const blockedInUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count();
+				stats.blockedTotalInUs += blockedInUs;
+				stats.blockedMaxInUs = std::max<int64_t>(stats.blockedMaxInUs, blockedInUs);
+			}
+			pendingBuffers++;
+			buffer->pendingWrites = (int)writes.size();
+			for (auto op : writes) {
+				op.buffer = buffer;
+				buffer->refs++;
+				push(file, op);
+			}
+			releaseBuffer(buffer);
+		}
+
+		void pushOp(FileState* file, Op op) {
+			std::unique_lock<std::mutex> lock(mutex);
+			push(file, op);
+		}
+
+		void releaseHandle(FileState* file, Buffer* buffer) {
+			std::unique_lock<std::mutex> lock(mutex);
+			if (buffer)
+				releaseBuffer(buffer);
+			file->handles--;
+			maybeErase(file);
+		}
+
+		// called with the lock held
+		FileState* getState(std::string const& path) {
+			auto& file = files[path];
+			if (!file) {
+				file.reset(new FileState);
+				file->path = path;
+			}
+			return file.get();
+		}
+
+		void push(FileState* file, Op op) {
+			pendingOps++;
+			file->ops.push_back(op);
+			dispatch(file);
+		}
+
+		void dispatch(FileState* file) {
+			while (!file->busy && !file->ops.empty()) {
+				auto op = file->ops.front();
+				file->ops.pop_front();
+				auto const fd = file->getFd(op);
+				auto const skipped = (op.type != Op::Open && op.type != Op::Unlink && fd < 0) || (op.type == Op::Open && op.direct && file->fd < 0);
+				if (skipped) {
+					finish(op);
+					continue;
+				}
+				file->current = op;
+				file->busy = true;
+				backend->submit(file, fd);
+			}
+		}
+
+		void finish(Op const& op) {
+			if (op.buffer) {
+				if (--op.buffer->pendingWrites == 0) {
+					pendingBuffers--;
+					bufferReleased.notify_all();
+				}
+				releaseBuffer(op.buffer);
+			}
+			if (--pendingOps == 0)
+				idle.notify_all();
+		}
+
+		void maybeErase(FileState* file) {
+			if (!file->busy && file->ops.empty() && file->handles == 0) {
+				auto const path = file->path; // the key is destroyed with the entry
+				files.erase(path);
+			}
+		}
+
+		void complete(FileState* file, int64_t res) {
+			std::unique_lock<std::mutex> lock(mutex);
+			auto& op = file->current;
+			if (res < 0) {
+				if (op.type == Op::Open && op.direct && res == -EINVAL) {
+					// the filesystem doesn't support O_DIRECT: buffered writes
+				} else if (op.type == Op::Unlink && res == -ENOENT) {
+				} else {
+					// a failed preallocation doesn't affect the data
+					if (op.type != Op::Fallocate)
+						stats.errors++;
+					static const char* names[] = { "open", "fallocate", "write", "fsync", "close", "unlink" };
+					auto const level = op.type == Op::Fallocate ? Warning : Error;
+					m_log->log(level, format("FileWriter: %s \"%s\": %s", names[op.type], file->path, strerror((int)-res)).c_str());
+				}
+				if (op.type == Op::Open && !op.direct)
+					file->failed = true;
+			} else {
+				switch (op.type) {
+				case Op::Open:
+					if (op.direct) {
+						file->directFd = (int)res;
+					} else {
+						file->fd = (int)res;
+						file->failed = false;
+					}
+					break;
+				case Op::Write:
+					stats.bytesWritten += res;
+					if (res > 0 && (size_t)res < op.len) {
+						// short write: the remaining data
+						op.ptr += res;
+						op.len -= (size_t)res;
+						op.offset += res;
+						backend->submit(file, file->getFd(op));
+						return;
+					}
+					break;
+				case Op::Close:
+					if (op.direct) {
+						file->directFd = -1;
+					} else {
+						file->fd = -1;
+						stats.filesClosed++;
+					}
+					break;
+				default:
+					break;
+				}
+			}
+
+			// the file descriptor was closed: the writes can't be retried
+			if (op.type == Op::Close && res < 0)
+				(op.direct ? file->directFd : file->fd) = -1;
+
+			file->busy = false;
+			finish(op);
+			dispatch(file);
+			maybeErase(file);
+		}
+
+		// called from the io_uring thread: the next operations go to the thread pool
+		void fallBack(std::string const& reason) {
+			std::unique_lock<std::mutex> lock(mutex);
+			m_log->log(Error, format("FileWriter: %s. Falling back to the thread pool.", reason).c_str());
+			failedBackend = std::move(backend); // can't be destroyed from its own thread
+			backend.reset(new ThreadPoolBackend(onComplete, cfg.numThreads));
+			ioUring = false;
+		}
+
+		void ensureDir(std::string const& path) {
+			if (path.empty())
+				return;
+			std::unique_lock<std::mutex> lock(dirMutex);
+			if (knownDirs.count(path))
+				return;
+			ensureDirRecurse(path);
+		}
+
+		void ensureDirRecurse(std::string const& path) {
+			if (path.empty() || knownDirs.count(path))
+				return;
+			if (!dirExists(path)) {
+				ensureDirRecurse(dirName(path));
+				mkdir(path);
+			}
+			knownDirs.insert(path);
+		}
+
+		FileWriterConfig const cfg;
+		size_t const bufferSize;
+		KHost* const m_log;
+		CompletionFunc const onComplete = [this](FileState* file, int64_t res) {
+			complete(file, res);
+		};
+		std::unique_ptr<Backend> backend, failedBackend;
+		std::atomic<bool> ioUring { false };
+
+		std::mutex mutex;
+		std::condition_variable idle, bufferReleased;
+		std::map<std::string, std::unique_ptr<FileState>> files;
+		std::vector<Buffer*> freeBuffers;
+		int pendingBuffers = 0;
+		int64_t pendingOps = 0;
+		FileWriterStats stats;
+
+		std::mutex dirMutex;
+		std::set<std::string> knownDirs;
+};
+
+File::File(Writer* writer, FileState* state) : writer(writer), state(state) {
+}
+
+File::~File() {
+	submit(true);
+	if (writer->cfg.fsync != FsyncPolicy::Never)
+		writer->pushOp(state, Op { Op::Fsync });
+	if (writer->cfg.directIo) {
+		Op op { Op::Close };
+		op.direct = true;
+		writer->pushOp(state, op);
+	}
+	writer->pushOp(state, Op { Op::Close });
+	writer->releaseHandle(state, buffer);
+}
+
+void File::write(SpanC data) {
+	while (data.len) {
+		if (!buffer) {
+			buffer = writer->acquireBuffer();
+			used = 0;
+		}
+		auto const n = std::min(writer->bufferSize - used, data.len);
+		memcpy(buffer->ptr + used, data.ptr, n);
+		used += n;
+		data += n;
+		if (used == writer->bufferSize)
+			submit(false);
+	}
+}
+
+void File::flush() {
+	submit(false);
+	if (writer->cfg.fsync == FsyncPolicy::OnFlush)
+		writer->pushOp(state, Op { Op::Fsync });
+}
+
+// O_DIRECT requires aligned sizes and offsets: the unaligned tail is written
+// through the buffered descriptor, and kept for the next buffer unless it's the last
+void File::submit(bool last) {
+	if (!buffer || !used)
+		return;
+
+	auto const direct = writer->cfg.directIo;
+	auto const alignedLen = direct ? used & ~(size_t)(ALIGNMENT - 1) : 0;
+	std::vector<Op> writes;
+	if (alignedLen) {
+		Op op { Op::Write };
+		op.direct = true;
+		op.ptr = buffer->ptr;
+		op.len = alignedLen;
+		op.offset = offset;
+		writes.push_back(op);
+	}
+	if (used > alignedLen) {
+		Op op { Op::Write };
+		op.ptr = buffer->ptr + alignedLen;
+		op.len = used - alignedLen;
+		op.offset = offset + alignedLen;
+		writes.push_back(op);
+	}
+
+	auto const tail = used - alignedLen;
+	uint8_t tailData[ALIGNMENT];
+	auto const keepTail = direct && !last && tail;
+	if (keepTail)
+		memcpy(tailData, buffer->ptr + alignedLen, tail);
+
+	writer->pushWrites(state, writes, buffer);
+	buffer = nullptr;
+
+	if (keepTail) {
+		buffer = writer->acquireBuffer();
+		memcpy(buffer->ptr, tailData, tail);
+		offset += alignedLen;
+		used = tail;
+	} else {
+		offset += used;
+		used = 0;
+	}
+}
+
+}
+
+std::unique_ptr<FileWriter> createFileWriter(FileWriterConfig const& config, KHost* log) {
+	return std::unique_ptr<FileWriter>(new Writer(config, log));
+}
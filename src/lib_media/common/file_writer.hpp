@@ -0,0 +1,62 @@
+#pragma once
+
+#include "lib_modules/core/module.hpp" // KHost
+#include "lib_modules/core/buffer.hpp" // SpanC
+#include <memory>
+#include <string>
+
+// Asynchronous write-behind file writer.
+// The data is copied into large aligned staging buffers, and the I/O is performed
+// by a backend: io_uring when the kernel supports it, a thread pool otherwise.
+// The operations on a path are performed in order, different paths concurrently.
+// The errors are logged: they can't be reported to the caller.
+//|  {
+//|    auto w = createFileWriter(cfg, host);
+//|    {
+//|      auto f = w->open("dir/file.mp4"); // the missing directories are created
+//|      f->write(data1);
+//|      f->flush(); // optional: makes the data written so far visible to readers
+//|      f->write(data2);
+//|    } // the file is closed when its pending writes are done: this doesn't block
+//|    w->remove("dir/old.mp4");
+//|  } // waits for all the pending operations
+enum class FsyncPolicy {
+	Never,
+	OnClose,
+	OnFlush, // each flush and close
+};
+
+struct FileWriterConfig {
+	size_t bufferSize = 1024 * 1024; // rounded up to the alignment (4kB)
+	int maxPendingBuffers = 16; // write() blocks when this many buffers are waiting for the disk
+	bool directIo = false; // O_DIRECT, when the filesystem supports it (Linux)
+	int64_t preallocateSize = 0; // fallocate()'d when the file is opened, the file size is unchanged (Linux)
+	FsyncPolicy fsync = FsyncPolicy::Never;
+	bool useIoUring = true; // false: thread pool
+	int numThreads = 4; // thread pool
+};
+
+struct FileWriterStats {
+	int64_t bytesWritten = 0;
+	int64_t filesClosed = 0;
+	int64_t errors = 0; // failed operations, the preallocations excepted
+	int64_t blockedMaxInUs = 0; // longest wait for the disk in write()
+	int64_t blockedTotalInUs = 0;
+};
+
+struct AsyncFile {
+	virtual ~AsyncFile() = default; // closes the file once its pending writes are done
+	virtual void write(SpanC data) = 0;
+	virtual void flush() = 0;
+};
+
+struct FileWriter {
+	virtual ~FileWriter() = default;
+	virtual std::unique_ptr<AsyncFile> open(std::string const& path) = 0; // truncates. One open file per path at a time
+	virtual void remove(std::string const& path) = 0;
+	virtual void waitForCompletion() = 0;
+	virtual FileWriterStats getStats() = 0;
+	virtual bool usesIoUring() const = 0;
+};
+
+std::unique_ptr<FileWriter> createFileWriter(FileWriterConfig const& config, Modules::KHost* log);
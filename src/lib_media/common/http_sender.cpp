@@ -1,8 +1,12 @@
 #include "http_sender.hpp"
 #include <algorithm> // std::min
+#include <atomic>
+#include <chrono>
 #include <cstring> // memcpy
+#include <deque>
 #include <thread>
 #include <mutex>
+#include <vector>
 #include <condition_variable>
 #include "lib_utils/log_sink.hpp" // Warning
 
@@ -57,21 +61,17 @@ std::shared_ptr<CURL> createCurl(std::string url, HttpRequest request) {
 	return curl;
 }
 
-void append(std::vector<uint8_t>& dst, SpanC data) {
-	auto offset = dst.size();
-	dst.resize(offset + data.len);
-	if(data.len)
-		memcpy(&dst[offset], data.ptr, data.len);
+Data copyToData(SpanC data) {
+	auto r = std::make_shared<DataRaw>(data.len);
+	memcpy(r->buffer->data().ptr, data.ptr, data.len);
+	return r;
 }
 
-void prepend(std::vector<uint8_t>& dst, SpanC data) {
-	auto offset = dst.size();
-	dst.resize(offset + data.len);
-	if (data.len) {
-		memmove(&dst[data.len], &dst[0], offset);
-		memcpy(&dst[0], data.ptr, data.len);
-	}
-}
+// a part of a Data, still to be sent
+struct Chunk {
+	Data data;
+	SpanC remaining;
+};
 
 struct CurlHttpSender : HttpSender {
 		CurlHttpSender(HttpSenderConfig const& cfg, Modules::KHost* log) : m_cfg(cfg) {
@@ -87,24 +87,57 @@ struct CurlHttpSender : HttpSender {
 		}
 
 		void send(span<const uint8_t> data) override {
+			if (data.len) {
+				countCopy(data.len);
+				sendData(copyToData(data));
+			} else {
+				flush();
+			}
+		}
+
+		void sendData(Data data) override {
 			if (m_cfg.request == DELETEX)
 				// don't try to send anything on DELETE
 				return;
 
+			// an empty chunk would end the transfer
+			if (data->data().len == 0)
+				return;
+
+			if (!curlThread.joinable())
+				curlThread = std::thread(&CurlHttpSender::threadProc, this);
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_fifo.push_back({ data, data->data() });
+			m_dataReady.notify_one();
+		}
+
+		void appendPrefix(span<const uint8_t> prefix) override {
+			if (prefix.len)
+				m_prefixData.push_back(copyToData(prefix));
+		}
+
+	private:
+		// all the bytes copied: by send(), and to the curl buffers
+		void countCopy(size_t n) {
+			if (m_cfg.copiedBytes)
+				*m_cfg.copiedBytes += n;
+		}
+
+		void flush() {
+			if (m_cfg.request == DELETEX)
+				return;
+
 			if (!curlThread.joinable())
 				curlThread = std::thread(&CurlHttpSender::threadProc, this);
 
 			{
 				std::unique_lock<std::mutex> lock(m_mutex);
-				if(data.len) {
-					append(m_fifo, data);
-				} else {
-					endOfDataFlag = true;
-				}
+				endOfDataFlag = true;
 				m_dataReady.notify_one();
 			}
 
-			if(!data.len) {
+			{
 				// wait for flush finished, before returning
 				std::unique_lock<std::mutex> lock(m_mutex);
 				auto pred = [this]() {
@@ -115,11 +148,6 @@ struct CurlHttpSender : HttpSender {
 			}
 		}
 
-		void appendPrefix(span<const uint8_t> prefix) override {
-			append(m_prefixData, prefix);
-		}
-
-	private:
 		void perform(CURL *curl) {
 			auto res = curl_easy_perform(curl);
 			if (res != CURLE_OK)
@@ -154,9 +182,10 @@ struct CurlHttpSender : HttpSender {
 
 			while(!destroying && !allDataSent) {
 				// load prefix, if any
-				if(m_prefixData.size()) {
+				{
 					std::unique_lock<std::mutex> lock(m_mutex);
-					prepend(m_fifo, {m_prefixData.data(), m_prefixData.size()});
+					for(auto i = m_prefixData.rbegin(); i != m_prefixData.rend(); ++i)
+						m_fifo.push_front({ *i, (*i)->data() });
 				}
 
 				perform(curl.get());
@@ -186,13 +215,21 @@ struct CurlHttpSender : HttpSender {
 			while (!pred())
 				m_dataReady.wait(lock, pred);
 
-			auto const N = std::min<int>(buffer.len, m_fifo.size());
-			if(N > 0) {
-				memcpy(buffer.ptr, m_fifo.data(), N);
-				memmove(m_fifo.data(), m_fifo.data()+N, m_fifo.size()-N);
-				m_fifo.resize(m_fifo.size()-N);
+			// copy directly from the queued Data
+			size_t N = 0;
+			while(N < buffer.len && !m_fifo.empty()) {
+				auto& chunk = m_fifo.front();
+				auto const n = std::min(buffer.len - N, chunk.remaining.len);
+				memcpy(buffer.ptr + N, chunk.remaining.ptr, n);
+				chunk.remaining += n;
+				N += n;
+
+				if(!chunk.remaining.len)
+					m_fifo.pop_front();
 			}
 
+			countCopy(N);
+
 			if(m_fifo.empty() && endOfDataFlag) {
 				allDataSent = true;
 				m_allDataSent.notify_one();
@@ -210,7 +247,7 @@ struct CurlHttpSender : HttpSender {
 		bool allDataSent = false;
 
 		// data to send first at the beginning of each connection
-		std::vector<uint8_t> m_prefixData;
+		std::vector<Data> m_prefixData;
 
 		Modules::KHost* m_log {};
 		curl_slist* headers {};
@@ -220,14 +257,371 @@ struct CurlHttpSender : HttpSender {
 		std::mutex m_mutex;
 		std::condition_variable m_dataReady;
 		bool endOfDataFlag = false; // 'true' means 'm_fifo will not grow anymore'
-		std::vector<uint8_t> m_fifo;
+		std::deque<Chunk> m_fifo;
+
+};
+
+int64_t nowInUs() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// one request of the upload engine
+struct Upload {
+	HttpSenderConfig cfg;
+	Modules::KHost* log;
+	std::mutex* mutex; // the engine's
+
+	// only used by the I/O thread
+	std::shared_ptr<CURL> curl;
+	curl_slist* headers {};
+
+	// protected by 'mutex'
+	std::vector<std::shared_ptr<Upload>> dependencies; // not started before they're done
+	std::deque<Chunk> fifo;
+	bool eos = false; // 'fifo' will not grow anymore
+	bool paused = false;
+	bool aborted = false;
+	bool done = false;
+	int64_t eosTime = 0;
+};
+
+class MultiUploadEngine : public HttpUploadEngine {
+	public:
+		MultiUploadEngine(HttpUploadEngineConfig const& cfg) : m_cfg(cfg) {
+			m_multi = curl_multi_init();
+			if (!m_multi)
+				throw std::runtime_error("Couldn't init the HTTP stack.");
+
+			curl_multi_setopt(m_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+			curl_multi_setopt(m_multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)cfg.maxConcurrentUploads);
+			curl_multi_setopt(m_multi, CURLMOPT_MAXCONNECTS, (long)cfg.maxConcurrentUploads); // keep-alive cache
+
+			m_thread = std::thread(&MultiUploadEngine::threadProc, this);
+		}
+
+		~MultiUploadEngine() {
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_stopping = true;
+			}
+			curl_multi_wakeup(m_multi);
+			m_thread.join();
+			curl_multi_cleanup(m_multi);
+		}
+
+		std::unique_ptr<HttpSender> createSender(HttpSenderConfig const& config, Modules::KHost* log) override;
+
+		// waits for the flushed uploads
+		void waitForCompletion() override {
+			auto flushed = [](std::shared_ptr<Upload> const& upload) {
+				return upload->eos && !upload->aborted;
+			};
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (std::any_of(m_pending.begin(), m_pending.end(), flushed) || std::any_of(m_active.begin(), m_active.end(), flushed))
+				m_changed.wait(lock);
+		}
+
+		HttpUploadStats getStats() override {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			return m_stats;
+		}
+
+		void start(std::shared_ptr<Upload> upload) {
+			upload->mutex = &m_mutex;
+			if (upload->cfg.request == DELETEX) {
+				// no body
+				upload->eos = true;
+				upload->eosTime = nowInUs();
+			}
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				if (upload->cfg.afterFlushedUploads) {
+					for (auto& other : m_pending)
+						if (other->eos && !other->aborted)
+							upload->dependencies.push_back(other);
+					for (auto& other : m_active)
+						if (other->eos && !other->aborted)
+							upload->dependencies.push_back(other);
+				}
+				m_pending.push_back(upload);
+			}
+			curl_multi_wakeup(m_multi);
+		}
+
+		void push(std::shared_ptr<Upload> const& upload, Data data) {
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				if (upload->done)
+					return;
+				upload->fifo.push_back({ data, data->data() });
+				resumeIfPaused(upload);
+			}
+			curl_multi_wakeup(m_multi);
+		}
+
+		void finish(std::shared_ptr<Upload> const& upload) {
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				if (upload->eos)
+					return;
+				upload->eos = true;
+				upload->eosTime = nowInUs();
+				resumeIfPaused(upload);
+			}
+			curl_multi_wakeup(m_multi);
+		}
+
+		// the sender is gone
+		void release(std::shared_ptr<Upload> const& upload) {
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				if (upload->eos)
+					return;
+				upload->aborted = true;
+				m_aborted.push_back(upload);
+			}
+			curl_multi_wakeup(m_multi);
+		}
+
+	private:
+		void resumeIfPaused(std::shared_ptr<Upload> const& upload) {
+			if (upload->paused) {
+				upload->paused = false;
+				m_resumed.push_back(upload);
+			}
+		}
+
+		void threadProc() {
+			while (true) {
+				std::vector<std::shared_ptr<Upload>> started, resumed, aborted;
+
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					if (m_stopping && m_pending.empty() && m_active.empty())
+						break;
+
+					for (auto i = m_pending.begin(); i != m_pending.end() && (int)m_active.size() < m_cfg.maxConcurrentUploads;) {
+						auto upload = *i;
+						if (upload->aborted) {
+							i = m_pending.erase(i);
+						} else if (canStart(*upload, i)) {
+							upload->dependencies.clear();
+							i = m_pending.erase(i);
+							m_active.push_back(upload);
+							started.push_back(upload);
+						} else {
+							++i;
+						}
+					}
+
+					std::swap(resumed, m_resumed);
+					std::swap(aborted, m_aborted);
+				}
+
+				for (auto& upload : started)
+					addTransfer(upload);
+
+				// may call the read callback: don't hold the lock
+				for (auto& upload : resumed)
+					if (upload->curl)
+						curl_easy_pause(upload->curl.get(), CURLPAUSE_CONT);
+
+				for (auto& upload : aborted)
+					if (upload->curl)
+						onTransferDone(upload.get(), false);
+
+				int running = 0;
+				curl_multi_perform(m_multi, &running);
+
+				// a completed transfer may unblock a pending one: don't wait
+				bool completed = !aborted.empty();
+
+				int left = 0;
+				while (auto msg = curl_multi_info_read(m_multi, &left)) {
+					if (msg->msg != CURLMSG_DONE)
+						continue;
+
+					Upload* upload = nullptr;
+					curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&upload);
+					if (msg->data.result != CURLE_OK)
+						upload->log->log(Warning, (std::string("Transfer failed: ") + curl_easy_strerror(msg->data.result)).c_str());
+					onTransferDone(upload, true);
+					completed = true;
+				}
+
+				curl_multi_poll(m_multi, nullptr, 0, completed ? 0 : 1000, nullptr);
+			}
+		}
+
+		// called with the lock held. 'pos' is the position of 'upload' in 'm_pending'.
+		bool canStart(Upload const& upload, std::deque<std::shared_ptr<Upload>>::iterator pos) {
+			for (auto& dependency : upload.dependencies)
+				if (!dependency->done && !dependency->aborted)
+					return false;
+
+			// one upload at a time per URL, in creation order: e.g a DELETE doesn't overtake an upload
+			auto sameUrl = [&](std::shared_ptr<Upload> const& other) {
+				return !other->aborted && other->cfg.url == upload.cfg.url;
+			};
+			return std::none_of(m_active.begin(), m_active.end(), sameUrl)
+			    && std::none_of(m_pending.begin(), pos, sameUrl);
+		}
+
+		void addTransfer(std::shared_ptr<Upload> const& upload) {
+			auto& cfg = upload->cfg;
+			upload->curl = createCurl(cfg.url, cfg.request);
+			auto curl = upload->curl.get();
+
+			curl_easy_setopt(curl, CURLOPT_USERAGENT, cfg.userAgent.c_str());
+			curl_easy_setopt(curl, CURLOPT_PRIVATE, upload.get());
+
+			// prefer multiplexing on an existing connection over opening a new one
+			curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+			curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+			curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+
+			// fail the stalled transfers, e.g. when the server never answers.
+			// Also applies while the producer has no new data for the upload.
+			curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+			curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long)m_cfg.stallTimeoutInSec);
+
+			for (auto &h : cfg.extraHeaders)
+				upload->headers = curl_slist_append(upload->headers, h.c_str());
+
+			if (cfg.request != DELETEX) {
+				upload->headers = curl_slist_append(upload->headers, "Transfer-Encoding: chunked");
+				upload->headers = curl_slist_append(upload->headers, "Expect:"); // no 100-continue round trip
+				curl_easy_setopt(curl, CURLOPT_READFUNCTION, &MultiUploadEngine::staticCurlCallback);
+				curl_easy_setopt(curl, CURLOPT_READDATA, upload.get());
+			}
+
+			curl_easy_setopt(curl, CURLOPT_HTTPHEADER, upload->headers);
+			curl_multi_add_handle(m_multi, curl);
+		}
+
+		void onTransferDone(Upload* upload, bool completed) {
+			auto curl = upload->curl.get();
+
+			long connects = 0;
+			curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+
+			long http_code = 0;
+			curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+			if (http_code >= 400)
+				upload->log->log(Warning, ("HTTP error: " + std::to_string(http_code) + " (" + upload->cfg.url + ")").c_str());
+
+			curl_multi_remove_handle(m_multi, curl);
+			upload->curl.reset();
+			curl_slist_free_all(upload->headers);
+			upload->headers = nullptr;
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			upload->done = true;
+			upload->fifo.clear();
+			m_stats.connectionsOpened += connects;
+			if (completed) {
+				auto const latency = nowInUs() - upload->eosTime;
+				m_stats.uploadsCompleted++;
+				m_stats.latencyTotalInUs += latency;
+				m_stats.latencyMaxInUs = std::max(m_stats.latencyMaxInUs, latency);
+			}
+
+			for (auto i = m_active.begin(); i != m_active.end(); ++i) {
+				if (i->get() == upload) {
+					m_active.erase(i);
+					break;
+				}
+			}
+			m_changed.notify_all();
+		}
+
+		static size_t staticCurlCallback(void *buffer, size_t size, size_t nmemb, void *userp) {
+			auto upload = (Upload*)userp;
+			span<uint8_t> dst((uint8_t*)buffer, size * nmemb);
+
+			std::unique_lock<std::mutex> lock(*upload->mutex);
+
+			size_t N = 0;
+			while (N < dst.len && !upload->fifo.empty()) {
+				auto& chunk = upload->fifo.front();
+				auto const n = std::min(dst.len - N, chunk.remaining.len);
+				memcpy(dst.ptr + N, chunk.remaining.ptr, n);
+				chunk.remaining += n;
+				N += n;
+
+				if (!chunk.remaining.len)
+					upload->fifo.pop_front();
+			}
+
+			// no data yet: the producer will resume us
+			if (N == 0 && !upload->eos) {
+				upload->paused = true;
+				return CURL_READFUNC_PAUSE;
+			}
+
+			return N;
+		}
+
+		HttpUploadEngineConfig const m_cfg;
+		CurlScope m_curlScope;
+		CURLM* m_multi {};
+		std::thread m_thread;
+
+		std::mutex m_mutex;
+		std::condition_variable m_changed;
+		bool m_stopping = false;
+		std::deque<std::shared_ptr<Upload>> m_pending;
+		std::vector<std::shared_ptr<Upload>> m_active, m_resumed, m_aborted;
+		HttpUploadStats m_stats;
 };
+
+struct UploadSender : HttpSender {
+	UploadSender(MultiUploadEngine* engine, std::shared_ptr<Upload> upload)
+		: m_engine(engine), m_upload(upload) {
+	}
+
+	~UploadSender() {
+		m_engine->release(m_upload);
+	}
+
+	void send(span<const uint8_t> data) override {
+		if (data.len)
+			sendData(copyToData(data));
+		else
+			m_engine->finish(m_upload);
+	}
+
+	void sendData(Data data) override {
+		if (m_upload->cfg.request != DELETEX && data->data().len)
+			m_engine->push(m_upload, data);
+	}
+
+	// sent once, as there is no reconnection
+	void appendPrefix(span<const uint8_t> prefix) override {
+		send(prefix);
+	}
+
+	MultiUploadEngine* const m_engine;
+	std::shared_ptr<Upload> const m_upload;
+};
+
+std::unique_ptr<HttpSender> MultiUploadEngine::createSender(HttpSenderConfig const& config, Modules::KHost* log) {
+	auto upload = std::make_shared<Upload>();
+	upload->cfg = config;
+	upload->log = log;
+	start(upload);
+	return std::make_unique<UploadSender>(this, upload);
+}
 }
 
 std::unique_ptr<HttpSender> createHttpSender(HttpSenderConfig const& config, Modules::KHost* log) {
 	return std::make_unique<CurlHttpSender>(config, log);
 }
 
+std::unique_ptr<HttpUploadEngine> createHttpUploadEngine(HttpUploadEngineConfig const& config) {
+	return std::make_unique<MultiUploadEngine>(config);
+}
+
 void enforceConnection(std::string url, HttpRequest request) {
 	CurlScope curlScope;
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "lib_modules/core/module.hpp" // KHost
+#include "lib_modules/core/database.hpp" // Data
 #include "lib_modules/utils/helper.hpp" // span
 
 // Single long running POST/PUT connection
@@ -19,9 +20,11 @@
 struct HttpSender {
 	virtual ~HttpSender() = default;
 	virtual void send(span<const uint8_t> data) = 0; // (send an empty span to flush)
+	virtual void sendData(Modules::Data data) = 0; // no copy: 'data' is referenced until it's sent
 	virtual void appendPrefix(span<const uint8_t> prefix) = 0; // may be called multiple times
 };
 
+#include <atomic>
 #include <string>
 #include <vector>
 
@@ -39,7 +42,42 @@ struct HttpSenderConfig {
 	std::string userAgent;
 	HttpRequest request = POST;
 	std::vector<std::string> extraHeaders;
+	std::atomic<int64_t>* copiedBytes = nullptr; // optional: the bytes the sender copies are added to it
+
+	// upload engine: don't start before the uploads flushed so far are complete
+	// (e.g a manifest after the segments it lists)
+	bool afterFlushedUploads = false;
 };
 
 std::unique_ptr<HttpSender> createHttpSender(HttpSenderConfig const& config, Modules::KHost* log);
 
+
+// Shared upload engine: a single I/O thread drives many concurrent chunked uploads
+// (curl multi interface). Connections are kept alive and reused per origin, and
+// multiplexed over HTTP/2 when the server supports it.
+// The senders it creates don't block on flush: the engine completes the upload.
+// Destroying a sender before flushing it aborts the upload.
+// The uploads to the same URL are performed in creation order.
+struct HttpUploadEngineConfig {
+	int maxConcurrentUploads = 32; // further uploads wait for a free slot
+
+	// a transfer without any progress for this long fails.
+	// Must be longer than the gaps between the chunks of a segment.
+	int stallTimeoutInSec = 10;
+};
+
+struct HttpUploadStats {
+	int64_t connectionsOpened = 0;
+	int64_t uploadsCompleted = 0;
+	int64_t latencyMaxInUs = 0; // from the end of the data to the server response
+	int64_t latencyTotalInUs = 0;
+};
+
+struct HttpUploadEngine {
+	virtual ~HttpUploadEngine() = default; // waits for the flushed uploads
+	virtual std::unique_ptr<HttpSender> createSender(HttpSenderConfig const& config, Modules::KHost* log) = 0;
+	virtual void waitForCompletion() = 0; // waits for the flushed uploads
+	virtual HttpUploadStats getStats() = 0;
+};
+
+std::unique_ptr<HttpUploadEngine> createHttpUploadEngine(HttpUploadEngineConfig const& config);
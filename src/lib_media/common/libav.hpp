@@ -29,11 +29,13 @@ struct MetadataHwContext {
 };
 
 struct MetadataRawVideoHw : MetadataRawVideo, MetadataHwContext {
-	MetadataRawVideoHw() {}
+	enum : uint32_t { Kind = MetadataRawVideo::Kind | KIND_RAW_VIDEO_HW };
+	MetadataRawVideoHw() : MetadataRawVideo(Kind) {}
 };
 
 struct MetadataPktVideoHw : MetadataPktVideo, MetadataHwContext {
-	MetadataPktVideoHw() {}
+	enum : uint32_t { Kind = MetadataPktVideo::Kind | KIND_PKT_VIDEO_HW };
+	MetadataPktVideoHw() : MetadataPktVideo(Kind) {}
 };
 
 const char* avCodecIdToSignalsId(int avCodecId);
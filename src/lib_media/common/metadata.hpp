@@ -11,21 +11,39 @@
 
 namespace Modules {
 
+// One bit per metadata class, see IMetadata::kind
+enum MetadataKindBit : uint32_t {
+	KIND_RAW_VIDEO    = 1 << 0,
+	KIND_RAW_AUDIO    = 1 << 1,
+	KIND_RAW_SUBTITLE = 1 << 2,
+	KIND_PKT          = 1 << 3,
+	KIND_PKT_VIDEO    = 1 << 4,
+	KIND_PKT_AUDIO    = 1 << 5,
+	KIND_PKT_SUBTITLE = 1 << 6,
+	KIND_FILE         = 1 << 7,
+	KIND_RAW_VIDEO_HW = 1 << 8,
+	KIND_PKT_VIDEO_HW = 1 << 9,
+};
+
 //TODO: Raw should be picture and Pcm and return the same fields as MetadataPkt
 struct MetadataRawVideo : IMetadata {
-	MetadataRawVideo() : IMetadata(VIDEO_RAW) {}
+	enum : uint32_t { Kind = KIND_RAW_VIDEO };
+	MetadataRawVideo(uint32_t kind = Kind) : IMetadata(VIDEO_RAW, kind) {}
 };
 
 struct MetadataRawAudio : IMetadata {
-	MetadataRawAudio() : IMetadata(AUDIO_RAW) {}
+	enum : uint32_t { Kind = KIND_RAW_AUDIO };
+	MetadataRawAudio() : IMetadata(AUDIO_RAW, Kind) {}
 };
 
 struct MetadataRawSubtitle : IMetadata {
-	MetadataRawSubtitle() : IMetadata(SUBTITLE_RAW) {}
+	enum : uint32_t { Kind = KIND_RAW_SUBTITLE };
+	MetadataRawSubtitle() : IMetadata(SUBTITLE_RAW, Kind) {}
 };
 
 struct MetadataPkt : public IMetadata {
-	MetadataPkt(StreamType type) : IMetadata(type) {
+	enum : uint32_t { Kind = KIND_PKT };
+	MetadataPkt(StreamType type, uint32_t kind = Kind) : IMetadata(type, kind) {
 	}
 	std::string codec; // do not replace this with an enum!
 	std::vector<uint8_t> codecSpecificInfo;
@@ -38,7 +56,8 @@ struct MetadataPkt : public IMetadata {
 };
 
 struct MetadataPktVideo : MetadataPkt {
-	MetadataPktVideo() : MetadataPkt(VIDEO_PKT) {}
+	enum : uint32_t { Kind = MetadataPkt::Kind | KIND_PKT_VIDEO };
+	MetadataPktVideo(uint32_t kind = Kind) : MetadataPkt(VIDEO_PKT, kind) {}
 	PixelFormat pixelFormat;
 	Fraction sampleAspectRatio;
 	Resolution resolution;
@@ -46,7 +65,8 @@ struct MetadataPktVideo : MetadataPkt {
 };
 
 struct MetadataPktAudio : MetadataPkt {
-	MetadataPktAudio() : MetadataPkt(AUDIO_PKT) {}
+	enum : uint32_t { Kind = MetadataPkt::Kind | KIND_PKT_AUDIO };
+	MetadataPktAudio() : MetadataPkt(AUDIO_PKT, Kind) {}
 	uint32_t numChannels;
 	uint32_t sampleRate;
 	uint8_t bitsPerSample;
@@ -57,7 +77,8 @@ struct MetadataPktAudio : MetadataPkt {
 };
 
 struct MetadataPktSubtitle : MetadataPkt {
-	MetadataPktSubtitle() : MetadataPkt(SUBTITLE_PKT) {}
+	enum : uint32_t { Kind = MetadataPkt::Kind | KIND_PKT_SUBTITLE };
+	MetadataPktSubtitle() : MetadataPkt(SUBTITLE_PKT, Kind) {}
 };
 
 inline PcmFormat toPcmFormat(std::shared_ptr<const MetadataPktAudio> meta) {
@@ -3,17 +3,19 @@
 #include <stdint.h>
 #include <string>
 #include "lib_media/common/resolution.hpp"
-#include "lib_modules/core/metadata.hpp"
+#include "lib_media/common/metadata.hpp" // MetadataKindBit
 
 namespace Modules {
 
 struct MetadataFile : IMetadata {
+	enum : uint32_t { Kind = KIND_FILE };
+
 	MetadataFile(StreamType type_)
-		: IMetadata(type_) {
+		: IMetadata(type_, Kind) {
 	}
 
 	MetadataFile(const MetadataFile& other) :
-		IMetadata(other.type) {
+		IMetadata(other.type, Kind) {
 		resolution     = other.resolution;
 		sampleRate     = other.sampleRate;
 		filename       = other.filename;
@@ -108,7 +108,7 @@ struct Decoder : ModuleS, PictureAllocator {
 				if(!meta)
 					throw error("Can't instantiate decoder: no metadata for input data");
 
-				openDecoder(safe_cast<const MetadataPkt>(meta.get()));
+				openDecoder(metadata_cast<const MetadataPkt>(meta.get()));
 			}
 
 			assert(codecCtx);
@@ -119,15 +119,12 @@ struct Decoder : ModuleS, PictureAllocator {
 			assert (data && data->getMetadata());
 
 			if (flags.unframed)
-				ensureParser(safe_cast<const MetadataPkt>(data->getMetadata()).get());
+				ensureParser(metadata_cast<const MetadataPkt>(data->getMetadata().get()));
 
 			AVPacket pkt {};
 			pkt.pts = data->get<PresentationTime>().time;
-			try {
-				pkt.dts = data->get<DecodingTime>().time;
-			} catch(...) {
-				pkt.dts = data->get<PresentationTime>().time;
-			}
+			DecodingTime dts;
+			pkt.dts = data->tryGet(dts) ? dts.time : pkt.pts;
 			pkt.data = (uint8_t*)data->data().ptr;
 			pkt.size = (int)data->data().len;
 			processPacket(&pkt);
@@ -170,14 +167,14 @@ struct Decoder : ModuleS, PictureAllocator {
 			}
 
 			if (metadata->codec == "raw_video") {
-				auto const m = safe_cast<const MetadataPktVideo>(metadata);
+				auto const m = metadata_cast<const MetadataPktVideo>(metadata);
 				codecCtx->pix_fmt = pixelFormat2libavPixFmt(m->pixelFormat);
 				codecCtx->width = m->resolution.width;
 				codecCtx->height = m->resolution.height;
 			}
 
 			if (metadata->codec == "raw_audio") {
-				auto const m = safe_cast<const MetadataPktAudio>(metadata);
+				auto const m = metadata_cast<const MetadataPktAudio>(metadata);
 				codecCtx->channels = m->numChannels;
 				codecCtx->sample_fmt = AV_SAMPLE_FMT_S16;
 				codecCtx->sample_rate = m->sampleRate;
@@ -182,7 +182,7 @@ struct LibavEncode : ModuleS {
 				f->linesize[i] = (int)pic->getStride(i);
 			}
 
-			auto hw = dynamic_cast<const MetadataRawVideoHw*>(data->getMetadata().get());
+			auto hw = metadata_try_cast<const MetadataRawVideoHw>(data->getMetadata().get());
 			if (hw) {
 				for (int i=0; i<AV_NUM_DATA_POINTERS && hw->dataRef[i]; ++i) {
 					f->buf[i] = av_buffer_ref(hw->dataRef[i]);
@@ -306,7 +306,7 @@ struct LibavEncode : ModuleS {
 				// for encoding level checks (MB rate) and rate control
 				codecCtx->ticks_per_frame = TICKS_PER_VIDEO_FRAME;
 
-				auto hw = dynamic_cast<const MetadataRawVideoHw*>(data->getMetadata().get());
+				auto hw = metadata_try_cast<const MetadataRawVideoHw>(data->getMetadata().get());
 				if (hw) {
 					avFrame->get()->hw_frames_ctx = av_buffer_ref(hw->framesCtx);
 					codecCtx->hw_frames_ctx = av_buffer_ref(hw->framesCtx);
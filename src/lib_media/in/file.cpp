@@ -4,7 +4,15 @@
 #include "lib_media/common/attributes.hpp"
 #include "lib_utils/tools.hpp"
 #include "lib_utils/format.hpp"
-#include "lib_utils/log_sink.hpp" // Info
+#include "lib_utils/log_sink.hpp" // Info, Warning
+#include <algorithm> // min
+
+#ifndef _WIN32
+#include <fcntl.h> // open
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h> // close
+#endif
 
 using namespace Modules;
 
@@ -14,16 +22,53 @@ auto const IOSIZE = 66176;
 static_assert(IOSIZE % 32 == 0, "IOSIZE must be a multiple of 32");
 static_assert(IOSIZE % 188 == 0, "IOSIZE must be a multiple of 188");
 
+#ifndef _WIN32
+auto const READAHEAD = 8 * 1024 * 1024; // a multiple of the page size
+
+// Unmapped when the last window is released.
+struct FileMapping {
+	~FileMapping() {
+		if (ptr)
+			munmap(ptr, size);
+	}
+	uint8_t* ptr = nullptr;
+	size_t size = 0;
+};
+
+// A view on a part of the mapping: allows to output the file contents without copying them.
+struct MappedWindow : IBuffer {
+	MappedWindow(std::shared_ptr<FileMapping> mapping_, Span window_) : mapping(mapping_), window(window_) {
+	}
+
+	Span data() override {
+		return window;
+	}
+
+	SpanC data() const override {
+		return { window.ptr, window.len };
+	}
+
+private:
+	std::shared_ptr<FileMapping> const mapping; // keeps the memory alive
+	Span const window;
+};
+#endif
+
 class FileInput : public Module {
 	public:
 		FileInput(KHost* host, FileInputConfig const& config) : m_host(host) {
 			m_blockSize = config.blockSize ? config.blockSize : IOSIZE;
-			file = fopen(config.filename.c_str(), "rb");
-			if (!file)
-				throw error(format("Can't open file for reading: %s", config.filename));
-			fseek(file, 0, SEEK_END);
-			auto const size = ftell(file);
-			fseek(file, 0, SEEK_SET);
+			int64_t size;
+			if (config.memoryMapped) {
+#ifndef _WIN32
+				size = map(config.filename);
+#else
+				m_host->log(Warning, "Memory mapped input is not supported on this platform: using buffered reads.");
+				size = openFile(config.filename);
+#endif
+			} else {
+				size = openFile(config.filename);
+			}
 			if (size > m_blockSize)
 				m_host->log(Info, format("File %s size is %s, will be sent by %s bytes chunks. Check the downstream modules are able to aggregate data frames.",
 				        config.filename, size, m_blockSize).c_str());
@@ -34,10 +79,17 @@ class FileInput : public Module {
 		}
 
 		~FileInput() {
-			fclose(file);
+			if (file)
+				fclose(file);
 		}
 
 		void process() override {
+#ifndef _WIN32
+			if (mapping) {
+				processMapped();
+				return;
+			}
+#endif
 			auto out = output->allocData<DataRawResizable>(m_blockSize);
 			size_t read = fread(out->buffer->data().ptr, 1, m_blockSize, file);
 			if (read == 0) {
@@ -50,8 +102,69 @@ class FileInput : public Module {
 		}
 
 	private:
+		int64_t openFile(std::string const& path) {
+			file = fopen(path.c_str(), "rb");
+			if (!file)
+				throw error(format("Can't open file for reading: %s", path));
+			fseek(file, 0, SEEK_END);
+			auto const size = ftell(file);
+			fseek(file, 0, SEEK_SET);
+			return size;
+		}
+
+#ifndef _WIN32
+		int64_t map(std::string const& path) {
+			auto const fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0)
+				throw error(format("Can't open file for reading: %s", path));
+			struct stat st;
+			if (fstat(fd, &st) != 0) {
+				close(fd);
+				throw error(format("Can't stat file: %s", path));
+			}
+
+			mapping = std::make_shared<FileMapping>();
+			if (st.st_size > 0) {
+				// private and writable: downstream modules may modify their input in place (copy-on-write)
+				auto ptr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+				if (ptr == MAP_FAILED) {
+					close(fd);
+					throw error(format("Can't map file: %s", path));
+				}
+				mapping->ptr = (uint8_t*)ptr;
+				mapping->size = st.st_size;
+				madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+			}
+			close(fd); // the mapping holds its own reference on the file
+			return st.st_size;
+		}
+
+		void processMapped() {
+			if (m_pos == mapping->size) {
+				m_host->activate(false);
+				return;
+			}
+
+			// keep the kernel reading ahead of us
+			while (m_prefetched < std::min(mapping->size, m_pos + 2 * READAHEAD)) {
+				madvise(mapping->ptr + m_prefetched, std::min<size_t>(READAHEAD, mapping->size - m_prefetched), MADV_WILLNEED);
+				m_prefetched += READAHEAD;
+			}
+
+			auto const len = std::min<size_t>(m_blockSize, mapping->size - m_pos);
+			auto out = output->allocData<DataRaw>(0);
+			out->buffer = std::make_shared<MappedWindow>(mapping, Span { mapping->ptr + m_pos, len });
+			out->set(PresentationTime{0});
+			output->post(out);
+			m_pos += len;
+		}
+
+		std::shared_ptr<FileMapping> mapping;
+		size_t m_pos = 0, m_prefetched = 0;
+#endif
+
 		KHost* const m_host;
-		FILE *file;
+		FILE *file = nullptr;
 		OutputDefault *output;
 		int m_blockSize;
 };
@@ -5,5 +5,6 @@
 struct FileInputConfig {
 	std::string filename;
 	int blockSize = 0;
+	bool memoryMapped = false; // zero-copy: the output data reference a mapping of the file (POSIX)
 };
 
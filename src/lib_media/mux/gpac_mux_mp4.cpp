@@ -517,7 +517,8 @@ void GPACMuxMP4::closeSegment(bool isLastSeg) {
 		}
 	}
 
-	sendSegmentToOutput(true);
+	//fragmented segments: gf_isom_close_segment() reported the size
+	sendSegmentToOutput(true, segmentPolicy == FragmentedSegment);
 	m_host->log(Debug, format("Segment %s completed (size %s) (startsWithSAP=%s)", segmentName.empty() ? "[in memory]" : segmentName, lastSegmentSize, segmentStartsWithRAP).c_str());
 
 	curSegmentDurInTs = 0;
@@ -799,11 +800,11 @@ void GPACMuxMP4::declareStreamVideo(const MetadataPktVideo* metadata) {
 }
 
 void GPACMuxMP4::declareStream(const IMetadata* metadata) {
-	if (auto video = dynamic_cast<const MetadataPktVideo*>(metadata)) {
+	if (auto video = metadata_try_cast<const MetadataPktVideo>(metadata)) {
 		declareStreamVideo(video);
-	} else if (auto audio = dynamic_cast<const MetadataPktAudio*>(metadata)) {
+	} else if (auto audio = metadata_try_cast<const MetadataPktAudio>(metadata)) {
 		declareStreamAudio(audio);
-	} else if (auto subs = dynamic_cast<const MetadataPktSubtitle*>(metadata)) {
+	} else if (auto subs = metadata_try_cast<const MetadataPktSubtitle>(metadata)) {
 		declareStreamSubtitle(subs);
 	} else
 		throw error("Stream creation failed: unknown type.");
@@ -829,7 +830,7 @@ void GPACMuxMP4::handleInitialTimeOffset() {
 	}
 }
 
-void GPACMuxMP4::sendSegmentToOutput(bool EOS) {
+void GPACMuxMP4::sendSegmentToOutput(bool EOS, bool sizeReported) {
 	if (segmentPolicy == IndependentSegment) {
 		nextFragmentNum = gf_isom_get_next_moof_number(isoCur);
 		SAFE(gf_isom_write(isoCur));
@@ -838,7 +839,8 @@ void GPACMuxMP4::sendSegmentToOutput(bool EOS) {
 	std::shared_ptr<DataRaw> out;
 	if (gf_isom_get_filename(isoCur)) {
 		out = output->allocData<DataRaw>(0); // data conveyed in file
-		lastSegmentSize = fileSize(segmentName);
+		if (!sizeReported)
+			lastSegmentSize = fileSize(segmentName);
 	} else {
 		auto const newBsNeeded = EOS || ( (compatFlags & FlushFragMemory) && curFragmentDurInTs );
 		auto contents = getBsContent(isoCur, newBsNeeded);
@@ -1013,7 +1015,7 @@ void GPACMuxMP4::fillSample(Data data, gpacpp::IsoSample* sample, bool isRap) {
 		sample->DTS = m_DTS;
 	}
 
-	auto srcTimeScale = safe_cast<const MetadataPkt>(data->getMetadata())->timeScale;
+	auto srcTimeScale = metadata_cast<const MetadataPkt>(data->getMetadata())->timeScale;
 
 	if (data->get<PresentationTime>().time != INT64_MAX) {
 		auto const ctsOffset = data->get<PresentationTime>().time - data->get<DecodingTime>().time;
@@ -160,7 +160,7 @@ class LibavMux : public ModuleDynI {
 			if(!data->getMetadata())
 				throw error("Can't declare stream without metadata");
 
-			auto const metadata = safe_cast<const MetadataPkt>(data->getMetadata().get());
+			auto const metadata = metadata_cast<const MetadataPkt>(data->getMetadata().get());
 
 			auto avcodecId = (AVCodecID)signalsIdToAvCodecId(metadata->codec.c_str());
 			auto const codec = avcodec_find_decoder(avcodecId);
@@ -175,11 +175,11 @@ class LibavMux : public ModuleDynI {
 
 			codecpar->codec_id = codec->id;
 
-			if(auto info = dynamic_cast<const MetadataPktVideo*>(metadata)) {
+			if(auto info = metadata_try_cast<const MetadataPktVideo>(metadata)) {
 				codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
 				codecpar->width  = info->resolution.width;
 				codecpar->height = info->resolution.height;
-			} else if(auto info = dynamic_cast<const MetadataPktAudio*>(metadata)) {
+			} else if(auto info = metadata_try_cast<const MetadataPktAudio>(metadata)) {
 				codecpar->codec_type = AVMEDIA_TYPE_AUDIO;
 				codecpar->sample_rate = info->sampleRate;
 				codecpar->channels = info->numChannels;
@@ -210,7 +210,7 @@ class LibavMux : public ModuleDynI {
 
 		void fillAvPacket(Data data, AVPacket* newPkt) {
 			// only insert headers for video, not for audio (e.g would break AAC)
-			auto const videoMetadata = dynamic_cast<const MetadataPktVideo*>(data->getMetadata().get());
+			auto const videoMetadata = metadata_try_cast<const MetadataPktVideo>(data->getMetadata().get());
 			auto const key = data->get<CueFlags>().keyframe;
 			auto const insertHeaders = m_inbandMetadata && videoMetadata && key;
 
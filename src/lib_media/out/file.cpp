@@ -5,20 +5,30 @@
 namespace Modules {
 namespace Out {
 
-File::File(KHost* host, std::string const& path)
+File::File(KHost* host, std::string const& path, FileWriterConfig const& cfg)
 	:  m_host(host) {
-	(void)m_host;
-	file = fopen(path.c_str(), "wb");
-	if (!file)
+	// fail early: the writer reports its errors asynchronously
+	auto f = fopen(path.c_str(), "wb");
+	if (!f)
 		throw error(format("Can't open file for writing: %s", path));
+	fclose(f);
+
+	writer = createFileWriter(cfg, m_host);
+	file = writer->open(path);
 }
 
 File::~File() {
-	fclose(file);
+	file.reset();
+	writer.reset(); // waits for the pending writes
 }
 
 void File::processOne(Data data) {
-	fwrite(data->data().ptr, 1, data->data().len, file);
+	file->write(data->data());
+}
+
+void File::flush() {
+	file->flush();
+	writer->waitForCompletion();
 }
 
 }
@@ -1,19 +1,23 @@
 #pragma once
 
 #include "lib_modules/utils/helper.hpp"
+#include "lib_media/common/file_writer.hpp"
 
 namespace Modules {
 namespace Out {
 
+// the writes are asynchronous
 class File : public ModuleS {
 	public:
-		File(KHost* host, std::string const& path);
+		File(KHost* host, std::string const& path, FileWriterConfig const& cfg = FileWriterConfig());
 		~File();
 		void processOne(Data data) override;
+		void flush() override;
 
 	private:
 		KHost* const m_host;
-		FILE *file;
+		std::unique_ptr<FileWriter> writer;
+		std::unique_ptr<AsyncFile> file;
 };
 
 }
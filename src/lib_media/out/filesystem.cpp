@@ -2,80 +2,63 @@
 #include "lib_media/common/metadata_file.hpp"
 #include "lib_modules/utils/helper.hpp"
 #include "lib_modules/utils/factory.hpp"
-#include "lib_utils/log_sink.hpp"
-#include "lib_utils/os.hpp"
+#include "lib_utils/format.hpp"
 #include "lib_utils/tools.hpp" // enforce
 
 #include <map>
-#include <fstream>
 
 using namespace Modules;
 
 namespace {
 
-std::ofstream openOutput(std::string path) {
-	auto fp = std::ofstream(path, std::ios::binary);
-	if(!fp.is_open())
-		throw std::runtime_error("can't open for writing: '" + path + "'");
-	return fp;
-}
-
-std::string dirName(std::string path) {
-	auto i = path.rfind('/');
-	if(i == std::string::npos)
-		return ".";
-	return path.substr(0, i);
-}
-
-void ensureDirRecurse(std::string path) {
-	if(path == "")
-		return;
-
-	if(!dirExists(path)) {
-		auto parent = dirName(path);
-		if(!dirExists(parent))
-			ensureDirRecurse(parent);
-
-		mkdir(path);
-	}
-}
-
 class FileSystemSink : public ModuleS {
 	public:
 		FileSystemSink(KHost* host, FileSystemSinkConfig cfg)
-			: m_host(host),
-			  m_config(cfg) {
+			: m_config(cfg),
+			  m_writer(createFileWriter(cfg.writer, host)) {
 		}
 
 		void processOne(Data data) override {
-			auto meta = safe_cast<const MetadataFile>(data->getMetadata());
+			checkErrors();
+			auto meta = metadata_cast<const MetadataFile>(data->getMetadata());
 
 			auto const path = m_config.directory + "/" + meta->filename;
 
 			if(meta->filesize == INT64_MAX) {
-				remove(path.c_str());
+				m_files.erase(path);
+				m_writer->remove(path);
 				return;
 			}
 
-			if(m_files.find(path) == m_files.end()) {
-				ensureDirRecurse(dirName(path));
-				m_files.insert(std::pair<std::string, std::ofstream> {path, openOutput(path)});
-			}
+			auto& file = m_files[path];
+			if(!file)
+				file = m_writer->open(path);
 
-			auto& fp = m_files[path];
-			auto contents = data->data();
-			fp.write((char*)contents.ptr, contents.len);
-			if(!fp)
-				m_host->log(Error, "write failure");
+			file->write(data->data());
 
 			if(meta->EOS)
 				m_files.erase(path);
+			else
+				file->flush(); // make the chunk visible to readers of the partial file
+		}
+
+		void flush() override {
+			m_files.clear();
+			m_writer->waitForCompletion();
+			checkErrors();
 		}
 
 	private:
-		KHost* const m_host;
+		// the writes are asynchronous: a failure is reported with the next data, or the flush
+		void checkErrors() {
+			auto const errors = m_writer->getStats().errors;
+			if(errors)
+				throw error(format("FileSystemSink: %s write failures in \"%s\" (see the log)", errors, m_config.directory));
+		}
+
 		FileSystemSinkConfig const m_config;
-		std::map<std::string, std::ofstream> m_files;
+		std::unique_ptr<FileWriter> m_writer;
+		std::map<std::string, std::unique_ptr<AsyncFile>> m_files;
 };
 
 IModule* createObject(KHost* host, void* va) {
@@ -1,8 +1,9 @@
 #pragma once
 
+#include "lib_media/common/file_writer.hpp"
 #include <string>
 
 struct FileSystemSinkConfig {
 	std::string directory;
+	FileWriterConfig writer {}; // the writes are asynchronous: the failures are thrown from the next process() or flush()
 };
-
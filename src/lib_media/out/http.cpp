@@ -35,7 +35,7 @@ class HTTP : public ModuleS {
 
 		void processOne(Data data) final {
 			if(data)
-				m_sender->send(data->data());
+				m_sender->sendData(data);
 		}
 
 		void flush() final {
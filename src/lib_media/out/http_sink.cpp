@@ -2,16 +2,13 @@
 
 #include "lib_modules/utils/helper.hpp" // ModuleS
 #include "lib_modules/utils/factory.hpp"
-#include "lib_modules/utils/loader.hpp"
 #include "lib_utils/format.hpp"
 #include "lib_utils/log_sink.hpp"
 #include "lib_utils/tools.hpp" // safe_cast
 #include "../common/metadata_file.hpp"
-#include "http.hpp"
+#include "../common/http_sender.hpp"
 #include <memory>
 #include <map>
-#include <thread>
-#include <atomic>
 
 using namespace std;
 using namespace Modules;
@@ -23,70 +20,87 @@ bool exists(T const& container, V const& val) {
 	return container.find(val) != container.end();
 }
 
+// All the transfers share one upload engine: persistent connections, one I/O thread.
 struct HttpSink : ModuleS {
-		HttpSink(KHost* host, string baseURL, string userAgent, const vector<string> &headers)
-			: m_host(host), baseURL(baseURL), userAgent(userAgent), headers(headers) {
-			done = false;
-		}
-		~HttpSink() {
-			done = true;
+		HttpSink(KHost* host, HttpSinkConfig const& cfg)
+			: m_host(host), baseURL(cfg.baseURL), userAgent(cfg.userAgent), headers(cfg.headers) {
+			HttpUploadEngineConfig engineCfg;
+			engineCfg.maxConcurrentUploads = cfg.maxConcurrentUploads;
+			m_engine = createHttpUploadEngine(engineCfg);
+
+			m_connectionsOpened = m_host->getStatsEntry("connections_opened");
+			m_uploadsCompleted = m_host->getStatsEntry("uploads_completed");
+			m_latencyMax = m_host->getStatsEntry("upload_latency_max_ms");
 		}
+
 		void processOne(Data data) override {
-			auto const meta = safe_cast<const MetadataFile>(data->getMetadata());
+			auto const meta = metadata_cast<const MetadataFile>(data->getMetadata());
 			auto const url = baseURL + meta->filename;
 
-			HttpOutputConfig httpConfig {};
-			httpConfig.flags.InitialEmptyPost = false;
-			httpConfig.flags.request = POST;
-			httpConfig.url = url;
-			httpConfig.userAgent = userAgent;
-			httpConfig.headers = headers;
+			HttpSenderConfig senderCfg { url, userAgent, POST, headers };
+			senderCfg.afterFlushedUploads = meta->type == PLAYLIST; // after the segments it lists
 
 			if (meta->filesize == INT64_MAX) {
 				m_host->log(Info, format("Delete at URL: \"%s\"", url).c_str());
-				httpConfig.flags.request = DELETEX;
-				auto http = loadModule("HTTP", m_host, &httpConfig);
+				senderCfg.request = DELETEX;
+				m_engine->createSender(senderCfg, m_host);
 			} else if (meta->filesize == 0 && !meta->EOS) {
 				if (exists(zeroSizeConnections, url))
 					throw error(format("Received zero-sized metadata but transfer is already initialized for URL: \"%s\"", url));
 
 				m_host->log(Info, format("Initialize transfer for URL: \"%s\"", url).c_str());
-				auto http = loadModule("HTTP", m_host, &httpConfig);
-				http->getInput(0)->push(data);
-				http->process();
-				zeroSizeConnections[url] = move(http);
+				zeroSizeConnections[url] = m_engine->createSender(senderCfg, m_host);
 			} else {
 				if (!exists(zeroSizeConnections, url)) {
 					m_host->log(Info, format("Starting transfer to URL: \"%s\"", url).c_str());
-					zeroSizeConnections[url] = loadModule("HTTP", m_host, &httpConfig);
+					zeroSizeConnections[url] = m_engine->createSender(senderCfg, m_host);
 				}
 
 				m_host->log(Debug, format("Continue transfer (%s bytes) for URL: \"%s\"", meta->filesize, url).c_str());
 				if (meta->filesize) {
-					zeroSizeConnections[url]->getInput(0)->push(data);
+					zeroSizeConnections[url]->sendData(data);
 				}
 				if (meta->EOS) {
 					m_host->log(Info, format("Ending transfer for URL: \"%s\"", url).c_str());
-					zeroSizeConnections[url]->getInput(0)->push(nullptr);
-					zeroSizeConnections[url]->flush();
+					zeroSizeConnections[url]->send({});
 					zeroSizeConnections.erase(url);
 				}
 			}
+
+			updateStats();
+		}
+
+		void flush() override {
+			m_engine->waitForCompletion();
+			updateStats();
 		}
 
 	private:
+		void updateStats() {
+			auto const stats = m_engine->getStats();
+			if (m_connectionsOpened)
+				*m_connectionsOpened = (int32_t)stats.connectionsOpened;
+			if (m_uploadsCompleted)
+				*m_uploadsCompleted = (int32_t)stats.uploadsCompleted;
+			if (m_latencyMax)
+				*m_latencyMax = (int32_t)(stats.latencyMaxInUs / 1000);
+		}
+
 		KHost* const m_host;
-		atomic_bool done;
-		map<string, shared_ptr<IModule>> zeroSizeConnections;
+		std::unique_ptr<HttpUploadEngine> m_engine; // must outlive the senders
+		map<string, unique_ptr<HttpSender>> zeroSizeConnections;
 		const string baseURL, userAgent;
 		const vector<string> headers;
+		int32_t* m_connectionsOpened;
+		int32_t* m_uploadsCompleted;
+		int32_t* m_latencyMax;
 };
 
 IModule* createObject(KHost* host, void* va) {
 	auto config = (HttpSinkConfig*)va;
 	enforce(host, "HttpSink: host can't be NULL");
 	enforce(config, "HttpSink: config can't be NULL");
-	return createModule<HttpSink>(host, config->baseURL, config->userAgent, config->headers).release();
+	return createModule<HttpSink>(host, *config).release();
 }
 
 auto const registered = Factory::registerModule("HttpSink", &createObject);
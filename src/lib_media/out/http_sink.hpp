@@ -7,5 +7,6 @@ struct HttpSinkConfig {
 	std::string baseURL;
 	std::string userAgent;
 	std::vector<std::string> headers;
+	int maxConcurrentUploads = 32;
 };
 
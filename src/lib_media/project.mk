@@ -1,7 +1,9 @@
 MYDIR=$(call get-my-dir)
 
 LIB_MEDIA_SRCS:=\
+  $(MYDIR)/common/crc.cpp\
   $(MYDIR)/common/expand_vars.cpp\
+  $(MYDIR)/common/file_writer.cpp\
   $(MYDIR)/common/http_puller.cpp\
   $(MYDIR)/common/http_sender.cpp\
   $(MYDIR)/common/iso8601.cpp\
@@ -144,6 +146,7 @@ $(BIN)/GPACDemuxMP4Full.smd: \
 TARGETS+=$(BIN)/FileSystemSink.smd
 $(BIN)/FileSystemSink.smd: \
   $(BIN)/$(SRC)/lib_media/out/filesystem.cpp.o\
+  $(BIN)/$(SRC)/lib_media/common/file_writer.cpp.o\
 
 #------------------------------------------------------------------------------
 TARGETS+=$(BIN)/LogoOverlay.smd
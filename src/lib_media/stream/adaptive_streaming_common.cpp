@@ -3,14 +3,10 @@
 #include "lib_utils/time.hpp"
 #include "lib_utils/os.hpp"
 #include "lib_utils/system_clock.hpp"
+#include <algorithm> // min
 #include <cstring> // memcpy
 #include <cassert>
-#include <thread>
-#include <chrono>
-
-#define MOVE_FILE_NUM_RETRY 3
-
-using namespace std::chrono;
+#include <fstream>
 
 namespace Modules {
 namespace Stream {
@@ -20,14 +16,17 @@ void ensureDir(std::string path) {
 		mkdir(path);
 }
 
-AdaptiveStreamingCommon::AdaptiveStreamingCommon(KHost* host, Type type, uint64_t segDurationInMs, const std::string &manifestDir, AdaptiveStreamingCommonFlags flags)
+AdaptiveStreamingCommon::AdaptiveStreamingCommon(KHost* host, Type type, uint64_t segDurationInMs, const std::string &manifestDir, AdaptiveStreamingCommonFlags flags,
+    std::shared_ptr<IScheduler> scheduler, uint64_t lateDeadlineInMs)
 	: m_host(host),
-	  type(type), segDurationInMs(segDurationInMs), manifestDir(manifestDir), flags(flags) {
+	  type(type), segDurationInMs(segDurationInMs), manifestDir(manifestDir), flags(flags),
+	  scheduler(scheduler), lateDeadlineInMs(lateDeadlineInMs), deadline(std::make_shared<Deadline>()) {
 	if ((flags & ForceRealDurations) && !segDurationInMs)
 		throw error("Inconsistent parameters: ForceRealDurations flag requires a non-null segment duration.");
 	if (!manifestDir.empty() && (flags & SegmentsNotOwned))
 		throw error(format("Inconsistent parameters: manifestDir (%s) should be empty when segments are not owned.", manifestDir));
 	addInput();
+	deadline->input = inputs[0].get();
 	outputSegments = addOutput();
 	outputManifest = addOutput();
 }
@@ -45,28 +44,33 @@ bool AdaptiveStreamingCommon::moveFile(const std::string &src, const std::string
 	auto subdir = dst.substr(0, dst.find_last_of("/") + 1);
 	ensureDir(subdir);
 
-	int retry = MOVE_FILE_NUM_RETRY + 1;
-	while (--retry) {
-		try {
-			::moveFile(src, dst);
-			break;
-		} catch(...) {
-		}
-
-		std::this_thread::sleep_for(10ms);
-	}
-	if (!retry) {
+	try {
+		::moveFile(src, dst);
+	} catch(std::exception const& e) {
+		m_host->log(Warning, format("Can't move \"%s\" to \"%s\": %s", src, dst, e.what()).c_str());
 		return false;
 	}
 	return true;
 }
 
+void AdaptiveStreamingCommon::writeManifest(const std::string &path, const std::string &contents) const {
+	//the rename is atomic: readers never see a partial manifest
+	auto const tmpPath = path + ".tmp";
+	{
+		std::ofstream file(tmpPath, std::ofstream::out | std::ofstream::trunc);
+		file << contents;
+		if (!file)
+			throw error(format("Can't write manifest \"%s\"", tmpPath));
+	}
+	::moveFile(tmpPath, path);
+}
+
 void AdaptiveStreamingCommon::processInitSegment(Quality const * const quality, size_t index) {
 	auto const &meta = quality->getMeta();
 	switch (meta->type) {
 	case AUDIO_PKT: case VIDEO_PKT: case SUBTITLE_PKT: {
 		auto out = quality->lastData->clone();
-		std::string initFn = safe_cast<const MetadataFile>(quality->lastData->getMetadata())->filename;
+		std::string initFn = metadata_cast<const MetadataFile>(quality->lastData->getMetadata())->filename;
 		if (initFn.empty()) {
 			initFn = format("%s%s", manifestDir, getInitName(quality, index));
 		} else if (!(flags & SegmentsNotOwned)) {
@@ -123,8 +127,12 @@ std::string AdaptiveStreamingCommon::getSegmentName(Quality const * const qualit
 	}
 }
 
-uint64_t AdaptiveStreamingCommon::getCurSegNum() const {
-	return (startTimeInMs + totalDurationInMs) / segDurationInMs;
+uint64_t AdaptiveStreamingCommon::getCurSegNum(Quality const * const quality) const {
+	return getCurSegStartTimeInMs(quality) / segDurationInMs;
+}
+
+uint64_t AdaptiveStreamingCommon::getCurSegStartTimeInMs(Quality const * const quality) const {
+	return startTimeInMs + quality->segIndex * segDurationInMs;
 }
 
 void AdaptiveStreamingCommon::ensurePrefix(size_t i) {
@@ -139,10 +147,21 @@ void AdaptiveStreamingCommon::ensurePrefix(size_t i) {
 }
 
 void AdaptiveStreamingCommon::endOfStream() {
-	if (workingThread.joinable()) {
-		for(auto& in : inputs)
-			in->push(nullptr);
-		workingThread.join();
+	{
+		//waits for a running deadline task: the pending ones won't wake us up anymore
+		std::unique_lock<std::mutex> lock(deadline->mutex);
+		deadline->input = nullptr;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+	if (deadlinePending) {
+		scheduler->cancel(deadlineId);
+		deadlinePending = false;
+	}
+	if (!qualities.empty() && !finalized) {
+		finalized = true;
+		/*final rewrite of MPD in static mode*/
+		finalizeManifest();
 	}
 }
 
@@ -150,7 +169,7 @@ std::shared_ptr<DataBase> AdaptiveStreamingCommon::getPresignalledData(uint64_t
 	if (!(flags & PresignalNextSegment)) {
 		return data->clone();
 	}
-	if (!safe_cast<const MetadataFile>(data->getMetadata())->filename.empty() && !EOS) {
+	if (!metadata_cast<const MetadataFile>(data->getMetadata())->filename.empty() && !EOS) {
 		return nullptr;
 	}
 
@@ -175,165 +194,180 @@ std::shared_ptr<DataBase> AdaptiveStreamingCommon::getPresignalledData(uint64_t
 	}
 }
 
-void AdaptiveStreamingCommon::threadProc() {
+void AdaptiveStreamingCommon::sendLocalData(Quality * const quality, size_t index, uint64_t size, bool EOS) {
+	auto out = getPresignalledData(size, quality->lastData, EOS);
+	if (out) {
+		auto const &meta = quality->getMeta();
+
+		auto metaFn = make_shared<MetadataFile>(SEGMENT);
+		metaFn->filename = getSegmentName(quality, index, std::to_string(getCurSegNum(quality)));
+		metaFn->mimeType = meta->mimeType;
+		metaFn->codecName = meta->codecName;
+		metaFn->lang = meta->lang;
+		metaFn->durationIn180k = meta->durationIn180k;
+		metaFn->filesize = size;
+		metaFn->latencyIn180k = meta->latencyIn180k;
+		metaFn->startsWithRAP = meta->startsWithRAP;
+		metaFn->EOS = EOS;
 
-	auto const numInputs = getNumInputs() - 1;
-	for (int i = 0; i < numInputs; ++i) {
-		qualities.push_back(createQuality());
+		out->setMetadata(metaFn);
+		out->set(PresentationTime{ timescaleToClock((int64_t)(quality->segIndex * segDurationInMs), 1000) + (int64_t)quality->curSegDurIn180k });
+		outputSegments->post(out);
 	}
+}
 
+bool AdaptiveStreamingCommon::processData(size_t i) {
 	Data data;
-	std::vector<uint64_t> curSegDurIn180k(numInputs);
-	int i;
-
-	auto isComplete = [&]()->bool {
-		uint64_t minIncompletSegDur = std::numeric_limits<uint64_t>::max();
-		for (size_t idx = 0; idx < curSegDurIn180k.size(); ++idx) {
-			auto const &segDur = curSegDurIn180k[idx];
-			if ( (segDur < minIncompletSegDur) &&
-			    ((segDur < timescaleToClock(segDurationInMs, 1000)) || (!qualities[idx]->getMeta() || !qualities[idx]->getMeta()->EOS))) {
-				minIncompletSegDur = segDur;
-			}
-		}
-		return (minIncompletSegDur == std::numeric_limits<uint64_t>::max()) || (curSegDurIn180k[i] > minIncompletSegDur);
-	};
-	auto ensureStartTime = [&]() {
-		if (startTimeInMs == (uint64_t)-2) startTimeInMs = clockToTimescale(data->get<PresentationTime>().time, 1000);
-	};
-	auto ensureCurDur = [&]() {
-		for (i = 0; i < numInputs; ++i) {
-			if (!curSegDurIn180k[0])
-				curSegDurIn180k[0] = segDurationInMs;
-		}
-	};
-	auto sendLocalData = [&](uint64_t size, bool EOS) {
-		ensureStartTime();
-		auto out = getPresignalledData(size, data, EOS);
-		if (out) {
-			auto const &meta = qualities[i]->getMeta();
-
-			auto metaFn = make_shared<MetadataFile>(SEGMENT);
-			metaFn->filename = getSegmentName(qualities[i].get(), i, std::to_string(getCurSegNum()));
-			metaFn->mimeType = meta->mimeType;
-			metaFn->codecName = meta->codecName;
-			metaFn->lang = meta->lang;
-			metaFn->durationIn180k = meta->durationIn180k;
-			metaFn->filesize = size;
-			metaFn->latencyIn180k = meta->latencyIn180k;
-			metaFn->startsWithRAP = meta->startsWithRAP;
-			metaFn->EOS = EOS;
-
-			out->setMetadata(metaFn);
-			out->set(PresentationTime{ (int64_t)(totalDurationInMs + timescaleToClock(curSegDurIn180k[i], 1000)) });
-			outputSegments->post(out);
-		}
-	};
-	auto segmentReady = [&]()->bool {
-		ensureCurDur();
-		for (i = 0; i < numInputs; ++i) {
-			if (curSegDurIn180k[i] < timescaleToClock(segDurationInMs, 1000)) {
-				return false;
-			}
-			if (!qualities[i]->getMeta()->EOS) {
-				return false;
-			}
-		}
-		for (auto &d : curSegDurIn180k) {
-			d -= timescaleToClock(segDurationInMs, 1000);
+	if (!inputs[i]->tryPop(data) || !data)
+		return false;
+	if (data == deadline->marker)
+		return true;
+
+	auto quality = qualities[i].get();
+	quality->lastData = data;
+	auto const &meta = quality->getMeta();
+	if (!meta)
+		throw error(format("Unknown data received on input %s", i));
+	ensurePrefix(i);
+
+	auto const curDurIn180k = meta->durationIn180k;
+	if (curDurIn180k == 0 && quality->curSegDurIn180k == 0) {
+		processInitSegment(quality, i);
+		if (flags & PresignalNextSegment) {
+			sendLocalData(quality, i, 0, false);
 		}
 		return true;
-	};
-	for (;;) {
-		for (i = 0; i < numInputs; ++i) {
-			if (isComplete()) {
-				continue;
-			}
+	}
 
-			if ((type == LiveNonBlocking) && (!qualities[i]->getMeta())) {
-				if (inputs[i]->tryPop(data) && !data) {
-					break;
-				}
-			} else {
-				data = inputs[i]->pop();
-				if (!data) {
-					break;
-				}
-			}
+	if (startTimeInMs == (uint64_t)-2)
+		startTimeInMs = clockToTimescale(data->get<PresentationTime>().time, 1000);
 
-			if (data) {
-				qualities[i]->lastData = data;
-				auto const &meta = qualities[i]->getMeta();
-				if (!meta)
-					throw error(format("Unknown data received on input %s", i));
-				ensurePrefix(i);
-
-				auto const curDurIn180k = meta->durationIn180k;
-				if (curDurIn180k == 0 && curSegDurIn180k[i] == 0) {
-					processInitSegment(qualities[i].get(), i);
-					if (flags & PresignalNextSegment) {
-						sendLocalData(0, false);
-					}
-					--i; data = nullptr; continue;
-				}
-
-				if (segDurationInMs && curDurIn180k) {
-					auto const numSeg = totalDurationInMs / segDurationInMs;
-					qualities[i]->avg_bitrate_in_bps = ((meta->filesize * 8 * IClock::Rate) / meta->durationIn180k + qualities[i]->avg_bitrate_in_bps * numSeg) / (numSeg + 1);
-				}
-				if (flags & ForceRealDurations) {
-					curSegDurIn180k[i] += meta->durationIn180k;
-				} else {
-					curSegDurIn180k[i] = segDurationInMs ? timescaleToClock(segDurationInMs, 1000) : meta->durationIn180k;
-				}
-				if (curSegDurIn180k[i] < timescaleToClock(segDurationInMs, 1000) || !meta->EOS) {
-					sendLocalData(meta->filesize, meta->EOS);
-				}
-			}
-		}
-		if (!data) {
-			if (i != numInputs) {
-				break;
-			} else {
-				assert((type == LiveNonBlocking) && ((int)qualities.size() < numInputs));
-				std::this_thread::sleep_for(1000ms);
-				continue;
-			}
-		}
-		const int64_t curMediaTimeInMs = clockToTimescale(data->get<PresentationTime>().time, 1000);
-		ensureStartTime();
-		data = nullptr;
-
-		if (segmentReady()) {
-			generateManifest();
-			totalDurationInMs += segDurationInMs;
-			auto utcInMs = int64_t(getUTC() * 1000);
-			m_host->log(Info, format("Processes segment (total processed: %ss, UTC: %sms (deltaAST=%s, deltaInput=%s).",
-			        (double)totalDurationInMs / 1000, utcInMs, utcInMs - startTimeInMs, (int64_t)(utcInMs - curMediaTimeInMs)).c_str());
-
-			if (type != Static) {
-				const int64_t durInMs = startTimeInMs + totalDurationInMs - utcInMs;
-				if (durInMs > 0) {
-					m_host->log(Debug, format("Going to sleep for %s ms.", durInMs).c_str());
-					std::this_thread::sleep_for(1000ms);
-				} else {
-					m_host->log(Warning, format("Late from %s ms.", -durInMs).c_str());
-				}
-			}
+	if (segDurationInMs && curDurIn180k) {
+		auto const numSeg = quality->segIndex;
+		quality->avg_bitrate_in_bps = ((meta->filesize * 8 * IClock::Rate) / meta->durationIn180k + quality->avg_bitrate_in_bps * numSeg) / (numSeg + 1);
+	}
+	if (flags & ForceRealDurations) {
+		quality->curSegDurIn180k += meta->durationIn180k;
+	} else {
+		quality->curSegDurIn180k = segDurationInMs ? timescaleToClock(segDurationInMs, 1000) : meta->durationIn180k;
+	}
+	if (quality->curSegDurIn180k < timescaleToClock(segDurationInMs, 1000) || !meta->EOS) {
+		sendLocalData(quality, i, meta->filesize, meta->EOS);
+		onSegmentChunk(i);
+		return true;
+	}
+
+	quality->segmentComplete = true;
+	if (quality->segIndex < publishedSegments) {
+		publishLate();
+	} else if (isIndexComplete()) {
+		publishIndex();
+	} else if (scheduler && !deadlinePending) {
+		deadlinePending = true;
+		auto const index = publishedSegments;
+		auto d = deadline;
+		deadlineId = scheduler->scheduleIn([d, index](Fraction) {
+			std::unique_lock<std::mutex> lock(d->mutex);
+			if (!d->input)
+				return;
+			d->expiredIndex = index;
+			d->input->push(d->marker);
+		}, Fraction((int64_t)lateDeadlineInMs, 1000));
+	}
+	return true;
+}
+
+bool AdaptiveStreamingCommon::isIndexComplete() const {
+	for (auto &quality : qualities) {
+		if ((type == LiveNonBlocking) && !quality->getMeta())
+			continue;
+		if (quality->segIndex < publishedSegments || (quality->segIndex == publishedSegments && !quality->segmentComplete))
+			return false;
+	}
+	return true;
+}
+
+void AdaptiveStreamingCommon::publish(bool lateOnly) {
+	for (auto &quality : qualities)
+		quality->publishing = quality->segmentComplete && (!lateOnly || quality->segIndex < publishedSegments);
+	generateManifest();
+	for (auto &quality : qualities) {
+		if (quality->publishing) {
+			quality->publishing = false;
+			quality->segmentComplete = false;
+			quality->curSegDurIn180k -= std::min<uint64_t>(quality->curSegDurIn180k, timescaleToClock(segDurationInMs, 1000));
+			quality->segIndex++;
 		}
 	}
+}
+
+void AdaptiveStreamingCommon::publishIndex() {
+	if (deadlinePending) {
+		scheduler->cancel(deadlineId);
+		deadlinePending = false;
+	}
+
+	publish(false);
+	publishedSegments++;
+	totalDurationInMs += segDurationInMs;
+	auto utcInMs = int64_t(getUTC() * 1000);
+	m_host->log(Info, format("Processes segment (total processed: %ss, UTC: %sms (deltaAST=%s).",
+	        (double)totalDurationInMs / 1000, utcInMs, utcInMs - startTimeInMs).c_str());
+}
+
+void AdaptiveStreamingCommon::publishLate() {
+	//the others keep their complete segment for the next index
+	publish(true);
+}
+
+void AdaptiveStreamingCommon::onDeadline() {
+	deadlinePending = false;
+	for (size_t i = 0; i < qualities.size(); ++i)
+		if (!qualities[i]->segmentComplete)
+			m_host->log(Warning, format("Representation %s is late: publishing segment %s without it.", i, publishedSegments).c_str());
+	publishIndex();
+}
 
-	/*final rewrite of MPD in static mode*/
-	finalizeManifest();
+bool AdaptiveStreamingCommon::schedule() {
+	bool reschedule = false;
+	for (size_t i = 0; i < qualities.size(); ++i) {
+		if (!qualities[i]->segmentComplete && processData(i))
+			reschedule = true;
+	}
+	return reschedule;
 }
 
 void AdaptiveStreamingCommon::process() {
-	if (!workingThread.joinable() && (startTimeInMs==(uint64_t)-1)) {
+	std::unique_lock<std::mutex> lock(mutex);
+	if (startTimeInMs == (uint64_t)-1) {
 		startTimeInMs = (uint64_t)-2;
-		workingThread = std::thread(&AdaptiveStreamingCommon::threadProc, this);
+		for (int i = 0; i < getNumInputs() - 1; ++i) {
+			qualities.push_back(createQuality());
+		}
+	}
+
+	while (schedule()) {}
+
+	//the deadline of a previous index may expire late: ignore it
+	if (deadlinePending && deadline->expiredIndex == publishedSegments) {
+		onDeadline();
+		while (schedule()) {}
 	}
 }
 
 void AdaptiveStreamingCommon::flush() {
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (schedule()) {}
+
+		//the other representations won't complete
+		for (auto &quality : qualities) {
+			if (quality->segmentComplete) {
+				publishIndex();
+				break;
+			}
+		}
+	}
 	endOfStream();
 }
 
@@ -6,9 +6,11 @@
 #include "lib_utils/format.hpp"
 #include "lib_utils/log.hpp"
 #include "lib_utils/tools.hpp" // safe_cast
+#include "lib_utils/i_scheduler.hpp"
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <string>
-#include <thread>
 
 namespace Modules {
 namespace Stream {
@@ -17,22 +19,29 @@ struct Quality {
 	virtual ~Quality() {}
 
 	std::shared_ptr<const MetadataFile> getMeta() const {
-		return lastData ? safe_cast<const MetadataFile>(lastData->getMetadata()) : nullptr;
+		return lastData ? metadata_cast<const MetadataFile>(lastData->getMetadata()) : nullptr;
 	};
 
 	Data lastData;
 	uint64_t avg_bitrate_in_bps = 0;
 	std::string prefix; //typically a subdir, ending with a folder separator '/'
+
+	uint64_t curSegDurIn180k = 0;
+	uint64_t segIndex = 0; //segment in progress, counted from the start
+	bool segmentComplete = false; //waiting for the other representations
+	bool publishing = false; //set during generateManifest() for the segments to publish
 };
 
 class AdaptiveStreamingCommon : public ModuleDynI {
 	public:
 		/*created each quality private data*/
 		virtual std::unique_ptr<Quality> createQuality() const = 0;
-		/*called each time segments are ready*/
+		/*called each time segments are ready: publishes the qualities with 'publishing' set*/
 		virtual void generateManifest() = 0;
 		/*last manifest to be written: usually the VoD one*/
 		virtual void finalizeManifest() = 0;
+		/*called each time a chunk of a segment in progress is sent*/
+		virtual void onSegmentChunk(size_t /*index*/) {}
 
 		enum Type {
 			Static,
@@ -46,7 +55,9 @@ class AdaptiveStreamingCommon : public ModuleDynI {
 			ForceRealDurations   = 1 << 2
 		};
 
-		AdaptiveStreamingCommon(KHost* host, Type type, uint64_t segDurationInMs, const std::string &manifestDir, AdaptiveStreamingCommonFlags flags);
+		/*when a scheduler is provided, late representations don't hold the publication of a segment index for more than lateDeadlineInMs*/
+		AdaptiveStreamingCommon(KHost* host, Type type, uint64_t segDurationInMs, const std::string &manifestDir, AdaptiveStreamingCommonFlags flags,
+		    std::shared_ptr<IScheduler> scheduler = nullptr, uint64_t lateDeadlineInMs = 0);
 		virtual ~AdaptiveStreamingCommon() {}
 
 		void process() override final;
@@ -65,10 +76,12 @@ class AdaptiveStreamingCommon : public ModuleDynI {
 	protected:
 		KHost* const m_host;
 		bool moveFile(const std::string &src, const std::string &dst) const;
+		void writeManifest(const std::string &path, const std::string &contents) const;
 		void processInitSegment(Quality const * const quality, size_t index);
 		std::string getInitName(Quality const * const quality, size_t index) const;
 		std::string getSegmentName(Quality const * const quality, size_t index, const std::string &segmentNumSymbol) const;
-		uint64_t getCurSegNum() const;
+		uint64_t getCurSegNum(Quality const * const quality) const;
+		uint64_t getCurSegStartTimeInMs(Quality const * const quality) const;
 		std::shared_ptr<DataBase> getPresignalledData(uint64_t size, Data &data, bool EOS);
 		void endOfStream();
 
@@ -83,8 +96,30 @@ class AdaptiveStreamingCommon : public ModuleDynI {
 	private:
 		void ensurePrefix(size_t index);
 		std::string getPrefix(Quality const * const quality, size_t index) const;
-		void threadProc();
-		std::thread workingThread;
+		void sendLocalData(Quality * const quality, size_t index, uint64_t size, bool EOS);
+		bool schedule();
+		bool processData(size_t index);
+		bool isIndexComplete() const;
+		void publishIndex();
+		void publishLate();
+		void publish(bool lateOnly);
+		void onDeadline();
+
+		/*the deadline task only wakes process() up: it pushes a marker on the first input*/
+		struct Deadline {
+			std::mutex mutex; //held by the task: the teardown waits for it
+			IInput* input = nullptr; //nullptr once torn down
+			const Data marker = std::make_shared<DataRaw>(0);
+			std::atomic<uint64_t> expiredIndex { (uint64_t)-1 };
+		};
+
+		std::mutex mutex; //process() is also entered from the scheduler thread, through the marker
+		std::shared_ptr<IScheduler> const scheduler;
+		const uint64_t lateDeadlineInMs;
+		std::shared_ptr<Deadline> const deadline; //outlives us in the scheduler tasks
+		IScheduler::Id deadlineId {};
+		bool deadlinePending = false, finalized = false;
+		uint64_t publishedSegments = 0;
 };
 
 }
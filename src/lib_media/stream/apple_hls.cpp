@@ -1,32 +1,83 @@
 #include "apple_hls.hpp"
 #include "lib_media/common/attributes.hpp"
-#include <fstream>
+#include <cstring> // memcpy
+#include <deque>
 #include <sstream>
 #include <vector>
-#include <sstream>
 #include <cassert>
 
 namespace Modules {
 namespace Stream {
 
+namespace {
+// LL-HLS: parts are listed for the segments within three target durations of the end
+size_t const PART_SEGMENTS = 3;
+// LL-HLS: delta playlists keep the segments within six target durations of the end
+size_t const SKIP_SEGMENTS = 6;
+
+uint64_t getSegmentNum(const std::string &fn) {
+	auto const sepPos = fn.find_last_of(".");
+	auto const segNumPos = fn.substr(0, sepPos).find_last_of("-");
+	auto const segNumStr = fn.substr(segNumPos + 1, sepPos - (segNumPos + 1));
+	uint64_t segNum = 0;
+	std::istringstream buffer(segNumStr);
+	buffer >> segNum;
+	return segNum;
+}
+
+std::string getPartName(const std::string &segmentName, size_t partIndex) {
+	auto const sepPos = segmentName.find_last_of(".");
+	return format("%s.%s%s", segmentName.substr(0, sepPos), partIndex, segmentName.substr(sepPos));
+}
+
+// "name.m3u8" -> "name_delta.m3u8": what an origin serves for "name.m3u8?_HLS_skip=YES"
+std::string getDeltaPlaylistName(const std::string &playlistName) {
+	return playlistName.substr(0, playlistName.find_last_of(".")) + "_delta.m3u8";
+}
+
+std::string toSeconds(double seconds) {
+	std::stringstream ss;
+	ss << seconds;
+	return ss.str();
+}
+}
+
 struct Apple_HLS::HLSQuality : public Quality {
 	struct Segment {
 		std::string path;
 		uint64_t startTimeInMs;
+		uint64_t num;
+		std::string entry; //EXTINF, PROGRAM-DATE-TIME and URI lines
+		std::string partEntries; //LL-HLS: EXT-X-PART lines, only for the last segments
+		std::vector<std::string> partPaths;
 	};
 	HLSQuality() {}
-	std::stringstream playlistVariant;
-	std::vector<Segment> segments;
+	std::deque<Segment> segments;
+
+	//the entries of the first numSettled segments don't change anymore: they are rendered once
+	std::string settledEntries;
+	size_t numSettled = 0;
+
+	//LL-HLS: the segment in progress
+	uint64_t curSegNum = 0;
+	std::string curPartEntries, nextPartPath;
+	std::vector<std::string> curPartPaths;
 };
 
 
 Apple_HLS::Apple_HLS(KHost* host, HlsMuxConfig* cfg)
-	: AdaptiveStreamingCommon(host, cfg->type, cfg->segDurationInMs, cfg->m3u8Dir, cfg->flags | (cfg->genVariantPlaylist ? SegmentsNotOwned : None)),
+	: AdaptiveStreamingCommon(host, cfg->type, cfg->segDurationInMs, cfg->m3u8Dir, cfg->flags | (cfg->genVariantPlaylist ? SegmentsNotOwned : None),
+	    cfg->scheduler, cfg->lateDeadlineInMs),
 	  m_host(host),
 	  playlistMasterPath(format("%s%s", cfg->m3u8Dir, cfg->m3u8Filename)),
-	  genVariantPlaylist(cfg->genVariantPlaylist), timeShiftBufferDepthInMs(cfg->timeShiftBufferDepthInMs) {
+	  genVariantPlaylist(cfg->genVariantPlaylist), timeShiftBufferDepthInMs(cfg->timeShiftBufferDepthInMs),
+	  partDurationInMs(cfg->partDurationInMs) {
 	if (segDurationInMs % 1000)
 		throw error("Segment duration must be an integer number of seconds.");
+	if (partDurationInMs && !genVariantPlaylist)
+		throw error("LL-HLS parts require variant playlists.");
+	if (partDurationInMs && (flags & PresignalNextSegment))
+		throw error("LL-HLS parts and PresignalNextSegment are exclusive: use the EXT-X-PRELOAD-HINT instead.");
 }
 
 Apple_HLS::~Apple_HLS() {
@@ -112,50 +163,64 @@ std::string Apple_HLS::getManifestMasterInternal() {
 }
 
 void Apple_HLS::generateManifestMaster() {
+	for (auto &quality : qualities)
+		if (!quality->getMeta())
+			return; //wait for all the representations
 	if (!masterManifestIsWritten) {
-		std::ofstream mpl(playlistMasterPath, std::ofstream::out | std::ofstream::trunc);
-		mpl << getManifestMasterInternal();
-		mpl.close();
+		auto const playlistMaster = getManifestMasterInternal();
+		if (type != Static) {
+			postPlaylist(playlistMasterPath, playlistMaster);
+		} else {
+			writeManifest(playlistMasterPath, playlistMaster);
+		}
 		masterManifestIsWritten = true;
+	}
+}
 
-		if (type != Static) {
-			auto out = outputManifest->allocData<DataRaw>(0);
+void Apple_HLS::postPlaylist(const std::string &path, const std::string &contents) {
+	writeManifest(path, contents);
 
-			auto metadata = make_shared<MetadataFile>(PLAYLIST);
-			metadata->filename = playlistMasterPath;
-			metadata->durationIn180k = timescaleToClock(segDurationInMs, 1000);
+	auto out = outputManifest->allocData<DataRaw>(contents.size());
+	memcpy(out->buffer->data().ptr, contents.data(), contents.size());
 
-			out->setMetadata(metadata);
-			out->set(PresentationTime { timescaleToClock((int64_t)totalDurationInMs, 1000) });
-			outputManifest->post(out);
+	auto metadata = make_shared<MetadataFile>(PLAYLIST);
+	metadata->filename = path;
+	metadata->durationIn180k = timescaleToClock(segDurationInMs, 1000);
+	metadata->filesize = contents.size();
+
+	out->setMetadata(metadata);
+	out->set(PresentationTime { timescaleToClock((int64_t)totalDurationInMs, 1000) });
+	outputManifest->post(out);
+}
+
+void Apple_HLS::ensureVersion(const std::string &segmentName) {
+	if (!version) {
+		auto const ext = segmentName.substr(segmentName.find_last_of(".") + 1);
+		if (ext == "m4s") {
+			version = 7;
+			isCMAF = true;
+		} else {
+			version = 3;
 		}
+		if (partDurationInMs)
+			version = 9; //EXT-X-SKIP
 	}
 }
 
 void Apple_HLS::updateManifestVariants() {
 	if (genVariantPlaylist) {
-		firstSegNums.resize(getNumInputs());
 		for (int i = 0; i < getNumInputs() - 1; ++i) {
 			auto quality = safe_cast<HLSQuality>(qualities[i].get());
+			if (!quality->publishing)
+				continue;
 			auto const &meta = quality->getMeta();
+			auto const segNum = getCurSegNum(quality);
+			auto const segStartTimeInMs = getCurSegStartTimeInMs(quality);
 			auto fn = meta->filename;
 			if (fn.empty()) {
-				fn = getSegmentName(quality, i, std::to_string(getCurSegNum()));
-			}
-			auto const sepPos = fn.find_last_of(".");
-			auto const ext = fn.substr(sepPos + 1);
-			if (!version) {
-				if (ext == "m4s") {
-					version = 7;
-					isCMAF = true;
-				} else {
-					version = 3;
-				}
+				fn = getSegmentName(quality, i, std::to_string(segNum));
 			}
-			auto const firstSegNumPos = fn.substr(0, sepPos).find_last_of("-");
-			auto const firstSegNumStr = fn.substr(firstSegNumPos + 1, sepPos - (firstSegNumPos + 1));
-			std::istringstream buffer(firstSegNumStr);
-			buffer >> firstSegNums[i];
+			ensureVersion(fn);
 
 			auto out = quality->lastData->clone();
 			{
@@ -175,97 +240,214 @@ void Apple_HLS::updateManifestVariants() {
 			out->set(PresentationTime { timescaleToClock((int64_t)totalDurationInMs, 1000) });
 			outputSegments->post(out);
 
+			//the last chunk of a segment is also its last part
+			if (partDurationInMs && quality->lastData->data().len) {
+				addPart(quality, i, segNum);
+			}
+
 			if (flags & PresignalNextSegment) {
 				if (quality->segments.empty()) {
-					quality->segments.push_back({ fn, startTimeInMs + totalDurationInMs });
+					addSegment(quality, i, fn, getSegmentNum(fn), segStartTimeInMs);
 				}
 				if (quality->segments.back().path != fn)
 					throw error(format("PresignalNextSegment but segment names are inconsistent (\"%s\" versus \"%s\")", quality->segments.back().path, fn));
 
+				auto const sepPos = fn.find_last_of(".");
 				auto const segNumPos = fn.substr(0, sepPos).find_last_of("-");
-				auto const segNumStr = fn.substr(segNumPos + 1, sepPos - (segNumPos + 1));
-				uint64_t segNum; std::istringstream buffer(segNumStr); buffer >> segNum;
-				auto fnNext = format("%s%s%s", fn.substr(0, segNumPos+1), segNum+1, fn.substr(sepPos));
-				quality->segments.push_back({ fnNext, startTimeInMs + totalDurationInMs + segDurationInMs });
+				auto const segNumNext = getSegmentNum(fn) + 1;
+				auto fnNext = format("%s%s%s", fn.substr(0, segNumPos+1), segNumNext, fn.substr(sepPos));
+				addSegment(quality, i, fnNext, segNumNext, segStartTimeInMs + segDurationInMs);
 			} else {
-				quality->segments.push_back({ fn, startTimeInMs + totalDurationInMs });
+				addSegment(quality, i, fn, getSegmentNum(fn), segStartTimeInMs);
 			}
+
+			removeExpiredSegments(quality);
+			generateManifestVariant(i, false);
 		}
+	}
+}
 
-		generateManifestVariantFull(false);
+void Apple_HLS::addPart(HLSQuality *quality, size_t index, uint64_t segNum) {
+	auto const &meta = quality->getMeta();
+	auto const segmentName = getSegmentName(quality, index, std::to_string(segNum));
+	auto const path = getPartName(segmentName, quality->curPartPaths.size());
+
+	//parts are complete files sharing the segment buffers
+	auto out = quality->lastData->clone();
+	{
+		auto file = make_shared<MetadataFile>(SEGMENT);
+
+		file->filename = manifestDir + path;
+		file->mimeType = meta->mimeType;
+		file->codecName = meta->codecName;
+		file->lang = meta->lang;
+		file->durationIn180k = meta->durationIn180k;
+		file->filesize = out->data().len;
+		file->latencyIn180k = meta->latencyIn180k;
+		file->startsWithRAP = meta->startsWithRAP;
+
+		out->setMetadata(file);
 	}
+	out->set(PresentationTime { timescaleToClock((int64_t)totalDurationInMs, 1000) });
+	outputSegments->post(out);
+
+	if (meta->durationIn180k > timescaleToClock(partDurationInMs, 1000))
+		m_host->log(Warning, format("Part \"%s\" exceeds the part target duration (%sms).", path, partDurationInMs).c_str());
+
+	quality->curSegNum = segNum;
+	quality->curPartEntries += format("#EXT-X-PART:DURATION=%s,URI=\"%s\"%s\n", toSeconds((double)meta->durationIn180k / IClock::Rate), path, meta->startsWithRAP ? ",INDEPENDENT=YES" : "");
+	quality->curPartPaths.push_back(path);
+	quality->nextPartPath = getPartName(segmentName, quality->curPartPaths.size());
 }
 
-void Apple_HLS::generateManifestVariantFull(bool isLast) {
-	if (genVariantPlaylist) {
-		for (int i = 0; i < getNumInputs() - 1; ++i) {
-			auto quality = safe_cast<HLSQuality>(qualities[i].get());
-			quality->playlistVariant.str(std::string());
-			quality->playlistVariant << "#EXTM3U" << std::endl;
-			quality->playlistVariant << "#EXT-X-VERSION:" << version << std::endl;
-			quality->playlistVariant << "#EXT-X-TARGETDURATION:" << (segDurationInMs + 500) / 1000 << std::endl;
-			if ((int)firstSegNums.size() > i) quality->playlistVariant << "#EXT-X-MEDIA-SEQUENCE:" << firstSegNums[i] << std::endl;
-			if (version >= 6) quality->playlistVariant << "#EXT-X-INDEPENDENT-SEGMENTS" << std::endl;
-			if (isCMAF) quality->playlistVariant << "#EXT-X-MAP:URI=\"" << getInitName(quality, i) << "\"" << std::endl;
-			if (!timeShiftBufferDepthInMs) quality->playlistVariant << "#EXT-X-PLAYLIST-TYPE:EVENT" << std::endl;
-
-			for (auto &seg : quality->segments) {
-				quality->playlistVariant << "#EXTINF:" << segDurationInMs / 1000.0 << std::endl;
-				if (type != Static) {
-					char cmd[100];
-					long tv_sec = (long)(seg.startTimeInMs/1000);
-					assert(!(tv_sec & 0xFFFFFFFF00000000));
-					time_t sec = tv_sec;
-					auto *tm = gmtime(&sec);
-					if (!tm) {
-						m_host->log(Warning, format("Segment \"%s\": could not convert UTC start time %sms. Skippping PROGRAM-DATE-TIME.", seg.startTimeInMs, seg.path).c_str());
-					} else {
-						snprintf(cmd, sizeof(cmd), "%d-%02d-%02dT%02d:%02d:%02d.%03d+00:00", 1900 + tm->tm_year, 1 + tm->tm_mon, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec, (int)(seg.startTimeInMs % 1000));
-						quality->playlistVariant << "#EXT-X-PROGRAM-DATE-TIME:" << cmd << std::endl;
-					}
-				}
+void Apple_HLS::addSegment(HLSQuality *quality, size_t index, const std::string &path, uint64_t segNum, uint64_t startTimeInMs) {
+	if (path.empty())
+		throw error("HLS segment path is empty. Even when using memory mode, you must set a valid path in the metadata.");
+
+	HLSQuality::Segment seg;
+	seg.path = path;
+	seg.startTimeInMs = startTimeInMs;
+	seg.num = segNum;
+
+	std::stringstream entry;
+	entry << "#EXTINF:" << segDurationInMs / 1000.0 << std::endl;
+	if (type != Static) {
+		char cmd[100];
+		long tv_sec = (long)(seg.startTimeInMs/1000);
+		assert(!(tv_sec & 0xFFFFFFFF00000000));
+		time_t sec = tv_sec;
+		auto *tm = gmtime(&sec);
+		if (!tm) {
+			m_host->log(Warning, format("Segment \"%s\": could not convert UTC start time %sms. Skippping PROGRAM-DATE-TIME.", seg.startTimeInMs, seg.path).c_str());
+		} else {
+			snprintf(cmd, sizeof(cmd), "%d-%02d-%02dT%02d:%02d:%02d.%03d+00:00", 1900 + tm->tm_year, 1 + tm->tm_mon, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec, (int)(seg.startTimeInMs % 1000));
+			entry << "#EXT-X-PROGRAM-DATE-TIME:" << cmd << std::endl;
+		}
+	}
+	entry << seg.path << std::endl;
+	seg.entry = entry.str();
+
+	seg.partEntries.swap(quality->curPartEntries);
+	seg.partPaths.swap(quality->curPartPaths);
+	quality->segments.push_back(std::move(seg));
+	if (partDurationInMs)
+		quality->nextPartPath = getPartName(getSegmentName(quality, index, std::to_string(segNum + 1)), 0);
+
+	auto const partSegments = partDurationInMs ? PART_SEGMENTS : 0;
+	while (quality->segments.size() - quality->numSettled > partSegments) {
+		auto &settled = quality->segments[quality->numSettled++];
+		quality->settledEntries += settled.entry;
+		deleteParts(settled.partPaths);
+		settled.partEntries.clear();
+		settled.partPaths.clear();
+	}
+}
 
-				if (seg.path.empty())
-					error("HLS segment path is empty. Even when using memory mode, you must set a valid path in the metadata.");
-				quality->playlistVariant << seg.path << std::endl;
-			}
+void Apple_HLS::removeSegment(HLSQuality *quality) {
+	auto const &seg = quality->segments.front();
+	if (quality->numSettled) {
+		quality->settledEntries.erase(0, seg.entry.size());
+		quality->numSettled--;
+	} else {
+		deleteParts(seg.partPaths);
+	}
+	quality->segments.pop_front();
+}
 
-			if (isLast) {
-				quality->playlistVariant << "#EXT-X-ENDLIST" << std::endl;
-			}
+void Apple_HLS::deleteParts(std::vector<std::string> const &paths) {
+	for (auto &path : paths) {
+		auto out = outputSegments->allocData<DataRaw>(0);
+		auto file = make_shared<MetadataFile>(SEGMENT);
+		file->filename = manifestDir + path;
+		file->filesize = INT64_MAX;
+		out->setMetadata(file);
+		out->set(PresentationTime { timescaleToClock((int64_t)totalDurationInMs, 1000) });
+		outputSegments->post(out);
+	}
+}
 
-			if (timeShiftBufferDepthInMs) {
-				auto seg = quality->segments.begin();
-				while (seg != quality->segments.end()) {
-					if ((*seg).startTimeInMs + timeShiftBufferDepthInMs < startTimeInMs + totalDurationInMs) {
-						seg = quality->segments.erase(seg);
-					} else {
-						++seg;
-					}
-				}
-			}
+std::string Apple_HLS::getVariantPlaylistHeader(HLSQuality const * const quality, size_t index) const {
+	auto const targetDuration = (segDurationInMs + 500) / 1000;
+	std::stringstream header;
+	header << "#EXTM3U" << std::endl;
+	header << "#EXT-X-VERSION:" << version << std::endl;
+	header << "#EXT-X-TARGETDURATION:" << targetDuration << std::endl;
+	if (partDurationInMs) {
+		header << "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,CAN-SKIP-UNTIL=" << SKIP_SEGMENTS * targetDuration << ",PART-HOLD-BACK=" << 3 * partDurationInMs / 1000.0 << std::endl;
+		header << "#EXT-X-PART-INF:PART-TARGET=" << partDurationInMs / 1000.0 << std::endl;
+	}
+	header << "#EXT-X-MEDIA-SEQUENCE:" << (quality->segments.empty() ? quality->curSegNum : quality->segments.front().num) << std::endl;
+	if (version >= 6) header << "#EXT-X-INDEPENDENT-SEGMENTS" << std::endl;
+	if (isCMAF) header << "#EXT-X-MAP:URI=\"" << getInitName(quality, index) << "\"" << std::endl;
+	if (!timeShiftBufferDepthInMs) header << "#EXT-X-PLAYLIST-TYPE:EVENT" << std::endl;
+	return header.str();
+}
+
+void Apple_HLS::generateManifestVariant(size_t index, bool isLast) {
+	auto quality = safe_cast<HLSQuality>(qualities[index].get());
 
-			std::ofstream vpl;
-			auto const playlistCurVariantPath = getVariantPlaylistName(quality, manifestDir, i);
-			vpl.open(playlistCurVariantPath, std::ofstream::out | std::ofstream::trunc);
-			vpl << quality->playlistVariant.str();
-			vpl.close();
+	//only the end of the playlist is rendered again
+	std::string recent;
+	for (auto seg = quality->segments.begin() + quality->numSettled; seg != quality->segments.end(); ++seg) {
+		recent += seg->partEntries;
+		recent += seg->entry;
+	}
+	recent += quality->curPartEntries;
+	if (isLast) {
+		recent += "#EXT-X-ENDLIST\n";
+	} else if (partDurationInMs) {
+		recent += format("#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"%s\"\n", quality->nextPartPath);
+	}
 
-			auto out = outputManifest->allocData<DataRaw>(0);
+	auto const header = getVariantPlaylistHeader(quality, index);
+	auto const playlistCurVariantPath = getVariantPlaylistName(quality, manifestDir, index);
+	postPlaylist(playlistCurVariantPath, header + quality->settledEntries + recent);
+
+	//delta update: the oldest segments are replaced by EXT-X-SKIP
+	if (partDurationInMs && quality->segments.size() > SKIP_SEGMENTS) {
+		auto const skipped = quality->segments.size() - SKIP_SEGMENTS;
+		size_t skippedSize = 0;
+		for (size_t s = 0; s < skipped; ++s)
+			skippedSize += quality->segments[s].entry.size();
+		postPlaylist(getDeltaPlaylistName(playlistCurVariantPath),
+		    format("%s#EXT-X-SKIP:SKIPPED-SEGMENTS=%s\n", header, skipped) + quality->settledEntries.substr(skippedSize) + recent);
+	}
+}
 
-			{
-				auto meta = make_shared<MetadataFile>(PLAYLIST);
-				meta->filename = playlistCurVariantPath;
-				meta->durationIn180k = timescaleToClock(segDurationInMs, 1000);
-				out->setMetadata(meta);
-			}
+void Apple_HLS::removeExpiredSegments(HLSQuality *quality) {
+	if (timeShiftBufferDepthInMs) {
+		while (!quality->segments.empty() && quality->segments.front().startTimeInMs + timeShiftBufferDepthInMs < startTimeInMs + totalDurationInMs) {
+			removeSegment(quality);
+		}
+	}
+}
 
-			out->set(PresentationTime { timescaleToClock((int64_t)totalDurationInMs, 1000) });
-			outputManifest->post(out);
+void Apple_HLS::generateManifestVariantFull(bool isLast) {
+	if (genVariantPlaylist) {
+		for (size_t i = 0; i < qualities.size(); ++i) {
+			auto quality = safe_cast<HLSQuality>(qualities[i].get());
+			if (!quality->getMeta())
+				continue;
+			removeExpiredSegments(quality);
+			generateManifestVariant(i, isLast);
 		}
 	}
 }
 
+void Apple_HLS::onSegmentChunk(size_t index) {
+	if (!partDurationInMs)
+		return;
+
+	auto quality = safe_cast<HLSQuality>(qualities[index].get());
+	if (!quality->lastData->data().len)
+		return;
+
+	auto const segNum = getCurSegNum(quality);
+	ensureVersion(getSegmentName(quality, index, std::to_string(segNum)));
+	addPart(quality, index, segNum);
+	generateManifestVariant(index, false);
+}
+
 void Apple_HLS::generateManifest() {
 	updateManifestVariants();
 	generateManifestMaster();
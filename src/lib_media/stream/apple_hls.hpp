@@ -11,6 +11,15 @@ struct HlsMuxConfig {
 	uint64_t timeShiftBufferDepthInMs = 0;
 	bool genVariantPlaylist = false;
 	Modules::Stream::AdaptiveStreamingCommon::AdaptiveStreamingCommonFlags flags = Modules::Stream::AdaptiveStreamingCommon::None;
+
+	// LL-HLS: each chunk received for a segment in progress is published as a part.
+	// Upper bound of the chunk durations. 0: disabled.
+	uint64_t partDurationInMs = 0;
+
+	// when set, a segment is published at most lateDeadlineInMs after its first
+	// representation completes: the late ones are published when they complete.
+	std::shared_ptr<IScheduler> scheduler = nullptr;
+	uint64_t lateDeadlineInMs = 0;
 };
 
 namespace Modules {
@@ -25,12 +34,22 @@ class Apple_HLS : public AdaptiveStreamingCommon {
 		std::unique_ptr<Quality> createQuality() const override;
 		void generateManifest() override;
 		void finalizeManifest() override;
+		void onSegmentChunk(size_t index) override;
 
 		struct HLSQuality;
 
 		std::string getVariantPlaylistName(HLSQuality const * const quality, const std::string &subDir, size_t index);
+		void ensureVersion(const std::string &segmentName);
 		void updateManifestVariants();
+		void addPart(HLSQuality *quality, size_t index, uint64_t segNum);
+		void addSegment(HLSQuality *quality, size_t index, const std::string &path, uint64_t segNum, uint64_t startTimeInMs);
+		void removeSegment(HLSQuality *quality);
+		void removeExpiredSegments(HLSQuality *quality);
+		void deleteParts(std::vector<std::string> const &paths);
+		std::string getVariantPlaylistHeader(HLSQuality const * const quality, size_t index) const;
+		void generateManifestVariant(size_t index, bool isLast);
 		void generateManifestVariantFull(bool isLast);
+		void postPlaylist(const std::string &path, const std::string &contents);
 
 		std::string getManifestMasterInternal();
 		void generateManifestMaster();
@@ -42,8 +61,8 @@ class Apple_HLS : public AdaptiveStreamingCommon {
 
 		unsigned version = 0;
 		bool masterManifestIsWritten = false, isCMAF = false;
-		std::vector<uint64_t> firstSegNums;
 		uint64_t timeShiftBufferDepthInMs = 0;
+		const uint64_t partDurationInMs;
 };
 
 }
@@ -11,28 +11,18 @@
 #include "lib_utils/log_sink.hpp"
 #include "lib_utils/tools.hpp" // safe_cast
 #include <cassert>
+#include <sys/stat.h>
 
 using namespace Modules;
 
 namespace {
 
-bool fileExists(std::string path) {
-	auto f = fopen(path.c_str(), "r");
-	if (f) {
-		fclose(f);
-		return true;
-	}
-	return false;
-}
-
-uint64_t fileSize(std::string path) {
-	auto file = fopen(path.c_str(), "rt");
-	if (!file)
-		throw std::runtime_error(format("Can't open segment for reading: '%s'", path));
-	fseek(file, 0, SEEK_END);
-	auto const fsize = ftell(file);
-	fclose(file);
-	return fsize;
+// -1 when the file doesn't exist
+int64_t fileSize(std::string path) {
+	struct stat st;
+	if (stat(path.c_str(), &st))
+		return -1;
+	return st.st_size;
 }
 
 class LibavMuxHLSTS : public ModuleDynI {
@@ -93,9 +83,9 @@ class LibavMuxHLSTS : public ModuleDynI {
 
 					switch (data->getMetadata()->type) {
 					case AUDIO_PKT:
-						meta->sampleRate = safe_cast<const MetadataPktAudio>(data->getMetadata())->sampleRate; break;
+						meta->sampleRate = metadata_cast<const MetadataPktAudio>(data->getMetadata())->sampleRate; break;
 					case VIDEO_PKT: {
-						auto const res = safe_cast<const MetadataPktVideo>(data->getMetadata())->resolution;
+						auto const res = metadata_cast<const MetadataPktVideo>(data->getMetadata())->resolution;
 						meta->resolution = res;
 						break;
 					}
@@ -145,12 +135,13 @@ class LibavMuxHLSTS : public ModuleDynI {
 				return false;
 
 			auto s = segmentsToPost.front();
-			if (!fileExists(s.meta->filename)) {
+			auto const size = fileSize(s.meta->filename);
+			if (size < 0) {
 				m_host->log(Warning, format("Cannot post filename \"%s\": file does not exist.", s.meta->filename).c_str());
 				return false;
 			}
 
-			s.meta->filesize = fileSize(s.meta->filename);
+			s.meta->filesize = size;
 
 			auto data = outputSegment->allocData<DataRaw>(0);
 			data->set(PresentationTime{s.pts});
@@ -178,7 +169,7 @@ class LibavMuxHLSTS : public ModuleDynI {
 
 			/*segment is complete when next segment exists*/
 			auto s = segmentsToPost.front();
-			if (!fileExists(format("%s%s%s.ts", hlsDir, segBasename, s.segIdx + 1)))
+			if (fileSize(format("%s%s%s.ts", hlsDir, segBasename, s.segIdx + 1)) < 0)
 				return;
 
 			post();
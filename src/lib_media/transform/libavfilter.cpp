@@ -76,8 +76,8 @@ void LibavFilter::processOne(Data data) {
 
 		srcParams->format = pixelFormat2libavPixFmt(format.format);
 		if (cfg.isHardwareFilter) {
-			buffersrc_ctx->hw_device_ctx = av_buffer_ref(safe_cast<const MetadataRawVideoHw>(data->getMetadata())->deviceCtx);
-			srcParams->hw_frames_ctx = av_buffer_ref(safe_cast<const MetadataRawVideoHw>(data->getMetadata())->framesCtx);
+			buffersrc_ctx->hw_device_ctx = av_buffer_ref(metadata_cast<const MetadataRawVideoHw>(data->getMetadata())->deviceCtx);
+			srcParams->hw_frames_ctx = av_buffer_ref(metadata_cast<const MetadataRawVideoHw>(data->getMetadata())->framesCtx);
 		}
 		srcParams->width = format.res.width;
 		srcParams->height = format.res.height;
@@ -111,7 +111,7 @@ void LibavFilter::processOne(Data data) {
 
 		if (cfg.isHardwareFilter) {
 			for (unsigned i=0; i<graph->nb_filters; i++)
-				graph->filters[i]->hw_device_ctx = av_buffer_ref(safe_cast<const MetadataRawVideoHw>(data->getMetadata())->deviceCtx);
+				graph->filters[i]->hw_device_ctx = av_buffer_ref(metadata_cast<const MetadataRawVideoHw>(data->getMetadata())->deviceCtx);
 		}
 
 		ret = avfilter_graph_config(graph, NULL);
@@ -133,7 +133,7 @@ void LibavFilter::processOne(Data data) {
 		avFrameIn->get()->pts = data->get<PresentationTime>().time;
 
 		if (cfg.isHardwareFilter) {
-			auto meta = safe_cast<const MetadataRawVideoHw>(data->getMetadata());
+			auto meta = metadata_cast<const MetadataRawVideoHw>(data->getMetadata());
 			for (int i=0; i<AV_NUM_DATA_POINTERS && meta->dataRef[i]; ++i) {
 				avFrameIn->get()->buf[i] = av_buffer_ref(meta->dataRef[i]);
 			}
@@ -0,0 +1,353 @@
+#include "tests/tests.hpp"
+#include "lib_modules/modules.hpp"
+#include "lib_modules/utils/helper.hpp"
+#include "lib_media/common/attributes.hpp"
+#include "lib_media/common/metadata_file.hpp"
+#include "lib_media/stream/apple_hls.hpp"
+#include "lib_utils/format.hpp"
+#include "lib_utils/os.hpp"
+#include "lib_utils/profiler.hpp"
+#include "lib_utils/scheduler.hpp"
+#include "modules_common.hpp"
+#include <algorithm> // max
+#include <chrono>
+#include <cstdlib> // atoi
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <thread>
+
+using namespace Tests;
+using namespace Modules;
+
+namespace {
+
+// when it doesn't own the segments, Apple_HLS writes its playlists in the current directory
+struct ScopedDir {
+	ScopedDir(std::string path) : previous(currentDir()) {
+		if(!dirExists("out"))
+			mkdir("out");
+		if(!dirExists(path))
+			mkdir(path);
+		changeDir(path);
+	}
+	~ScopedDir() {
+		changeDir(previous);
+	}
+	std::string const previous;
+};
+
+struct Hls {
+	Hls(int64_t segDurationInMs, int64_t partDurationInMs, int numInputs = 1, std::shared_ptr<IScheduler> scheduler = nullptr, uint64_t lateDeadlineInMs = 0) {
+		HlsMuxConfig cfg {};
+		cfg.m3u8Filename = "master.m3u8";
+		cfg.type = Stream::AdaptiveStreamingCommon::Live;
+		cfg.segDurationInMs = segDurationInMs;
+		cfg.genVariantPlaylist = true;
+		cfg.partDurationInMs = partDurationInMs;
+		cfg.scheduler = scheduler;
+		cfg.lateDeadlineInMs = lateDeadlineInMs;
+		segments = createModule<FileRecorder>();
+		playlists = createModule<FileRecorder>();
+		hls = createModule<Stream::Apple_HLS>(&NullHost, &cfg);
+		ConnectOutputToInput(hls->getOutput(0), segments->getInput(0));
+		ConnectOutputToInput(hls->getOutput(1), playlists->getInput(0));
+		for(int i=0; i < numInputs; ++i)
+			hls->getInput(i)->connect();
+		for(int i=0; i < numInputs; ++i)
+			hls->getInput(i)->push(getTestChunk(0, true, true)); // init
+	}
+
+	void pushSegments(int numSegments, int partsPerSegment, int64_t partDurationInMs) {
+		for(int seg=0; seg < numSegments; ++seg)
+			for(int part=0; part < partsPerSegment; ++part)
+				hls->getInput(0)->push(getTestChunk(timescaleToClock(partDurationInMs, 1000), part == partsPerSegment - 1, part == 0));
+	}
+
+	void pushSegment(int input, int64_t durationInMs) {
+		hls->getInput(input)->push(getTestChunk(timescaleToClock(durationInMs, 1000), true, true));
+	}
+
+	ScopedDir dir { "out/apple_hls" };
+	std::shared_ptr<FileRecorder> segments, playlists;
+	std::shared_ptr<Stream::Apple_HLS> hls;
+};
+
+int count(std::string const& text, std::string const& pattern) {
+	int n = 0;
+	for(auto pos = text.find(pattern); pos != std::string::npos; pos = text.find(pattern, pos + 1))
+		++n;
+	return n;
+}
+
+}
+
+unittest("Apple_HLS: LL-HLS parts are published as they are produced") {
+	Hls ll(2000, 500);
+	ll.pushSegments(3, 4, 500);
+	ll.hls->flush();
+
+	// one update per part
+	auto const variants = ll.playlists->get("v_0_0x0_.m3u8");
+	ASSERT_EQUALS(3 * 4 + 1, (int)variants.size());
+	ASSERT_EQUALS(1, (int)ll.playlists->get("master.m3u8").size());
+
+	// the first part is listed before its segment is complete
+	auto const& first = variants[0].contents;
+	ASSERT(first.find("#EXT-X-VERSION:9\n") != std::string::npos);
+	ASSERT(first.find("#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,CAN-SKIP-UNTIL=12,PART-HOLD-BACK=1.5\n") != std::string::npos);
+	ASSERT(first.find("#EXT-X-PART-INF:PART-TARGET=0.5\n") != std::string::npos);
+	ASSERT(first.find("#EXT-X-MEDIA-SEQUENCE:0\n") != std::string::npos);
+	ASSERT(first.find("#EXT-X-PART:DURATION=0.5,URI=\"v_0_0x0/v_0_0x0-0.0.m4s\",INDEPENDENT=YES\n") != std::string::npos);
+	ASSERT(first.find("#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"v_0_0x0/v_0_0x0-0.1.m4s\"\n") != std::string::npos);
+	ASSERT(first.find("#EXTINF") == std::string::npos);
+
+	// the last part of a segment completes it
+	auto const& completed = variants[3].contents;
+	ASSERT(completed.find("#EXT-X-PART:DURATION=0.5,URI=\"v_0_0x0/v_0_0x0-0.3.m4s\"\n#EXTINF:2\n") != std::string::npos);
+	ASSERT(completed.find("#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"v_0_0x0/v_0_0x0-1.0.m4s\"\n") != std::string::npos);
+
+	auto const& last = variants.back().contents;
+	ASSERT_EQUALS(3, count(last, "#EXTINF:2\n"));
+	ASSERT_EQUALS(3 * 4, count(last, "#EXT-X-PART:"));
+	ASSERT_EQUALS(0, count(last, "#EXT-X-PRELOAD-HINT"));
+	ASSERT(last.substr(last.size() - 15) == "#EXT-X-ENDLIST\n");
+
+	// each part is a complete file
+	for(int seg=0; seg < 3; ++seg) {
+		for(int part=0; part < 4; ++part) {
+			auto const parts = ll.segments->get(format("v_0_0x0/v_0_0x0-%s.%s.m4s", seg, part));
+			ASSERT_EQUALS(1, (int)parts.size());
+			ASSERT_EQUALS(6, (int)parts[0].contents.size());
+		}
+	}
+}
+
+unittest("Apple_HLS: LL-HLS delta playlists and part retention") {
+	Hls ll(1000, 500);
+	ll.pushSegments(10, 2, 500);
+	ll.hls->flush();
+
+	// parts are only listed (and kept) for the last three segments
+	auto const last = ll.playlists->get("v_0_0x0_.m3u8").back().contents;
+	ASSERT_EQUALS(10, count(last, "#EXTINF:1\n"));
+	ASSERT_EQUALS(3 * 2, count(last, "#EXT-X-PART:"));
+	int deleted = 0;
+	for(auto& f : ll.segments->files)
+		deleted += f.deleted;
+	ASSERT_EQUALS(7 * 2, deleted);
+
+	// the delta update skips the segments older than six target durations
+	auto const delta = ll.playlists->get("v_0_0x0__delta.m3u8").back().contents;
+	ASSERT(delta.find("#EXT-X-MEDIA-SEQUENCE:0\n") != std::string::npos);
+	ASSERT(delta.find("#EXT-X-SKIP:SKIPPED-SEGMENTS=4\n#EXTINF:1\n#EXT-X-PROGRAM-DATE-TIME:1970-01-01T00:00:04.000+00:00\nv_0_0x0/v_0_0x0-4.m4s\n") != std::string::npos);
+	ASSERT_EQUALS(6, count(delta, "#EXTINF:1\n"));
+	ASSERT(delta.size() < last.size());
+}
+
+secondclasstest("Apple_HLS: perf test, part-availability latency") {
+	auto const SEGMENT_IN_MS = 1000;
+	auto const PART_IN_MS = 200;
+	auto const PARTS_PER_SEGMENT = SEGMENT_IN_MS / PART_IN_MS;
+	auto const SEGMENTS = 3;
+
+	auto now = []() {
+		return std::chrono::steady_clock::now();
+	};
+	auto inMs = [](std::chrono::steady_clock::duration d) {
+		return std::chrono::duration<double, std::milli>(d).count();
+	};
+
+	// the muxer outputs a chunk every PART_IN_MS. Without LL-HLS, only complete segments are listed.
+	for(auto lowLatency : { false, true }) {
+		Hls ll(SEGMENT_IN_MS, lowLatency ? PART_IN_MS : 0);
+
+		// when each chunk is ready, and when each part or segment first appears in the playlist
+		std::vector<std::chrono::steady_clock::time_point> readyTimes, listedTimes;
+		std::set<std::string> listed;
+		ll.playlists->onFile = [&](FileRecorder::File const& playlist) {
+			if(playlist.filename != "v_0_0x0_.m3u8")
+				return;
+			std::istringstream lines(playlist.contents);
+			std::string line;
+			while(std::getline(lines, line)) {
+				auto const isItem = lowLatency ? line.compare(0, 12, "#EXT-X-PART:") == 0 : (!line.empty() && line[0] != '#');
+				if(isItem && listed.insert(line).second)
+					listedTimes.push_back(now());
+			}
+		};
+
+		{
+			Tools::Profiler p(lowLatency ? "LL-HLS parts" : "Segments");
+			auto const start = now();
+			for(int part=0; part < SEGMENTS * PARTS_PER_SEGMENT; ++part) {
+				// the chunk is ready once its last frame is over
+				std::this_thread::sleep_until(start + std::chrono::milliseconds((part + 1) * PART_IN_MS));
+				readyTimes.push_back(now());
+				auto const EOS = (part + 1) % PARTS_PER_SEGMENT == 0;
+				ll.hls->getInput(0)->push(getTestChunk(timescaleToClock(PART_IN_MS, 1000), EOS, part % PARTS_PER_SEGMENT == 0));
+			}
+		}
+		ll.hls->flush();
+
+		auto const itemInMs = lowLatency ? PART_IN_MS : SEGMENT_IN_MS;
+		auto const chunksPerItem = itemInMs / PART_IN_MS;
+		ASSERT_EQUALS(readyTimes.size() / chunksPerItem, listedTimes.size());
+
+		// latency: from the capture of the first frame of the item to its listing
+		double totalLatencyInMs = 0, maxLatencyInMs = 0, maxDelayInMs = 0;
+		for(size_t i=0; i < listedTimes.size(); ++i) {
+			auto const captureTime = readyTimes[i * chunksPerItem] - std::chrono::milliseconds(PART_IN_MS);
+			auto const latency = inMs(listedTimes[i] - captureTime);
+			totalLatencyInMs += latency;
+			maxLatencyInMs = std::max(maxLatencyInMs, latency);
+			maxDelayInMs = std::max(maxDelayInMs, inMs(listedTimes[i] - readyTimes[(i + 1) * chunksPerItem - 1]));
+		}
+		auto const avgLatencyInMs = totalLatencyInMs / listedTimes.size();
+		auto const name = std::string(lowLatency ? "LL-HLS parts" : "Segments");
+		Report(name + ", part-availability latency, average", avgLatencyInMs, "ms");
+		Report(name + ", part-availability latency, max", maxLatencyInMs, "ms");
+		Report(name + ", chunk ready to listed, max", maxDelayInMs, "ms");
+
+		// listed as soon as ready: the latency is the duration of the item
+		ASSERT(avgLatencyInMs > itemInMs * 0.9 && maxLatencyInMs < itemInMs + PART_IN_MS / 2);
+		ASSERT(maxDelayInMs < PART_IN_MS / 4);
+	}
+}
+
+unittest("Apple_HLS: a segment is published when its last representation completes") {
+	Hls hls(1000, 0, 2);
+	hls.pushSegment(0, 1000);
+	ASSERT_EQUALS(0, (int)hls.playlists->get("v_0_0x0_.m3u8").size());
+
+	// no thread: the publication happens on data arrival
+	hls.pushSegment(1, 1000);
+	ASSERT_EQUALS(1, (int)hls.playlists->get("v_0_0x0_.m3u8").size());
+	ASSERT_EQUALS(1, (int)hls.playlists->get("v_1_0x0_.m3u8").size());
+	ASSERT_EQUALS(1, (int)hls.playlists->get("master.m3u8").size());
+	ASSERT(hls.playlists->get("v_1_0x0_.m3u8")[0].contents.find("v_1_0x0/v_1_0x0-0.m4s\n") != std::string::npos);
+	hls.hls->flush();
+}
+
+unittest("Apple_HLS: playlists are published atomically") {
+	Hls hls(1000, 0);
+	for(int i = 0; i < 3; ++i)
+		hls.pushSegment(0, 1000);
+
+	// written under a temporary name, then renamed over the previous version
+	auto const posted = hls.playlists->get("v_0_0x0_.m3u8");
+	ASSERT_EQUALS(3, (int)posted.size());
+	std::ifstream file("v_0_0x0_.m3u8");
+	std::stringstream onDisk;
+	onDisk << file.rdbuf();
+	ASSERT_EQUALS(posted.back().contents, onDisk.str());
+	ASSERT(!std::ifstream("v_0_0x0_.m3u8.tmp"));
+	hls.hls->flush();
+}
+
+unittest("Apple_HLS: late representations don't hold the publication") {
+	auto scheduler = std::make_shared<Scheduler>();
+	Hls hls(1000, 0, 2, scheduler, 50);
+
+	hls.pushSegment(0, 1000);
+	auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while(hls.playlists->get("v_0_0x0_.m3u8").empty() && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	ASSERT_EQUALS(1, (int)hls.playlists->get("v_0_0x0_.m3u8").size());
+	ASSERT_EQUALS(0, (int)hls.playlists->get("v_1_0x0_.m3u8").size());
+
+	// the late segment is published as soon as it completes
+	hls.pushSegment(1, 1000);
+	auto const late = hls.playlists->get("v_1_0x0_.m3u8");
+	ASSERT_EQUALS(1, (int)late.size());
+	ASSERT(late[0].contents.find("v_1_0x0/v_1_0x0-0.m4s\n") != std::string::npos);
+	ASSERT_EQUALS(1, (int)hls.playlists->get("v_0_0x0_.m3u8").size());
+
+	// back in sync
+	hls.pushSegment(0, 1000);
+	hls.pushSegment(1, 1000);
+	ASSERT_EQUALS(2, (int)hls.playlists->get("v_0_0x0_.m3u8").size());
+	ASSERT(hls.playlists->get("v_1_0x0_.m3u8").back().contents.find("v_1_0x0/v_1_0x0-1.m4s\n") != std::string::npos);
+	hls.hls->flush();
+}
+
+unittest("Apple_HLS: a late representation doesn't drop the next segment of the others") {
+	auto scheduler = std::make_shared<Scheduler>();
+	Hls hls(1000, 0, 2, scheduler, 50);
+
+	hls.pushSegment(0, 1000);
+	auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while(hls.playlists->get("v_0_0x0_.m3u8").empty() && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	ASSERT_EQUALS(1, (int)hls.playlists->get("v_0_0x0_.m3u8").size());
+
+	// the first representation completes its segment 1 before the late one completes its segment 0
+	hls.pushSegment(0, 1000);
+	hls.pushSegment(1, 1000);
+	ASSERT_EQUALS(1, (int)hls.playlists->get("v_0_0x0_.m3u8").size());
+	hls.pushSegment(1, 1000);
+
+	auto const first = hls.playlists->get("v_0_0x0_.m3u8");
+	ASSERT_EQUALS(2, (int)first.size());
+	ASSERT(first.back().contents.find("v_0_0x0/v_0_0x0-1.m4s\n") != std::string::npos);
+	ASSERT(hls.playlists->get("v_1_0x0_.m3u8").back().contents.find("v_1_0x0/v_1_0x0-1.m4s\n") != std::string::npos);
+	hls.hls->flush();
+}
+
+unittest("Apple_HLS: destroyed while a deadline expires") {
+	auto scheduler = std::make_shared<Scheduler>();
+	for(int i = 0; i < 50; ++i) {
+		Hls hls(1000, 0, 2, scheduler, 1);
+		hls.pushSegment(0, 1000);
+		std::this_thread::sleep_for(std::chrono::microseconds(i * 40));
+	}
+}
+
+secondclasstest("Apple_HLS: perf test, publication delay from segment completion") {
+	auto const REPRESENTATIONS = 4;
+	auto const SEGMENTS = 1000;
+
+	Hls hls(1000, 0, REPRESENTATIONS);
+	auto const lastVariant = format("v_%s_0x0_.m3u8", REPRESENTATIONS - 1);
+
+	// per segment index: when its last representation completes, when the last variant first lists it
+	std::vector<std::chrono::steady_clock::time_point> completions(SEGMENTS), publications(SEGMENTS);
+	std::vector<bool> published(SEGMENTS);
+	hls.playlists->onFile = [&](FileRecorder::File const& playlist) {
+		if(playlist.filename != lastVariant)
+			return;
+		auto const uri = playlist.contents.rfind(".m4s\n");
+		auto const index = atoi(playlist.contents.c_str() + playlist.contents.rfind('-', uri) + 1);
+		if(index < SEGMENTS && !published[index]) {
+			publications[index] = std::chrono::steady_clock::now();
+			published[index] = true;
+		}
+	};
+
+	{
+		Tools::Profiler p(format("%s segments, %s representations", SEGMENTS, REPRESENTATIONS));
+		for(int seg=0; seg < SEGMENTS; ++seg) {
+			for(int i=0; i < REPRESENTATIONS - 1; ++i)
+				hls.pushSegment(i, 1000);
+
+			// the last representation completes the segment
+			completions[seg] = std::chrono::steady_clock::now();
+			hls.pushSegment(REPRESENTATIONS - 1, 1000);
+		}
+	}
+	hls.hls->flush();
+
+	double totalDelayInUs = 0, maxDelayInUs = 0;
+	for(int seg=0; seg < SEGMENTS; ++seg) {
+		ASSERT(published[seg]);
+		auto const delay = std::chrono::duration<double, std::micro>(publications[seg] - completions[seg]).count();
+		totalDelayInUs += delay;
+		maxDelayInUs = std::max(maxDelayInUs, delay);
+	}
+	Report("Publication delay, average", totalDelayInUs / SEGMENTS, "us");
+	Report("Publication delay, max", maxDelayInUs, "us");
+
+	// published on completion, not on a timer: a small fraction of the segment duration
+	ASSERT(totalDelayInUs / SEGMENTS < 10 * 1000);
+	ASSERT(maxDelayInUs < 100 * 1000);
+}
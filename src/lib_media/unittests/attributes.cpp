@@ -0,0 +1,137 @@
+#include "tests/tests.hpp"
+#include "lib_media/common/attributes.hpp"
+#include "lib_modules/core/database.hpp"
+#include "lib_utils/profiler.hpp"
+#include <stdexcept>
+
+using namespace Tests;
+using namespace Modules;
+
+namespace {
+
+struct LargeAttribute {
+	enum { TypeId = 0x1A46E0A7 };
+	uint8_t bytes[100];
+};
+
+unittest("attributes: set and get") {
+	auto data = std::make_shared<DataRaw>(0);
+	data->set(PresentationTime{ 1234 });
+	data->set(DecodingTime{ 1000 });
+	data->set(CueFlags{ false, true, false });
+
+	ASSERT_EQUALS(1234, data->get<PresentationTime>().time);
+	ASSERT_EQUALS(1000, data->get<DecodingTime>().time);
+	ASSERT_EQUALS(true, data->get<CueFlags>().keyframe);
+	ASSERT_EQUALS(false, data->get<CueFlags>().discontinuity);
+	ASSERT_THROWN(data->get<LargeAttribute>());
+}
+
+unittest("attributes: overwrite") {
+	auto data = std::make_shared<DataRaw>(0);
+	data->set(PresentationTime{ 1234 });
+	data->set(CueFlags{ false, true, false });
+	data->set(PresentationTime{ 5678 });
+	ASSERT_EQUALS(5678, data->get<PresentationTime>().time);
+	ASSERT_EQUALS(true, data->get<CueFlags>().keyframe);
+
+	ASSERT_THROWN(data->setAttribute(PresentationTime::TypeId, {(const uint8_t*)"abc", 3}));
+}
+
+unittest("attributes: large attributes spill to the heap") {
+	LargeAttribute large;
+	for(int i=0; i < (int)sizeof large.bytes; ++i)
+		large.bytes[i] = (uint8_t)i;
+
+	auto data = std::make_shared<DataRaw>(0);
+	data->set(PresentationTime{ 1234 });
+	data->set(large);
+	data->set(DecodingTime{ 1000 });
+
+	auto clone = data->clone();
+	ASSERT_EQUALS(1234, clone->get<PresentationTime>().time);
+	ASSERT_EQUALS(1000, clone->get<DecodingTime>().time);
+	ASSERT_EQUALS(99, (int)clone->get<LargeAttribute>().bytes[99]);
+	ASSERT_EQUALS(sizeof large, clone->getAttribute(LargeAttribute::TypeId).len);
+}
+
+unittest("attributes: tryGet and has") {
+	auto data = std::make_shared<DataRaw>(0);
+	data->set(PresentationTime{ 1234 });
+
+	ASSERT(data->has<PresentationTime>());
+	ASSERT(!data->has<DecodingTime>());
+
+	PresentationTime pts {};
+	ASSERT(data->tryGet(pts));
+	ASSERT_EQUALS(1234, pts.time);
+
+	DecodingTime dts { 42 };
+	ASSERT(!data->tryGet(dts));
+	ASSERT_EQUALS(42, dts.time);
+}
+
+unittest("attributes: clone copies inline attributes") {
+	auto data = std::make_shared<DataRaw>(16);
+	data->set(PresentationTime{ 1234 });
+	data->set(CueFlags{ true, false, true });
+
+	auto clone = data->clone();
+	clone->set(PresentationTime{ 42 });
+
+	ASSERT_EQUALS(1234, data->get<PresentationTime>().time);
+	ASSERT_EQUALS(42, clone->get<PresentationTime>().time);
+	ASSERT_EQUALS(true, clone->get<CueFlags>().unframed);
+}
+
+// Mimics the TsDemuxer -> Decoder path: the demuxer allocates a packet and
+// stamps it, the packet is cloned once, and the decoder reads the attributes.
+// The allocations of this path are counted by bin/allocations.exe.
+secondclasstest("attributes: perf test, allocate, stamp, clone, read") {
+	auto const N = 1000 * 1000;
+	int64_t sum = 0;
+
+	{
+		Tools::Profiler p("1M packets: allocate, stamp, clone, read");
+		for(int i=0; i < N; ++i) {
+			auto pkt = std::make_shared<DataRaw>(188);
+			pkt->set(PresentationTime{ i });
+			pkt->set(DecodingTime{ i });
+			pkt->set(CueFlags{ false, true, true });
+
+			auto clone = pkt->clone();
+			sum += clone->get<CueFlags>().keyframe;
+			sum += clone->get<PresentationTime>().time - clone->get<DecodingTime>().time;
+		}
+	}
+
+	ASSERT_EQUALS(N, sum);
+}
+
+secondclasstest("attributes: perf test, missing attribute lookup") {
+	auto const N = 1000 * 1000;
+	auto data = std::make_shared<DataRaw>(0);
+	data->set(PresentationTime{ 1 });
+
+	int64_t sum = 0;
+	{
+		Tools::Profiler p("1M lookups of a missing attribute: get() + catch");
+		for(int i=0; i < N; ++i) {
+			try {
+				sum += data->get<DecodingTime>().time;
+			} catch(...) {
+				sum += data->get<PresentationTime>().time;
+			}
+		}
+	}
+	{
+		Tools::Profiler p("1M lookups of a missing attribute: tryGet()");
+		for(int i=0; i < N; ++i) {
+			DecodingTime dts;
+			sum += data->tryGet(dts) ? dts.time : data->get<PresentationTime>().time;
+		}
+	}
+	ASSERT_EQUALS(2 * N, sum);
+}
+
+}
@@ -0,0 +1,94 @@
+#include "tests/tests.hpp"
+#include "lib_media/common/crc.hpp"
+#include "lib_utils/profiler.hpp"
+#include "lib_utils/format.hpp"
+#include <vector>
+
+using namespace Tests;
+
+namespace {
+
+// straightforward bitwise implementation
+uint32_t referenceCrc32(SpanC data) {
+	uint32_t r = 0xffffffff;
+	for(auto b : data) {
+		r ^= uint32_t(b) << 24;
+		for(int i=0; i < 8; ++i)
+			r = (r & 0x80000000) ? (r << 1) ^ 0x04C11DB7 : (r << 1);
+	}
+	return r;
+}
+
+// byte-wise table implementation (the previous one)
+uint32_t bytewiseCrc32(SpanC data) {
+	static uint32_t table[256];
+	static bool init = false;
+	if(!init) {
+		for(int i=0; i < 256; ++i) {
+			uint32_t c = uint32_t(i) << 24;
+			for(int j=0; j < 8; ++j)
+				c = (c & 0x80000000) ? (c << 1) ^ 0x04C11DB7 : (c << 1);
+			table[i] = c;
+		}
+		init = true;
+	}
+
+	uint32_t r = 0xffffffff;
+	for(auto b : data)
+		r = (r << 8) ^ table[((r >> 24) ^ b) & 0xff];
+	return r;
+}
+
+std::vector<uint8_t> makeBuffer(size_t size) {
+	std::vector<uint8_t> r(size);
+	uint32_t x = 12345;
+	for(auto& b : r) {
+		x = x * 1103515245 + 12345;
+		b = (uint8_t)(x >> 16);
+	}
+	return r;
+}
+
+unittest("Crc32: check value") {
+	auto const s = "123456789";
+	ASSERT_EQUALS(0x0376E6E7u, Crc32({(const uint8_t*)s, 9}));
+	ASSERT_EQUALS(0xFFFFFFFFu, Crc32({nullptr, 0}));
+}
+
+unittest("Crc32: all lengths and alignments") {
+	auto const buf = makeBuffer(256);
+	for(size_t offset = 0; offset < 8; ++offset)
+		for(size_t len = 0; offset + len <= buf.size(); ++len)
+			ASSERT_EQUALS(referenceCrc32({buf.data() + offset, len}), Crc32({buf.data() + offset, len}));
+}
+
+unittest("Crc32: a section with its CRC appended checks to zero") {
+	auto section = makeBuffer(100);
+	auto const crc = Crc32({section.data(), section.size()});
+	for(int i=0; i < 4; ++i)
+		section.push_back((uint8_t)(crc >> (24 - 8 * i)));
+	ASSERT_EQUALS(0u, Crc32({section.data(), section.size()}));
+}
+
+secondclasstest("Crc32: perf test, slice-by-8 vs byte-wise") {
+	// PSI sections, and a large buffer
+	for(size_t size : { (size_t)32, (size_t)1024, (size_t)1024 * 1024 }) {
+		auto const buf = makeBuffer(size);
+		auto const iterations = (256 * 1024 * 1024) / size;
+
+		uint32_t expected = 0, actual = 0;
+		{
+			Tools::Profiler p(format("byte-wise, %s bytes", size));
+			for(size_t i=0; i < iterations; ++i)
+				expected ^= bytewiseCrc32({buf.data(), size});
+		}
+		{
+			Tools::Profiler p(format("slice-by-8, %s bytes", size));
+			for(size_t i=0; i < iterations; ++i)
+				actual ^= Crc32({buf.data(), size});
+		}
+		ASSERT_EQUALS(expected, actual);
+	}
+}
+
+}
@@ -0,0 +1,85 @@
+#include "tests/tests.hpp"
+#include "lib_media/in/file.hpp"
+#include "lib_modules/modules.hpp"
+#include "lib_modules/utils/loader.hpp"
+#include "lib_utils/os.hpp"
+#include <cstdio> // fopen
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+using namespace Modules;
+
+namespace {
+
+std::string readFile(std::string path) {
+	std::ifstream file(path, std::ios::binary);
+	std::stringstream s;
+	s << file.rdbuf();
+	return s.str();
+}
+
+struct Chunks {
+	std::vector<std::string> contents;
+	Data last; // the output allocator blocks if we keep them all
+};
+
+Chunks readAll(FileInputConfig const& cfg) {
+	Chunks r;
+	auto f = loadModule("FileInput", &NullHost, &cfg);
+	ConnectOutput(f->getOutput(0), [&](Data data) {
+		r.contents.push_back(std::string((const char*)data->data().ptr, data->data().len));
+		r.last = data;
+	});
+	for(int i = 0; i < 1000; ++i)
+		f->process();
+	return r;
+}
+
+}
+
+unittest("FileInput: memory mapped, same chunks as buffered reads") {
+	for(auto blockSize : { 7 * 188, 0 }) {
+		FileInputConfig cfg;
+		cfg.filename = "data/beepbop.ts";
+		cfg.blockSize = blockSize;
+		auto const buffered = readAll(cfg).contents;
+		cfg.memoryMapped = true;
+		auto const mapped = readAll(cfg).contents;
+
+		ASSERT(buffered == mapped);
+		std::string contents;
+		for(auto& chunk : mapped)
+			contents += chunk;
+		ASSERT(readFile("data/beepbop.ts") == contents);
+	}
+}
+
+unittest("FileInput: memory mapped, the data outlive the module") {
+	FileInputConfig cfg;
+	cfg.filename = "data/beepbop.ts";
+	cfg.blockSize = 7 * 188;
+	cfg.memoryMapped = true;
+	auto const chunks = readAll(cfg); // the module is destroyed
+
+	ASSERT(chunks.contents.size() > 1);
+	auto const last = chunks.last->data();
+	ASSERT(chunks.contents.back() == std::string((const char*)last.ptr, last.len));
+}
+
+unittest("FileInput: memory mapped, empty file") {
+	if(!dirExists("out"))
+		mkdir("out");
+	fclose(fopen("out/file_input_empty.bin", "wb"));
+	FileInputConfig cfg;
+	cfg.filename = "out/file_input_empty.bin";
+	cfg.memoryMapped = true;
+	ASSERT(readAll(cfg).contents.empty());
+}
+
+unittest("FileInput: memory mapped, missing file") {
+	FileInputConfig cfg;
+	cfg.filename = "out/file_input_missing.bin";
+	cfg.memoryMapped = true;
+	ASSERT_THROWN(loadModule("FileInput", &NullHost, &cfg));
+}
@@ -0,0 +1,277 @@
+#include "tests/tests.hpp"
+#include "lib_media/common/file_writer.hpp"
+#include "lib_media/common/metadata_file.hpp"
+#include "lib_media/out/file.hpp"
+#include "lib_media/out/filesystem.hpp"
+#include "lib_modules/modules.hpp"
+#include "lib_modules/utils/loader.hpp"
+#include "lib_utils/os.hpp"
+#include "lib_utils/format.hpp"
+#include "lib_utils/profiler.hpp"
+#include "modules_common.hpp"
+#include <algorithm> // sort
+#include <chrono>
+#include <cstdio> // fopen
+#include <cstring> // memcpy
+#include <functional>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+using namespace Modules;
+
+namespace {
+
+std::string readFile(std::string path) {
+	std::ifstream file(path, std::ios::binary);
+	std::stringstream s;
+	s << file.rdbuf();
+	return s.str();
+}
+
+bool fileExists(std::string path) {
+	return std::ifstream(path).good();
+}
+
+void write(AsyncFile* file, std::vector<uint8_t> const& contents) {
+	file->write({ contents.data(), contents.size() });
+}
+
+std::vector<FileWriterConfig> getConfigs() {
+	std::vector<FileWriterConfig> r;
+	for(auto ioUring : { true, false }) {
+		for(auto directIo : { false, true }) {
+			FileWriterConfig cfg;
+			cfg.bufferSize = 16 * 1024;
+			cfg.maxPendingBuffers = 2;
+			cfg.useIoUring = ioUring;
+			cfg.directIo = directIo;
+			cfg.preallocateSize = 64 * 1024;
+			cfg.fsync = directIo ? FsyncPolicy::OnClose : FsyncPolicy::Never;
+			r.push_back(cfg);
+		}
+	}
+	return r;
+}
+
+}
+
+unittest("FileWriter: data is written in order") {
+	for(auto cfg : getConfigs()) {
+		auto writer = createFileWriter(cfg, &NullHost);
+		std::string expected;
+		{
+			auto file = writer->open("out/file_writer/a/b/data.bin");
+			int seed = 0;
+			// unaligned sizes, smaller and larger than the staging buffers
+			for(auto size : { 1, 100, 5000, 16 * 1024, 40000, 3, 70000 }) {
+				auto const contents = makePayload(size, seed++);
+				write(file.get(), contents);
+				expected.append(contents.begin(), contents.end());
+				if(size == 5000)
+					file->flush();
+			}
+		}
+		writer->waitForCompletion();
+		ASSERT_EQUALS(0, writer->getStats().errors);
+		ASSERT_EQUALS(1, writer->getStats().filesClosed);
+		ASSERT(expected == readFile("out/file_writer/a/b/data.bin"));
+	}
+}
+
+unittest("FileWriter: flushed data is visible before the file is closed") {
+	for(auto cfg : getConfigs()) {
+		auto writer = createFileWriter(cfg, &NullHost);
+		auto file = writer->open("out/file_writer/partial.bin");
+		auto const contents = makePayload(20000, 1);
+		write(file.get(), contents);
+		file->flush();
+		writer->waitForCompletion();
+		ASSERT(std::string(contents.begin(), contents.end()) == readFile("out/file_writer/partial.bin"));
+	}
+}
+
+unittest("FileWriter: the operations on a path are performed in order") {
+	for(auto cfg : getConfigs()) {
+		auto writer = createFileWriter(cfg, &NullHost);
+		auto const big = makePayload(200000, 1), small = makePayload(10, 2);
+		writer->open("out/file_writer/rewritten.bin")->write({ big.data(), big.size() });
+		writer->open("out/file_writer/rewritten.bin")->write({ small.data(), small.size() });
+		writer->open("out/file_writer/removed.bin")->write({ big.data(), big.size() });
+		writer->remove("out/file_writer/removed.bin");
+		writer->waitForCompletion();
+		ASSERT(std::string(small.begin(), small.end()) == readFile("out/file_writer/rewritten.bin"));
+		ASSERT(!fileExists("out/file_writer/removed.bin"));
+	}
+}
+
+unittest("FileWriter: open errors are reported in the stats") {
+	for(auto cfg : getConfigs()) {
+		auto writer = createFileWriter(cfg, &NullHost);
+		{
+			auto file = writer->open("out/file_writer");
+			auto const contents = makePayload(100000, 1);
+			write(file.get(), contents);
+		}
+		writer->waitForCompletion();
+		ASSERT_EQUALS(1, writer->getStats().errors);
+		ASSERT_EQUALS(0, writer->getStats().bytesWritten);
+	}
+}
+
+unittest("FileSystemSink: chunks, complete files and deletions") {
+	auto push = [](IModule* sink, std::string filename, std::string contents, bool EOS, bool del) {
+		auto data = std::make_shared<DataRaw>(contents.size());
+		if(!contents.empty())
+			memcpy(data->buffer->data().ptr, contents.data(), contents.size());
+		auto meta = std::make_shared<MetadataFile>(SEGMENT);
+		meta->filename = filename;
+		meta->filesize = del ? INT64_MAX : contents.size();
+		meta->EOS = EOS;
+		data->setMetadata(meta);
+		sink->getInput(0)->push(data);
+	};
+
+	FileSystemSinkConfig cfg {};
+	cfg.directory = "out/filesystem_sink";
+	auto sink = loadModule("FileSystemSink", &NullHost, &cfg);
+	push(sink.get(), "seg/1.m4s", "Hello", false, false);
+	push(sink.get(), "seg/old.m4s", "Old", true, false);
+	push(sink.get(), "seg/1.m4s", "World", true, false);
+	push(sink.get(), "seg/old.m4s", "", true, true);
+	sink->flush();
+	ASSERT_EQUALS("HelloWorld", readFile("out/filesystem_sink/seg/1.m4s"));
+	ASSERT(!fileExists("out/filesystem_sink/seg/old.m4s"));
+}
+
+unittest("FileSystemSink: write failures are thrown") {
+	for(auto dir : { "out", "out/filesystem_sink_error" })
+		if(!dirExists(dir))
+			mkdir(dir);
+	FileSystemSinkConfig cfg {};
+	cfg.directory = "out";
+	auto sink = loadModule("FileSystemSink", &NullHost, &cfg);
+	auto data = std::make_shared<DataRaw>(0);
+	auto meta = std::make_shared<MetadataFile>(SEGMENT);
+	meta->filename = "filesystem_sink_error"; // a directory
+	data->setMetadata(meta);
+	sink->getInput(0)->push(data);
+	ASSERT_THROWN(sink->flush());
+	ASSERT_THROWN(sink->getInput(0)->push(data));
+}
+
+namespace {
+
+// the duration of each call, as seen by the caller: the waits for the disk included
+struct CallLatencies {
+	void measure(std::function<void()> call) {
+		auto const t0 = std::chrono::steady_clock::now();
+		call();
+		inUs.push_back(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count());
+	}
+
+	void report(std::string name, size_t bytes, double elapsedInSeconds) {
+		std::sort(inUs.begin(), inUs.end());
+		Tests::Report(name + ", throughput", bytes / (1024.0 * 1024.0) / elapsedInSeconds, "MB/s");
+		Tests::Report(name + ", call latency p99", inUs[inUs.size() * 99 / 100], "us");
+		Tests::Report(name + ", call latency max", inUs.back(), "us");
+	}
+
+	std::vector<int64_t> inUs;
+};
+
+std::shared_ptr<DataBase> createChunk(std::vector<uint8_t> const& contents, std::string filename, bool EOS) {
+	auto data = std::make_shared<DataRaw>(contents.size());
+	memcpy(data->buffer->data().ptr, contents.data(), contents.size());
+	auto meta = std::make_shared<MetadataFile>(SEGMENT);
+	meta->filename = filename;
+	meta->filesize = contents.size();
+	meta->EOS = EOS;
+	data->setMetadata(meta);
+	return data;
+}
+
+}
+
+secondclasstest("FileWriter: perf test, sustained writes and push() latency") {
+	auto const totalSize = (size_t)256 * 1024 * 1024;
+	auto const chunkSize = (size_t)64 * 1024; // e.g. a TS muxer output
+	auto const chunksPerSegment = 64; // 4MB segments
+	auto const chunk = makePayload(chunkSize, 0);
+
+	std::vector<std::string> dirs { "out/file_writer_perf" }; // disk
+	if(dirExists("/dev/shm"))
+		dirs.push_back("/dev/shm/file_writer_perf"); // tmpfs
+
+	for(auto& dir : dirs) {
+		if(!dirExists("out"))
+			mkdir("out");
+		if(!dirExists(dir))
+			mkdir(dir);
+		auto const path = dir + "/perf.bin";
+
+		// reference: synchronous writes from the caller
+		{
+			CallLatencies latencies;
+			Tools::Profiler p(format("%s, fwrite (synchronous)", dir));
+			auto f = fopen(path.c_str(), "wb");
+			for(size_t i = 0; i < totalSize / chunkSize; ++i)
+				latencies.measure([&]() {
+					fwrite(chunk.data(), 1, chunk.size(), f);
+				});
+			fclose(f);
+			latencies.report(format("%s, fwrite (synchronous)", dir), totalSize, p.elapsedInSeconds());
+		}
+
+		// Out::File: one file, written through process()
+		struct Mode {
+			const char* name;
+			bool ioUring, directIo;
+		};
+		for(auto mode : { Mode { "thread pool", false, false }, Mode { "io_uring", true, false }, Mode { "io_uring + O_DIRECT", true, true } }) {
+			FileWriterConfig cfg;
+			cfg.useIoUring = mode.ioUring;
+			cfg.directIo = mode.directIo;
+			cfg.preallocateSize = totalSize;
+			auto const name = format("%s, Out::File, %s", dir, mode.name);
+			auto const data = createChunk(chunk, "", false);
+			CallLatencies latencies;
+			Tools::Profiler p(name);
+			{
+				auto file = createModule<Out::File>(&NullHost, path, cfg);
+				for(size_t i = 0; i < totalSize / chunkSize; ++i)
+					latencies.measure([&]() {
+						file->getInput(0)->push(data);
+					});
+				file->flush();
+			}
+			latencies.report(name, totalSize, p.elapsedInSeconds());
+		}
+		remove(path.c_str());
+
+		// FileSystemSink: segments made of chunks, each one flushed to be visible to the readers
+		{
+			FileSystemSinkConfig cfg {};
+			cfg.directory = dir;
+			auto const name = format("%s, FileSystemSink", dir);
+			auto const segments = totalSize / chunkSize / chunksPerSegment;
+			CallLatencies latencies;
+			Tools::Profiler p(name);
+			{
+				auto sink = loadModule("FileSystemSink", &NullHost, &cfg);
+				for(size_t seg = 0; seg < segments; ++seg) {
+					for(int i = 0; i < chunksPerSegment; ++i) {
+						auto const data = createChunk(chunk, format("perf_%s.m4s", seg), i == chunksPerSegment - 1);
+						latencies.measure([&]() {
+							sink->getInput(0)->push(data);
+						});
+					}
+				}
+				sink->flush();
+			}
+			latencies.report(name, totalSize, p.elapsedInSeconds());
+			for(size_t seg = 0; seg < segments; ++seg)
+				remove(format("%s/perf_%s.m4s", dir, seg).c_str());
+		}
+	}
+}
@@ -2,7 +2,19 @@
 #include "lib_media/out/http.hpp"
 #include "lib_modules/utils/loader.hpp"
 #include "lib_modules/modules.hpp"
+#include "lib_media/common/metadata_file.hpp"
+#include "lib_media/out/http_sink.hpp"
+#include "lib_utils/format.hpp"
+#include "lib_utils/profiler.hpp"
+#include "modules_common.hpp"
+#include <algorithm> // search
+#include <condition_variable>
 #include <cstring> // memcpy
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 // To run the below tests, you must first launch the fake webserver:
 // $ ./scripts/http-post-server.sh
@@ -91,3 +103,417 @@ secondclasstest("HttpSender: post data to real server, no flush") {
 	}
 }
 
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+// Minimal HTTP/1.1 listener on the loopback, with keep-alive.
+// Accepts chunked and fixed-size request bodies.
+struct LoopbackHttpServer {
+	struct Request {
+		std::string method, path;
+		std::vector<uint8_t> body;
+		// event sequence numbers: the request was fully received, then replied to
+		int arrival = 0, reply = 0;
+	};
+
+	LoopbackHttpServer() {
+		m_socket = socket(AF_INET, SOCK_STREAM, 0);
+		ASSERT(m_socket >= 0);
+
+		sockaddr_in addr {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		ASSERT(bind(m_socket, (sockaddr*)&addr, sizeof(addr)) == 0);
+		ASSERT(listen(m_socket, 64) == 0);
+
+		socklen_t len = sizeof(addr);
+		getsockname(m_socket, (sockaddr*)&addr, &len);
+		url = "http://127.0.0.1:" + std::to_string(ntohs(addr.sin_port));
+
+		m_acceptThread = std::thread([this]() {
+			int s;
+			while((s = accept(m_socket, nullptr, nullptr)) >= 0) {
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_clients.push_back(s);
+				m_connectionThreads.push_back(std::thread([this, s]() {
+					serve(s);
+				}));
+			}
+		});
+	}
+
+	~LoopbackHttpServer() {
+		shutdown(m_socket, SHUT_RDWR);
+		m_acceptThread.join();
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			for(auto s : m_clients)
+				shutdown(s, SHUT_RDWR);
+		}
+		for(auto& t : m_connectionThreads)
+			t.join();
+		for(auto s : m_clients)
+			close(s);
+		close(m_socket);
+	}
+
+	std::vector<Request> waitForRequests(size_t count) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while(m_requests.size() < count)
+			m_requestReceived.wait(lock);
+		return m_requests;
+	}
+
+	int connections() {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		return (int)m_clients.size();
+	}
+
+	std::string url;
+
+	// delays the replies to the segment uploads (POST *.m4s)
+	int segmentReplyDelayInMs = 0;
+
+private:
+	void serve(int s) {
+		std::vector<uint8_t> buf;
+
+		auto receive = [&]() {
+			uint8_t tmp[64 * 1024];
+			auto n = recv(s, tmp, sizeof(tmp), 0);
+			if(n <= 0)
+				return false;
+			buf.insert(buf.end(), tmp, tmp + n);
+			return true;
+		};
+
+		auto readLine = [&](std::string& line) {
+			while(true) {
+				static const char crlf[] = "\r\n";
+				auto const end = std::search(buf.begin(), buf.end(), crlf, crlf + 2);
+				if(end != buf.end()) {
+					line.assign(buf.begin(), end);
+					buf.erase(buf.begin(), end + 2);
+					return true;
+				}
+				if(!receive())
+					return false;
+			}
+		};
+
+		auto readBytes = [&](std::vector<uint8_t>& dst, size_t n) {
+			while(buf.size() < n)
+				if(!receive())
+					return false;
+			dst.insert(dst.end(), buf.begin(), buf.begin() + n);
+			buf.erase(buf.begin(), buf.begin() + n);
+			return true;
+		};
+
+		std::string line;
+		while(readLine(line)) {
+			Request req;
+			auto const sp1 = line.find(' ');
+			req.method = line.substr(0, sp1);
+			req.path = line.substr(sp1 + 1, line.find(' ', sp1 + 1) - sp1 - 1);
+
+			bool chunked = false, expectContinue = false;
+			size_t contentLength = 0;
+			while(readLine(line) && !line.empty()) {
+				if(line == "Transfer-Encoding: chunked")
+					chunked = true;
+				else if(line == "Expect: 100-continue")
+					expectContinue = true;
+				else if(line.compare(0, 16, "Content-Length: ") == 0)
+					contentLength = std::stoul(line.substr(16));
+			}
+
+			if(expectContinue)
+				reply(s, "HTTP/1.1 100 Continue\r\n\r\n");
+
+			if(chunked) {
+				while(readLine(line)) {
+					auto const size = strtoul(line.c_str(), nullptr, 16);
+					std::vector<uint8_t> crlf;
+					if(!readBytes(req.body, size) || !readBytes(crlf, 2))
+						return;
+					if(size == 0)
+						break;
+				}
+			} else if(!readBytes(req.body, contentLength)) {
+				return;
+			}
+
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				req.arrival = m_events++;
+			}
+
+			auto const isSegment = req.path.size() > 4 && req.path.compare(req.path.size() - 4, 4, ".m4s") == 0;
+			if(req.method == "POST" && isSegment)
+				std::this_thread::sleep_for(std::chrono::milliseconds(segmentReplyDelayInMs));
+
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				req.reply = m_events++;
+			}
+
+			reply(s, "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n\r\n");
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_requests.push_back(std::move(req));
+			m_requestReceived.notify_all();
+		}
+	}
+
+	static void reply(int s, std::string const& msg) {
+		::send(s, msg.data(), msg.size(), 0);
+	}
+
+	int m_socket = -1;
+	std::thread m_acceptThread;
+	std::mutex m_mutex;
+	std::condition_variable m_requestReceived;
+	std::vector<int> m_clients;
+	std::vector<std::thread> m_connectionThreads;
+	std::vector<Request> m_requests;
+	int m_events = 0;
+};
+
+std::shared_ptr<DataBase> createPayload(size_t size, int seed) {
+	auto r = std::make_shared<DataRaw>(size);
+	auto const payload = makePayload(size, seed);
+	if(size)
+		memcpy(r->buffer->data().ptr, payload.data(), size);
+	return r;
+}
+
+unittest("HttpSender: stream a large payload to a loopback listener") {
+	auto const CHUNK_SIZE = 7 * 188;
+	auto const PAYLOAD_SIZE = 8 * 1024 * 1024;
+
+	LoopbackHttpServer server;
+	std::atomic<int64_t> copied(0);
+
+	std::vector<uint8_t> expected;
+	{
+		HttpSenderConfig cfg {};
+		cfg.url = server.url;
+		cfg.copiedBytes = &copied;
+		auto sender = createHttpSender(cfg, &NullHost);
+
+		const uint8_t prefix[] = "prefix";
+		sender->appendPrefix(prefix);
+		expected.insert(expected.end(), prefix, prefix + sizeof(prefix));
+
+		for(int i=0; i * CHUNK_SIZE < PAYLOAD_SIZE; ++i) {
+			auto data = createPayload(CHUNK_SIZE, i);
+			sender->sendData(data);
+			expected.insert(expected.end(), data->data().ptr, data->data().ptr + CHUNK_SIZE);
+		}
+
+		sender->send({});
+	}
+
+	ASSERT(server.waitForRequests(1)[0].body == expected);
+
+	// each byte was copied once, straight to curl: no compaction
+	ASSERT_EQUALS((int64_t)expected.size(), copied.load());
+}
+
+secondclasstest("HttpSender: perf test, 256MB upload to a loopback listener") {
+	auto const SEGMENT_SIZE = 4 * 1024 * 1024;
+	auto const NUM_SEGMENTS = 64;
+
+	LoopbackHttpServer server;
+	std::atomic<int64_t> copied(0);
+
+	auto segment = createPayload(SEGMENT_SIZE, 0);
+	double elapsed;
+	{
+		Tools::Profiler p("Upload 64 segments of 4MB");
+		HttpSenderConfig cfg {};
+		cfg.url = server.url;
+		cfg.copiedBytes = &copied;
+		auto sender = createHttpSender(cfg, &NullHost);
+		for(int i=0; i < NUM_SEGMENTS; ++i)
+			sender->sendData(segment);
+		sender->send({});
+		elapsed = p.elapsedInSeconds();
+	}
+
+	ASSERT_EQUALS((size_t)SEGMENT_SIZE * NUM_SEGMENTS, server.waitForRequests(1)[0].body.size());
+	Tests::Report("Upload throughput", SEGMENT_SIZE * NUM_SEGMENTS * 8.0 / elapsed / 1e9, "Gbps");
+	Tests::Report("Copied", copied / (1024.0 * 1024.0), "MB");
+
+	// each byte was copied once, straight to curl
+	ASSERT_EQUALS((int64_t)SEGMENT_SIZE * NUM_SEGMENTS, copied.load());
+}
+
+void pushFile(IModule* sink, std::string filename, uint64_t size, bool eos, int seed, StreamType type = SEGMENT) {
+	auto meta = std::make_shared<MetadataFile>(type);
+	meta->filename = filename;
+	meta->filesize = size;
+	meta->EOS = eos;
+	auto data = std::const_pointer_cast<DataBase>(std::shared_ptr<const DataBase>(createPayload(size == INT64_MAX ? 0 : size, seed)));
+	data->setMetadata(meta);
+	sink->getInput(0)->push(data);
+}
+
+// 8 renditions x 'segments' segments, each sent in 4 parts, and a manifest update per segment.
+// 'paced': wait for the uploads of a segment before sending the next one, as a live source would.
+void pushSegments(IModule* sink, int segments, bool paced = false) {
+	for(int i=0; i < segments; ++i) {
+		for(int r=0; r < 8; ++r) {
+			auto const filename = format("r%s_%s.m4s", r, i);
+			pushFile(sink, filename, 0, false, 0);
+			for(int part=0; part < 4; ++part)
+				pushFile(sink, filename, 10 * 1000, part == 3, part);
+		}
+		pushFile(sink, "manifest.mpd", 2000, true, i, PLAYLIST);
+		if(paced)
+			sink->flush();
+	}
+}
+
+unittest("HttpSink: uploads share persistent connections") {
+	auto const SEGMENTS = 5;
+	LoopbackHttpServer server;
+	StatsHost host;
+
+	{
+		HttpSinkConfig cfg { server.url + "/", "test", {} };
+		auto sink = loadModule("HttpSink", &host, &cfg);
+		pushSegments(sink.get(), SEGMENTS, true);
+	}
+
+	auto const requests = server.waitForRequests(SEGMENTS * 9);
+	ASSERT_EQUALS(SEGMENTS * 9, (int)requests.size());
+	for(auto& req : requests) {
+		ASSERT_EQUALS("POST", req.method);
+		ASSERT_EQUALS(req.path == "/manifest.mpd" ? 2000u : 40 * 1000u, req.body.size());
+	}
+
+	ASSERT_EQUALS(SEGMENTS * 9, host.stats["uploads_completed"]);
+	ASSERT_EQUALS(server.connections(), host.stats["connections_opened"]);
+	// at most one connection per concurrent upload: the files of one segment
+	ASSERT(server.connections() <= 9);
+}
+
+unittest("HttpSink: delete") {
+	LoopbackHttpServer server;
+	StatsHost host;
+
+	{
+		HttpSinkConfig cfg { server.url + "/", "test", {} };
+		auto sink = loadModule("HttpSink", &host, &cfg);
+		pushFile(sink.get(), "old.m4s", INT64_MAX, true, 0);
+	}
+
+	auto const requests = server.waitForRequests(1);
+	ASSERT_EQUALS("DELETE", requests[0].method);
+	ASSERT_EQUALS("/old.m4s", requests[0].path);
+}
+
+unittest("HttpSink: a manifest is uploaded after the segments it lists") {
+	LoopbackHttpServer server;
+	server.segmentReplyDelayInMs = 100;
+	StatsHost host;
+
+	{
+		HttpSinkConfig cfg { server.url + "/", "test", {} };
+		auto sink = loadModule("HttpSink", &host, &cfg);
+		pushFile(sink.get(), "v_1.m4s", 1000, true, 0);
+		pushFile(sink.get(), "a_1.m4s", 1000, true, 0);
+		pushFile(sink.get(), "manifest.mpd", 100, true, 0, PLAYLIST);
+		sink->flush();
+	}
+
+	std::map<std::string, LoopbackHttpServer::Request> requests;
+	for(auto& req : server.waitForRequests(3))
+		requests[req.path] = req;
+	ASSERT(requests["/manifest.mpd"].arrival > requests["/v_1.m4s"].reply);
+	ASSERT(requests["/manifest.mpd"].arrival > requests["/a_1.m4s"].reply);
+}
+
+unittest("HttpSink: uploads to the same URL are ordered") {
+	LoopbackHttpServer server;
+	server.segmentReplyDelayInMs = 100;
+	StatsHost host;
+
+	{
+		HttpSinkConfig cfg { server.url + "/", "test", {} };
+		auto sink = loadModule("HttpSink", &host, &cfg);
+		// once the protocol is known, curl doesn't wait to multiplex: it opens a new connection
+		pushFile(sink.get(), "init.mp4", 1000, true, 0);
+		sink->flush();
+
+		pushFile(sink.get(), "v_1.m4s", 1000, true, 0);
+		pushFile(sink.get(), "v_1.m4s", INT64_MAX, true, 0);
+		sink->flush();
+	}
+
+	std::map<std::string, LoopbackHttpServer::Request> requests;
+	for(auto& req : server.waitForRequests(3))
+		requests[req.method + " " + req.path] = req;
+	ASSERT(requests["DELETE /v_1.m4s"].arrival > requests["POST /v_1.m4s"].reply);
+}
+
+secondclasstest("HttpSink: perf test, connections and upload latency") {
+	auto const SEGMENTS = 50;
+
+	// one HTTP module per URL, as before the upload engine
+	int legacyConnections;
+	{
+		LoopbackHttpServer server;
+		double elapsed;
+		{
+			Tools::Profiler p("One connection per URL");
+			for(int i=0; i < SEGMENTS; ++i) {
+				for(int r=0; r < 9; ++r) {
+					HttpOutputConfig cfg {};
+					cfg.flags.InitialEmptyPost = false;
+					cfg.url = server.url + format("/r%s_%s.m4s", r, i);
+					auto http = loadModule("HTTP", &NullHost, &cfg);
+					for(int part=0; part < 4; ++part)
+						http->getInput(0)->push(createPayload(10 * 1000, part));
+					http->flush();
+				}
+			}
+			server.waitForRequests(SEGMENTS * 9);
+			elapsed = p.elapsedInSeconds();
+		}
+		legacyConnections = server.connections();
+		Tests::Report("One connection per URL", legacyConnections, "connections");
+		Tests::Report("One connection per URL: time per segment", elapsed * 1000 / SEGMENTS, "ms");
+	}
+
+	{
+		LoopbackHttpServer server;
+		StatsHost host;
+		double elapsed;
+		{
+			Tools::Profiler p("HttpSink upload engine");
+			HttpSinkConfig cfg { server.url + "/", "test", {} };
+			auto sink = loadModule("HttpSink", &host, &cfg);
+			pushSegments(sink.get(), SEGMENTS);
+			sink->flush();
+			elapsed = p.elapsedInSeconds();
+		}
+		auto const connections = host.stats["connections_opened"];
+		Tests::Report("HttpSink upload engine", connections, "connections");
+		Tests::Report("HttpSink upload engine: time per segment", elapsed * 1000 / SEGMENTS, "ms");
+		Tests::Report("HttpSink upload engine: upload_latency_max_ms", host.stats["upload_latency_max_ms"], "ms");
+
+		ASSERT_EQUALS(SEGMENTS * 9, host.stats["uploads_completed"]);
+		ASSERT(connections < legacyConnections);
+	}
+}
+}
+#endif
@@ -2,7 +2,9 @@
 #include "lib_modules/modules.hpp"
 #include "lib_media/common/pcm.hpp"
 #include "lib_media/common/metadata.hpp"
+#include "lib_media/common/metadata_file.hpp"
 #include "lib_media/common/resolution.hpp"
+#include "lib_utils/profiler.hpp"
 
 using namespace std;
 using namespace Tests;
@@ -132,3 +134,44 @@ unittest("duplicating data") {
 	auto dataCopyPcm = safe_cast<const DataPcm>(dataCopy);
 	ASSERT(dataCopyPcm);
 }
+
+unittest("metadata: cast without RTTI") {
+	Metadata meta = make_shared<MetadataPktVideo>();
+
+	ASSERT(metadata_cast<const MetadataPkt>(meta));
+	ASSERT(metadata_cast<const MetadataPktVideo>(meta));
+	ASSERT_THROWN(metadata_cast<const MetadataPktAudio>(meta));
+	ASSERT_THROWN(metadata_cast<const MetadataFile>(meta));
+
+	ASSERT(metadata_try_cast<const MetadataPkt>(meta.get()) != nullptr);
+	ASSERT(metadata_try_cast<const MetadataPktAudio>(meta.get()) == nullptr);
+	ASSERT(metadata_try_cast<const MetadataPktAudio>(nullptr) == nullptr);
+
+	Metadata basePkt = make_shared<MetadataPkt>(VIDEO_PKT);
+	ASSERT(metadata_cast<const MetadataPkt>(basePkt));
+	ASSERT_THROWN(metadata_cast<const MetadataPktVideo>(basePkt));
+}
+
+unittest("metadata: comparison by kind") {
+	ASSERT(MetadataPktVideo() == MetadataPktVideo());
+	ASSERT(!(MetadataPktVideo() == MetadataPkt(VIDEO_PKT)));
+	ASSERT(!(MetadataFile(AUDIO_PKT) == MetadataFile(VIDEO_PKT)));
+	ASSERT(MetadataFile(AUDIO_PKT) == MetadataFile(AUDIO_PKT));
+}
+
+secondclasstest("metadata: perf test, cast per data") {
+	auto const N = 10 * 1000 * 1000;
+	Metadata meta = make_shared<MetadataPktAudio>();
+	int64_t sum = 0;
+	{
+		Tools::Profiler p("10M dynamic_cast");
+		for(int i=0; i < N; ++i)
+			sum += dynamic_cast<const MetadataPktAudio*>(meta.get())->bitrate;
+	}
+	{
+		Tools::Profiler p("10M metadata_cast (kind tag)");
+		for(int i=0; i < N; ++i)
+			sum += metadata_cast<const MetadataPktAudio>(meta.get())->bitrate;
+	}
+	ASSERT_EQUALS(-2 * N, sum);
+}
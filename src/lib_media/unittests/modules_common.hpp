@@ -1,8 +1,14 @@
 #pragma once
 
 #include "lib_modules/modules.hpp"
+#include "lib_media/common/attributes.hpp"
 #include "lib_media/common/metadata_file.hpp"
+#include "lib_utils/tools.hpp" // safe_cast
+#include <cstring> // memcpy
+#include <functional>
 #include <iostream> // std::cout
+#include <map>
+#include <mutex>
 
 namespace {
 
@@ -38,4 +44,67 @@ struct Listener : public Modules::ModuleS {
 	std::vector<Meta> results;
 };
 
+// a chunk as output by a muxer: a complete segment, or a CMAF chunk when it flushes its fragments
+inline std::shared_ptr<Modules::DataBase> getTestChunk(int64_t durationIn180k, bool EOS, bool RAP = true) {
+	static const uint8_t markerData[] = { 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F };
+	auto r = std::make_shared<Modules::DataRaw>(sizeof markerData);
+	memcpy(r->buffer->data().ptr, markerData, sizeof markerData);
+	r->set(PresentationTime{0});
+
+	auto meta = std::make_shared<Modules::MetadataFile>(Modules::VIDEO_PKT);
+	meta->durationIn180k = durationIn180k;
+	meta->latencyIn180k = durationIn180k;
+	meta->filesize = sizeof markerData;
+	meta->startsWithRAP = RAP;
+	meta->EOS = EOS;
+	r->setMetadata(meta);
+	return r;
+}
+
+inline std::vector<uint8_t> makePayload(size_t size, int seed) {
+	std::vector<uint8_t> r(size);
+	for(size_t i=0; i < size; ++i)
+		r[i] = (uint8_t)(i * 7 + seed);
+	return r;
+}
+
+// collects the stats entries of the modules
+struct StatsHost : Modules::KHost {
+	void log(int, char const*) override {
+	}
+	void activate(bool) override {
+	}
+	int32_t* getStatsEntry(char const* name) override {
+		return &stats[name];
+	}
+	std::map<std::string, int32_t> stats;
+};
+
+// records the files output by the streamers (segments, chunks, manifests)
+struct FileRecorder : public Modules::ModuleS {
+	void processOne(Modules::Data data) override {
+		auto meta = safe_cast<const Modules::MetadataFile>(data->getMetadata().get());
+		std::unique_lock<std::mutex> lock(mutex);
+		files.push_back({ meta->filename, std::string((char const*)data->data().ptr, data->data().len), meta->EOS, meta->filesize == INT64_MAX });
+		if(onFile)
+			onFile(files.back());
+	}
+	struct File {
+		std::string filename, contents;
+		bool EOS, deleted;
+	};
+	std::vector<File> files;
+	std::function<void(File const&)> onFile;
+	mutable std::mutex mutex; // Apple_HLS publishes from the scheduler thread when a deadline expires
+
+	std::vector<File> get(std::string filename) const {
+		std::unique_lock<std::mutex> lock(mutex);
+		std::vector<File> r;
+		for(auto& f : files)
+			if(f.filename == filename)
+				r.push_back(f);
+		return r;
+	}
+};
+
 }
@@ -14,10 +14,17 @@ void DataBase::setMetadata(std::shared_ptr<const IMetadata> metadata) {
 }
 
 SpanC DataBase::getAttribute(int typeId) const {
-	auto first = attributeOffset.find(typeId);
-	if(first == attributeOffset.end())
+	auto data = tryGetAttribute(typeId);
+	if(!data.ptr)
 		throw std::runtime_error("Attribute not found");
-	return {attributes.data() + (*first).value, 0};
+	return data;
+}
+
+SpanC DataBase::tryGetAttribute(int typeId) const {
+	auto slot = attributeSlots.find(typeId);
+	if(slot == attributeSlots.end())
+		return {nullptr, 0};
+	return {attributeData() + (*slot).value.offset, (*slot).value.size};
 }
 
 void DataBase::setAttribute(int typeId, SpanC data) {
@@ -25,27 +32,37 @@ void DataBase::setAttribute(int typeId, SpanC data) {
 		throw std::runtime_error("Can't set a NULL attribute");
 
 	{
-		auto first = attributeOffset.find(typeId);
-		if(first != attributeOffset.end()) {
-			// HACK for DecodingTime and PresentationTime.
-			if(typeId == 0x35A12022 || typeId == 0x5DF434D0) {
-				memcpy(attributes.data() + (*first).value, data.ptr, data.len);
-				return;
-			}
-
-			throw std::runtime_error("Attribute is already set");
+		auto slot = attributeSlots.find(typeId);
+		if(slot != attributeSlots.end()) {
+			if((*slot).value.size != data.len)
+				throw std::runtime_error("Attribute is already set with a different size");
+
+			memcpy(attributeData() + (*slot).value.offset, data.ptr, data.len);
+			return;
 		}
 	}
 
-	auto offset = attributes.size();
-	attributeOffset[typeId] = offset;
-	attributes.resize(offset + data.len);
-	memcpy(attributes.data() + offset, data.ptr, data.len);
+	auto const offset = attributeSize;
+	auto const newSize = offset + data.len;
+
+	if(newSize > InlineAttributeCapacity) {
+		if(offset <= InlineAttributeCapacity) // spill to the heap
+			heapAttributes.assign(inlineAttributes, inlineAttributes + offset);
+		heapAttributes.resize(newSize);
+	}
+
+	attributeSize = newSize;
+	attributeSlots[typeId] = AttributeSlot{(uint32_t)offset, (uint32_t)data.len};
+	memcpy(attributeData() + offset, data.ptr, data.len);
 }
 
 void DataBase::copyAttributes(DataBase const& from) {
-	attributeOffset = from.attributeOffset;
-	attributes = from.attributes;
+	attributeSlots = from.attributeSlots;
+	attributeSize = from.attributeSize;
+	if(attributeSize > InlineAttributeCapacity)
+		heapAttributes = from.heapAttributes;
+	else
+		memcpy(inlineAttributes, from.inlineAttributes, attributeSize);
 }
 
 DataRaw::DataRaw(size_t size) {
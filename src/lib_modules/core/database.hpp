@@ -4,7 +4,7 @@
 #include <cstring> //memcpy
 #include <memory>
 #include <vector>
-#include "lib_utils/small_map.hpp"
+#include "lib_utils/flat_map.hpp"
 #include "lib_utils/clock.hpp"
 
 namespace Modules {
@@ -28,6 +28,9 @@ class DataBase {
 		void setMetadata(std::shared_ptr<const IMetadata> metadata);
 
 		SpanC getAttribute(int typeId) const;
+		// Returns an empty span when the attribute is absent (doesn't throw).
+		SpanC tryGetAttribute(int typeId) const;
+		// Setting an already present attribute overwrites it in-place, provided the size matches.
 		void setAttribute(int typeId, SpanC data);
 		void copyAttributes(DataBase const& from);
 
@@ -39,6 +42,21 @@ class DataBase {
 			return r;
 		}
 
+		// Non-throwing version of 'get': returns false when the attribute is absent.
+		template<typename Type>
+		bool tryGet(Type& attribute) const {
+			auto data = tryGetAttribute(Type::TypeId);
+			if(!data.ptr)
+				return false;
+			memcpy(&attribute, data.ptr, sizeof attribute);
+			return true;
+		}
+
+		template<typename Type>
+		bool has() const {
+			return tryGetAttribute(Type::TypeId).ptr != nullptr;
+		}
+
 		template<typename Type>
 		void set(const Type& attribute) {
 			static_assert(std::is_pod<Type>::value, "Type must be POD");
@@ -59,9 +77,29 @@ class DataBase {
 		DataBase() = default;
 
 	private:
+		uint8_t* attributeData() {
+			return attributeSize > InlineAttributeCapacity ? heapAttributes.data() : inlineAttributes;
+		}
+
+		const uint8_t* attributeData() const {
+			return const_cast<DataBase*>(this)->attributeData();
+		}
+
+		struct AttributeSlot {
+			uint32_t offset;
+			uint32_t size;
+		};
+
+		// Typical packets carry timestamps and CueFlags:
+		// keep them inline to avoid any allocation.
+		// Rare large attributes spill to the heap.
+		static constexpr size_t InlineAttributeCapacity = 40;
+
 		std::shared_ptr<const IMetadata> metadata;
-		std::vector<uint8_t> attributes;
-		SmallMap<int, int> attributeOffset;
+		FlatMap<int, AttributeSlot> attributeSlots;
+		uint8_t inlineAttributes[InlineAttributeCapacity];
+		std::vector<uint8_t> heapAttributes;
+		size_t attributeSize = 0;
 };
 
 class DataRaw : public DataBase {
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <cstdint>
+#include <memory>
 #include <typeinfo>
 
+[[noreturn]] void throw_dynamic_cast_error(const char* typeName);
+
 namespace Modules {
 
 enum StreamType {
@@ -17,10 +21,12 @@ enum StreamType {
 };
 
 struct IMetadata {
-	IMetadata(StreamType type_) : type(type_) {
+	IMetadata(StreamType type_, uint32_t kind_ = 0) : type(type_), kind(kind_) {
 	}
 	virtual ~IMetadata() {}
 	inline bool operator==(const IMetadata &right) const {
+		if (kind || right.kind)
+			return kind == right.kind && type == right.type;
 		return typeid(*this) == typeid(right) && type == right.type;
 	}
 	bool isVideo() const {
@@ -42,6 +48,42 @@ struct IMetadata {
 		}
 	}
 	StreamType const type;
+
+	// Identifies the concrete class without RTTI (0 means unknown).
+	// Each tagged class sets its own bit plus the ones of its bases (see metadata_cast).
+	uint32_t const kind;
 };
+
+// Checked downcasts for tagged metadata classes: no RTTI lookup involved.
+// 'T' must be const-qualified and declare its 'Kind' bit mask.
+template<typename T>
+bool isKindOf(const IMetadata* p) {
+	return (p->kind & T::Kind) == T::Kind;
+}
+
+template<typename T>
+T* metadata_try_cast(const IMetadata* p) {
+	if (!p || !isKindOf<T>(p))
+		return nullptr;
+	return static_cast<T*>(p);
+}
+
+template<typename T>
+T* metadata_cast(const IMetadata* p) {
+	if (!p)
+		return nullptr;
+	if (!isKindOf<T>(p))
+		throw_dynamic_cast_error(typeid(T).name());
+	return static_cast<T*>(p);
+}
+
+template<typename T>
+std::shared_ptr<T> metadata_cast(std::shared_ptr<const IMetadata> const& p) {
+	if (!p)
+		return nullptr;
+	if (!isKindOf<T>(p.get()))
+		throw_dynamic_cast_error(typeid(T).name());
+	return std::static_pointer_cast<T>(p);
+}
 }
 
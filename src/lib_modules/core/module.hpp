@@ -52,6 +52,10 @@ struct KHost {
 
 	// if 'enable' is true, will cause 'process' to be called repeatedly
 	virtual void activate(bool enable) = 0;
+
+	// returns a named counter, published by the host (e.g. as pipeline statistics).
+	// The storage is owned by the host. Returns null if the host doesn't publish statistics.
+	virtual int32_t* getStatsEntry(char const* name) = 0;
 };
 
 }
@@ -136,6 +136,9 @@ class ModuleS : public Module {
 struct NullHostType : KHost {
 	void log(int, char const*) override;
 	void activate(bool) override {};
+	int32_t* getStatsEntry(char const*) override {
+		return nullptr;
+	}
 };
 
 static NullHostType NullHost;
@@ -45,6 +45,10 @@ void Filter::activate(bool enable) {
 	active = enable;
 }
 
+int32_t* Filter::getStatsEntry(char const* name) {
+	return &statsRegistry->getNewEntry(format("%s.%s", m_name, name).c_str())->value;
+}
+
 void Filter::setDelegate(std::shared_ptr<IModule> module) {
 	delegate = module;
 }
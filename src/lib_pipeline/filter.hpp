@@ -61,6 +61,7 @@ class Filter :
 		// KHost implementation
 		void log(int level, char const* msg) override;
 		void activate(bool enable) override;
+		int32_t* getStatsEntry(char const* name) override;
 
 		// IEventSink implementation
 		void endOfStream() override;
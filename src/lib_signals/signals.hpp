@@ -3,7 +3,7 @@
 #include "signal.hpp"
 #include "executor.hpp" // ExecutorSync
 
-#include "lib_utils/small_map.hpp"
+#include "lib_utils/flat_map.hpp"
 #include <memory>
 #include <mutex>
 
@@ -54,7 +54,7 @@ class Signal : public ISignal<Arg> {
 		};
 
 		mutable std::mutex callbacksMutex;
-		SmallMap<int, ConnectionType> callbacks;  //protected by callbacksMutex
+		FlatMap<int, ConnectionType> callbacks;   //protected by callbacksMutex
 		int uid = 0;                              //protected by callbacksMutex
 
 		std::unique_ptr<IExecutor> const defaultExecutor;
@@ -5,13 +5,18 @@
 #include <cstring>
 #include <vector>
 
+// Contiguous byte FIFO.
+// 'consume' only advances a read offset: the unread bytes are moved back to
+// the beginning of the buffer once the consumed prefix is larger than them.
+// This keeps 'readPointer' contiguous while making 'consume' amortized O(1),
+// instead of O(backlog) per call.
 template<typename T>
 class GenericFifo {
 	public:
 		void write(const T* data, size_t len) {
 			if (!len) return;
 			m_data.resize(m_writePos + len);
-			memcpy(&m_data[m_writePos], data, len);
+			memcpy(&m_data[m_writePos], data, len * sizeof(T));
 			m_writePos += len;
 		}
 
@@ -23,10 +28,17 @@ class GenericFifo {
 			assert(numBytes <= bytesToRead());
 			m_readPos += numBytes;
 
-			// shift everything to the beginning of the buffer
-			memmove(m_data.data(), m_data.data() + m_readPos, bytesToRead());
-			m_writePos -= m_readPos;
-			m_readPos = 0;
+			if (m_readPos == m_writePos) {
+				m_readPos = m_writePos = 0;
+				return;
+			}
+
+			// lazy compaction: the moved bytes are bounded by the consumed ones
+			if (m_readPos >= bytesToRead()) {
+				memmove(m_data.data(), m_data.data() + m_readPos, bytesToRead() * sizeof(T));
+				m_writePos -= m_readPos;
+				m_readPos = 0;
+			}
 		}
 
 		size_t bytesToRead() const {
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <vector>
+#include <cstddef> // size_t
+#include <cstdint>
+#include <functional> // std::hash
+#include <utility> // std::move
+
+// Drop-in replacement for SmallMap, for maps that may grow large.
+// Elements are kept contiguous and in insertion order (like SmallMap).
+// Up to 'InlineCapacity' elements are stored inside the object (no heap allocation).
+// Above 'LinearSearchMax' elements, an open-addressing index (linear probing)
+// is maintained, so lookups stay O(1) instead of O(n).
+template<typename Key, typename Value, size_t InlineCapacity = 4>
+struct FlatMap {
+	static_assert(InlineCapacity > 0, "InlineCapacity must be non-zero");
+
+	// below this size, a linear search beats hashing (see the crossover perf test)
+	static constexpr size_t LinearSearchMax = 8;
+
+	struct Pair {
+		Key key;
+		Value value;
+	};
+
+	struct Iterator {
+		FlatMap* parent;
+		int idx;
+
+		bool operator==(const Iterator& other) const {
+			return idx == other.idx;
+		}
+
+		bool operator!=(const Iterator& other) const {
+			return idx != other.idx;
+		}
+
+		void operator++() {
+			idx++;
+		}
+
+		Pair& operator*() {
+			return parent->pairs()[idx];
+		}
+	};
+
+	FlatMap() = default;
+
+	FlatMap(const FlatMap& other) {
+		*this = other;
+	}
+
+	FlatMap& operator=(const FlatMap& other) {
+		if(this == &other)
+			return *this;
+		clear();
+		if(other.count > InlineCapacity) {
+			heapPairs = other.heapPairs;
+		} else {
+			for(size_t i=0; i < other.count; ++i)
+				inlinePairs[i] = other.inlinePairs[i];
+		}
+		count = other.count;
+		index = other.index;
+		return *this;
+	}
+
+	Value& operator[](Key key) {
+		auto i = find(key);
+		if(i != end())
+			return (*i).value;
+
+		return insert(std::move(key)).value;
+	}
+
+	const Value& operator[](Key key) const {
+		return const_cast<FlatMap*>(this)->operator[](key);
+	}
+
+	Iterator find(Key const& key) const {
+		auto self = const_cast<FlatMap*>(this);
+		auto p = self->pairs();
+
+		if(index.empty()) {
+			for(int i=0; i < (int)count; ++i)
+				if(key == p[i].key)
+					return {self, i};
+
+			return end();
+		}
+
+		auto const mask = index.size() - 1;
+		for(auto slot = hashOf(key) & mask; index[slot] != Empty; slot = (slot + 1) & mask)
+			if(key == p[index[slot]].key)
+				return {self, index[slot]};
+
+		return end();
+	}
+
+	void erase(Iterator i) {
+		if(count > InlineCapacity) {
+			heapPairs.erase(heapPairs.begin() + i.idx);
+			if(heapPairs.size() == InlineCapacity) {
+				// back to inline storage
+				for(size_t k=0; k < InlineCapacity; ++k)
+					inlinePairs[k] = std::move(heapPairs[k]);
+				heapPairs.clear();
+			}
+		} else {
+			for(int k=i.idx; k + 1 < (int)count; ++k)
+				inlinePairs[k] = std::move(inlinePairs[k+1]);
+			inlinePairs[count-1] = Pair{};
+		}
+		count--;
+
+		// preserving the insertion order shifts the indices anyway
+		rebuildIndex();
+	}
+
+	Iterator begin() const {
+		return {const_cast<FlatMap*>(this), 0};
+	}
+
+	Iterator end() const {
+		return {const_cast<FlatMap*>(this), (int)count};
+	}
+
+	void clear() {
+		for(size_t i=0; i < count && i < InlineCapacity; ++i)
+			inlinePairs[i] = Pair{};
+		heapPairs.clear();
+		index.clear();
+		count = 0;
+	}
+
+	size_t size() const {
+		return count;
+	}
+
+private:
+	enum { Empty = -1 };
+
+	Pair* pairs() {
+		return count > InlineCapacity ? heapPairs.data() : inlinePairs;
+	}
+
+	static size_t hashOf(Key const& key) {
+		// Fibonacci hashing: spread consecutive integer keys over the table
+		uint64_t h = std::hash<Key>()(key);
+		h *= 0x9E3779B97F4A7C15ull;
+		return (size_t)(h ^ (h >> 32));
+	}
+
+	Pair& insert(Key key) {
+		if(count == InlineCapacity) {
+			// spill to the heap
+			heapPairs.reserve(InlineCapacity * 2);
+			for(size_t i=0; i < InlineCapacity; ++i) {
+				heapPairs.push_back(std::move(inlinePairs[i]));
+				inlinePairs[i] = Pair{};
+			}
+		}
+
+		if(count >= InlineCapacity)
+			heapPairs.push_back({std::move(key), {}});
+		else
+			inlinePairs[count] = {std::move(key), {}};
+
+		count++;
+
+		if(count > LinearSearchMax) {
+			if(count * 2 > index.size())
+				rebuildIndex();
+			else
+				addToIndex((int)count - 1);
+		}
+
+		return pairs()[count-1];
+	}
+
+	void rebuildIndex() {
+		index.clear();
+		if(count <= LinearSearchMax)
+			return;
+
+		size_t capacity = 16;
+		while(capacity < count * 4)
+			capacity *= 2;
+		index.assign(capacity, Empty);
+
+		for(int i=0; i < (int)count; ++i)
+			addToIndex(i);
+	}
+
+	void addToIndex(int idx) {
+		auto const mask = index.size() - 1;
+		auto slot = hashOf(pairs()[idx].key) & mask;
+		while(index[slot] != Empty)
+			slot = (slot + 1) & mask;
+		index[slot] = idx;
+	}
+
+	Pair inlinePairs[InlineCapacity] {};
+	std::vector<Pair> heapPairs;
+	size_t count = 0;
+	std::vector<int> index; // open addressing: indices into pairs(), 'Empty' for free slots
+};
@@ -37,12 +37,9 @@ void mkdir(string path) {
 }
 
 void moveFile(string src, string dst) {
-	if(!MoveFileA(src.c_str(), dst.c_str())) {
-		if (GetLastError() == ERROR_ALREADY_EXISTS) {
-			DeleteFileA(dst.c_str());
-		}
+	// same as rename(): an existing destination is replaced
+	if(!MoveFileExA(src.c_str(), dst.c_str(), MOVEFILE_REPLACE_EXISTING))
 		throw runtime_error("can't move file");
-	}
 }
 
 void changeDir(string path) {
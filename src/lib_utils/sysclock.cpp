@@ -12,8 +12,8 @@ SystemClock::SystemClock(double speed)
 Fraction SystemClock::now() const {
 	auto const timeNow = high_resolution_clock::now();
 	auto const timeElapsedInSpeed = speed * (timeNow - timeStart);
-	auto const timeNowInMs = duration_cast<milliseconds>(timeElapsedInSpeed);
-	return Fraction(timeNowInMs.count(), 1000);
+	auto const timeNowInUs = duration_cast<microseconds>(timeElapsedInSpeed);
+	return Fraction(timeNowInUs.count(), 1000000);
 }
 
 extern const std::shared_ptr<IClock> g_SystemClock(new SystemClock(1.0));
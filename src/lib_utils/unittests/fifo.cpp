@@ -1,6 +1,7 @@
 #include "tests/tests.hpp"
 #include "lib_utils/fifo.hpp"
 #include "lib_utils/tools.hpp"
+#include "lib_utils/profiler.hpp"
 
 using namespace Tests;
 
@@ -19,3 +20,40 @@ unittest("fifo") {
 	fp.consume(6);
 	ASSERT(fp.bytesToRead() == 0);
 }
+
+unittest("fifo: interleaved writes and small consumes") {
+	GenericFifo<uint8_t> fp;
+	uint8_t writeVal = 0, readVal = 0;
+	for(int i=0; i < 1000; ++i) {
+		uint8_t buf[7];
+		for(auto& b : buf)
+			b = writeVal++;
+		fp.write(buf, sizeof buf);
+
+		auto const toRead = fp.bytesToRead() / 2;
+		for(size_t j=0; j < toRead; ++j)
+			ASSERT_EQUALS((int)readVal++, (int)fp.readPointer()[j]);
+		fp.consume(toRead);
+	}
+
+	auto const remaining = fp.bytesToRead();
+	for(size_t j=0; j < remaining; ++j)
+		ASSERT_EQUALS((int)readVal++, (int)fp.readPointer()[j]);
+	fp.consume(remaining);
+	ASSERT_EQUALS(0u, fp.bytesToRead());
+}
+
+secondclasstest("fifo: perf test, consume 64 bytes at a time from a 64MB backlog") {
+	auto const backlogSize = 64 * 1024 * 1024;
+	std::vector<uint8_t> buf(backlogSize, 0x42);
+
+	GenericFifo<uint8_t> fp;
+	fp.write(buf.data(), buf.size());
+
+	Tools::Profiler p("consume 64-byte pieces");
+	while(fp.bytesToRead() >= 64) {
+		ASSERT_EQUALS(0x42, (int)fp.readPointer()[63]);
+		fp.consume(64);
+	}
+	ASSERT_EQUALS(0u, fp.bytesToRead());
+}
@@ -0,0 +1,112 @@
+#include "tests/tests.hpp"
+#include "lib_utils/flat_map.hpp"
+#include "lib_utils/small_map.hpp"
+#include "lib_utils/profiler.hpp"
+#include "lib_utils/format.hpp"
+#include <memory>
+#include <string>
+
+using namespace Tests;
+
+namespace {
+
+unittest("FlatMap: insert and find") {
+	FlatMap<int, int> m;
+	for(int i=0; i < 100; ++i)
+		m[i * 7] = i;
+
+	ASSERT_EQUALS(100u, m.size());
+	for(int i=0; i < 100; ++i)
+		ASSERT_EQUALS(i, m[i * 7]);
+
+	ASSERT(m.find(3) == m.end());
+	ASSERT_EQUALS(100u, m.size());
+}
+
+unittest("FlatMap: iteration follows insertion order") {
+	FlatMap<int, int> m;
+	for(int i=0; i < 20; ++i)
+		m[1000 - i] = i;
+
+	int expected = 0;
+	for(auto& pair : m) {
+		ASSERT_EQUALS(1000 - expected, pair.key);
+		ASSERT_EQUALS(expected, pair.value);
+		expected++;
+	}
+	ASSERT_EQUALS(20, expected);
+}
+
+unittest("FlatMap: erase, across inline/heap/index boundaries") {
+	FlatMap<int, std::string, 2> m;
+	for(int i=0; i < 32; ++i)
+		m[i] = format("%s", i);
+
+	for(int i=0; i < 32; i += 2)
+		m.erase(m.find(i));
+
+	ASSERT_EQUALS(16u, m.size());
+	for(int i=0; i < 32; ++i) {
+		if(i % 2)
+			ASSERT_EQUALS(format("%s", i), (*m.find(i)).value);
+		else
+			ASSERT(m.find(i) == m.end());
+	}
+
+	while(m.size() > 1)
+		m.erase(m.begin());
+
+	ASSERT_EQUALS("31", (*m.begin()).value);
+	ASSERT_EQUALS("31", m[31]);
+}
+
+unittest("FlatMap: copy and clear") {
+	FlatMap<std::string, int> m;
+	for(int i=0; i < 12; ++i)
+		m[format("key%s", i)] = i;
+
+	auto copy = m;
+	m.clear();
+	ASSERT_EQUALS(0u, m.size());
+	ASSERT_EQUALS(12u, copy.size());
+	ASSERT_EQUALS(11, copy["key11"]);
+	ASSERT(copy.find("key12") == copy.end());
+}
+
+unittest("FlatMap: values are released on erase and clear") {
+	auto value = std::make_shared<int>(0);
+	FlatMap<int, std::shared_ptr<int>> m;
+	for(int i=0; i < 10; ++i)
+		m[i] = value;
+	ASSERT_EQUALS(11, (int)value.use_count());
+
+	m.erase(m.find(5));
+	ASSERT_EQUALS(10, (int)value.use_count());
+
+	m.clear();
+	ASSERT_EQUALS(1, (int)value.use_count());
+}
+
+template<typename Map>
+void lookupPerf(const char* name, int size) {
+	Map m;
+	for(int i=0; i < size; ++i)
+		m[0x35A12022 + i * 0x1000] = i;
+
+	int sum = 0;
+	{
+		Tools::Profiler p(format("%s: %s keys, 10M lookups", name, size));
+		for(int i=0; i < 10 * 1000 * 1000; ++i)
+			sum += (*m.find(0x35A12022 + (i % size) * 0x1000)).value;
+	}
+	ASSERT(sum > 0 || size == 1);
+}
+
+secondclasstest("FlatMap: perf test, crossover with SmallMap") {
+	for(int size : { 1, 2, 4, 8, 16, 32, 64 }) {
+		lookupPerf<SmallMap<int, int>>("SmallMap", size);
+		lookupPerf<FlatMap<int, int>>("FlatMap ", size);
+	}
+}
+
+}
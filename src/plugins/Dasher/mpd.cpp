@@ -13,6 +13,12 @@ std::string formatInt(int64_t val) {
 	return buffer;
 }
 
+std::string formatDouble(double val) {
+	char buffer[256];
+	snprintf(buffer, sizeof buffer, "%.3f", val);
+	return buffer;
+}
+
 std::string formatBool(bool val) {
 	return val ? "true" : "false";
 }
@@ -120,6 +126,12 @@ Tag mpdToTags(MPD const& mpd) {
 				else
 					tSegmentTemplate["startNumber"] = formatInt(adaptationSet.startNumber);
 
+				// segments are requestable while being written
+				if (mpd.dynamic && adaptationSet.availabilityTimeOffset > 0) {
+					tSegmentTemplate["availabilityTimeOffset"] = formatDouble(adaptationSet.availabilityTimeOffset);
+					tSegmentTemplate["availabilityTimeComplete"] = formatBool(false);
+				}
+
 				tAdaptationSet.add(tSegmentTemplate);
 			}
 
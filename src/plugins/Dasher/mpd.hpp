@@ -24,7 +24,7 @@ struct MPD {
 		int startNumber;
 		int duration;
 		int timescale;
-		int64_t availabilityTimeOffset;
+		double availabilityTimeOffset; // in seconds, for chunked segments
 		bool segmentAlignment;
 		bool bitstreamSwitching;
 		std::string lang;
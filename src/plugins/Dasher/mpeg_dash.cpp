@@ -35,10 +35,11 @@ enum AdaptiveStreamingCommonFlags {
 
 struct Quality {
 	std::shared_ptr<const MetadataFile> getMeta() const {
-		return lastData ? safe_cast<const MetadataFile>(lastData->getMetadata()) : nullptr;
+		return lastData ? metadata_cast<const MetadataFile>(lastData->getMetadata()) : nullptr;
 	};
 
 	uint64_t curSegDurIn180k = 0;
+	bool chunked = false; // segments are received in several parts, e.g. CMAF chunks
 	Data lastData;
 	uint64_t avg_bitrate_in_bps = 0;
 	std::string prefix; // typically a subdir, ending with a dir separator '/'
@@ -120,7 +121,7 @@ struct AdaptiveStreamer : ModuleDynI {
 		void processInitSegment(Quality const& quality, size_t index) {
 			auto const meta = quality.getMeta();
 			auto out = quality.lastData->clone();
-			std::string initFn = safe_cast<const MetadataFile>(quality.lastData->getMetadata())->filename;
+			std::string initFn = metadata_cast<const MetadataFile>(quality.lastData->getMetadata())->filename;
 
 			if (initFn.empty() || (!(flags & SegmentsNotOwned)))
 				initFn = manifestDir + getInitName(quality, index);
@@ -169,7 +170,7 @@ struct AdaptiveStreamer : ModuleDynI {
 			if (!(flags & PresignalNextSegment)) {
 				return data->clone();
 			}
-			if (!safe_cast<const MetadataFile>(data->getMetadata())->filename.empty() && !EOS) {
+			if (!metadata_cast<const MetadataFile>(data->getMetadata())->filename.empty() && !EOS) {
 				return nullptr;
 			}
 
@@ -239,7 +240,7 @@ struct AdaptiveStreamer : ModuleDynI {
 				metaFn->EOS = EOS;
 
 				out->setMetadata(metaFn);
-				out->set(PresentationTime{totalDurationInMs + timescaleToClock((int64_t)qualities[repIdx].curSegDurIn180k, 1000)});
+				out->set(PresentationTime{timescaleToClock(totalDurationInMs, 1000)});
 				outputSegments->post(out);
 			}
 		}
@@ -291,8 +292,11 @@ struct AdaptiveStreamer : ModuleDynI {
 				quality.curSegDurIn180k = segDurationIn180k ? segDurationIn180k : meta->durationIn180k;
 			}
 
-			if (!meta->EOS)
+			// forward the chunks immediately: the sinks append them
+			if (!meta->EOS) {
+				quality.chunked = true;
 				sendLocalData(currData, repIdx, meta->filesize, meta->EOS);
+			}
 
 			return true;
 		}
@@ -485,7 +489,9 @@ class Dasher : public AdaptiveStreamer {
 					rep.codecs = meta->codecName;
 					rep.startWithSAP = true;
 					if (live && meta->latencyIn180k) {
-						as.availabilityTimeOffset = std::max(0.0, (segDurationInMs - clockToTimescale(meta->latencyIn180k, DASH_TIMESCALE)) / 1000.0);
+						// a chunked segment can be requested as soon as its first chunk is available
+						if (quality.chunked)
+							as.availabilityTimeOffset = std::max(0.0, (segDurationInMs - clockToTimescale(meta->latencyIn180k, DASH_TIMESCALE)) / 1000.0);
 						mpd.minBufferTime = clockToTimescale(meta->latencyIn180k, DASH_TIMESCALE);
 					}
 					switch (meta->type) {
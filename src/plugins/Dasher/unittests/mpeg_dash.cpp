@@ -4,8 +4,14 @@
 #include "lib_media/common/attributes.hpp"
 #include "lib_media/common/metadata_file.hpp"
 #include "lib_utils/format.hpp"
+#include "lib_utils/profiler.hpp"
 #include "lib_utils/tools.hpp" // safe_cast
+#include "lib_media/unittests/modules_common.hpp"
 #include "plugins/Dasher/mpeg_dash.hpp" // DasherConfig
+#include <algorithm> // max
+#include <chrono>
+#include <functional>
+#include <thread>
 
 using namespace Tests;
 using namespace Modules;
@@ -465,3 +471,105 @@ unittest("dasher: tiles") {
 
 	ASSERT_EQUALS(expectedMpd, mpdAnalyzer->mpd);
 }
+
+unittest("dasher: chunked segments are forwarded before completion") {
+	auto const CHUNKS = 4;
+
+	DasherConfig cfg {};
+	cfg.segDurationInMs = segmentDurationInMs;
+	cfg.live = true;
+	auto dasher = loadModule("MPEG_DASH", &NullHost, &cfg);
+
+	auto recSeg = createModule<FileRecorder>();
+	ConnectOutputToInput(dasher->getOutput(0), recSeg->getInput(0));
+
+	struct MpdRecorder : ModuleS {
+		void processOne(Data data) override {
+			mpd = std::string((char*)data->data().ptr, data->data().len);
+		}
+		std::string mpd;
+	};
+	auto recMpd = createModule<MpdRecorder>();
+	ConnectOutputToInput(dasher->getOutput(1), recMpd->getInput(0));
+
+	dasher->getInput(0)->connect();
+
+	for(int seg=0; seg < 2; ++seg) {
+		for(int i=0; i < CHUNKS; ++i) {
+			auto const EOS = i == CHUNKS - 1;
+			dasher->getInput(0)->push(getTestChunk(segmentDuration / CHUNKS, EOS));
+
+			// each chunk is available as soon as it is received
+			ASSERT_EQUALS(seg * CHUNKS + i + 1, (int)recSeg->files.size());
+			ASSERT_EQUALS(format("v_0_0x0/v_0_0x0-%s.m4s", seg), recSeg->files.back().filename);
+			ASSERT_EQUALS(EOS, recSeg->files.back().EOS);
+		}
+	}
+
+	// segments can be requested one chunk after they start
+	ASSERT(recMpd->mpd.find("availabilityTimeOffset=\"2.250\" availabilityTimeComplete=\"false\"") != std::string::npos);
+}
+
+secondclasstest("dasher: perf test, glass-to-availability latency per chunk") {
+	auto const FRAME_IN_MS = 20;
+	auto const FRAMES_PER_FRAGMENT = 4;
+	auto const FRAMES_PER_SEGMENT = 24;
+	auto const SEGMENTS = 4;
+
+	auto now = []() {
+		return std::chrono::steady_clock::now();
+	};
+
+	// a live source captures one frame every FRAME_IN_MS.
+	// The muxer outputs either complete segments, or a chunk per fragment.
+	for(auto chunked : { false, true }) {
+		auto const framesPerOutput = chunked ? FRAMES_PER_FRAGMENT : FRAMES_PER_SEGMENT;
+
+		DasherConfig cfg {};
+		cfg.segDurationInMs = FRAMES_PER_SEGMENT * FRAME_IN_MS;
+		cfg.live = true;
+		auto dasher = loadModule("MPEG_DASH", &NullHost, &cfg);
+
+		// the capture time of the first frame of each chunk, in output order
+		std::vector<std::chrono::steady_clock::time_point> captureTimes;
+		double totalLatencyInMs = 0, maxLatencyInMs = 0;
+		size_t chunks = 0;
+
+		auto recSeg = createModule<FileRecorder>();
+		recSeg->onFile = [&](FileRecorder::File const& file) {
+			if(file.deleted)
+				return;
+			auto const latency = std::chrono::duration<double, std::milli>(now() - captureTimes[chunks++]).count();
+			totalLatencyInMs += latency;
+			maxLatencyInMs = std::max(maxLatencyInMs, latency);
+		};
+		ConnectOutputToInput(dasher->getOutput(0), recSeg->getInput(0));
+		dasher->getInput(0)->connect();
+
+		Tools::Profiler p(format("%s output", chunked ? "Chunked" : "Segment"));
+		auto const start = now();
+		for(int frame=0; frame < SEGMENTS * FRAMES_PER_SEGMENT; ++frame) {
+			auto const captureTime = start + std::chrono::milliseconds(frame * FRAME_IN_MS);
+			if(frame % framesPerOutput == 0)
+				captureTimes.push_back(captureTime);
+
+			// the output is ready once its last frame is over
+			if((frame + 1) % framesPerOutput == 0) {
+				std::this_thread::sleep_until(captureTime + std::chrono::milliseconds(FRAME_IN_MS));
+				auto const EOS = (frame + 1) % FRAMES_PER_SEGMENT == 0;
+				dasher->getInput(0)->push(getTestChunk(timescaleToClock(framesPerOutput * FRAME_IN_MS, 1000), EOS));
+			}
+		}
+
+		ASSERT_EQUALS(captureTimes.size(), chunks);
+		auto const name = format("%s output, glass-to-availability latency", chunked ? "Chunked" : "Segment");
+		Report(name + ", average", totalLatencyInMs / chunks, "ms");
+		Report(name + ", max", maxLatencyInMs, "ms");
+
+		// available as soon as the muxer outputs it: one fragment, or one segment
+		auto const outputInMs = framesPerOutput * FRAME_IN_MS;
+		ASSERT(maxLatencyInMs >= outputInMs && maxLatencyInMs < outputInMs * 2);
+		if(chunked)
+			ASSERT(maxLatencyInMs < FRAMES_PER_SEGMENT * FRAME_IN_MS / 2);
+	}
+}
@@ -122,16 +122,12 @@ struct GpacFilters : ModuleDynI {
 				auto span = pData->data();
 				*data = span.ptr;
 				*data_size = span.len;
-				try {
-					*pts = pData->get<PresentationTime>().time;
-				} catch(...) {
-					*pts = 0; // not set
-				}
-				try {
-					*dts = pData->get<DecodingTime>().time;
-				} catch(...) {
-					*dts = *pts;
-				}
+				PresentationTime presentationTime {0}; // zero when not set
+				pData->tryGet(presentationTime);
+				*pts = presentationTime.time;
+				DecodingTime decodingTime {presentationTime.time};
+				pData->tryGet(decodingTime);
+				*dts = decodingTime.time;
 				pThis->danglingData[*data] = pData;
 			} else {
 				//pThis->m_host->log(Debug, "MemIn requests data but no data is available. Rescheduling.");
@@ -157,7 +153,7 @@ struct GpacFilters : ModuleDynI {
 		}
 		static void ensureMetadata(void *parent, const u8 *data, u32 data_size) {
 			auto pThis = (GpacFilters*)parent;
-			auto meta = safe_cast<const MetadataPkt>(pThis->outputs[0]->getMetadata());
+			auto meta = metadata_cast<const MetadataPkt>(pThis->outputs[0]->getMetadata());
 			if(!meta || meta->codecSpecificInfo.empty()) {
 				auto metaDsi = make_shared<MetadataPkt>(meta->type);
 				metaDsi->codecSpecificInfo.assign(data, data + data_size);
@@ -167,7 +163,7 @@ struct GpacFilters : ModuleDynI {
 		}
 
 		bool openReframer(Metadata meta_) {
-			auto meta = safe_cast<const MetadataPkt>(meta_);
+			auto meta = metadata_cast<const MetadataPkt>(meta_);
 			outputs[0]->setMetadata(meta); //TODO: to be extended to multiple outputs
 			codecName = meta->codec;
 			if (codecName.empty())
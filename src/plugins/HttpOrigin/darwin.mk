@@ -0,0 +1 @@
+  HTTPORIGIN_OBJS:=$(BIN)/$(PLUG_DIR)/http_origin.cpp.o
@@ -0,0 +1,661 @@
+#include "http_origin.hpp"
+#include "lib_modules/utils/factory.hpp" // registerModule
+#include "lib_modules/utils/helper.hpp"
+#include "lib_media/common/metadata_file.hpp"
+#include "lib_utils/log_sink.hpp" // Info, Warning
+#include "lib_utils/format.hpp"
+#include "lib_utils/tools.hpp" // enforce
+#include <algorithm> // transform
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio> // snprintf
+#include <cstdlib> // atoll
+#include <cstring> // strlen
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+using namespace Modules;
+
+namespace {
+
+// requests with larger headers are rejected
+size_t const MAX_REQUEST_SIZE = 64 * 1024;
+
+// A file, complete or still being written.
+// The chunks are the received Data: they are sent as-is, without copies.
+struct Entry {
+	std::string contentType;
+	std::vector<Data> chunks;
+	uint64_t size = 0;
+	bool complete = false;
+	bool removed = false;
+
+	// HLS playlists: the last listed segment, and the parts listed after it
+	bool playlist = false;
+	int64_t lastMsn = -1;
+	int64_t lastParts = 0;
+	int64_t targetDurationInMs = 0;
+	bool ended = false;
+};
+
+// Parses what blocking playlist reloads need to know.
+void parsePlaylist(Entry& entry) {
+	std::string text;
+	for(auto& chunk : entry.chunks)
+		text.append((char const*)chunk->data().ptr, chunk->data().len);
+
+	std::string line;
+	auto startsWith = [&](char const* tag) {
+		return line.compare(0, strlen(tag), tag) == 0;
+	};
+	auto value = [&](char const* tag) {
+		return std::atoll(line.c_str() + strlen(tag));
+	};
+
+	int64_t msn = 0;
+	bool segments = false;
+	std::istringstream lines(text);
+	while(std::getline(lines, line)) {
+		if(!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if(line.empty())
+			continue;
+		if(line[0] != '#') {
+			entry.lastMsn = msn++;
+			entry.lastParts = 0;
+			segments = true;
+		} else if(startsWith("#EXT-X-MEDIA-SEQUENCE:")) {
+			msn = value("#EXT-X-MEDIA-SEQUENCE:");
+		} else if(startsWith("#EXT-X-SKIP:SKIPPED-SEGMENTS=")) {
+			msn += value("#EXT-X-SKIP:SKIPPED-SEGMENTS=");
+		} else if(startsWith("#EXT-X-PART:")) {
+			entry.lastParts++;
+		} else if(startsWith("#EXT-X-TARGETDURATION:")) {
+			entry.targetDurationInMs = value("#EXT-X-TARGETDURATION:") * 1000;
+		} else if(line == "#EXT-X-ENDLIST") {
+			entry.ended = true;
+		}
+	}
+	if(!segments)
+		entry.lastMsn = msn - 1;
+	entry.playlist = true;
+}
+
+// Returns -1 when the query parameter is absent.
+int64_t getQueryValue(std::string const& query, std::string const& name) {
+	auto const pos = query.find(name + "=");
+	if(pos == std::string::npos || (pos > 0 && query[pos - 1] != '?' && query[pos - 1] != '&'))
+		return -1;
+	return std::atoll(query.c_str() + pos + name.size() + 1);
+}
+
+struct Segment {
+	std::string name;
+	int64_t durationIn180k;
+	uint64_t index; // completion order, across the representations
+};
+
+struct Representation {
+	std::deque<Segment> segments; // completed, oldest first
+	int64_t durationIn180k = 0;
+};
+
+// "<prefix><number>.<ext>" -> "<prefix>.<ext>": the segments of a representation share a key.
+// LL-HLS parts ("<segment>.<index>.<ext>", they overlap their segment) have an empty key.
+std::string getRepresentation(std::string const& name) {
+	auto const dot = std::min(name.rfind('.'), name.size());
+	auto const numPos = name.find_last_not_of("0123456789", dot - 1) + 1;
+	if(numPos > 0 && numPos < dot && name[numPos - 1] == '.')
+		return {};
+	return name.substr(0, numPos) + name.substr(dot);
+}
+
+std::string getContentType(std::string const& name) {
+	auto const ext = name.substr(name.rfind('.') + 1);
+	if(ext == "mpd")
+		return "application/dash+xml";
+	if(ext == "m3u8")
+		return "application/vnd.apple.mpegurl";
+	if(ext == "mp4" || ext == "m4s")
+		return "video/mp4";
+	if(ext == "ts")
+		return "video/mp2t";
+	if(ext == "vtt")
+		return "text/vtt";
+	return "application/octet-stream";
+}
+
+void setNonBlocking(int fd) {
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+struct Connection {
+	int fd;
+	std::string in; // received, not parsed yet
+
+	// current response
+	bool responding = false;
+	bool waiting = false; // for the entry to grow
+	bool chunked = false;
+	bool closeAfter = false; // HTTP/1.0 or "Connection: close"
+	std::string out; // status line, headers or chunk framing
+	size_t outOffset = 0;
+	std::shared_ptr<Entry> entry;
+	size_t chunkIdx = 0;
+	Data chunk;
+	size_t chunkOffset = 0;
+
+	// LL-HLS blocking playlist reload: the request is replayed once the playlist is updated
+	bool blocked = false;
+	std::string blockedRequest;
+	std::chrono::steady_clock::time_point blockedUntil;
+};
+
+class HttpOrigin : public ModuleS {
+	public:
+		HttpOrigin(KHost* host, HttpOriginConfig const& cfg)
+			: m_host(host),
+			  m_timeShiftBufferDepthIn180k(timescaleToClock(cfg.timeShiftBufferDepthInMs, 1000)),
+			  m_maxCacheSize(cfg.maxCacheSizeInBytes) {
+			m_socket = socket(AF_INET, SOCK_STREAM, 0);
+			if(m_socket < 0)
+				throw error("socket failed");
+
+			int one = 1;
+			setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+
+			sockaddr_in addr {};
+			addr.sin_family = AF_INET;
+			addr.sin_addr.s_addr = inet_addr(cfg.bindAddress.c_str());
+			addr.sin_port = htons(cfg.port);
+			if(bind(m_socket, (sockaddr*)&addr, sizeof addr) < 0 || listen(m_socket, 128) < 0) {
+				close(m_socket);
+				throw error(format("can't listen on %s:%s", cfg.bindAddress, cfg.port));
+			}
+			setNonBlocking(m_socket);
+
+			socklen_t len = sizeof addr;
+			getsockname(m_socket, (sockaddr*)&addr, &len);
+			int const port = ntohs(addr.sin_port);
+			m_host->log(Info, format("Serving on http://%s:%s/", cfg.bindAddress, port).c_str());
+
+			if(pipe(m_wakeup) < 0) {
+				close(m_socket);
+				throw error("pipe failed");
+			}
+			setNonBlocking(m_wakeup[0]);
+			setNonBlocking(m_wakeup[1]);
+
+			if(auto entry = m_host->getStatsEntry("port"))
+				*entry = port;
+			m_statsClients = m_host->getStatsEntry("clients");
+			m_statsRequests = m_host->getStatsEntry("requests");
+			m_statsCacheSize = m_host->getStatsEntry("cache_kbytes");
+			m_statsEvicted = m_host->getStatsEntry("evicted_segments");
+
+			m_thread = std::thread(&HttpOrigin::threadProc, this);
+		}
+
+		~HttpOrigin() {
+			m_stop = true;
+			wakeup();
+			m_thread.join();
+			close(m_wakeup[0]);
+			close(m_wakeup[1]);
+			close(m_socket);
+		}
+
+		void processOne(Data data) override {
+			auto const meta = metadata_cast<const MetadataFile>(data->getMetadata());
+			auto const& name = meta->filename;
+
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+
+				if(meta->filesize == INT64_MAX) {
+					remove(name);
+				} else {
+					auto entry = m_transfers[name];
+					if(!entry) {
+						remove(name); // also drops the transfer slot
+						entry = std::make_shared<Entry>();
+						entry->contentType = getContentType(name);
+						m_files[name] = entry;
+						m_transfers[name] = entry;
+					}
+
+					auto const size = data->data().len;
+					if(size) {
+						entry->chunks.push_back(data);
+						entry->size += size;
+						m_cacheSize += size;
+					}
+
+					if(meta->EOS) {
+						entry->complete = true;
+						m_transfers.erase(name);
+						if(entry->contentType == "application/vnd.apple.mpegurl")
+							parsePlaylist(*entry);
+						auto const representation = getRepresentation(name);
+						if(meta->durationIn180k && !representation.empty()) {
+							auto& r = m_representations[representation];
+							r.segments.push_back({name, (int64_t)meta->durationIn180k, m_segmentIndex++});
+							r.durationIn180k += meta->durationIn180k;
+						}
+						evict();
+					}
+				}
+			}
+
+			wakeup();
+			updateStats();
+		}
+
+		void flush() override {
+			updateStats();
+		}
+
+	private:
+		// called with m_mutex held
+		void remove(std::string const& name) {
+			auto i = m_files.find(name);
+			if(i == m_files.end())
+				return;
+
+			i->second->removed = true;
+			m_cacheSize -= i->second->size;
+			m_files.erase(i);
+			m_transfers.erase(name);
+
+			auto r = m_representations.find(getRepresentation(name));
+			if(r == m_representations.end())
+				return;
+			auto& segments = r->second.segments;
+			for(auto s = segments.begin(); s != segments.end(); ++s) {
+				if(s->name == name) {
+					r->second.durationIn180k -= s->durationIn180k;
+					segments.erase(s);
+					break;
+				}
+			}
+		}
+
+		// called with m_mutex held
+		void evict() {
+			// each representation keeps enough segments to cover the timeshift depth
+			if(m_timeShiftBufferDepthIn180k) {
+				for(auto& r : m_representations) {
+					auto& rep = r.second;
+					while(!rep.segments.empty() && rep.durationIn180k - rep.segments.front().durationIn180k >= m_timeShiftBufferDepthIn180k) {
+						auto const name = rep.segments.front().name;
+						remove(name);
+						m_evicted++;
+					}
+				}
+			}
+
+			// then the oldest segments, whatever their representation
+			while(m_cacheSize > m_maxCacheSize) {
+				Representation* oldest = nullptr;
+				for(auto& r : m_representations)
+					if(!r.second.segments.empty() && (!oldest || r.second.segments.front().index < oldest->segments.front().index))
+						oldest = &r.second;
+				if(!oldest)
+					break;
+				auto const name = oldest->segments.front().name;
+				remove(name);
+				m_evicted++;
+			}
+		}
+
+		void updateStats() {
+			if(m_statsClients)
+				*m_statsClients = m_clients;
+			if(m_statsRequests)
+				*m_statsRequests = m_requests;
+			if(m_statsEvicted)
+				*m_statsEvicted = m_evicted;
+			if(m_statsCacheSize) {
+				std::unique_lock<std::mutex> lock(m_mutex);
+				*m_statsCacheSize = (int32_t)(m_cacheSize / 1024);
+			}
+		}
+
+		void wakeup() {
+			char c = 0;
+			auto ret = write(m_wakeup[1], &c, 1);
+			(void)ret; // the pipe is full: the server thread is already awake
+		}
+
+		void threadProc() {
+			std::vector<std::unique_ptr<Connection>> connections;
+			std::vector<pollfd> fds;
+
+			while(!m_stop) {
+				fds.clear();
+				fds.push_back({m_wakeup[0], POLLIN, 0});
+				fds.push_back({m_socket, POLLIN, 0});
+				int timeoutInMs = -1;
+				auto now = std::chrono::steady_clock::now();
+				for(auto& c : connections) {
+					if(c->blocked) {
+						auto const remaining = std::chrono::duration_cast<std::chrono::milliseconds>(c->blockedUntil - now).count() + 1;
+						if(timeoutInMs < 0 || remaining < timeoutInMs)
+							timeoutInMs = (int)std::max<int64_t>(remaining, 0);
+					}
+					short events = 0;
+					if(c->in.size() < MAX_REQUEST_SIZE)
+						events |= POLLIN;
+					if(c->outOffset < c->out.size() || c->chunk)
+						events |= POLLOUT;
+					fds.push_back({c->fd, events, 0});
+				}
+
+				if(poll(fds.data(), fds.size(), timeoutInMs) < 0 && errno != EINTR)
+					break;
+				now = std::chrono::steady_clock::now();
+
+				bool dataAvailable = false;
+				if(fds[0].revents) {
+					char buf[256];
+					while(read(m_wakeup[0], buf, sizeof buf) > 0) {
+					}
+					dataAvailable = true;
+				}
+
+				for(size_t i=0; i < connections.size(); ++i) {
+					auto& c = *connections[i];
+					auto const revents = fds[i + 2].revents;
+					bool alive = true;
+
+					if(revents & (POLLIN | POLLHUP | POLLERR))
+						alive = receive(c);
+
+					auto const retry = c.blocked && (dataAvailable || now >= c.blockedUntil);
+					if(alive && (revents || (dataAvailable && c.waiting) || retry))
+						alive = pump(c);
+
+					if(!alive) {
+						close(c.fd);
+						connections[i] = nullptr;
+					}
+				}
+				connections.erase(std::remove(connections.begin(), connections.end(), nullptr), connections.end());
+
+				if(fds[1].revents) {
+					int fd;
+					while((fd = accept(m_socket, nullptr, nullptr)) >= 0) {
+						setNonBlocking(fd);
+						int one = 1;
+						setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+						auto c = std::make_unique<Connection>();
+						c->fd = fd;
+						connections.push_back(std::move(c));
+					}
+				}
+
+				m_clients = (int)connections.size();
+			}
+
+			for(auto& c : connections)
+				close(c->fd);
+		}
+
+		// returns false when the connection is closed
+		bool receive(Connection& c) {
+			char buf[16 * 1024];
+			auto const n = recv(c.fd, buf, sizeof buf, 0);
+			if(n == 0)
+				return false;
+			if(n < 0)
+				return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+			c.in.append(buf, n);
+			return true;
+		}
+
+		// returns false when the connection must be closed
+		bool pump(Connection& c) {
+			while(true) {
+				if(!c.responding) {
+					if(c.closeAfter)
+						return false;
+
+					if(c.blocked) {
+						startResponse(c, c.blockedRequest);
+						if(c.blocked)
+							return true;
+					} else {
+						auto const end = c.in.find("\r\n\r\n");
+						if(end == std::string::npos)
+							return c.in.size() < MAX_REQUEST_SIZE;
+
+						auto const request = c.in.substr(0, end);
+						c.in.erase(0, end + 4);
+						startResponse(c, request);
+						if(c.blocked)
+							return true;
+					}
+				}
+
+				while(c.outOffset < c.out.size()) {
+					auto const n = send(c.fd, c.out.data() + c.outOffset, c.out.size() - c.outOffset, MSG_NOSIGNAL);
+					if(n < 0)
+						return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+					c.outOffset += n;
+				}
+				c.out.clear();
+				c.outOffset = 0;
+
+				if(c.chunk) {
+					auto const body = c.chunk->data();
+					while(c.chunkOffset < body.len) {
+						auto const n = send(c.fd, body.ptr + c.chunkOffset, body.len - c.chunkOffset, MSG_NOSIGNAL);
+						if(n < 0)
+							return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+						c.chunkOffset += n;
+					}
+					c.chunk = nullptr;
+				}
+
+				if(!nextBodyPart(c))
+					return true; // wait for the entry to grow
+			}
+		}
+
+		void startResponse(Connection& c, std::string const& raw) {
+			if(!c.blocked)
+				m_requests++;
+			c.responding = true;
+			c.chunkIdx = 0;
+
+			// the path is case-sensitive, the rest isn't
+			auto request = raw;
+			std::transform(request.begin(), request.end(), request.begin(), ::tolower);
+
+			auto const sp1 = request.find(' ');
+			auto const sp2 = request.find(' ', sp1 + 1);
+			auto const eol = request.find("\r\n");
+			if(sp1 == std::string::npos || sp2 == std::string::npos || sp2 > eol) {
+				c.out = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+				c.closeAfter = true;
+				return;
+			}
+
+			auto const method = request.substr(0, sp1);
+			auto const version = request.substr(sp2 + 1, eol - sp2 - 1);
+			auto const http11 = version == "http/1.1";
+			c.closeAfter = request.find("\r\nconnection: close") != std::string::npos
+			    || (!http11 && request.find("\r\nconnection: keep-alive") == std::string::npos);
+			auto const connectionHeader = c.closeAfter ? "Connection: close\r\n" : "";
+
+			if(method != "get" && method != "head") {
+				c.out = format("HTTP/1.1 405 Method Not Allowed\r\nAllow: GET, HEAD\r\nContent-Length: 0\r\n%s\r\n", connectionHeader);
+				return;
+			}
+
+			auto path = raw.substr(sp1 + 1, sp2 - sp1 - 1);
+			auto const queryPos = path.find('?');
+			auto const query = queryPos == std::string::npos ? std::string() : path.substr(queryPos);
+			path = path.substr(0, queryPos);
+			while(!path.empty() && path[0] == '/')
+				path.erase(0, 1);
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			auto i = m_files.end();
+
+			// LL-HLS delta update, when available
+			if(query.find("_HLS_skip=YES") != std::string::npos || query.find("_HLS_skip=v2") != std::string::npos)
+				i = m_files.find(path.substr(0, path.rfind('.')) + "_delta.m3u8");
+			if(i == m_files.end())
+				i = m_files.find(path);
+			if(i == m_files.end()) {
+				c.blocked = false;
+				c.out = format("HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n%s\r\n", connectionHeader);
+				return;
+			}
+
+			// LL-HLS blocking playlist reload: wait for the requested segment or part
+			auto const msn = getQueryValue(query, "_HLS_msn");
+			if(msn >= 0 && i->second->playlist && !i->second->ended) {
+				auto const part = getQueryValue(query, "_HLS_part");
+				auto const& playlist = *i->second;
+				auto const ready = msn <= playlist.lastMsn || (msn == playlist.lastMsn + 1 && part >= 0 && part < playlist.lastParts);
+				if(msn > playlist.lastMsn + 2) {
+					c.blocked = false;
+					c.out = format("HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n%s\r\n", connectionHeader);
+					return;
+				}
+				if(!ready) {
+					auto const now = std::chrono::steady_clock::now();
+					if(!c.blocked) {
+						c.blocked = true;
+						c.blockedRequest = raw;
+						c.blockedUntil = now + std::chrono::milliseconds(3 * playlist.targetDurationInMs);
+						c.responding = false;
+						return;
+					}
+					if(now < c.blockedUntil) {
+						c.responding = false;
+						return;
+					}
+					c.blocked = false;
+					c.out = format("HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n%s\r\n", connectionHeader);
+					return;
+				}
+			}
+			c.blocked = false;
+
+			auto const& entry = i->second;
+			c.out = format("HTTP/1.1 200 OK\r\nContent-Type: %s\r\n%s", entry->contentType, connectionHeader);
+			if(entry->complete) {
+				c.out += format("Content-Length: %s\r\n\r\n", entry->size);
+				c.chunked = false;
+			} else if(http11) {
+				c.out += "Transfer-Encoding: chunked\r\n\r\n";
+				c.chunked = true;
+			} else {
+				// close-delimited
+				c.out += "\r\n";
+				c.chunked = false;
+				c.closeAfter = true;
+			}
+
+			if(method == "get")
+				c.entry = entry;
+			else
+				c.chunked = false;
+		}
+
+		// Fetches the next chunk of the body, or the end of the response.
+		// Returns false when the entry must grow first.
+		bool nextBodyPart(Connection& c) {
+			c.waiting = false;
+
+			if(c.entry) {
+				std::unique_lock<std::mutex> lock(m_mutex);
+				auto const& chunks = c.entry->chunks;
+				if(c.chunkIdx < chunks.size()) {
+					c.chunk = chunks[c.chunkIdx++];
+					c.chunkOffset = 0;
+					if(c.chunked) {
+						char framing[32];
+						snprintf(framing, sizeof framing, "%s%zx\r\n", c.chunkIdx > 1 ? "\r\n" : "", c.chunk->data().len);
+						c.out = framing;
+					}
+					return true;
+				}
+
+				if(!c.entry->complete) {
+					if(c.entry->removed) {
+						// can't be completed: the client sees a truncated response
+						c.responding = false;
+						c.closeAfter = true;
+						return true;
+					}
+					c.waiting = true;
+					return false;
+				}
+			}
+
+			if(c.chunked) {
+				c.out = c.chunkIdx ? "\r\n0\r\n\r\n" : "0\r\n\r\n";
+				c.chunked = false;
+				return true;
+			}
+
+			c.responding = false;
+			c.entry = nullptr;
+			return true;
+		}
+
+		KHost* const m_host;
+		int64_t const m_timeShiftBufferDepthIn180k;
+		uint64_t const m_maxCacheSize;
+
+		int m_socket = -1;
+		int m_wakeup[2] {};
+		std::thread m_thread;
+		std::atomic<bool> m_stop { false };
+
+		std::mutex m_mutex;
+		std::map<std::string, std::shared_ptr<Entry>> m_files; // served
+		std::map<std::string, std::shared_ptr<Entry>> m_transfers; // being written
+		std::map<std::string, Representation> m_representations; // by getRepresentation()
+		uint64_t m_segmentIndex = 0;
+		uint64_t m_cacheSize = 0;
+
+		std::atomic<int> m_clients { 0 }, m_requests { 0 }, m_evicted { 0 };
+		int32_t* m_statsClients;
+		int32_t* m_statsRequests;
+		int32_t* m_statsCacheSize;
+		int32_t* m_statsEvicted;
+};
+
+IModule* createObject(KHost* host, void* va) {
+	auto config = (HttpOriginConfig*)va;
+	enforce(host, "HttpOrigin: host can't be NULL");
+	enforce(config, "HttpOrigin: config can't be NULL");
+	return createModule<HttpOrigin>(host, *config).release();
+}
+
+auto const registered = Factory::registerModule("HttpOrigin", &createObject);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Serves the received files (MetadataFile) from memory over HTTP/1.1.
+// Files still being written are delivered with chunked transfer-encoding.
+// LL-HLS: playlist requests with _HLS_msn/_HLS_part are held until the playlist
+// lists the requested segment or part. _HLS_skip=YES serves "<name>_delta.m3u8".
+struct HttpOriginConfig {
+	std::string bindAddress = "127.0.0.1";
+	int port = 8080; // 0: any free port, see the "port" stats entry
+
+	// each representation evicts its completed segments older than this. 0: no limit.
+	uint64_t timeShiftBufferDepthInMs = 0;
+
+	// when exceeded, the oldest segments are evicted
+	uint64_t maxCacheSizeInBytes = 1024 * 1024 * 1024;
+};
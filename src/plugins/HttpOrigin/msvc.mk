@@ -0,0 +1,2 @@
+# the origin is written against the POSIX sockets (poll, pipe, fcntl): not built on Windows
+HTTPORIGIN_OBJS:=
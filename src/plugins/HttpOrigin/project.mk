@@ -0,0 +1,11 @@
+PLUG_DIR:=$(call get-my-dir)
+
+HTTPORIGIN_OBJS:=
+-include $(PLUG_DIR)/$(shell $(CXX) -dumpmachine | sed "s/.*-\([a-zA-Z]*\)[0-9.]*/\1/" | sed "s/linux/gnu/").mk
+
+ifneq ($(HTTPORIGIN_OBJS),)
+TARGETS+=$(BIN)/HttpOrigin.smd
+$(BIN)/HttpOrigin.smd: \
+  $(HTTPORIGIN_OBJS)\
+
+endif
@@ -0,0 +1,360 @@
+#include "tests/tests.hpp"
+#include "lib_modules/modules.hpp"
+#include "lib_modules/utils/loader.hpp"
+#include "lib_media/common/metadata_file.hpp"
+#include "lib_utils/format.hpp"
+#include "lib_utils/profiler.hpp"
+#include "lib_media/unittests/modules_common.hpp"
+#include "../http_origin.hpp"
+#include <algorithm> // max, min_element
+#include <atomic>
+#include <chrono>
+#include <cstring> // memcpy
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <curl/curl.h>
+
+#ifndef _WIN32 // HttpOrigin isn't built on Windows
+using namespace Tests;
+using namespace Modules;
+
+namespace {
+
+void push(IModule* origin, std::string filename, std::vector<uint8_t> const& contents, bool EOS, int64_t durationIn180k = 0) {
+	auto meta = std::make_shared<MetadataFile>(VIDEO_PKT);
+	meta->filename = filename;
+	meta->filesize = contents.size();
+	meta->durationIn180k = durationIn180k;
+	meta->EOS = EOS;
+	auto data = std::make_shared<DataRaw>(contents.size());
+	if(!contents.empty())
+		memcpy(data->buffer->data().ptr, contents.data(), contents.size());
+	data->setMetadata(meta);
+	origin->getInput(0)->push(data);
+}
+
+void pushDelete(IModule* origin, std::string filename) {
+	auto meta = std::make_shared<MetadataFile>(VIDEO_PKT);
+	meta->filename = filename;
+	meta->filesize = INT64_MAX;
+	auto data = std::make_shared<DataRaw>(0);
+	data->setMetadata(meta);
+	origin->getInput(0)->push(data);
+}
+
+struct Response {
+	long status = 0;
+	std::vector<uint8_t> body;
+	std::string headers;
+};
+
+// a curl client, reusing its connection across requests
+struct Client {
+	Client() : m_curl(curl_easy_init()) {
+	}
+
+	~Client() {
+		curl_easy_cleanup(m_curl);
+	}
+
+	Response get(std::string url, std::function<void(size_t)> onData = nullptr) {
+		Response r;
+		m_onData = onData;
+		m_response = &r;
+		curl_easy_setopt(m_curl, CURLOPT_URL, url.c_str());
+		curl_easy_setopt(m_curl, CURLOPT_WRITEFUNCTION, &Client::write);
+		curl_easy_setopt(m_curl, CURLOPT_WRITEDATA, this);
+		curl_easy_setopt(m_curl, CURLOPT_HEADERFUNCTION, &Client::header);
+		curl_easy_setopt(m_curl, CURLOPT_HEADERDATA, this);
+		ASSERT_EQUALS(CURLE_OK, curl_easy_perform(m_curl));
+		curl_easy_getinfo(m_curl, CURLINFO_RESPONSE_CODE, &r.status);
+		long connects = 0;
+		curl_easy_getinfo(m_curl, CURLINFO_NUM_CONNECTS, &connects);
+		connections += connects;
+		return r;
+	}
+
+	int connections = 0;
+
+private:
+	static size_t write(char* ptr, size_t size, size_t nmemb, void* userdata) {
+		auto self = (Client*)userdata;
+		self->m_response->body.insert(self->m_response->body.end(), ptr, ptr + size * nmemb);
+		if(self->m_onData)
+			self->m_onData(self->m_response->body.size());
+		return size * nmemb;
+	}
+
+	static size_t header(char* ptr, size_t size, size_t nmemb, void* userdata) {
+		auto self = (Client*)userdata;
+		self->m_response->headers.append(ptr, size * nmemb);
+		return size * nmemb;
+	}
+
+	CURL* const m_curl;
+	Response* m_response = nullptr;
+	std::function<void(size_t)> m_onData;
+};
+
+struct Origin {
+	Origin(HttpOriginConfig cfg = {}) {
+		cfg.port = 0;
+		module = loadModule("HttpOrigin", &host, &cfg);
+		url = format("http://127.0.0.1:%s/", host.stats["port"]);
+	}
+
+	StatsHost host;
+	std::shared_ptr<IModule> module;
+	std::string url;
+};
+
+unittest("HttpOrigin: serve files from memory") {
+	Origin origin;
+	auto const manifest = makePayload(1500, 0);
+	auto const init = makePayload(700, 1);
+	push(origin.module.get(), "live.mpd", manifest, true);
+	push(origin.module.get(), "v_0/init.mp4", init, true);
+
+	Client client;
+	auto r = client.get(origin.url + "live.mpd");
+	ASSERT_EQUALS(200, r.status);
+	ASSERT(manifest == r.body);
+	ASSERT(r.headers.find("Content-Type: application/dash+xml") != std::string::npos);
+	ASSERT(r.headers.find("Content-Length: 1500") != std::string::npos);
+
+	r = client.get(origin.url + "v_0/init.mp4?token=1");
+	ASSERT_EQUALS(200, r.status);
+	ASSERT(init == r.body);
+
+	ASSERT_EQUALS(404, client.get(origin.url + "missing.m4s").status);
+
+	// manifest update
+	auto const manifest2 = makePayload(1600, 2);
+	push(origin.module.get(), "live.mpd", manifest2, true);
+	ASSERT(manifest2 == client.get(origin.url + "live.mpd").body);
+
+	// keep-alive
+	ASSERT_EQUALS(1, client.connections);
+	origin.module->flush();
+	ASSERT_EQUALS(4, origin.host.stats["requests"]);
+}
+
+unittest("HttpOrigin: in-progress segment is delivered chunked") {
+	Origin origin;
+	auto const part1 = makePayload(10000, 1);
+	auto const part2 = makePayload(20000, 2);
+	push(origin.module.get(), "seg_1.m4s", {}, false);
+	push(origin.module.get(), "seg_1.m4s", part1, false);
+
+	std::atomic<size_t> received { 0 };
+	Response r;
+	std::thread reader([&]() {
+		Client client;
+		r = client.get(origin.url + "seg_1.m4s", [&](size_t size) {
+			received = size;
+		});
+	});
+
+	// the first part is delivered before the segment is complete
+	auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while(received < part1.size() && std::chrono::steady_clock::now() < deadline)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	ASSERT_EQUALS(part1.size(), received);
+
+	push(origin.module.get(), "seg_1.m4s", part2, true, IClock::Rate);
+	reader.join();
+
+	ASSERT_EQUALS(200, r.status);
+	ASSERT(r.headers.find("Transfer-Encoding: chunked") != std::string::npos);
+	auto expected = part1;
+	expected.insert(expected.end(), part2.begin(), part2.end());
+	ASSERT(expected == r.body);
+}
+
+unittest("HttpOrigin: eviction by timeshift depth") {
+	HttpOriginConfig cfg;
+	cfg.timeShiftBufferDepthInMs = 3000;
+	Origin origin(cfg);
+
+	for(int i=0; i < 10; ++i)
+		push(origin.module.get(), format("seg_%s.m4s", i), makePayload(1000, i), true, IClock::Rate);
+	push(origin.module.get(), "init.mp4", makePayload(100, 0), true);
+	origin.module->flush();
+
+	ASSERT_EQUALS(7, origin.host.stats["evicted_segments"]);
+	ASSERT_EQUALS(3, origin.host.stats["cache_kbytes"]);
+
+	Client client;
+	ASSERT_EQUALS(404, client.get(origin.url + "seg_6.m4s").status);
+	for(int i=7; i < 10; ++i)
+		ASSERT_EQUALS(200, client.get(origin.url + format("seg_%s.m4s", i)).status);
+	ASSERT_EQUALS(200, client.get(origin.url + "init.mp4").status);
+}
+
+unittest("HttpOrigin: eviction by timeshift depth, per representation") {
+	HttpOriginConfig cfg;
+	cfg.timeShiftBufferDepthInMs = 3000;
+	Origin origin(cfg);
+
+	// 2s video segments, 1s audio segments, and the video LL-HLS parts
+	for(int i=0; i < 6; ++i) {
+		for(int part=0; part < 4; ++part)
+			push(origin.module.get(), format("video-%s.%s.m4s", i, part), makePayload(100, part), true, IClock::Rate / 2);
+		push(origin.module.get(), format("video-%s.m4s", i), makePayload(1000, i), true, 2 * IClock::Rate);
+		for(int j=0; j < 2; ++j)
+			push(origin.module.get(), format("audio-%s.m4s", 2 * i + j), makePayload(1000, j), true, IClock::Rate);
+	}
+	origin.module->flush();
+
+	Client client;
+	ASSERT_EQUALS(404, client.get(origin.url + "video-3.m4s").status);
+	for(int i=4; i < 6; ++i)
+		ASSERT_EQUALS(200, client.get(origin.url + format("video-%s.m4s", i)).status);
+	ASSERT_EQUALS(404, client.get(origin.url + "audio-8.m4s").status);
+	for(int i=9; i < 12; ++i)
+		ASSERT_EQUALS(200, client.get(origin.url + format("audio-%s.m4s", i)).status);
+	// the parts are not segments: the packager deletes them
+	ASSERT_EQUALS(200, client.get(origin.url + "video-0.0.m4s").status);
+	ASSERT_EQUALS(4 + 9, origin.host.stats["evicted_segments"]);
+}
+
+unittest("HttpOrigin: eviction by cache size") {
+	HttpOriginConfig cfg;
+	cfg.maxCacheSizeInBytes = 5000;
+	Origin origin(cfg);
+
+	for(int i=0; i < 10; ++i)
+		push(origin.module.get(), format("seg_%s.m4s", i), makePayload(1000, i), true, IClock::Rate);
+	origin.module->flush();
+
+	ASSERT_EQUALS(5, origin.host.stats["evicted_segments"]);
+	Client client;
+	ASSERT_EQUALS(404, client.get(origin.url + "seg_4.m4s").status);
+	ASSERT_EQUALS(200, client.get(origin.url + "seg_5.m4s").status);
+}
+
+unittest("HttpOrigin: delete") {
+	Origin origin;
+	push(origin.module.get(), "seg_1.m4s", makePayload(1000, 0), true, IClock::Rate);
+	Client client;
+	ASSERT_EQUALS(200, client.get(origin.url + "seg_1.m4s").status);
+	pushDelete(origin.module.get(), "seg_1.m4s");
+	ASSERT_EQUALS(404, client.get(origin.url + "seg_1.m4s").status);
+}
+
+std::vector<uint8_t> makePlaylist(int parts) {
+	std::string r = "#EXTM3U\n#EXT-X-TARGETDURATION:2\n#EXT-X-MEDIA-SEQUENCE:5\n#EXTINF:2\nseg-5.m4s\n";
+	for(int i=0; i < parts; ++i)
+		r += format("#EXT-X-PART:DURATION=0.5,URI=\"seg-6.%s.m4s\"\n", i);
+	return std::vector<uint8_t>(r.begin(), r.end());
+}
+
+unittest("HttpOrigin: LL-HLS blocking playlist reload") {
+	Origin origin;
+	push(origin.module.get(), "live.m3u8", makePlaylist(1), true);
+
+	Client client;
+	ASSERT(makePlaylist(1) == client.get(origin.url + "live.m3u8?_HLS_msn=5").body);
+	ASSERT(makePlaylist(1) == client.get(origin.url + "live.m3u8?_HLS_msn=6&_HLS_part=0").body);
+	ASSERT_EQUALS(400, client.get(origin.url + "live.m3u8?_HLS_msn=8").status);
+
+	// the request is held until the part is listed
+	std::atomic<bool> done { false };
+	Response r;
+	std::thread reader([&]() {
+		Client client;
+		r = client.get(origin.url + "live.m3u8?_HLS_msn=6&_HLS_part=1");
+		done = true;
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	ASSERT(!done);
+
+	push(origin.module.get(), "live.m3u8", makePlaylist(2), true);
+	reader.join();
+	ASSERT_EQUALS(200, r.status);
+	ASSERT(makePlaylist(2) == r.body);
+}
+
+unittest("HttpOrigin: LL-HLS delta updates") {
+	Origin origin;
+	auto const full = makePlaylist(0);
+	auto const delta = makePayload(100, 0);
+	push(origin.module.get(), "live.m3u8", full, true);
+	push(origin.module.get(), "live_delta.m3u8", delta, true);
+
+	Client client;
+	ASSERT(delta == client.get(origin.url + "live.m3u8?_HLS_skip=YES").body);
+	ASSERT(full == client.get(origin.url + "live.m3u8").body);
+
+	// without a delta playlist, the full one is served
+	push(origin.module.get(), "other.m3u8", full, true);
+	ASSERT(full == client.get(origin.url + "other.m3u8?_HLS_skip=YES").body);
+}
+
+secondclasstest("HttpOrigin: perf test, request latency") {
+	auto const REQUESTS = 10000;
+	Origin origin;
+	push(origin.module.get(), "live.mpd", makePayload(2000, 0), true);
+
+	Client client;
+	int64_t maxInUs = 0;
+	double elapsed;
+	{
+		Tools::Profiler p(format("%s requests on a keep-alive connection", REQUESTS));
+		for(int i=0; i < REQUESTS; ++i) {
+			auto const t0 = std::chrono::steady_clock::now();
+			ASSERT_EQUALS(2000u, client.get(origin.url + "live.mpd").body.size());
+			auto const latency = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count();
+			maxInUs = std::max<int64_t>(maxInUs, latency);
+		}
+		elapsed = p.elapsedInSeconds();
+	}
+	Report("Request latency, average", elapsed * 1e6 / REQUESTS, "us");
+	Report("Request latency, max", maxInUs, "us");
+}
+
+secondclasstest("HttpOrigin: perf test, concurrent clients throughput") {
+	auto const CLIENTS = 32;
+	auto const REQUESTS = 20;
+	auto const SEGMENT_SIZE = 4 * 1024 * 1024;
+
+	Origin origin;
+	for(int i=0; i < 4; ++i)
+		push(origin.module.get(), format("seg_%s.m4s", i), makePayload(SEGMENT_SIZE, i), true, IClock::Rate);
+
+	std::atomic<int64_t> bytes { 0 };
+	std::vector<double> clientRates(CLIENTS); // bytes/s
+	double elapsed;
+	{
+		Tools::Profiler p(format("%s clients, %s requests each", CLIENTS, REQUESTS));
+		std::vector<std::thread> clients;
+		for(int c=0; c < CLIENTS; ++c) {
+			clients.push_back(std::thread([&, c]() {
+				Client client;
+				int64_t received = 0;
+				auto const t0 = std::chrono::steady_clock::now();
+				for(int i=0; i < REQUESTS; ++i)
+					received += client.get(origin.url + format("seg_%s.m4s", (c + i) % 4)).body.size();
+				clientRates[c] = received / std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+				bytes += received;
+			}));
+		}
+		for(auto& t : clients)
+			t.join();
+		elapsed = p.elapsedInSeconds();
+	}
+	ASSERT_EQUALS((int64_t)CLIENTS * REQUESTS * SEGMENT_SIZE, bytes);
+
+	double totalRate = 0;
+	for(auto rate : clientRates)
+		totalRate += rate;
+	Report("Throughput", bytes * 8.0 / elapsed / 1e9, "Gbps");
+	Report("Throughput per client, average", totalRate / CLIENTS / (1024 * 1024), "MB/s");
+	Report("Throughput per client, min", *std::min_element(clientRates.begin(), clientRates.end()) / (1024 * 1024), "MB/s");
+}
+
+}
+#endif
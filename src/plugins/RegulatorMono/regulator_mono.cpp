@@ -5,6 +5,8 @@
 #include "lib_modules/utils/factory.hpp"
 #include "lib_modules/utils/helper.hpp"
 #include "lib_media/common/attributes.hpp"
+#include <algorithm> // max
+#include <cstdlib> // abs
 #include <thread>
 #include <chrono>
 
@@ -12,56 +14,111 @@ using namespace Modules;
 
 namespace {
 
+int64_t const NS = 1000000000;
+
 class RegulatorMono : public ModuleS {
 	public:
 		RegulatorMono(KHost* host, RegulatorMonoConfig &cfg)
-			: m_host(host), clock(cfg.clock), resyncAllowed(cfg.resyncAllowed) {
+			: m_host(host), clock(cfg.clock), resyncAllowed(cfg.resyncAllowed),
+			  bitrate(cfg.bitrate), burstInNs(cfg.bitrate ? cfg.burstSize * 8 * NS / cfg.bitrate : 0) {
+			enforce(cfg.bitrate >= 0, "RegulatorMono: invalid bitrate");
 			m_output = addOutput();
 		}
 
 		void processOne(Data data) override {
-			auto const timeTarget = data->get<DecodingTime>().time;
-			auto const timeNow = fractionToClock(clock->now());
-			auto const delayInMs = clockToTimescale(timeTarget - timeNow, 1000) - m_offsetInMs;
-			if (delayInMs > 0) {
-				if (resyncAllowed && delayInMs > FWD_TOLERANCE_IN_MS) {
-					m_host->log(Warning, format("forward discontinuity detected (%s ms)", delayInMs).c_str());
-					m_offsetInMs += delayInMs;
+			auto const timeTarget = clockToNs(data->get<DecodingTime>().time) - m_offsetInNs;
+
+			// batch releases when behind schedule: no clock read while the data is already due
+			if (timeTarget > m_now)
+				m_now = nowInNs();
+
+			auto const delayInNs = timeTarget - m_now;
+			if (delayInNs > 0) {
+				if (resyncAllowed && delayInNs > FWD_TOLERANCE_IN_MS * 1000000) {
+					m_host->log(Warning, format("forward discontinuity detected (%s ms)", delayInNs / 1000000).c_str());
+					m_offsetInNs += delayInNs;
 					return processOne(data);
 				}
 
-				if (delayInMs > REGULATION_TOLERANCE_IN_MS)
-					m_host->log(Debug, format("will sleep for %s ms", delayInMs).c_str());
-				std::this_thread::sleep_for(std::chrono::milliseconds(delayInMs));
-			} else if (delayInMs < -REGULATION_TOLERANCE_IN_MS) {
-				if (resyncAllowed && delayInMs < -BWD_TOLERANCE_IN_MS) {
-					m_host->log(Warning, format("backward discontinuity detected (%s ms)", -delayInMs).c_str());
-					m_offsetInMs += delayInMs;
+				if (delayInNs > REGULATION_TOLERANCE_IN_MS * 1000000)
+					m_host->log(Debug, format("will sleep for %s ms", delayInNs / 1000000).c_str());
+			} else if (delayInNs < -REGULATION_TOLERANCE_IN_MS * 1000000) {
+				if (resyncAllowed && delayInNs < -BWD_TOLERANCE_IN_MS * 1000000) {
+					m_host->log(Warning, format("backward discontinuity detected (%s ms)", -delayInNs / 1000000).c_str());
+					m_offsetInNs += delayInNs;
 					return processOne(data);
 				}
 
-				if (-delayInMs > std::abs(m_lastDelayInMs)) {
+				if (-delayInNs > std::abs(m_lastDelayInNs)) {
 					char msg[256];
-					sprintf(msg, "late data (%.2fs)", -delayInMs/1000.0);
+					sprintf(msg, "late data (%.2fs)", -delayInNs/double(NS));
 					m_host->log(Warning, msg);
 				}
 			}
-			m_lastDelayInMs = delayInMs;
+			m_lastDelayInNs = delayInNs;
+
+			// token bucket (GCRA): 'm_tat' is when the bucket will be full again
+			auto const sizeInNs = bitrate ? (int64_t)data->data().len * 8 * NS / bitrate : 0;
+			auto const releaseTime = bitrate ? std::max(timeTarget, m_tat + sizeInNs - burstInNs) : timeTarget;
+
+			if (releaseTime > m_now)
+				m_now = waitUntil(releaseTime);
+
+			if (bitrate)
+				m_tat = std::max(m_tat, std::max(releaseTime, m_now)) + sizeInNs;
+
 			m_output->post(data);
 		}
 
 	private:
+		int64_t nowInNs() const {
+			return fractionToTimescale(clock->now(), NS);
+		}
+
+		static int64_t clockToNs(int64_t time) {
+			return (time / IClock::Rate) * NS + (time % IClock::Rate) * NS / IClock::Rate;
+		}
+
+		// sleep, then spin for the last part: sleep_for() overshoots.
+		// An injected clock may not advance on its own: if it stalls, sleep for what remains.
+		int64_t waitUntil(int64_t timeInNs) const {
+			auto now = nowInNs();
+			if (timeInNs - now > SPIN_IN_NS) {
+				std::this_thread::sleep_for(std::chrono::nanoseconds(timeInNs - now - SPIN_IN_NS));
+				now = nowInNs();
+			}
+			int stalledReads = 0;
+			while (now < timeInNs) {
+				auto const prev = now;
+				now = nowInNs();
+				if (now != prev) {
+					stalledReads = 0;
+				} else if (++stalledReads > MAX_STALLED_READS) {
+					std::this_thread::sleep_for(std::chrono::nanoseconds(timeInNs - now));
+					return nowInNs();
+				}
+			}
+			return now;
+		}
+
 		KHost* const m_host;
 		KOutput* m_output;
-		int64_t m_lastDelayInMs = 0, m_offsetInMs = 0;
+		int64_t m_lastDelayInNs = 0, m_offsetInNs = 0;
+		int64_t m_now = INT64_MIN; // last clock read
+		int64_t m_tat = INT64_MIN / 2; // token bucket: theoretical arrival time
 
 		std::shared_ptr<IClock> const clock;
 
 		static auto const REGULATION_TOLERANCE_IN_MS = 300;
+		static auto const SPIN_IN_NS = 200 * 1000LL;
+		static auto const MAX_STALLED_READS = 1000;
 
 		bool resyncAllowed;
-		static auto const FWD_TOLERANCE_IN_MS = 20000;
-		static auto const BWD_TOLERANCE_IN_MS = 6000;
+		static auto const FWD_TOLERANCE_IN_MS = 20000LL;
+		static auto const BWD_TOLERANCE_IN_MS = 6000LL;
+
+		int64_t const bitrate;
+		int64_t const burstInNs;
 };
 
 IModule* createObject(KHost* host, void* va) {
@@ -73,4 +130,3 @@ IModule* createObject(KHost* host, void* va) {
 
 auto const registered = Factory::registerModule("RegulatorMono", &createObject);
 }
-
@@ -5,4 +5,9 @@
 struct RegulatorMonoConfig {
 	std::shared_ptr<IClock> clock = g_SystemClock;
 	bool resyncAllowed = true;
+
+	// token-bucket smoothing, in bits per second (0: disabled).
+	// The data never leaves faster than this, except for bursts of up to 'burstSize' bytes.
+	int64_t bitrate = 0;
+	int burstSize = 7 * 188;
 };
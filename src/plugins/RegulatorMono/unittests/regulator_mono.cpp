@@ -0,0 +1,156 @@
+#include "tests/tests.hpp"
+#include "lib_modules/modules.hpp"
+#include "lib_modules/utils/loader.hpp"
+#include "lib_media/common/attributes.hpp"
+#include "lib_utils/sysclock.hpp"
+#include <plugins/RegulatorMono/regulator_mono.hpp>
+#include <algorithm> // sort
+#include <chrono>
+#include <cstdlib> // abs
+#include <functional>
+#include <vector>
+
+using namespace std;
+using namespace Tests;
+using namespace Modules;
+
+namespace {
+
+auto const PACKET_SIZE = 7 * 188;
+
+// counts the clock reads
+struct CountingClock : IClock {
+	Fraction now() const override {
+		++reads;
+		return clock.now();
+	}
+	SystemClock clock { 1.0 };
+	mutable int reads = 0;
+};
+
+// never advances
+struct FrozenClock : IClock {
+	Fraction now() const override {
+		return Fraction(0, 1);
+	}
+};
+
+// advances by 1us on each read: the release times don't depend on how loaded the host is
+struct SteppingClock : IClock {
+	Fraction now() const override {
+		timeInNs += 1000;
+		return Fraction(timeInNs, 1000000000);
+	}
+	mutable int64_t timeInNs = 0;
+};
+
+int64_t nowInNs() {
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// release times, in ns
+vector<int64_t> regulate(RegulatorMonoConfig cfg, int count, int64_t intervalInNs, function<int64_t()> now = nowInNs) {
+	auto reg = loadModule("RegulatorMono", &NullHost, &cfg);
+
+	vector<int64_t> times;
+	ConnectOutput(reg->getOutput(0), [&](Data) {
+		times.push_back(now());
+	});
+
+	for(int i=0; i < count; ++i) {
+		auto pkt = make_shared<DataRaw>(PACKET_SIZE);
+		pkt->set(DecodingTime{ timescaleToClock(i * intervalInNs, 1000000000) });
+		reg->getInput(0)->push(pkt);
+	}
+
+	return times;
+}
+
+struct Jitter {
+	int64_t p50, p99, max; // deviation from the expected interval, in ns
+};
+
+Jitter measureJitter(vector<int64_t> const& times, int64_t intervalInNs) {
+	vector<int64_t> deviations;
+	for(size_t i=1; i < times.size(); ++i)
+		deviations.push_back(abs(times[i] - times[i-1] - intervalInNs));
+	sort(deviations.begin(), deviations.end());
+	return { deviations[deviations.size() / 2], deviations[deviations.size() * 99 / 100], deviations.back() };
+}
+
+unittest("RegulatorMono: sub-millisecond pacing") {
+	auto const interval = 500 * 1000LL;
+
+	auto clock = make_shared<SteppingClock>();
+	RegulatorMonoConfig cfg;
+	cfg.clock = clock;
+	auto const times = regulate(cfg, 200, interval, [&]() {
+		return clock->timeInNs;
+	});
+
+	ASSERT_EQUALS(200, (int)times.size());
+	auto const duration = times.back() - times.front();
+	// the first packet is due at the first clock read: it leaves one step late
+	ASSERT(abs(duration - 199 * interval) <= 2 * 1000);
+	ASSERT(measureJitter(times, interval).max <= 2 * 1000);
+}
+
+unittest("RegulatorMono: token bucket smooths bursts") {
+	auto clock = make_shared<SteppingClock>();
+	RegulatorMonoConfig cfg;
+	cfg.clock = clock;
+	cfg.bitrate = PACKET_SIZE * 8 * 1000; // one packet per ms
+	cfg.burstSize = PACKET_SIZE;
+
+	// all the packets have the same timestamp
+	auto const times = regulate(cfg, 100, 0, [&]() {
+		return clock->timeInNs;
+	});
+
+	ASSERT_EQUALS(100, (int)times.size());
+	auto const duration = times.back() - times.front();
+	ASSERT(duration >= 99 * 1000 * 1000LL && duration < 99 * 1000 * 1000LL + 100 * 1000);
+	ASSERT(measureJitter(times, 1000 * 1000).max <= 2 * 1000);
+}
+
+unittest("RegulatorMono: late data is released in a batch") {
+	auto clock = make_shared<CountingClock>();
+	RegulatorMonoConfig cfg;
+	cfg.clock = clock;
+
+	// all due at once
+	auto const times = regulate(cfg, 1000, 0);
+
+	ASSERT_EQUALS(1000, (int)times.size());
+	ASSERT(times.back() - times.front() < 50 * 1000 * 1000LL);
+	ASSERT(clock->reads < 10);
+}
+
+unittest("RegulatorMono: a clock that doesn't advance doesn't stall the output") {
+	RegulatorMonoConfig cfg;
+	cfg.clock = make_shared<FrozenClock>();
+
+	// due 1ms ahead of the clock, forever
+	auto const times = regulate(cfg, 10, 1000 * 1000LL);
+
+	ASSERT_EQUALS(10, (int)times.size());
+	ASSERT(times.back() - times.front() < 1000 * 1000 * 1000LL);
+}
+
+secondclasstest("RegulatorMono: perf test, inter-packet jitter") {
+	for(auto interval : { 200 * 1000LL, 1000 * 1000LL }) {
+		RegulatorMonoConfig cfg;
+		cfg.clock = make_shared<SystemClock>(1.0);
+		auto const times = regulate(cfg, 2000, interval);
+		auto const j = measureJitter(times, interval);
+		auto const name = to_string(interval / 1000) + "us interval jitter";
+		Report(name + " p50", j.p50 / 1000.0, "us");
+		Report(name + " p99", j.p99 / 1000.0, "us");
+		Report(name + " max", j.max / 1000.0, "us");
+		// after a scheduling stall, the late packets leave back-to-back: one interval off each
+		ASSERT(j.p50 < 20 * 1000);
+		ASSERT(j.p99 < 2 * interval);
+	}
+}
+
+}
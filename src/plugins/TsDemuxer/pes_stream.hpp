@@ -7,7 +7,8 @@
 #include "lib_media/common/attributes.hpp"
 #include <vector>
 #include <cstring> // memcpy
-#include <utility> // exchange
+#include <algorithm> // min, max
+#include <atomic>
 
 Metadata createMetadata(int mpegStreamType) {
 	auto make = [](Modules::StreamType majorType, const char* codecName) {
@@ -41,89 +42,164 @@ Metadata createMetadata(int mpegStreamType) {
 	}
 }
 
+// A view on a part of another buffer: allows to output data without copying it.
+struct BufferSlice : Modules::IBuffer {
+	BufferSlice(std::shared_ptr<IBuffer> parent_, SpanC slice_, std::shared_ptr<std::atomic<int>> liveCount_)
+		: parent(parent_), slice(slice_), liveCount(liveCount_) {
+		(*liveCount)++;
+	}
+
+	~BufferSlice() {
+		(*liveCount)--;
+	}
+
+	Span data() override {
+		return { const_cast<uint8_t*>(slice.ptr), slice.len };
+	}
+
+	SpanC data() const override {
+		return slice;
+	}
+
+private:
+	std::shared_ptr<IBuffer> const parent; // keeps the memory alive
+	SpanC const slice;
+	std::shared_ptr<std::atomic<int>> const liveCount;
+};
+
+// PES reassembly: the payload is copied once, straight into the output buffer,
+// which is pre-sized from PES_packet_length (or from the previous PES size).
+// A PES lying in one single TS packet is output without any copy (it references
+// the input buffer), provided no other such output is still alive downstream:
+// we don't want to hold the input buffers indefinitely, as the upstream allocators may block.
 struct PesStream : Stream {
 		struct IRestamper {
 			virtual void restamp(int64_t& time) = 0;
 		};
 
-		struct MyVector {
-				MyVector(int reservedSize) {
-					m_vector.resize(reservedSize);
-				}
-				MyVector(MyVector &&src) : m_vector(std::move(src.m_vector)), m_size(std::exchange(src.m_size, 0)) {}
-				size_t size() const {
-					return m_size;
-				}
-				bool empty() const {
-					return m_size == 0;
-				}
-				void insert(uint8_t const * const ptr, size_t len) {
-					auto const sz = size();
-					resize(sz + len);
-					memcpy(&m_vector[sz], ptr, len);
-				}
-				void resize(size_t size) {
-					m_size = size;
-					// only resize to a bigger size
-					if (size > m_vector.size())
-						m_vector.resize(size);
-				}
-				uint8_t& operator[] (int i) {
-					return m_vector[i];
-				}
-				const uint8_t* data() const {
-					return m_vector.data();
-				}
-				void clear() {
-					// don't reset the vector
-					m_size = 0;
-				}
-
-			private:
-				std::vector<uint8_t> m_vector;
-				size_t m_size = 0;
-		};
-
 		PesStream(int pid_, int type_, IRestamper* restamper_, KHost* host, OutputDefault* output_) :
-			Stream(pid_, host), type(type_), m_restamper(restamper_), m_output(output_), m_pesBuffer(256*1024) {
+			Stream(pid_, host), type(type_), m_restamper(restamper_), m_output(output_) {
 			if(type == TsDemuxerConfig::VIDEO)
 				m_output->setMetadata(make_shared<MetadataPkt>(VIDEO_PKT));
 			else
 				m_output->setMetadata(make_shared<MetadataPkt>(AUDIO_PKT));
 		}
 
-		void push(SpanC data, bool pusi) override {
+		void push(SpanC data, bool pusi, Data const& owner) override {
+			if(pusi)
+				m_started = true;
+
 			// if we missed the start of the PES packet ...
-			if(!pusi && m_pesBuffer.empty())
+			if(!m_started)
 				return; // ... discard the rest
 
-			m_pesBuffer.insert(data.ptr, data.len);
-
-			// try to early-parse PES_packet_length
-			if(m_pesBuffer.size() >= 6) {
-				auto PES_packet_length = (m_pesBuffer[4] << 8) + m_pesBuffer[5];
-				if(PES_packet_length > 0 && (int)m_pesBuffer.size() >= PES_packet_length + 6) {
-					m_pesBuffer.resize(6 + PES_packet_length);
-					flush();
+			if(!m_headerParsed) {
+				auto const prevHeaderSize = m_header.size();
+				SpanC header = data;
+				if(prevHeaderSize > 0 || !parseHeader(header)) {
+					// the PES header is split across TS packets (unlikely)
+					m_header.insert(m_header.end(), data.begin(), data.end());
+					header = {m_header.data(), m_header.size()};
+					if(!parseHeader(header))
+						return; // wait for more data
 				}
+
+				// the end of the header is in 'data'
+				data += m_headerSize - prevHeaderSize;
+				m_header.clear();
 			}
+
+			if(m_payloadSize >= 0)
+				data.len = min<size_t>(data.len, m_payloadSize - m_received);
+
+			addFragment(data, owner);
+
+			if(m_payloadSize >= 0 && m_received == (size_t)m_payloadSize)
+				flush();
 		}
 
 		void flush() override {
-			if(m_pesBuffer.empty())
+			if(!m_started)
 				return; // nothing to flush
 
+			if(!m_headerParsed) {
+				clear();
+				throw runtime_error(format("[%s] truncated PES packet", pid));
+			}
+
+			Data payload;
+			if(m_owner && *m_liveSlices == 0) {
+				// zero copy
+				auto buf = m_output->allocData<DataRaw>(0);
+				buf->buffer = make_shared<BufferSlice>(m_owner->buffer, m_firstFragment, m_liveSlices);
+				payload = buf;
+			} else {
+				appendFirstFragment();
+				if(!m_pes)
+					m_pes = m_output->allocData<DataRawResizable>(0);
+				m_pes->resize(m_pesSize);
+				payload = m_pes;
+			}
+
+			auto buf = const_pointer_cast<DataBase>(payload);
+
+			if(m_PTS_DTS_indicator & 0b10) {
+				auto pts = m_pts;
+				m_restamper->restamp(pts);
+				int64_t presentationTime = timescaleToClock(pts, 90000); // PTS are in 90kHz units
+				buf->set(PresentationTime {presentationTime});
+			}
+			{
+				auto dts = m_dts;
+				m_restamper->restamp(dts);
+				int64_t decodingTime = timescaleToClock(dts, 90000); // DTS are in 90kHz units
+				buf->set(DecodingTime {decodingTime});
+			}
+			buf->set(CueFlags{ discontinuity, rap, true });
+
+			m_lastPayloadSize = m_received;
+			clear();
+			discontinuity = false;
+			rap = false;
+
+			m_output->post(buf);
+		}
+
+		bool reset() override {
+			if(!m_started)
+				return false;
+
+			clear();
+			discontinuity = true;
+			return true;
+		}
+
+		bool setType(int mpegStreamType) {
+			auto meta = createMetadata(mpegStreamType);
+			if(!meta)
+				return false;
+
+			m_output->setMetadata(meta);
+			return true;
+		}
+
+		int type;
+	private:
+		// returns false if more data is needed
+		bool parseHeader(SpanC data) {
+			auto const PES_HEADER_SIZE = 9;
+			if(data.len < PES_HEADER_SIZE)
+				return false;
+
 			try {
-				BitReader r = {SpanC(m_pesBuffer.data(), m_pesBuffer.size())};
-				if(m_pesBuffer.size() < 3)
-					throw runtime_error(format("[%s] truncated PES packet", pid));
+				BitReader r = {data};
 
 				auto const start_code_prefix = r.u(24);
 				if(start_code_prefix != 0x000001)
 					throw runtime_error(format("[%s] invalid PES start code (%s)", pid, start_code_prefix));
 
 				/*auto const stream_id =*/ r.u(8);
-				/*auto const pes_packet_length =*/ r.u(16);
+				auto const PES_packet_length = r.u(16);
 
 				// optional PES header
 				auto const markerBits = r.u(2);
@@ -149,11 +225,13 @@ struct PesStream : Stream {
 					throw runtime_error("discarding scrambled PES packet");
 
 				if(PES_header_data_length > r.remaining())
-					throw runtime_error("Invalid PES_header_data_length");
+					return false;
 
 				int64_t pts = 0;
 
 				if(PTS_DTS_indicator & 0b10) {
+					if(PES_header_data_length < 5)
+						throw runtime_error("Invalid PES_header_data_length");
 					/*auto const reservedBits =*/ r.u(4); // 0b0010
 					pts |= r.u(3); // PTS [32..30]
 					/*auto marker_bit0 =*/ r.u(1);
@@ -168,6 +246,8 @@ struct PesStream : Stream {
 				int64_t dts = pts;
 
 				if(PTS_DTS_indicator & 0b01) {
+					if(PES_header_data_length < 10)
+						throw runtime_error("Invalid PES_header_data_length");
 					dts = 0;
 					/*auto const reservedBits =*/ r.u(4); // 0b0010
 					dts |= r.u(3); // DTS [32..30]
@@ -180,59 +260,92 @@ struct PesStream : Stream {
 					/*auto marker_bit2 =*/ r.u(1);
 				}
 
-				// skip extra remaining headers
-				while(r.byteOffset() < PES_header_data_end)
-					r.u(8);
-
-				auto pesPayloadSize = m_pesBuffer.size() - r.byteOffset();
-				auto buf = m_output->allocData<DataRaw>(pesPayloadSize);
-
-				if(PTS_DTS_indicator & 0b10) {
-					m_restamper->restamp(pts);
-					int64_t presentationTime = timescaleToClock(pts, 90000); // PTS are in 90kHz units
-					buf->set(PresentationTime {presentationTime});
+				m_headerParsed = true;
+				m_headerSize = PES_header_data_end;
+				m_PTS_DTS_indicator = PTS_DTS_indicator;
+				m_pts = pts;
+				m_dts = dts;
+
+				// pre-size from PES_packet_length when present (usually not for video)
+				m_payloadSize = -1;
+				if(PES_packet_length > 0) {
+					m_payloadSize = PES_packet_length + 6 - m_headerSize;
+					if(m_payloadSize < 0)
+						throw runtime_error("Invalid PES_packet_length");
 				}
-				{
-					m_restamper->restamp(dts);
-					int64_t decodingTime = timescaleToClock(dts, 90000); // DTS are in 90kHz units
-					buf->set(DecodingTime {decodingTime});
-				}
-				buf->set(CueFlags{ discontinuity, rap, true });
-				memcpy(buf->buffer->data().ptr, m_pesBuffer.data()+r.byteOffset(), pesPayloadSize);
-				m_output->post(buf);
 
-				m_pesBuffer.clear();
-				discontinuity = false;
-				rap = false;
+				return true;
 			} catch (const std::runtime_error &e) {
-				m_pesBuffer.clear();
+				clear();
 				throw(e);
 			}
 		}
 
-		bool reset() override {
-			if(m_pesBuffer.empty())
-				return false;
+		void addFragment(SpanC data, Data const& owner) {
+			if(data.len == 0)
+				return;
 
-			m_pesBuffer.clear();
-			discontinuity = true;
-			return true;
+			m_received += data.len;
+
+			if(owner && !m_pes && !m_owner) {
+				// first fragment: don't copy it yet
+				m_owner = owner;
+				m_firstFragment = data;
+				return;
+			}
+
+			appendFirstFragment();
+			append(data);
 		}
 
-		bool setType(int mpegStreamType) {
-			auto meta = createMetadata(mpegStreamType);
-			if(!meta)
-				return false;
+		void appendFirstFragment() {
+			if(!m_owner)
+				return;
+			append(m_firstFragment);
+			m_owner = nullptr;
+		}
 
-			m_output->setMetadata(meta);
-			return true;
+		void append(SpanC data) {
+			if(!m_pes) {
+				auto capacity = m_payloadSize >= 0 ? (size_t)m_payloadSize : max(m_received * 2, m_lastPayloadSize);
+				m_pes = m_output->allocData<DataRawResizable>(max(capacity, m_pesSize + data.len));
+			} else if(m_pesSize + data.len > m_pes->data().len) {
+				m_pes->resize(max(m_pesSize + data.len, m_pes->data().len * 2));
+			}
+
+			memcpy(m_pes->buffer->data().ptr + m_pesSize, data.ptr, data.len);
+			m_pesSize += data.len;
+		}
+
+		void clear() {
+			m_started = false;
+			m_headerParsed = false;
+			m_header.clear();
+			m_owner = nullptr;
+			m_pes = nullptr;
+			m_pesSize = 0;
+			m_received = 0;
 		}
 
-		int type;
-	private:
 		IRestamper * const m_restamper;
 		OutputDefault * const m_output = nullptr;
-		MyVector m_pesBuffer;
 		bool discontinuity = false;
-};
 
+		// current PES packet
+		bool m_started = false;
+		bool m_headerParsed = false;
+		vector<uint8_t> m_header; // only used when the PES header is split across TS packets
+		int m_headerSize = 0;
+		int m_PTS_DTS_indicator = 0;
+		int64_t m_pts = 0, m_dts = 0;
+		int64_t m_payloadSize = -1; // from PES_packet_length, -1 if unbounded
+		size_t m_received = 0; // payload bytes
+
+		// payload: the first fragment references 'm_owner', the next ones are copied to 'm_pes'
+		Data m_owner;
+		SpanC m_firstFragment;
+		shared_ptr<DataRawResizable> m_pes;
+		size_t m_pesSize = 0;
+		size_t m_lastPayloadSize = 0; // to pre-size unbounded PES
+		shared_ptr<atomic<int>> m_liveSlices = make_shared<atomic<int>>(0);
+};
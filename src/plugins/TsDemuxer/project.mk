@@ -3,4 +3,5 @@ PLUG_DIR:=$(call get-my-dir)
 TARGETS+=$(BIN)/TsDemuxer.smd
 $(BIN)/TsDemuxer.smd: \
   $(BIN)/$(PLUG_DIR)/ts_demuxer.cpp.o\
+  $(BIN)/$(SRC)/lib_media/common/crc.cpp.o\
 
@@ -2,6 +2,8 @@
 #pragma once
 
 #include "stream.hpp"
+#include "lib_media/common/crc.hpp"
+#include <cstring> // memcmp
 #include <vector>
 
 auto const TABLE_ID_PAT = 0;
@@ -21,13 +23,14 @@ struct PsiStream : Stream {
 
 		struct Listener {
 			virtual void onPat(span<int> pmtPids) = 0;
-			virtual void onPmt(span<EsInfo> esInfo) = 0;
+			virtual void onPmt(int pmtPid, span<EsInfo> esInfo) = 0;
+			virtual void onInvalidCrc(int pid, int tableId) = 0;
 		};
 
 		PsiStream(int pid_, KHost* host, Listener* listener_) : Stream(pid_, host), m_host(host), listener(listener_) {
 		}
 
-		void push(SpanC data, bool pusi) override {
+		void push(SpanC data, bool pusi, Data const& /*owner*/) override {
 			BitReader r = {data};
 			if(pusi) {
 				int pointerField = r.u(8);
@@ -49,36 +52,50 @@ struct PsiStream : Stream {
 			/*auto const reserved1 =*/ r.u(2);
 			auto /*const*/ section_length = r.u(12);
 
+			auto const crcSize = 4;
 			auto sectionStart = r.byteOffset();
-			if(r.remaining() < section_length)
+			if(r.remaining() < section_length || section_length < PSI_HEADER_SIZE - sectionStart + crcSize)
 				throw runtime_error("Invalid section_length in PSI header");
 
 			/*auto const table_id_extension =*/ r.u(16);
 			/*auto const reserved2 =*/ r.u(2);
 			/*auto const version_number =*/ r.u(5);
-			/*auto const current_next_indicator =*/ r.u(1);
+			auto const current_next_indicator = r.u(1);
 			/*auto const section_number =*/ r.u(8);
 			/*auto const last_section_number =*/ r.u(8);
 
 			assert(PSI_HEADER_SIZE == r.byteOffset());
 
-			auto const crcSize = 4;
+			if(!current_next_indicator)
+				return; // not applicable yet
+
+			// PSI tables are repeated every ~100ms: skip unchanged sections
+			auto const sectionEnd = sectionStart + section_length;
+			auto const section = SpanC { r.src.ptr, (size_t)sectionEnd };
+			if(section.len == m_lastSection.size() && memcmp(section.ptr, m_lastSection.data(), section.len) == 0)
+				return;
+
+			if(Crc32(section) != 0) {
+				listener->onInvalidCrc(pid, table_id);
+				return;
+			}
 
 			switch(table_id) {
 			case TABLE_ID_PAT: {
-				while (r.byteOffset() < sectionStart + section_length - crcSize) {
+				vector<int> pmtPids;
+
+				while (r.byteOffset() < sectionEnd - crcSize) {
 					auto const program_number = r.u(16);
 					/*auto const reserved3 =*/ r.u(3);
 					if (program_number == 0) {
 						/*auto const network_pid = */r.u(13);
 					} else {
 						auto const program_map_pid = r.u(13);
-
-						int pids[] = { program_map_pid };
-						listener->onPat(pids);
+						pmtPids.push_back(program_map_pid);
 					}
 				}
 
+				listener->onPat({pmtPids.data(), pmtPids.size()});
 				break;
 			}
 			case TABLE_ID_PMT: {
@@ -91,7 +108,7 @@ struct PsiStream : Stream {
 
 				vector<EsInfo> info;
 
-				while(r.byteOffset() < sectionStart + section_length - crcSize) {
+				while(r.byteOffset() < sectionEnd - crcSize) {
 					// Elementary stream info
 					auto stream_type = r.u(8);
 					/*auto const reserved5 =*/ r.u(3);
@@ -115,13 +132,13 @@ struct PsiStream : Stream {
 					info.push_back({ pid, stream_type });
 				}
 
-				listener->onPmt({info.data(), info.size()});
+				listener->onPmt(pid, {info.data(), info.size()});
 				break;
 			}
 			break;
 			}
 
-			/*auto const crc32 = r.u(crcSize * 8);*/
+			m_lastSection.assign(section.ptr, section.ptr + section.len);
 		}
 
 		void flush() override {
@@ -134,5 +151,8 @@ struct PsiStream : Stream {
 	private:
 		KHost* const m_host;
 		Listener* const listener;
+
+		// last successfully parsed section
+		vector<uint8_t> m_lastSection;
 };
 
@@ -9,7 +9,9 @@ struct Stream {
 	virtual ~Stream() = default;
 
 	// send data for processing
-	virtual void push(SpanC data, bool pusi) = 0;
+	// 'owner' is the input buffer 'data' points into (or null for a temporary buffer):
+	// the stream may keep a reference to it instead of copying 'data'.
+	virtual void push(SpanC data, bool pusi, Modules::Data const& owner) = 0;
 
 	// tell the stream when the payload unit is finished (e.g PUSI=1 or EOS)
 	virtual void flush() = 0;
@@ -0,0 +1,388 @@
+// TR 101 290 measurements (priority 1 and 2) on the raw TS packets.
+//
+// The work per packet is O(1): the timing checks use byte positions in the
+// stream, converted to 27MHz ticks with the transport rate estimated from the PCRs.
+// The results are published to the host statistics once per second of
+// stream time, and on flush. The bitrates of the first PIDs seen are published
+// in a configurable number of slots: "pid<i>" holds the PID, "pid<i>_kbps" its bitrate.
+// All the statistics entries are registered at construction: the host registry
+// is shared and fixed-size, so keep 'pidStats' small.
+#pragma once
+
+#include <algorithm> // find
+#include <cstdlib> // llabs
+#include <map>
+#include <vector>
+
+struct TsAnalyzer {
+		enum Counter {
+			SYNC_LOSS, // 1.1, 1.2
+			PAT_ERROR, // 1.3
+			CC_ERROR, // 1.4
+			PMT_ERROR, // 1.5
+			PID_ERROR, // 1.6
+			TRANSPORT_ERROR, // 2.1
+			CRC_ERROR, // 2.2
+			PCR_REPETITION_ERROR, // 2.3a
+			PCR_DISCONTINUITY_ERROR, // 2.3b
+			PCR_ACCURACY_ERROR, // 2.4
+			PCR_ACCURACY_MAX_NS,
+			PAT_INTERVAL_MAX_MS,
+			PMT_INTERVAL_MAX_MS,
+			BITRATE_KBPS,
+			COUNTER_COUNT
+		};
+
+		TsAnalyzer(KHost* host, int pidStats) : m_host(host), m_pids(MAX_PID), m_pidSlots(pidStats) {
+			static const char* const names[COUNTER_COUNT] = {
+				"sync_loss",
+				"pat_error",
+				"cc_error",
+				"pmt_error",
+				"pid_error",
+				"transport_error",
+				"crc_error",
+				"pcr_repetition_error",
+				"pcr_discontinuity_error",
+				"pcr_accuracy_error",
+				"pcr_accuracy_max_ns",
+				"pat_interval_max_ms",
+				"pmt_interval_max_ms",
+				"bitrate_kbps",
+			};
+
+			for(int i=0; i < COUNTER_COUNT; ++i)
+				m_entries[i] = m_host->getStatsEntry(names[i]);
+
+			for(int i=0; i < pidStats; ++i) {
+				m_pidSlots[i].pid = m_host->getStatsEntry(format("pid%s", i).c_str());
+				m_pidSlots[i].bitrate = m_host->getStatsEntry(format("pid%s_kbps", i).c_str());
+				if(m_pidSlots[i].pid)
+					*m_pidSlots[i].pid = -1;
+			}
+
+			setRole(0, PAT);
+		}
+
+		void onPacket(const uint8_t* pkt) {
+			auto const pid = ((pkt[1] & 0x1f) << 8) | pkt[2];
+			auto& st = m_pids[pid];
+
+			if(!st.packets++)
+				m_activePids.push_back(pid);
+
+			st.lastPacket = m_pos;
+			if(st.role == ES)
+				st.late = false;
+
+			if(pkt[1] & 0x80)
+				m_counters[TRANSPORT_ERROR]++;
+
+			auto const adaptationFieldControl = (pkt[3] >> 4) & 0b11;
+			auto const afLength = (adaptationFieldControl & 0b10) ? pkt[4] : 0;
+			bool discontinuity = false;
+			if(afLength > 0 && afLength <= PACKET_SIZE - 5) {
+				discontinuity = pkt[5] & 0x80;
+				if((pkt[5] & 0x10) && afLength >= 7)
+					onPcr(st, pid, readPcr(pkt + 6), discontinuity);
+			}
+
+			if(pid != NULL_PID)
+				checkContinuity(st, pkt[3] & 0x0f, adaptationFieldControl & 0b01, discontinuity);
+
+			if(st.role == PAT || st.role == PMT)
+				checkPsi(st, pkt, adaptationFieldControl);
+
+			m_pos += PACKET_SIZE;
+			if(m_pos >= m_nextReport)
+				report();
+		}
+
+		void onSyncLoss() {
+			m_counters[SYNC_LOSS]++;
+		}
+
+		// bytes discarded while looking for the sync
+		void onSkip(int64_t bytes) {
+			m_pos += bytes;
+		}
+
+		void onCrcError() {
+			m_counters[CRC_ERROR]++;
+		}
+
+		void onPat(span<int> pmtPids) {
+			for(auto pid : m_pmtPids)
+				setRole(pid, OTHER);
+
+			m_pmtPids.clear();
+			for(auto pid : pmtPids) {
+				setRole(pid, PMT);
+				m_pmtPids.push_back(pid);
+			}
+
+			// the programs that left the PAT
+			for(auto i = m_programEsPids.begin(); i != m_programEsPids.end();) {
+				if(!contains(m_pmtPids, i->first))
+					i = m_programEsPids.erase(i);
+				else
+					++i;
+			}
+			updateEsPids();
+		}
+
+		void onPmt(int pmtPid, span<PsiStream::EsInfo> esInfo) {
+			auto& esPids = m_programEsPids[pmtPid];
+			esPids.clear();
+			for(auto es : esInfo)
+				esPids.push_back(es.pid);
+			updateEsPids();
+		}
+
+		void flush() {
+			if(m_ticksPerByte > 0)
+				report();
+			else
+				publish();
+		}
+
+	private:
+		enum Role : uint8_t { OTHER, PAT, PMT, ES };
+
+		struct PidState {
+			int64_t lastPacket = -1; // stream positions, in bytes
+			int64_t lastSection = -1;
+			int64_t lastPcrPos = -1;
+			int64_t lastPcr = -1; // 27MHz
+			int slot = -1; // index in 'm_pidSlots'
+			uint32_t packets = 0; // in the current report window
+			int8_t cc = -1;
+			Role role = OTHER;
+			bool duplicate = false; // the last packet was a duplicate
+			bool late = false; // already reported as missing
+		};
+
+		struct PidSlot {
+			int32_t* pid = nullptr;
+			int32_t* bitrate = nullptr;
+		};
+
+		static auto const MAX_PID = 8192;
+		static auto const NULL_PID = 0x1FFF;
+		static auto const PACKET_SIZE = 188;
+
+		static constexpr int64_t PCR_HZ = 27000000;
+		static constexpr int64_t PCR_WRAP = (1LL << 33) * 300;
+		static constexpr int64_t PSI_INTERVAL_MAX = PCR_HZ / 2;
+		static constexpr int64_t PID_INTERVAL_MAX = PCR_HZ * 5;
+		static constexpr int64_t PCR_REPETITION_MAX = PCR_HZ / 25;
+		static constexpr int64_t PCR_DISCONTINUITY_MAX = PCR_HZ / 10;
+		static constexpr int64_t PCR_ACCURACY_MAX = 500; // ns
+
+		static int64_t readPcr(const uint8_t* p) {
+			auto const base = ((int64_t)p[0] << 25) | (p[1] << 17) | (p[2] << 9) | (p[3] << 1) | (p[4] >> 7);
+			auto const ext = ((p[4] & 1) << 8) | p[5];
+			return base * 300 + ext;
+		}
+
+		int64_t toTicks(int64_t bytes) const {
+			return (int64_t)(bytes * m_ticksPerByte);
+		}
+
+		static bool contains(std::vector<int> const& pids, int pid) {
+			return std::find(pids.begin(), pids.end(), pid) != pids.end();
+		}
+
+		// the elementary streams listed by the current PMTs
+		void updateEsPids() {
+			std::vector<int> esPids;
+			for(auto& program : m_programEsPids)
+				for(auto pid : program.second)
+					if(!contains(esPids, pid))
+						esPids.push_back(pid);
+
+			for(auto pid : m_esPids)
+				if(!contains(esPids, pid))
+					setRole(pid, OTHER);
+			for(auto pid : esPids)
+				setRole(pid, ES);
+			m_esPids = std::move(esPids);
+		}
+
+		void setRole(int pid, Role role) {
+			auto& st = m_pids[pid];
+			if(st.role == role)
+				return;
+			st.role = role;
+			st.late = false;
+			// the deadlines start now
+			st.lastSection = m_pos;
+			if(st.lastPacket < 0)
+				st.lastPacket = m_pos;
+		}
+
+		void checkContinuity(PidState& st, int cc, bool hasPayload, bool discontinuity) {
+			if(st.cc >= 0 && !discontinuity) {
+				if(!hasPayload) {
+					if(cc != st.cc)
+						m_counters[CC_ERROR]++;
+				} else if(cc == st.cc) {
+					// a packet may be sent twice, not more
+					if(st.duplicate)
+						m_counters[CC_ERROR]++;
+					st.duplicate = true;
+				} else {
+					if(cc != ((st.cc + 1) & 0x0f))
+						m_counters[CC_ERROR]++;
+					st.duplicate = false;
+				}
+			}
+			st.cc = cc;
+		}
+
+		void checkPsi(PidState& st, const uint8_t* pkt, int adaptationFieldControl) {
+			auto const error = st.role == PAT ? PAT_ERROR : PMT_ERROR;
+
+			if(pkt[3] >> 6) {
+				m_counters[error]++; // scrambled
+				return;
+			}
+
+			auto const pusi = pkt[1] & 0x40;
+			if(!pusi || !(adaptationFieldControl & 0b01))
+				return;
+
+			int offset = 4;
+			if(adaptationFieldControl & 0b10)
+				offset += 1 + pkt[4];
+			if(offset < PACKET_SIZE)
+				offset += 1 + pkt[offset]; // pointer_field
+
+			auto const tableId = st.role == PAT ? TABLE_ID_PAT : TABLE_ID_PMT;
+			if(offset >= PACKET_SIZE || pkt[offset] != tableId) {
+				m_counters[error]++;
+				return;
+			}
+
+			if(m_ticksPerByte > 0) {
+				auto const interval = toTicks(m_pos - st.lastSection);
+				auto& maxMs = m_counters[st.role == PAT ? PAT_INTERVAL_MAX_MS : PMT_INTERVAL_MAX_MS];
+				maxMs = max<int64_t>(maxMs, interval * 1000 / PCR_HZ);
+				if(interval > PSI_INTERVAL_MAX && !st.late)
+					m_counters[error]++;
+			}
+
+			st.lastSection = m_pos;
+			st.late = false;
+		}
+
+		void onPcr(PidState& st, int pid, int64_t pcr, bool discontinuity) {
+			if(m_pcrPid < 0)
+				m_pcrPid = pid;
+
+			if(st.lastPcr >= 0 && !discontinuity) {
+				auto const delta = (pcr - st.lastPcr + PCR_WRAP) % PCR_WRAP;
+				auto const bytes = m_pos - st.lastPcrPos;
+
+				if(delta > PCR_DISCONTINUITY_MAX) {
+					m_counters[PCR_DISCONTINUITY_ERROR]++;
+				} else {
+					if(delta > PCR_REPETITION_MAX)
+						m_counters[PCR_REPETITION_ERROR]++;
+
+					if(m_ticksPerByte > 0) {
+						auto const ns = llabs(delta - toTicks(bytes)) * 1000 / 27;
+						m_counters[PCR_ACCURACY_MAX_NS] = max<int64_t>(m_counters[PCR_ACCURACY_MAX_NS], ns);
+						if(ns > PCR_ACCURACY_MAX)
+							m_counters[PCR_ACCURACY_ERROR]++;
+					}
+
+					if(pid == m_pcrPid && bytes > 0)
+						updateRate(delta / double(bytes));
+				}
+			}
+
+			st.lastPcr = pcr;
+			st.lastPcrPos = m_pos;
+		}
+
+		void updateRate(double ticksPerByte) {
+			if(m_ticksPerByte > 0) {
+				m_ticksPerByte += (ticksPerByte - m_ticksPerByte) / 16;
+				return;
+			}
+
+			// we now have a time base: start reporting
+			m_ticksPerByte = ticksPerByte;
+			m_windowStart = m_pos;
+			m_nextReport = m_pos + bytesPerSecond();
+		}
+
+		int64_t bytesPerSecond() const {
+			return max<int64_t>(1, (int64_t)(PCR_HZ / m_ticksPerByte));
+		}
+
+		void report() {
+			// tables or elementary streams that stopped
+			checkLate(m_pids[0], PSI_INTERVAL_MAX, m_pids[0].lastSection, PAT_ERROR);
+			for(auto pid : m_pmtPids)
+				checkLate(m_pids[pid], PSI_INTERVAL_MAX, m_pids[pid].lastSection, PMT_ERROR);
+			for(auto pid : m_esPids)
+				checkLate(m_pids[pid], PID_INTERVAL_MAX, m_pids[pid].lastPacket, PID_ERROR);
+
+			// bitrates over the window
+			auto const ticks = toTicks(m_pos - m_windowStart);
+			m_counters[BITRATE_KBPS] = (int64_t)(8 * (PCR_HZ / 1000) / m_ticksPerByte);
+
+			for(int i=0; i < m_usedPidSlots; ++i)
+				if(m_pidSlots[i].bitrate)
+					*m_pidSlots[i].bitrate = 0;
+
+			for(auto pid : m_activePids) {
+				auto& st = m_pids[pid];
+				if(st.slot < 0 && m_usedPidSlots < (int)m_pidSlots.size()) {
+					st.slot = m_usedPidSlots++;
+					if(m_pidSlots[st.slot].pid)
+						*m_pidSlots[st.slot].pid = pid;
+				}
+				if(st.slot >= 0 && m_pidSlots[st.slot].bitrate && ticks > 0)
+					*m_pidSlots[st.slot].bitrate = (int32_t)(st.packets * int64_t(PACKET_SIZE * 8) * (PCR_HZ / 1000) / ticks);
+				st.packets = 0;
+			}
+			m_activePids.clear();
+
+			publish();
+
+			m_windowStart = m_pos;
+			m_nextReport = m_pos + bytesPerSecond();
+		}
+
+		void checkLate(PidState& st, int64_t maxInterval, int64_t lastEvent, Counter error) {
+			if(!st.late && toTicks(m_pos - lastEvent) > maxInterval) {
+				m_counters[error]++;
+				st.late = true;
+			}
+		}
+
+		void publish() {
+			for(int i=0; i < COUNTER_COUNT; ++i)
+				if(m_entries[i])
+					*m_entries[i] = (int32_t)min<int64_t>(m_counters[i], INT32_MAX);
+		}
+
+		KHost* const m_host;
+		std::vector<PidState> m_pids;
+		std::vector<int> m_pmtPids, m_esPids;
+		std::map<int, std::vector<int>> m_programEsPids; // PMT PID -> elementary streams
+		std::vector<int> m_activePids; // PIDs seen in the current report window
+		std::vector<PidSlot> m_pidSlots;
+		int m_usedPidSlots = 0;
+		int64_t m_counters[COUNTER_COUNT] {};
+		int32_t* m_entries[COUNTER_COUNT] {};
+
+		int64_t m_pos = 0; // in bytes
+		int m_pcrPid = -1; // the PCRs of this PID give the transport rate
+		double m_ticksPerByte = 0; // unknown
+		int64_t m_windowStart = 0;
+		int64_t m_nextReport = INT64_MAX;
+};
@@ -11,6 +11,8 @@
 #include "lib_utils/format.hpp"
 #include "lib_utils/time_unwrapper.hpp"
 #include "lib_utils/tools.hpp" // enforce
+#include <algorithm> // find, min
+#include <cstring> // memchr, memcpy
 #include <vector>
 
 using namespace std;
@@ -19,6 +21,7 @@ using namespace Modules;
 #include "stream.hpp"
 #include "pes_stream.hpp"
 #include "psi_stream.hpp"
+#include "ts_analyzer.hpp"
 
 namespace {
 
@@ -27,46 +30,95 @@ auto const TS_PACKET_LEN = 188;
 auto const PID_PAT = 0;
 auto const MAX_PID = 8192;
 
-struct TsDemuxer : ModuleS, PsiStream::Listener, PesStream::IRestamper {
-		TsDemuxer(KHost* host, TsDemuxerConfig const& config)
-			: m_host(host), m_needsRestamp(config.timestampStartsAtZero) {
+// Each program has its own clock: the timestamps are restamped per program.
+struct Program : PesStream::IRestamper {
+		Program(bool needsRestamp) : m_needsRestamp(needsRestamp) {
 			m_unwrapper.WRAP_PERIOD = PTS_PERIOD;
+		}
+
+		void restamp(int64_t& pts) override {
+			pts = m_unwrapper.unwrap(pts);
+
+			// make the timestamp start from zero
+			if (m_needsRestamp) {
+				if(m_ptsOrigin == INT64_MAX)
+					m_ptsOrigin = pts;
+
+				pts -= m_ptsOrigin;
+			}
+		}
+
+		int pmtPid = -1; // not bound to a program of the PAT yet
+		vector<unique_ptr<Stream>> streamsPending; // User-provided yet-unmapped PIDs
+
+		// the streams moved from 'streamsPending' to the PID table
+		struct Binding {
+			size_t slot; // in 'streamsPending'
+			int pid;
+		};
+		vector<Binding> bindings;
+
+	private:
+		int64_t m_ptsOrigin = INT64_MAX;
+		TimeUnwrapper m_unwrapper;
+		bool const m_needsRestamp;
+};
+
+struct TsDemuxer : ModuleS, PsiStream::Listener {
+		TsDemuxer(KHost* host, TsDemuxerConfig const& config)
+			: m_host(host) {
 			m_streams[PID_PAT] = make_unique<PsiStream>(PID_PAT, m_host, this);
 
+			if(config.analyze)
+				m_analyzer = make_unique<TsAnalyzer>(m_host, config.analyzePidStats);
+
+			enforce(config.programs >= 1, "TsDemuxer: there must be at least one program");
 			for(auto& pid : config.pids)
-				if(pid.type != TsDemuxerConfig::NONE) {
-					auto pess = make_unique<PesStream>(pid.pid, pid.type, this, m_host, addOutput());
-					if(pid.pid == TsDemuxerConfig::ANY)
-						m_streamsPending.push_back(move(pess));
-					else
-						m_streams[pid.pid] = move(pess);
-				}
+				enforce(config.programs == 1 || pid.pid == TsDemuxerConfig::ANY, "TsDemuxer: only ANY PIDs are supported with multiple programs");
+
+			for(int i=0; i < config.programs; ++i) {
+				m_programs.push_back(make_unique<Program>(config.timestampStartsAtZero));
+				auto program = m_programs.back().get();
+
+				for(auto& pid : config.pids)
+					if(pid.type != TsDemuxerConfig::NONE) {
+						auto pess = make_unique<PesStream>(pid.pid, pid.type, program, m_host, addOutput());
+						if(pid.pid == TsDemuxerConfig::ANY)
+							program->streamsPending.push_back(move(pess));
+						else
+							m_streams[pid.pid] = move(pess);
+					}
+			}
 		}
 
 		void processOne(Data data) override {
 			auto buf = data->data();
 			processRemainder(buf);
-			processSpan(buf);
+			processSpan(buf, data);
 		}
 
-		void processSpan(SpanC &buf) {
+		void processSpan(SpanC &buf, Data const& owner) {
 			bool syncing = true;
-			auto syncFound = [&]() {
-				if (*buf.ptr == SYNC_BYTE) {
-					syncing = false;
-					return true;
-				}
-				if (!syncing) {
-					m_host->log(Warning, "Looking for sync byte");
-					syncing = true;
-				}
-				buf += 1;
-				return false;
-			};
 
 			while(buf.len > 0) {
-				if (!syncFound())
+				// fast path: aligned input, one check per packet
+				if (*buf.ptr != SYNC_BYTE || (syncing && !syncConfirmed(buf))) {
+					if (!syncing) {
+						m_host->log(Warning, "Looking for sync byte");
+						syncing = true;
+						if(m_analyzer)
+							m_analyzer->onSyncLoss();
+					}
+					// memchr is vectorized by the C library
+					auto next = (const uint8_t*)memchr(buf.ptr + 1, SYNC_BYTE, buf.len - 1);
+					auto const skipped = next ? next - buf.ptr : buf.len;
+					if(m_analyzer)
+						m_analyzer->onSkip(skipped);
+					buf += skipped;
 					continue;
+				}
+
+				syncing = false;
 
 				if(buf.len < TS_PACKET_LEN) {
 					m_host->log(Debug, "Truncated TS packet");
@@ -77,8 +129,7 @@ struct TsDemuxer : ModuleS, PsiStream::Listener, PesStream::IRestamper {
 				}
 
 				try {
-					processTsPacket({buf.ptr, TS_PACKET_LEN});
-					syncing = false;
+					processTsPacket(buf.ptr, owner);
 				} catch(exception const& e) {
 					m_host->log(Error, e.what());
 				}
@@ -86,6 +137,11 @@ struct TsDemuxer : ModuleS, PsiStream::Listener, PesStream::IRestamper {
 			}
 		}
 
+		// when (re)syncing, a candidate sync byte must be followed by another one
+		static bool syncConfirmed(SpanC buf) {
+			return buf.len <= TS_PACKET_LEN || buf.ptr[TS_PACKET_LEN] == SYNC_BYTE;
+		}
+
 		void processRemainder(SpanC &buf) {
 			if (!m_remainderSize)
 				return;
@@ -93,21 +149,16 @@ struct TsDemuxer : ModuleS, PsiStream::Listener, PesStream::IRestamper {
 			assert(m_remainderSize < TS_PACKET_LEN);
 			assert(m_remainder[0] == SYNC_BYTE);
 
-			for(;;) {
-				m_remainder[m_remainderSize] = *buf.ptr;
-				m_remainderSize++;
-				buf += 1;
-
-				if (m_remainderSize == TS_PACKET_LEN)
-					break;
+			auto const len = min<size_t>(TS_PACKET_LEN - m_remainderSize, buf.len);
+			memcpy(m_remainder + m_remainderSize, buf.ptr, len);
+			m_remainderSize += len;
+			buf += len;
 
-				if(buf.len == 0)
-					return; // early exit if remainder + data < TS_PACKET_LEN
-			}
+			if (m_remainderSize < TS_PACKET_LEN)
+				return; // early exit if remainder + data < TS_PACKET_LEN
 
-			assert(m_remainderSize == TS_PACKET_LEN);
 			SpanC remBuf { m_remainder, m_remainderSize };
-			processSpan(remBuf);
+			processSpan(remBuf, nullptr);
 			m_remainderSize = 0;
 		}
 
@@ -120,19 +171,50 @@ struct TsDemuxer : ModuleS, PsiStream::Listener, PesStream::IRestamper {
 			for(int i=0; i<MAX_PID; ++i)
 				if(m_streams[i])
 					m_streams[i]->flush();
+
+			if(m_analyzer)
+				m_analyzer->flush();
 		}
 
 		// PsiStream::Listener implementation
 		void onPat(span<int> pmtPids) override {
 			m_host->log(Debug, format("Found PAT (%s programs)", pmtPids.len).c_str());
-			for(auto pid : pmtPids)
-				m_streams[pid] = make_unique<PsiStream>(pid, m_host, this);
+
+			// the programs which left the PAT give their streams back: the next PMT bound to them is matched again.
+			// The bound programs which are still there don't move.
+			for(auto& program : m_programs)
+				if(program->pmtPid >= 0 && find(pmtPids.begin(), pmtPids.end(), program->pmtPid) == pmtPids.end())
+					unbind(*program);
+
+			// keep the PMT streams (and their cached sections) of the unchanged programs
+			for(auto pid : m_pmtPids)
+				if(find(pmtPids.begin(), pmtPids.end(), pid) == pmtPids.end())
+					m_streams[pid].reset();
+
+			m_pmtPids.clear();
+			for(auto pid : pmtPids) {
+				if(!dynamic_cast<PsiStream*>(m_streams[pid].get()))
+					m_streams[pid] = make_unique<PsiStream>(pid, m_host, this);
+				m_pmtPids.push_back(pid);
+			}
+
+			// bind the programs in PAT order
+			for(auto pid : pmtPids) {
+				if(findProgram(pid))
+					continue;
+				if(auto program = findProgram(-1))
+					program->pmtPid = pid;
+			}
+
+			if(m_analyzer)
+				m_analyzer->onPat(pmtPids);
 		}
 
-		void onPmt(span<PsiStream::EsInfo> esInfo) override {
+		void onPmt(int pmtPid, span<PsiStream::EsInfo> esInfo) override {
 			m_host->log(Debug, format("Found PMT (%s streams)", esInfo.len).c_str());
+			auto program = findProgram(pmtPid);
 			for(auto es : esInfo) {
-				if(auto stream = findMatchingStream(es)) {
+				if(auto stream = findMatchingStream(program, es)) {
 					stream->pid = es.pid;
 					if(stream->setType(es.mpegStreamType))
 						m_host->log(Debug, format("[%s] MPEG stream type %s", es.pid, es.mpegStreamType).c_str());
@@ -140,34 +222,27 @@ struct TsDemuxer : ModuleS, PsiStream::Listener, PesStream::IRestamper {
 						m_host->log(Warning, format("[%s] unknown MPEG stream type: %s", es.pid, es.mpegStreamType).c_str());
 				}
 			}
-		}
-
-		// PesStream::IRestamper implementation
-		void restamp(int64_t& pts) override {
-			pts = m_unwrapper.unwrap(pts);
 
-			// make the timestamp start from zero
-			if (m_needsRestamp) {
-				if(m_ptsOrigin == INT64_MAX)
-					m_ptsOrigin = pts;
+			if(m_analyzer)
+				m_analyzer->onPmt(pmtPid, esInfo);
+		}
 
-				pts -= m_ptsOrigin;
-			}
+		void onInvalidCrc(int pid, int tableId) override {
+			m_host->log(Error, format("[%s] Invalid CRC in PSI section (table_id=%s)", pid, tableId).c_str());
+			if(m_analyzer)
+				m_analyzer->onCrcError();
 		}
 
 	private:
-		void processTsPacket(const SpanC pkt) {
-			BitReader r = {pkt};
-			const int syncByte = r.u(8);
-			assert(syncByte == SYNC_BYTE);
-			const int transportErrorIndicator = r.u(1);
-			const int payloadUnitStartIndicator = r.u(1);
-			/*const int priority =*/ r.u(1);
-			const int packetId = r.u(13);
-			const int scrambling = r.u(2);
-			const int adaptationFieldControl = r.u(2);
-			const int continuityCounter = r.u(4);
+		void processTsPacket(const uint8_t* pkt, Data const& owner) {
+			assert(pkt[0] == SYNC_BYTE);
+
+			if(m_analyzer)
+				m_analyzer->onPacket(pkt);
 
+			// fixed-offset header parsing: the PID is checked first,
+			// so the packets we're not interested in are dropped early.
+			const int packetId = ((pkt[1] & 0x1f) << 8) | pkt[2];
 			if(packetId == 0x1FFF)
 				return; // null packet
 
@@ -175,15 +250,23 @@ struct TsDemuxer : ModuleS, PsiStream::Listener, PesStream::IRestamper {
 			if(!stream)
 				return; // we're not interested in this PID
 
+			const int transportErrorIndicator = pkt[1] >> 7;
+			const int payloadUnitStartIndicator = (pkt[1] >> 6) & 1;
+			const int scrambling = pkt[3] >> 6;
+			const int adaptationFieldControl = (pkt[3] >> 4) & 0b11;
+			const int continuityCounter = pkt[3] & 0x0f;
+
 			// skip adaptation field if any
+			int payloadOffset = 4;
 			if(adaptationFieldControl & 0b10) {
-				auto length = r.u(8);
+				auto length = pkt[4];
+				if(payloadOffset + 1 + length > TS_PACKET_LEN)
+					throw runtime_error(format("[%s] Invalid adaptation_field_length in TS header (%s)", packetId, length));
 				if (length > 0) {
-					/*const int discontinuity_indicator =*/ r.u(1);
-					stream->rap |= r.u(1);
-					r.u(6);
-					skip(r, length - 1, "adaptation_field length in TS header");
+					/*const int discontinuity_indicator = pkt[5] >> 7;*/
+					stream->rap |= (pkt[5] >> 6) & 1;
 				}
+				payloadOffset += 1 + length;
 			}
 
 			if(stream->cc == -1)
@@ -225,15 +308,39 @@ struct TsDemuxer : ModuleS, PsiStream::Listener, PesStream::IRestamper {
 				stream->flush();
 
 			if(adaptationFieldControl & 0b01)
-				stream->push(r.payload(), payloadUnitStartIndicator);
+				stream->push({pkt + payloadOffset, size_t(TS_PACKET_LEN - payloadOffset)}, payloadUnitStartIndicator, owner);
 		}
 
-		PesStream* findMatchingStream(PsiStream::EsInfo es) {
-			if(!m_streams[es.pid]) {
-				for(auto& s : m_streamsPending) {
+		void unbind(Program& program) {
+			for(auto& binding : program.bindings) {
+				auto& stream = m_streams[binding.pid];
+				stream->flush();
+				stream->reset();
+				stream->pid = TsDemuxerConfig::ANY;
+				stream->cc = -1;
+				stream->rap = false;
+				program.streamsPending[binding.slot] = move(stream);
+			}
+			program.bindings.clear();
+			program.pmtPid = -1;
+		}
+
+		Program* findProgram(int pmtPid) {
+			for(auto& program : m_programs)
+				if(program->pmtPid == pmtPid)
+					return program.get();
+			return nullptr;
+		}
+
+		// 'program' is null when the PMT doesn't belong to one of our programs
+		PesStream* findMatchingStream(Program* program, PsiStream::EsInfo es) {
+			if(!m_streams[es.pid] && program) {
+				for(size_t i=0; i < program->streamsPending.size(); ++i) {
+					auto& s = program->streamsPending[i];
 					if(auto stream = dynamic_cast<PesStream*>(s.get()))
 						if(matches(stream, es)) {
 							m_streams[es.pid] = move(s);
+							program->bindings.push_back({ i, es.pid });
 							break;
 						}
 				}
@@ -261,10 +368,9 @@ struct TsDemuxer : ModuleS, PsiStream::Listener, PesStream::IRestamper {
 
 		KHost* const m_host;
 		unique_ptr<Stream> m_streams[MAX_PID];
-		vector<unique_ptr<Stream>> m_streamsPending; // User-provided yet-unmapped PIDs
-		int64_t m_ptsOrigin = INT64_MAX;
-		TimeUnwrapper m_unwrapper;
-		bool m_needsRestamp;
+		vector<unique_ptr<Program>> m_programs;
+		vector<int> m_pmtPids; // from the last PAT
+		unique_ptr<TsAnalyzer> m_analyzer; // null unless analyzing
 
 		// incomplete packet from previous data: size < TS_PACKET_LEN and starts with SYNC_BYTE
 		uint8_t m_remainder[TS_PACKET_LEN] {};
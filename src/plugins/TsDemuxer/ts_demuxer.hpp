@@ -21,5 +21,19 @@ struct TsDemuxerConfig {
 	std::vector<Pid> pids = { ANY_VIDEO(), ANY_AUDIO() };
 
 	bool timestampStartsAtZero = true;
+
+	// MPTS: number of programs to demux, in PAT order.
+	// The 'pids' (only ANY is supported then) are looked up in each program:
+	// output 'i * N + k' is the k-th stream of the i-th program,
+	// with N the number of 'pids' whose type isn't NONE.
+	int programs = 1;
+
+	// TR 101 290 priority 1/2 checks, published to the host statistics.
+	// For analysis only, set 'pids' to {}.
+	bool analyze = false;
+
+	// Analysis: number of PIDs whose bitrate is published, in order of appearance.
+	// Each one takes two entries in the host statistics.
+	int analyzePidStats = 4;
 };
 
@@ -0,0 +1,339 @@
+#include "tests/tests.hpp"
+#include "lib_modules/modules.hpp"
+#include "lib_modules/utils/loader.hpp"
+#include "lib_media/common/attributes.hpp"
+#include "lib_media/common/crc.hpp"
+#include "lib_media/common/metadata.hpp"
+#include "lib_utils/profiler.hpp"
+#include "lib_utils/format.hpp"
+#include "lib_media/unittests/modules_common.hpp"
+#include "plugins/TsMuxer/mpegts_muxer.hpp"
+#include "../ts_demuxer.hpp"
+#include <algorithm> // min
+#include <cstring> // memcpy
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace Tests;
+using namespace Modules;
+
+namespace {
+
+using Stats = std::map<std::string, int32_t>;
+
+Data makeData(SpanC span) {
+	auto r = std::make_shared<DataRaw>(span.len);
+	memcpy(r->buffer->data().ptr, span.ptr, span.len);
+	return r;
+}
+
+Data makeFrame(int size, std::shared_ptr<const MetadataPkt> meta, int64_t pts) {
+	auto r = std::make_shared<DataRaw>(size);
+	for(int i=0; i < size; ++i)
+		r->buffer->data()[i] = (uint8_t)(i & 0x3f);
+	r->setMetadata(meta);
+	r->set(PresentationTime{pts});
+	r->set(DecodingTime{pts});
+	return r;
+}
+
+// ~7s of audio+video at 1Mbps, from the TsMuxer.
+// The PCRs are on PID 256, every 20ms.
+std::vector<uint8_t> createTestTs() {
+	auto videoMeta = std::make_shared<MetadataPktVideo>();
+	videoMeta->codec = "h264_annexb";
+	videoMeta->bitrate = 300 * 1000;
+
+	auto audioMeta = std::make_shared<MetadataPktAudio>();
+	audioMeta->codec = "mp3";
+	audioMeta->bitrate = 128 * 1000;
+
+	TsMuxerConfig cfg;
+	cfg.muxRate = 1000 * 1000;
+	auto mux = loadModule("TsMuxer", &NullHost, &cfg);
+
+	std::vector<uint8_t> ts;
+	ConnectOutput(mux->getOutput(0), [&](Data data) {
+		auto pkt = data->data();
+		ts.insert(ts.end(), pkt.ptr, pkt.ptr + pkt.len);
+	});
+
+	mux->getInput(0)->connect();
+	mux->getInput(1)->connect();
+
+	for(int i=0; i < 350; ++i) {
+		auto const pts = i * (IClock::Rate / 50);
+		mux->getInput(0)->push(makeFrame(400, videoMeta, pts));
+		mux->getInput(1)->push(makeFrame(150, audioMeta, pts));
+	}
+	mux->flush();
+
+	return ts;
+}
+
+std::vector<uint8_t> const& getTestTs() {
+	static auto const ts = createTestTs();
+	return ts;
+}
+
+Stats analyze(std::vector<uint8_t> const& ts, int pidStats = TsDemuxerConfig().analyzePidStats) {
+	TsDemuxerConfig cfg;
+	cfg.pids = {};
+	cfg.analyze = true;
+	cfg.analyzePidStats = pidStats;
+
+	StatsHost host;
+	auto demux = loadModule("TsDemuxer", &host, &cfg);
+	demux->getInput(0)->push(makeData({ts.data(), ts.size()}));
+	demux->flush();
+	return host.stats;
+}
+
+void assertNoErrors(Stats& stats, std::vector<std::string> except = {}) {
+	for(auto name : { "sync_loss", "pat_error", "cc_error", "pmt_error", "pid_error", "transport_error", "crc_error",
+	        "pcr_repetition_error", "pcr_discontinuity_error", "pcr_accuracy_error"
+	    }) {
+		if(std::find(except.begin(), except.end(), name) == except.end())
+			ASSERT_EQUALS(0, stats[name]);
+	}
+}
+
+// -1 if the PID has no bitrate slot
+int pidBitrate(Stats& stats, int pid) {
+	for(int i=0; stats.count(format("pid%s", i)); ++i)
+		if(stats[format("pid%s", i)] == pid)
+			return stats[format("pid%s_kbps", i)];
+	return -1;
+}
+
+int pidOf(uint8_t const* pkt) {
+	return ((pkt[1] & 0x1f) << 8) | pkt[2];
+}
+
+// offsets of the packets with the given PID
+std::vector<size_t> findPackets(std::vector<uint8_t> const& ts, int pid) {
+	std::vector<size_t> r;
+	for(size_t offset = 0; offset + 188 <= ts.size(); offset += 188)
+		if(pidOf(&ts[offset]) == pid)
+			r.push_back(offset);
+	return r;
+}
+
+// offsets of the packets carrying a PCR
+std::vector<size_t> findPcrPackets(std::vector<uint8_t> const& ts) {
+	std::vector<size_t> r;
+	for(size_t offset = 0; offset + 188 <= ts.size(); offset += 188) {
+		auto pkt = &ts[offset];
+		if((pkt[3] & 0x20) && pkt[4] >= 7 && (pkt[5] & 0x10))
+			r.push_back(offset);
+	}
+	return r;
+}
+
+void makeNull(uint8_t* pkt) {
+	pkt[1] = 0x1f;
+	pkt[2] = 0xff;
+	pkt[3] = 0x10;
+	memset(pkt + 4, 0xff, 184);
+}
+
+int64_t readPcr(uint8_t const* pkt) {
+	auto p = pkt + 6;
+	auto const base = ((int64_t)p[0] << 25) | (p[1] << 17) | (p[2] << 9) | (p[3] << 1) | (p[4] >> 7);
+	return base * 300 + (((p[4] & 1) << 8) | p[5]);
+}
+
+void writePcr(uint8_t* pkt, int64_t pcr) {
+	auto const base = pcr / 300;
+	auto const ext = pcr % 300;
+	auto p = pkt + 6;
+	p[0] = (uint8_t)(base >> 25);
+	p[1] = (uint8_t)(base >> 17);
+	p[2] = (uint8_t)(base >> 9);
+	p[3] = (uint8_t)(base >> 1);
+	p[4] = (uint8_t)(((base & 1) << 7) | 0x7e | (ext >> 8));
+	p[5] = (uint8_t)ext;
+}
+
+auto const PCR_PID = 256;
+auto const AUDIO_PID = 257;
+auto const PMT_PID = 4096;
+
+unittest("TsAnalyzer: clean stream") {
+	auto stats = analyze(getTestTs(), 8);
+	assertNoErrors(stats);
+	ASSERT_EQUALS(1000, stats["bitrate_kbps"]);
+	// the TsMuxer sends whole access units in one burst: the PSI is a bit late
+	ASSERT(stats["pat_interval_max_ms"] >= 99 && stats["pat_interval_max_ms"] <= 110);
+	ASSERT(stats["pmt_interval_max_ms"] >= 99 && stats["pmt_interval_max_ms"] <= 110);
+	ASSERT(stats["pcr_accuracy_max_ns"] < 100);
+	ASSERT(pidBitrate(stats, PCR_PID) > 0);
+	ASSERT(pidBitrate(stats, 8191) > 0);
+}
+
+unittest("TsAnalyzer: lost packet") {
+	auto ts = getTestTs();
+	makeNull(&ts[findPackets(ts, AUDIO_PID)[50]]);
+	auto stats = analyze(ts);
+	assertNoErrors(stats, { "cc_error" });
+	ASSERT_EQUALS(1, stats["cc_error"]);
+}
+
+unittest("TsAnalyzer: transport error") {
+	auto ts = getTestTs();
+	ts[findPackets(ts, PCR_PID)[50] + 1] |= 0x80;
+	auto stats = analyze(ts);
+	assertNoErrors(stats, { "transport_error" });
+	ASSERT_EQUALS(1, stats["transport_error"]);
+}
+
+unittest("TsAnalyzer: sync loss") {
+	auto ts = getTestTs();
+	ts[findPackets(ts, 0x1fff)[100]] = 0x00;
+	auto stats = analyze(ts);
+	assertNoErrors(stats, { "sync_loss" });
+	ASSERT_EQUALS(1, stats["sync_loss"]);
+}
+
+unittest("TsAnalyzer: PSI CRC error") {
+	auto ts = getTestTs();
+	// the section is at the end of the packet: corrupt its CRC
+	ts[findPackets(ts, 0)[10] + 187] ^= 0xff;
+	auto stats = analyze(ts);
+	assertNoErrors(stats, { "crc_error" });
+	ASSERT_EQUALS(1, stats["crc_error"]);
+}
+
+unittest("TsAnalyzer: PAT interval") {
+	auto ts = getTestTs();
+	// ~3s without PAT
+	for(auto offset : findPackets(ts, 0))
+		if(offset > 1000 * 188 && offset < 3000 * 188)
+			makeNull(&ts[offset]);
+	auto stats = analyze(ts);
+	assertNoErrors(stats, { "pat_error", "cc_error" });
+	ASSERT_EQUALS(1, stats["pat_error"]);
+	ASSERT_EQUALS(1, stats["cc_error"]); // the PAT packets are missing
+	ASSERT(stats["pat_interval_max_ms"] > 2500);
+}
+
+unittest("TsAnalyzer: missing elementary stream") {
+	auto ts = getTestTs();
+	for(auto offset : findPackets(ts, AUDIO_PID))
+		if(offset > 500 * 188)
+			makeNull(&ts[offset]);
+	auto stats = analyze(ts);
+	assertNoErrors(stats, { "pid_error" });
+	ASSERT_EQUALS(1, stats["pid_error"]);
+}
+
+unittest("TsAnalyzer: a stream removed from the PMT isn't missing") {
+	auto ts = getTestTs();
+	for(auto offset : findPackets(ts, AUDIO_PID))
+		if(offset > 500 * 188)
+			makeNull(&ts[offset]);
+
+	// from then on, the PMT (new version) only lists the video
+	for(auto offset : findPackets(ts, PMT_PID)) {
+		if(offset <= 500 * 188)
+			continue;
+		auto const pkt = &ts[offset];
+		auto payload = pkt + 4 + ((pkt[3] & 0x20) ? 1 + pkt[4] : 0);
+		auto section = payload + 1 + payload[0]; // pointer_field
+		auto const sectionLength = ((section[1] & 0x0f) << 8) | section[2];
+		auto const programInfoLength = ((section[10] & 0x0f) << 8) | section[11];
+		auto const end = 3 + sectionLength - 4; // CRC
+		for(int pos = 12 + programInfoLength; pos < end;) {
+			auto const esInfoLength = 5 + (((section[pos + 3] & 0x0f) << 8) | section[pos + 4]);
+			if((((section[pos + 1] & 0x1f) << 8) | section[pos + 2]) != AUDIO_PID) {
+				pos += esInfoLength;
+				continue;
+			}
+			memmove(section + pos, section + pos + esInfoLength, end + 4 - pos - esInfoLength);
+			auto const newLength = sectionLength - esInfoLength;
+			section[1] = (uint8_t)((section[1] & 0xf0) | (newLength >> 8));
+			section[2] = (uint8_t)newLength;
+			section[5] = (uint8_t)((section[5] & 0xc1) | ((((section[5] >> 1) + 1) & 0x1f) << 1)); // version
+			auto const crc = Crc32({section, (size_t)(3 + newLength - 4)});
+			for(int i=0; i < 4; ++i)
+				section[3 + newLength - 4 + i] = (uint8_t)(crc >> (24 - 8 * i));
+			memset(section + 3 + newLength, 0xff, pkt + 188 - (section + 3 + newLength));
+			break;
+		}
+	}
+
+	auto stats = analyze(ts);
+	assertNoErrors(stats);
+}
+
+unittest("TsAnalyzer: PCR jitter") {
+	auto ts = getTestTs();
+	auto pkt = &ts[findPcrPackets(ts)[100]];
+	writePcr(pkt, readPcr(pkt) + 1350); // 50us
+	auto stats = analyze(ts);
+	assertNoErrors(stats, { "pcr_accuracy_error" });
+	ASSERT(stats["pcr_accuracy_error"] >= 1);
+	ASSERT(stats["pcr_accuracy_max_ns"] >= 49000);
+}
+
+unittest("TsAnalyzer: PCR discontinuity") {
+	auto ts = getTestTs();
+	auto const pcrPackets = findPcrPackets(ts);
+	for(size_t i=100; i < pcrPackets.size(); ++i)
+		writePcr(&ts[pcrPackets[i]], readPcr(&ts[pcrPackets[i]]) + 27000000 / 5);
+
+	auto stats = analyze(ts);
+	assertNoErrors(stats, { "pcr_discontinuity_error" });
+	ASSERT_EQUALS(1, stats["pcr_discontinuity_error"]);
+
+	// signalled discontinuity
+	ts[pcrPackets[100] + 5] |= 0x80; // discontinuity_indicator
+	stats = analyze(ts);
+	assertNoErrors(stats);
+}
+
+unittest("TsAnalyzer: the statistics entries don't grow with the PIDs") {
+	// 32 more PIDs
+	auto ts = getTestTs();
+	auto const nullPackets = findPackets(ts, 8191);
+	for(size_t i=0; i < nullPackets.size(); ++i) {
+		auto const pid = 0x1000 + (int)(i % 32);
+		ts[nullPackets[i] + 1] = (uint8_t)((ts[nullPackets[i] + 1] & 0xe0) | (pid >> 8));
+		ts[nullPackets[i] + 2] = (uint8_t)pid;
+	}
+
+	auto stats = analyze(ts);
+	ASSERT_EQUALS(14 + 2 * 4, (int)stats.size());
+	ASSERT(pidBitrate(stats, 0) > 0);
+
+	ASSERT_EQUALS(14, (int)analyze(ts, 0).size());
+}
+
+secondclasstest("TsAnalyzer: perf test, analysis throughput") {
+	std::vector<uint8_t> ts;
+	while(ts.size() < 100 * 1000 * 1000)
+		ts.insert(ts.end(), getTestTs().begin(), getTestTs().end());
+
+	// UDP datagrams
+	std::vector<Data> chunks;
+	auto const chunkSize = 7 * 188;
+	for(size_t offset = 0; offset < ts.size(); offset += chunkSize)
+		chunks.push_back(makeData({ts.data() + offset, std::min<size_t>(chunkSize, ts.size() - offset)}));
+
+	for(auto analyze : { false, true }) {
+		TsDemuxerConfig cfg;
+		cfg.pids = {};
+		cfg.analyze = analyze;
+
+		StatsHost host;
+		auto demux = loadModule("TsDemuxer", &host, &cfg);
+
+		Tools::Profiler p(format("Parse %s MB of TS, analysis=%s", ts.size() / (1024 * 1024), analyze));
+		for(auto& chunk : chunks)
+			demux->getInput(0)->push(chunk);
+		demux->flush();
+	}
+}
+
+}
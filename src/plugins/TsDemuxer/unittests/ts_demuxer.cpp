@@ -1,10 +1,18 @@
 #include "tests/tests.hpp"
+#include "lib_media/common/attributes.hpp"
 #include "lib_media/common/metadata.hpp"
 #include "lib_modules/modules.hpp"
 #include "lib_modules/utils/loader.hpp"
+#include "lib_media/common/crc.hpp"
+#include "lib_media/in/file.hpp"
 #include "lib_utils/tools.hpp" // safe_cast
+#include "lib_utils/os.hpp" // mkdir
+#include "lib_utils/profiler.hpp"
+#include "lib_utils/format.hpp"
 #include "../ts_demuxer.hpp"
 #include <cstring> // memcpy
+#include <string>
+#include <vector>
 
 using namespace Tests;
 using namespace Modules;
@@ -128,6 +136,168 @@ struct FrameCounter : ModuleS {
 	int totalLength = 0;
 };
 
+struct LogCounter : KHost {
+	void log(int, char const* msg) override {
+		auto const str = std::string(msg);
+		if(str.find("Found PAT") == 0)
+			patCount++;
+		else if(str.find("Found PMT") == 0)
+			pmtCount++;
+		else if(str.find("Invalid CRC") != std::string::npos)
+			crcErrorCount++;
+	}
+	void activate(bool) override {
+	}
+	int32_t* getStatsEntry(char const*) override {
+		return nullptr;
+	}
+	int patCount = 0;
+	int pmtCount = 0;
+	int crcErrorCount = 0;
+};
+
+// writes a single-packet PSI section, with a valid CRC
+static void writePsiPacket(uint8_t* pkt, int pid, int cc, int tableId, int tableIdExtension, int version, std::vector<uint8_t> const& tableData) {
+	BitWriter w { {pkt, 188} };
+	w.u(8, 0x47); // sync byte
+	w.u(1, 0); // TEI
+	w.u(1, 1); // PUSI
+	w.u(1, 0); // priority
+	w.u(13, pid); // PID
+	w.u(2, 0); // scrambling control
+	w.u(2, 0b01); // adaptation field control
+	w.u(4, cc); // continuity counter
+
+	w.u(8, 0x00); // pointer field
+
+	auto const sectionStart = w.m_pos / 8;
+	w.u(8, tableId); // table id
+	w.u(1, 0x1); // section syntax indicator
+	w.u(1, 0x0); // private bit
+	w.u(2, 0x3); // reserved
+	w.u(12, 5 + (int)tableData.size() + 4); // section_length
+
+	w.u(16, tableIdExtension);
+	w.u(2, 0x3); // reserved
+	w.u(5, version); // version_number
+	w.u(1, 0x1); // current_next_indicator
+	w.u(8, 0x00); // section_number
+	w.u(8, 0x00); // last_section_number
+
+	for(auto b : tableData)
+		w.u(8, b);
+
+	auto const crc = Crc32({pkt + sectionStart, (size_t)(w.m_pos / 8 - sectionStart)});
+	w.u(16, crc >> 16); // CRC32
+	w.u(16, crc & 0xffff);
+
+	while(w.m_pos < 188 * 8)
+		w.u(8, 0xff); // stuffing
+}
+
+static std::vector<uint8_t> patData(std::vector<int> const& pmtPids) {
+	std::vector<uint8_t> r;
+	int programNumber = 1;
+	for(auto pid : pmtPids) {
+		r.push_back(programNumber >> 8);
+		r.push_back(programNumber & 0xff);
+		r.push_back(0xe0 | (pid >> 8));
+		r.push_back(pid & 0xff);
+		programNumber++;
+	}
+	return r;
+}
+
+// a PMT with several elementary streams: { PID, stream type }
+static std::vector<uint8_t> pmtData(std::vector<std::pair<int, int>> const& streams) {
+	std::vector<uint8_t> r {
+		0xe1, 0x00, // PCR_PID
+		0xf0, 0x00, // program_info_length
+	};
+	for(auto es : streams) {
+		r.push_back((uint8_t)es.second);
+		r.push_back((uint8_t)(0xe0 | (es.first >> 8)));
+		r.push_back((uint8_t)(es.first & 0xff));
+		r.push_back(0xf0); // ES_info_length
+		r.push_back(0x00);
+	}
+	return r;
+}
+
+// a PMT with a single elementary stream
+static std::vector<uint8_t> pmtData(int esPid, int mpegStreamType) {
+	return pmtData({{ esPid, mpegStreamType }});
+}
+
+// appends a PES packet (PTS only, PES_packet_length=0) split into TS packets
+static void writePes(std::vector<uint8_t>& ts, int pid, int& cc, int payloadSize, int64_t pts) {
+	std::vector<uint8_t> pes {
+		0x00, 0x00, 0x01, 0xe0, // start code, stream_id
+		0x00, 0x00, // PES_packet_length
+		0x80, 0x80, 0x05, // PTS only, PES_header_data_length
+		(uint8_t)(0x21 | ((pts >> 29) & 0x0e)), (uint8_t)(pts >> 22), (uint8_t)(0x01 | (pts >> 14)), (uint8_t)(pts >> 7), (uint8_t)(0x01 | (pts << 1)),
+	};
+	for(int i=0; i < payloadSize; ++i)
+		pes.push_back((uint8_t)i);
+
+	for(size_t offset = 0; offset < pes.size(); ) {
+		auto const len = std::min<size_t>(184, pes.size() - offset);
+		uint8_t pkt[188];
+		pkt[0] = 0x47;
+		pkt[1] = (offset == 0 ? 0x40 : 0x00) | (pid >> 8);
+		pkt[2] = pid & 0xff;
+		if(len == 184) {
+			pkt[3] = 0x10 | cc; // payload only
+		} else {
+			// stuffing in the adaptation field
+			pkt[3] = 0x30 | cc;
+			pkt[4] = (uint8_t)(183 - len);
+			if(pkt[4] > 0) {
+				pkt[5] = 0x00;
+				memset(pkt + 6, 0xff, pkt[4] - 1);
+			}
+		}
+		memcpy(pkt + 188 - len, pes.data() + offset, len);
+		ts.insert(ts.end(), pkt, pkt + 188);
+		cc = (cc + 1) % 16;
+		offset += len;
+	}
+}
+
+
+// A multiplex of 'numPrograms' H.264 + AAC services.
+// Program i: PMT on PID 1000+i, video on PID 256+2i, audio on PID 257+2i.
+// Each program has its own clock, and its own video frame size.
+static std::vector<uint8_t> createMpts(int numPrograms, int frames, int videoFrameSize) {
+	std::vector<int> pmtPids;
+	for(int i=0; i < numPrograms; ++i)
+		pmtPids.push_back(1000 + i);
+
+	std::vector<uint8_t> ts;
+	std::vector<int> cc(numPrograms * 2);
+	uint8_t pkt[188];
+
+	for(int f=0; f < frames; ++f) {
+		if(f % 10 == 0) {
+			auto const psiCC = (f / 10) % 16;
+			writePsiPacket(pkt, 0, psiCC, 0x00, 1, 0, patData(pmtPids));
+			ts.insert(ts.end(), pkt, pkt + 188);
+			for(int i=0; i < numPrograms; ++i) {
+				writePsiPacket(pkt, pmtPids[i], psiCC, 0x02, i + 1, 0, pmtData({{ 256 + 2 * i, 0x1b }, { 257 + 2 * i, 0x0f }}));
+				ts.insert(ts.end(), pkt, pkt + 188);
+			}
+		}
+
+		for(int i=0; i < numPrograms; ++i) {
+			auto const pts = i * 1000000 + f * 3600;
+			writePes(ts, 256 + 2 * i, cc[2 * i + 0], videoFrameSize + i * 100, pts);
+			writePes(ts, 257 + 2 * i, cc[2 * i + 1], 768, pts);
+		}
+	}
+
+	return ts;
+}
+
 }
 
 unittest("TsDemuxer: pins with proper metadata are created based on config, not input data") {
@@ -337,7 +507,7 @@ unittest("TsDemuxer: get codec from PMT") {
 		w.u(3, 0x7); // reserved bits
 		w.u(13, 50); // program map PID
 
-		w.u(32, 0x2ab104b2); // CRC32
+		w.u(32, 0x97c5f0ea); // CRC32
 	}
 
 	// PMT
@@ -406,7 +576,7 @@ unittest("TsDemuxer: get codec from PMT") {
 		w.u(8, 0x6a); // ES info: descriptor_tag for AC-3
 		w.u(8, 0x0); //  ES info: descriptor_length
 
-		w.u(32, 0x896249fe); // CRC32
+		w.u(32, 0x4577abc5); // CRC32
 	}
 
 	TsDemuxerConfig cfg;
@@ -433,6 +603,336 @@ unittest("TsDemuxer: get codec from PMT") {
 	ASSERT_EQUALS("ac3", meta2->codec);
 }
 
+unittest("TsDemuxer: repeated PSI sections are parsed once") {
+	auto const PMT_PID = 100;
+	auto const REPEAT = 10;
+	std::vector<uint8_t> ts(REPEAT * 2 * 188);
+	for(int i=0; i < REPEAT; ++i) {
+		writePsiPacket(&ts[(2*i+0) * 188], 0, i % 16, 0x00, 1, 0, patData({PMT_PID}));
+		writePsiPacket(&ts[(2*i+1) * 188], PMT_PID, i % 16, 0x02, 1, 0, pmtData(666, 0x1b));
+	}
+
+	TsDemuxerConfig cfg;
+	cfg.pids = {};
+	cfg.pids.push_back(TsDemuxerConfig::ANY_VIDEO());
+
+	LogCounter host;
+	auto demux = loadModule("TsDemuxer", &host, &cfg);
+	demux->getInput(0)->push(createPacket({ts.data(), ts.size()}));
+
+	ASSERT_EQUALS(1, host.patCount);
+	ASSERT_EQUALS(1, host.pmtCount);
+	ASSERT_EQUALS("h264_annexb", safe_cast<const MetadataPkt>(demux->getOutput(0)->getMetadata())->codec);
+
+	// new PMT version: the stream type changes
+	uint8_t pmt[188];
+	writePsiPacket(pmt, PMT_PID, REPEAT % 16, 0x02, 1, 1, pmtData(666, 0x24));
+	demux->getInput(0)->push(createPacket(pmt));
+
+	ASSERT_EQUALS(1, host.patCount);
+	ASSERT_EQUALS(2, host.pmtCount);
+	ASSERT_EQUALS("hevc_annexb", safe_cast<const MetadataPkt>(demux->getOutput(0)->getMetadata())->codec);
+}
+
+unittest("TsDemuxer: PSI section with invalid CRC is discarded") {
+	uint8_t ts[2 * 188];
+	writePsiPacket(&ts[0], 0, 0, 0x00, 1, 0, patData({100}));
+	writePsiPacket(&ts[188], 100, 0, 0x02, 1, 0, pmtData(666, 0x1b));
+	ts[188 + 5 + 12] ^= 0xff; // corrupt the PMT ES info
+
+	TsDemuxerConfig cfg;
+	cfg.pids = {};
+	cfg.pids.push_back(TsDemuxerConfig::ANY_VIDEO());
+
+	LogCounter host;
+	auto demux = loadModule("TsDemuxer", &host, &cfg);
+	demux->getInput(0)->push(createPacket(ts));
+
+	ASSERT_EQUALS(1, host.patCount);
+	ASSERT_EQUALS(0, host.pmtCount);
+	ASSERT_EQUALS(1, host.crcErrorCount);
+}
+
+static std::vector<uint8_t> getTestTsWithGarbage(std::vector<uint8_t> const& garbage, int repeat) {
+	auto const testTs = getTestTs();
+	auto const ref = testTs->data();
+
+	std::vector<uint8_t> ts;
+	for(int i=0; i < repeat; ++i) {
+		ts.insert(ts.end(), garbage.begin(), garbage.end());
+		ts.insert(ts.end(), ref.ptr, ref.ptr + ref.len);
+		// continuity counters
+		ts[ts.size() - 2 * 188 + 3] = (ts[ts.size() - 2 * 188 + 3] & 0xf0) | (2 * i + 0);
+		ts[ts.size() - 1 * 188 + 3] = (ts[ts.size() - 1 * 188 + 3] & 0xf0) | (2 * i + 1);
+	}
+	return ts;
+}
+
+static int demuxTestTs(std::vector<uint8_t> const& ts, size_t chunkSize) {
+	TsDemuxerConfig cfg;
+	cfg.pids = {};
+	cfg.pids.push_back({ 120, 1 });
+
+	auto demux = loadModule("TsDemuxer", &NullHost, &cfg);
+	auto rec = createModule<FrameCounter>();
+	ConnectOutputToInput(demux->getOutput(0), rec->getInput(0));
+
+	for(size_t offset = 0; offset < ts.size(); offset += chunkSize)
+		demux->getInput(0)->push(createPacket({ts.data() + offset, std::min<size_t>(chunkSize, ts.size() - offset)}));
+	demux->flush();
+
+	ASSERT_EQUALS(rec->frameCount * 168, rec->totalLength);
+	return rec->frameCount;
+}
+
+unittest("TsDemuxer: resync on garbage") {
+	// the fake sync bytes are not followed by another sync byte 188 bytes later
+	auto ts = getTestTsWithGarbage({ 0x00, 0x47, 0x12, 0x99, 0x47 }, 4);
+	ASSERT_EQUALS(8, demuxTestTs(ts, ts.size()));
+}
+
+unittest("TsDemuxer: resync on garbage, misaligned input") {
+	// odd-sized chunks: packets are split across calls
+	auto ts = getTestTsWithGarbage({ 0x00, 0x12, 0x99 }, 4);
+	ASSERT_EQUALS(8, demuxTestTs(ts, 101));
+}
+
+struct FrameRecorder : ModuleS {
+	void processOne(Data data) override {
+		frames.push_back(data);
+	}
+	std::vector<Data> frames;
+};
+
+static std::vector<std::shared_ptr<DataBase>> split(std::vector<uint8_t> const& ts, size_t chunkSize) {
+	std::vector<std::shared_ptr<DataBase>> chunks;
+	for(size_t offset = 0; offset < ts.size(); offset += chunkSize)
+		chunks.push_back(createPacket({ts.data() + offset, std::min<size_t>(chunkSize, ts.size() - offset)}));
+	return chunks;
+}
+
+unittest("TsDemuxer: PES reassembly across input buffers") {
+	auto const PAYLOAD_SIZES = { 1, 100, 184, 1000, 5000, 40000 };
+
+	std::vector<uint8_t> ts;
+	int cc = 0;
+	for(auto size : PAYLOAD_SIZES)
+		writePes(ts, 120, cc, size, 0);
+
+	for(size_t chunkSize : { (size_t)188, (size_t)7 * 188, (size_t)1000, ts.size() }) {
+		TsDemuxerConfig cfg;
+		cfg.pids = {};
+		cfg.pids.push_back({ 120, 1 });
+
+		auto demux = loadModule("TsDemuxer", &NullHost, &cfg);
+		auto rec = createModule<FrameRecorder>();
+		ConnectOutputToInput(demux->getOutput(0), rec->getInput(0));
+
+		for(auto& chunk : split(ts, chunkSize))
+			demux->getInput(0)->push(chunk);
+		demux->flush();
+
+		ASSERT_EQUALS(PAYLOAD_SIZES.size(), rec->frames.size());
+		int i = 0;
+		for(auto size : PAYLOAD_SIZES) {
+			auto payload = rec->frames[i++]->data();
+			ASSERT_EQUALS(size, (int)payload.len);
+			for(int k=0; k < size; ++k)
+				if(payload.ptr[k] != (uint8_t)k)
+					ASSERT_EQUALS((int)(uint8_t)k, (int)payload.ptr[k]);
+		}
+	}
+}
+
+unittest("TsDemuxer: PES in one TS packet is not copied") {
+	std::vector<uint8_t> ts;
+	int cc = 0;
+	writePes(ts, 120, cc, 100, 0);
+	writePes(ts, 120, cc, 100, 3600);
+	writePes(ts, 120, cc, 100, 7200);
+
+	TsDemuxerConfig cfg;
+	cfg.pids = {};
+	cfg.pids.push_back({ 120, 1 });
+
+	auto demux = loadModule("TsDemuxer", &NullHost, &cfg);
+	auto rec = createModule<FrameRecorder>();
+	ConnectOutputToInput(demux->getOutput(0), rec->getInput(0));
+
+	auto input = createPacket({ts.data(), ts.size()});
+	demux->getInput(0)->push(input);
+	demux->flush();
+
+	auto isInInput = [&](Data data) {
+		auto p = data->data().ptr;
+		return p >= input->data().ptr && p < input->data().ptr + input->data().len;
+	};
+
+	ASSERT_EQUALS(3u, rec->frames.size());
+	ASSERT(isInInput(rec->frames[0]));
+	// the first one is still held by the recorder: the next ones are copied
+	// (we don't want to hold the input buffers indefinitely)
+	ASSERT(!isInInput(rec->frames[1]));
+	ASSERT(!isInInput(rec->frames[2]));
+
+	for(auto& frame : rec->frames)
+		ASSERT_EQUALS(99, (int)frame->data().ptr[99]);
+}
+
+secondclasstest("TsDemuxer: perf test, single program HD throughput") {
+	auto const VIDEO_PID = 256;
+	auto const AUDIO_PID = 257;
+	auto const FRAMES = 2000;
+	auto const FRAME_SIZE = 40000; // 8Mbps at 25fps
+
+	std::vector<uint8_t> ts(2 * 188);
+	writePsiPacket(&ts[0], 0, 0, 0x00, 1, 0, patData({100}));
+	writePsiPacket(&ts[188], 100, 0, 0x02, 1, 0, pmtData(VIDEO_PID, 0x1b));
+
+	int videoCC = 0, audioCC = 0;
+	for(int i=0; i < FRAMES; ++i) {
+		writePes(ts, VIDEO_PID, videoCC, FRAME_SIZE, i * 3600);
+		writePes(ts, AUDIO_PID, audioCC, 768, i * 3600); // not demuxed
+	}
+
+	// UDP datagrams, and large chunks like a file input would push
+	for(size_t chunkSize : { (size_t)7 * 188, (size_t)64 * 1024 }) {
+		TsDemuxerConfig cfg;
+		cfg.pids = {};
+		cfg.pids.push_back(TsDemuxerConfig::ANY_VIDEO());
+
+		auto demux = loadModule("TsDemuxer", &NullHost, &cfg);
+		auto rec = createModule<FrameCounter>();
+		ConnectOutputToInput(demux->getOutput(0), rec->getInput(0));
+
+		auto chunks = split(ts, chunkSize);
+
+		{
+			Tools::Profiler p(format("Demux %s MB of single program TS, by chunks of %s bytes", ts.size() / (1024 * 1024), chunkSize));
+			for(auto& chunk : chunks)
+				demux->getInput(0)->push(chunk);
+			demux->flush();
+		}
+
+		ASSERT_EQUALS(FRAMES, rec->frameCount);
+		ASSERT_EQUALS(FRAMES * FRAME_SIZE, rec->totalLength);
+	}
+}
+
+// File -> TsDemuxer -> null, on a multi-GB file (in the page cache: this measures the copies, not the disk).
+secondclasstest("TsDemuxer: perf test, from a file: buffered vs memory mapped input") {
+	auto const VIDEO_PID = 256;
+	auto const FRAMES = 50000;
+	auto const FRAME_SIZE = 40000; // 2GB
+	auto const path = std::string("out/ts_demuxer_perf.ts");
+
+	if(!dirExists("out"))
+		mkdir("out");
+	int64_t fileSize = 0;
+	{
+		auto f = fopen(path.c_str(), "wb");
+		std::vector<uint8_t> ts(2 * 188);
+		writePsiPacket(&ts[0], 0, 0, 0x00, 1, 0, patData({100}));
+		writePsiPacket(&ts[188], 100, 0, 0x02, 1, 0, pmtData(VIDEO_PID, 0x1b));
+		int cc = 0;
+		for(int i=0; i < FRAMES; ++i) {
+			writePes(ts, VIDEO_PID, cc, FRAME_SIZE, i * 3600);
+			if(ts.size() > 64 * 1024 * 1024) {
+				fwrite(ts.data(), 1, ts.size(), f);
+				fileSize += ts.size();
+				ts.clear();
+			}
+		}
+		fwrite(ts.data(), 1, ts.size(), f);
+		fileSize += ts.size();
+		fclose(f);
+	}
+
+	struct Mode {
+		const char* name;
+		bool memoryMapped;
+		int blockSize;
+	};
+	for(auto mode : { Mode { "fread", false, 0 }, Mode { "fread", false, 7 * 188 }, Mode { "mmap", true, 0 }, Mode { "mmap", true, 7 * 188 }, Mode { "mmap", true, 1024 * 188 } }) {
+		FileInputConfig fileCfg;
+		fileCfg.filename = path;
+		fileCfg.memoryMapped = mode.memoryMapped;
+		fileCfg.blockSize = mode.blockSize;
+		auto const blockSize = mode.blockSize ? mode.blockSize : 66176;
+
+		TsDemuxerConfig cfg;
+		cfg.pids = {};
+		cfg.pids.push_back(TsDemuxerConfig::ANY_VIDEO());
+
+		auto input = loadModule("FileInput", &NullHost, &fileCfg);
+		auto demux = loadModule("TsDemuxer", &NullHost, &cfg);
+		auto rec = createModule<FrameCounter>();
+		ConnectOutputToInput(input->getOutput(0), demux->getInput(0));
+		ConnectOutputToInput(demux->getOutput(0), rec->getInput(0));
+
+		{
+			Tools::Profiler p(format("%s, chunks of %s bytes", mode.name, blockSize));
+			for(int64_t i = 0; i <= fileSize / blockSize; ++i)
+				input->process();
+			demux->flush();
+		}
+
+		ASSERT_EQUALS(FRAMES, rec->frameCount);
+	}
+
+	remove(path.c_str());
+}
+
+// MPTS-like capture, where PSI is dense: for each program, the PMT is repeated
+// as often as the PAT, and there are few ES packets in between.
+secondclasstest("TsDemuxer: perf test, PSI repetition") {
+	auto const NUM_PROGRAMS = 16;
+	auto const ES_PACKETS_PER_CYCLE = 8;
+	auto const CYCLES = 20000;
+	auto const CYCLE_PACKETS = 1 + NUM_PROGRAMS + ES_PACKETS_PER_CYCLE;
+
+	std::vector<int> pmtPids;
+	for(int i=0; i < NUM_PROGRAMS; ++i)
+		pmtPids.push_back(1000 + i);
+
+	std::vector<uint8_t> ts(CYCLES * CYCLE_PACKETS * 188);
+	for(int c=0; c < CYCLES; ++c) {
+		auto pkt = &ts[c * CYCLE_PACKETS * 188];
+		writePsiPacket(pkt, 0, c % 16, 0x00, 1, 0, patData(pmtPids));
+		pkt += 188;
+		for(int i=0; i < NUM_PROGRAMS; ++i) {
+			writePsiPacket(pkt, pmtPids[i], c % 16, 0x02, i + 1, 0, pmtData(2000 + i, 0x1b));
+			pkt += 188;
+		}
+		for(int i=0; i < ES_PACKETS_PER_CYCLE; ++i) {
+			memset(pkt, 0xff, 188);
+			pkt[0] = 0x47;
+			pkt[1] = 0x1f; // null packets
+			pkt[2] = 0xff;
+			pkt[3] = 0x10;
+			pkt += 188;
+		}
+	}
+
+	TsDemuxerConfig cfg;
+	cfg.pids = {};
+	cfg.pids.push_back(TsDemuxerConfig::ANY_VIDEO());
+
+	LogCounter host;
+	auto demux = loadModule("TsDemuxer", &host, &cfg);
+
+	{
+		Tools::Profiler p("Demux 20000 PSI cycles (1 PAT + 16 PMTs)");
+		// push the capture like UDP datagrams
+		for(size_t offset = 0; offset < ts.size(); offset += 7 * 188)
+			demux->getInput(0)->push(createPacket({ts.data() + offset, std::min<size_t>(7 * 188, ts.size() - offset)}));
+		demux->flush();
+	}
+
+	ASSERT_EQUALS(1, host.patCount);
+	ASSERT_EQUALS(NUM_PROGRAMS, host.pmtCount);
+}
+
 fuzztest("TsDemuxer") {
 	SpanC testdata;
 	GetFuzzTestData(testdata.ptr, testdata.len);
@@ -448,3 +948,134 @@ fuzztest("TsDemuxer") {
 	demux->flush();
 }
 
+unittest("TsDemuxer: MPTS, outputs per program") {
+	auto const NUM_PROGRAMS = 3;
+	auto const FRAMES = 20;
+	auto const ts = createMpts(NUM_PROGRAMS, FRAMES, 1000);
+
+	TsDemuxerConfig cfg;
+	cfg.pids = { TsDemuxerConfig::ANY_VIDEO(), TsDemuxerConfig::ANY_AUDIO() };
+	cfg.programs = NUM_PROGRAMS;
+
+	auto demux = loadModule("TsDemuxer", &NullHost, &cfg);
+	ASSERT_EQUALS(NUM_PROGRAMS * 2, demux->getNumOutputs());
+
+	std::vector<std::shared_ptr<FrameCounter>> recs;
+	std::vector<int64_t> firstPts(NUM_PROGRAMS * 2, -1);
+	for(int i=0; i < demux->getNumOutputs(); ++i) {
+		recs.push_back(createModule<FrameCounter>());
+		ConnectOutputToInput(demux->getOutput(i), recs.back()->getInput(0));
+		ConnectOutput(demux->getOutput(i), [&firstPts, i](Data data) {
+			if(firstPts[i] == -1)
+				firstPts[i] = data->get<PresentationTime>().time;
+		});
+	}
+
+	demux->getInput(0)->push(createPacket({ts.data(), ts.size()}));
+	demux->flush();
+
+	for(int i=0; i < NUM_PROGRAMS; ++i) {
+		ASSERT_EQUALS("h264_annexb", safe_cast<const MetadataPkt>(demux->getOutput(2 * i + 0)->getMetadata())->codec);
+		ASSERT_EQUALS("aac_adts", safe_cast<const MetadataPkt>(demux->getOutput(2 * i + 1)->getMetadata())->codec);
+		ASSERT_EQUALS(FRAMES, recs[2 * i + 0]->frameCount);
+		ASSERT_EQUALS(FRAMES * (1000 + i * 100), recs[2 * i + 0]->totalLength);
+		ASSERT_EQUALS(FRAMES, recs[2 * i + 1]->frameCount);
+		ASSERT_EQUALS(FRAMES * 768, recs[2 * i + 1]->totalLength);
+
+		// each program starts from zero
+		ASSERT_EQUALS(0, firstPts[2 * i + 0]);
+		ASSERT_EQUALS(0, firstPts[2 * i + 1]);
+	}
+}
+
+unittest("TsDemuxer: the PAT changes mid-stream") {
+	std::vector<uint8_t> ts;
+	uint8_t pkt[188];
+	int cc[2] {};
+
+	writePsiPacket(pkt, 0, 0, 0x00, 1, 0, patData({100}));
+	ts.insert(ts.end(), pkt, pkt + 188);
+	writePsiPacket(pkt, 100, 0, 0x02, 1, 0, pmtData(666, 0x1b));
+	ts.insert(ts.end(), pkt, pkt + 188);
+	for(int f=0; f < 3; ++f)
+		writePes(ts, 666, cc[0], 500, f * 3600);
+
+	// the program moves to other PIDs
+	writePsiPacket(pkt, 0, 1, 0x00, 1, 1, patData({200}));
+	ts.insert(ts.end(), pkt, pkt + 188);
+	writePsiPacket(pkt, 200, 0, 0x02, 1, 0, pmtData(777, 0x24));
+	ts.insert(ts.end(), pkt, pkt + 188);
+	for(int f=3; f < 6; ++f)
+		writePes(ts, 777, cc[1], 700, f * 3600);
+
+	TsDemuxerConfig cfg;
+	cfg.pids = { TsDemuxerConfig::ANY_VIDEO() };
+
+	auto demux = loadModule("TsDemuxer", &NullHost, &cfg);
+	std::vector<size_t> sizes;
+	ConnectOutput(demux->getOutput(0), [&](Data data) {
+		sizes.push_back(data->data().len);
+	});
+
+	demux->getInput(0)->push(createPacket({ts.data(), ts.size()}));
+	demux->flush();
+
+	ASSERT_EQUALS("hevc_annexb", safe_cast<const MetadataPkt>(demux->getOutput(0)->getMetadata())->codec);
+	ASSERT_EQUALS(std::vector<size_t>({ 500, 500, 500, 700, 700, 700 }), sizes);
+}
+
+unittest("TsDemuxer: MPTS, only ANY PIDs") {
+	TsDemuxerConfig cfg;
+	cfg.pids = { { 256, TsDemuxerConfig::VIDEO } };
+	cfg.programs = 2;
+	ASSERT_THROWN(loadModule("TsDemuxer", &NullHost, &cfg));
+}
+
+secondclasstest("TsDemuxer: perf test, MPTS: N single-program demuxers vs one MPTS demuxer") {
+	auto const NUM_PROGRAMS = 20;
+	auto const FRAMES = 250;
+	auto const FRAME_SIZE = 20000; // 4Mbps at 25fps
+
+	auto const ts = createMpts(NUM_PROGRAMS, FRAMES, FRAME_SIZE);
+	auto const chunks = split(ts, 7 * 188); // UDP datagrams
+
+	auto run = [&](std::vector<std::shared_ptr<IModule>> const& demuxers, const char* name) {
+		std::vector<std::shared_ptr<FrameCounter>> recs;
+		for(auto& demux : demuxers) {
+			for(int i=0; i < demux->getNumOutputs(); ++i) {
+				recs.push_back(createModule<FrameCounter>());
+				ConnectOutputToInput(demux->getOutput(i), recs.back()->getInput(0));
+			}
+		}
+
+		{
+			Tools::Profiler p(format("%s, %s MB", name, ts.size() / (1024 * 1024)));
+			for(auto& chunk : chunks)
+				for(auto& demux : demuxers)
+					demux->getInput(0)->push(chunk);
+			for(auto& demux : demuxers)
+				demux->flush();
+		}
+
+		ASSERT_EQUALS(NUM_PROGRAMS * 2, (int)recs.size());
+		for(auto& rec : recs)
+			ASSERT_EQUALS(FRAMES, rec->frameCount);
+	};
+
+	{
+		std::vector<std::shared_ptr<IModule>> demuxers;
+		for(int i=0; i < NUM_PROGRAMS; ++i) {
+			TsDemuxerConfig cfg;
+			cfg.pids = { { 256 + 2 * i, TsDemuxerConfig::VIDEO }, { 257 + 2 * i, TsDemuxerConfig::AUDIO } };
+			demuxers.push_back(loadModule("TsDemuxer", &NullHost, &cfg));
+		}
+		run(demuxers, format("%s single-program demuxers", NUM_PROGRAMS).c_str());
+	}
+
+	{
+		TsDemuxerConfig cfg;
+		cfg.pids = { TsDemuxerConfig::ANY_VIDEO(), TsDemuxerConfig::ANY_AUDIO() };
+		cfg.programs = NUM_PROGRAMS;
+		run({ loadModule("TsDemuxer", &NullHost, &cfg) }, "One MPTS demuxer");
+	}
+}
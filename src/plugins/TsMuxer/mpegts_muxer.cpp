@@ -2,12 +2,18 @@
 #include "bit_writer.hpp"
 #include "pes.hpp"
 #include "lib_modules/utils/helper_dyn.hpp"
+#include "lib_modules/utils/helper_input.hpp" // Input
 #include "lib_modules/utils/factory.hpp"
 #include "lib_utils/tools.hpp"
 #include "lib_utils/log_sink.hpp"
 #include "lib_media/common/metadata.hpp"
 #include "lib_media/common/attributes.hpp"
+#include "lib_media/common/crc.hpp"
 #include <cassert>
+#include <cstring> // memcpy
+#include <deque>
+#include <functional> // greater
+#include <queue> // priority_queue
 #include <string>
 
 static auto const TS_PACKET_SIZE = 188;
@@ -15,8 +21,6 @@ static auto const TS_PACKET_SIZE = 188;
 using namespace Modules;
 using namespace std;
 
-uint32_t Crc32(SpanC data);
-
 namespace {
 static auto const PAT_INTERVAL_MS = 100;
 static auto const PMT_INTERVAL_MS = 100;
@@ -26,6 +30,12 @@ static auto const PMT_PID = 4096; // implementation specific
 static auto const BASE_PID = 256; // implementation specific
 static auto const PCR_PID = BASE_PID; // implementation specific
 
+// the PMT must fit in one TS packet
+static auto const MAX_STREAMS = 33;
+
+static auto const PCR_HZ = 27000000LL;
+static auto const PCR_PER_TICK = PCR_HZ / IClock::Rate;
+
 // ISO/IEC 13818-1 Table 2-29
 int codecToMpegStreamType(string codec) {
 	if(codec == "h264_annexb")
@@ -44,7 +54,7 @@ int codecToMpegStreamType(string codec) {
 
 struct Stream {
 	int streamType {}; // MPEG-2 specified
-	vector<PesPacket> fifo;
+	deque<PesPacket> fifo;
 };
 
 class TsMuxer : public ModuleDynI {
@@ -55,22 +65,40 @@ class TsMuxer : public ModuleDynI {
 			m_output = addOutput();
 		}
 
-		void process() override {
-			m_streams.resize(getNumInputs() - 1);
+		IInput* getInput(int i) override {
+			if(i == (int)inputs.size())
+				inputs.push_back(make_unique<StreamInput>(this, i));
+			return ModuleDynI::getInput(i);
+		}
 
-			int id;
-			auto data = popAny(id);
+		// the data is delivered by StreamInput::push()
+		void process() override {
+		}
 
+		void processInput(int id, Data data) {
+			auto const numStreams = getNumInputs() - 1;
+			if(numStreams > (int)m_streams.size()) {
+				enforce(numStreams <= MAX_STREAMS, "too many streams");
+				m_undeclaredStreams += numStreams - (int)m_streams.size();
+				m_streams.resize(numStreams);
+			}
 			assert(id < (int)m_streams.size());
+
 			inputs[id]->updateMetadata(data);
 
-			if(m_streams[id].streamType == 0)
-				declareStream(m_streams[id], data);
+			auto& s = m_streams[id];
+
+			if(s.streamType == 0) {
+				declareStream(s, data);
+				m_undeclaredStreams--;
+			}
 
 			// if 'data' is a stream declaration, there's no actual data to process.
 			if(!isDeclaration(data)) {
-				auto streamId = m_streams[id].streamType == 0x03 ? 0xC0 : 0xE0;
-				m_streams[id].fifo.push_back(createPesPacket(streamId, data));
+				auto streamId = s.streamType == 0x03 ? 0xC0 : 0xE0;
+				s.fifo.push_back(createPesPacket(streamId, data));
+				if(s.fifo.size() == 1)
+					m_heads.push({ s.fifo.front().tts, id });
 			}
 
 			while(mux()) {
@@ -85,92 +113,103 @@ class TsMuxer : public ModuleDynI {
 		TsMuxerConfig const m_cfg;
 		OutputDefault* m_output {};
 
+		// knows its index: avoids scanning all the input queues on each push
+		struct StreamInput : Input {
+			StreamInput(TsMuxer* muxer, int index) : Input(muxer), muxer(muxer), index(index) {}
+			void push(Data data) override {
+				muxer->processInput(index, data);
+			}
+			TsMuxer* const muxer;
+			int const index;
+		};
+
 		vector<Stream> m_streams;
-		int m_patTimer = 0;
-		int m_pmtTimer = 0;
+		int m_undeclaredStreams = 0;
+
+		// (TTS, stream index) of the first PES packet of each non-empty stream
+		priority_queue<pair<int64_t, int>, vector<pair<int64_t, int>>, greater<pair<int64_t, int>>> m_heads;
+		int64_t m_nextPat = 0; // deadlines, in time()
+		int64_t m_nextPmt = 0;
+		int64_t m_nextPcr = 0;
 		int64_t m_pcrOffset = INT64_MAX;
 		uint8_t m_cc[8192] {};
 
+		// serialized PSI packets: only the continuity counter changes on re-emission
+		vector<uint8_t> m_patPacket;
+		vector<uint8_t> m_pmtPacket;
+
 		// total packet count. Used to compute PCR.
 		int64_t m_packetCount = 0;
 
-		Data popAny(int& inputIdx) {
-			Data data;
-			inputIdx = 0;
-			while (!inputs[inputIdx]->tryPop(data)) {
-				inputIdx++;
-			}
-			return data;
-		}
+		// VBR: skipped idle time, in 27MHz units
+		int64_t m_idleTime = 0;
 
 		void declareStream(Stream& s, Data data) {
 			if(!data->getMetadata())
 				throw error("Can't declare stream without metadata");
 
-			auto const metadata = safe_cast<const MetadataPkt>(data->getMetadata().get());
+			auto const metadata = metadata_cast<const MetadataPkt>(data->getMetadata().get());
 
 			enforce(metadata->bitrate >= 0, "bitrate must be specified for each ES");
 
 			s.streamType = codecToMpegStreamType(metadata->codec);
+			m_pmtPacket.clear();
 		}
 
 		// packet scheduling occurs here
 		bool mux() {
-			if(m_patTimer <= 0) {
+			if(time() >= m_nextPat) {
+				m_nextPat = time() + msToTime(PAT_INTERVAL_MS);
 				sendPat();
-				m_patTimer = timeToPackets(PAT_INTERVAL_MS);
 				return true;
 			}
 
 			// can't mux any further if we don't know the stream types
-			for(auto& s : m_streams)
-				if(s.streamType == 0)
-					return false;
+			if(m_streams.empty() || m_undeclaredStreams > 0)
+				return false;
 
-			if(m_pmtTimer <= 0) {
+			if(time() >= m_nextPmt) {
+				m_nextPmt = time() + msToTime(PMT_INTERVAL_MS);
 				sendPmt();
-				m_pmtTimer = timeToPackets(PMT_INTERVAL_MS);
 				return true;
 			}
 
-			int bestIdx = -1;
+			if(pcrDue()) {
+				sendPcr();
+				return true;
+			}
 
-			{
-				int idx = 0;
-				int64_t bestTts = INT64_MAX;
-				for(auto& s : m_streams) {
-					// if one stream has no data, we can't compute the lowest TTS.
-					if(s.fifo.empty())
-						return false;
+			// if one stream has no data, we can't compute the lowest TTS.
+			if(m_heads.size() < m_streams.size())
+				return false;
 
-					auto tts = s.fifo.front().tts;
-					if(tts < bestTts) {
-						bestTts = tts;
-						bestIdx = idx;
-					}
+			// the AU with the lowest TTS
+			auto const tts = m_heads.top().first;
+			auto const bestIdx = m_heads.top().second;
 
-					++idx;
-				}
+			// compute first pcr
+			if(m_pcrOffset == INT64_MAX) {
+				assert(tts != INT64_MAX);
+				m_pcrOffset = tts;
 			}
 
-			// we have an AU with a DTS
-			if(bestIdx >= 0) {
-				auto tts = m_streams[bestIdx].fifo.front().tts;
-
-				// compute first pcr
-				if(m_pcrOffset == INT64_MAX) {
-					assert(tts != INT64_MAX);
-					m_pcrOffset = tts;
-				}
+			// time to send?
+			if(tts < pcr()) {
+				auto& stream = m_streams[bestIdx];
+				auto pkt = move(stream.fifo.front());
+				stream.fifo.pop_front();
+				m_heads.pop();
+				if(!stream.fifo.empty())
+					m_heads.push({ stream.fifo.front().tts, bestIdx });
+				sendPes(pkt, BASE_PID + bestIdx);
+				return true;
+			}
 
-				// time to send?
-				if(tts < pcr()) {
-					auto& stream = m_streams[bestIdx];
-					auto pkt = stream.fifo.front();
-					stream.fifo.erase(stream.fifo.begin());
-					sendPes(pkt, BASE_PID + bestIdx);
-					return true;
-				}
+			if(m_cfg.vbr) {
+				// nothing to send: skip the idle time, up to the next event
+				auto next = min(tts - m_pcrOffset + 1, min(m_nextPcr, min(m_nextPat, m_nextPmt)));
+				m_idleTime += max<int64_t>(0, next * PCR_PER_TICK - packetTime(m_packetCount) - m_idleTime);
+				return true;
 			}
 
 			// nothing to send: send one NUL packet
@@ -180,6 +219,32 @@ class TsMuxer : public ModuleDynI {
 		}
 
 		void sendPat() {
+			if(m_patPacket.empty())
+				m_patPacket = serializePat();
+			sendPsiPacket(PAT_PID, m_patPacket);
+		}
+
+		void sendPmt() {
+			if(m_pmtPacket.empty())
+				m_pmtPacket = serializePmt();
+			sendPsiPacket(PMT_PID, m_pmtPacket);
+		}
+
+		void sendPsiPacket(int pid, vector<uint8_t> const& cached) {
+			auto data = m_output->allocData<DataRaw>(TS_PACKET_SIZE);
+			auto pkt = data->buffer->data();
+			memcpy(pkt.ptr, cached.data(), TS_PACKET_SIZE);
+			pkt[3] = (pkt[3] & 0xf0) | m_cc[pid];
+			post(data, pid, true);
+		}
+
+		vector<uint8_t> serializePsiPacket(int pid, SpanC section) const {
+			auto data = serializeTsPacket(pid, section, 1, false);
+			auto pkt = data->data();
+			return vector<uint8_t>(pkt.ptr, pkt.ptr + pkt.len);
+		}
+
+		vector<uint8_t> serializePat() const {
 			uint8_t payload[64] {};
 			auto w = BitWriter { payload };
 
@@ -213,12 +278,11 @@ class TsMuxer : public ModuleDynI {
 			// compute and write the CRC (skip pointer_field)
 			w.u(32, Crc32({ payload + 1, (size_t)w.offset() - 1 }));
 
-			auto sp = SpanC { payload, (size_t)(w.offset()) };
-			sendTsPacket(PAT_PID, sp, 1);
+			return serializePsiPacket(PAT_PID, { payload, (size_t)(w.offset()) });
 		}
 
-		void sendPmt() {
-			uint8_t payload[128] {};
+		vector<uint8_t> serializePmt() const {
+			uint8_t payload[TS_PACKET_SIZE - 4] {};
 			auto w = BitWriter { payload };
 
 			// ISO/IEC 13818-1 Table 2-24
@@ -260,8 +324,7 @@ class TsMuxer : public ModuleDynI {
 			// compute and write the CRC (skip pointer_field)
 			w.u(32, Crc32({ payload + 1, (size_t)w.offset() - 1 }));
 
-			auto sp = SpanC { payload, (size_t)(w.offset()) };
-			sendTsPacket(PMT_PID, sp, 1);
+			return serializePsiPacket(PMT_PID, { payload, (size_t)(w.offset()) });
 		}
 
 		void sendPes(PesPacket const& pkt, int pid) {
@@ -270,8 +333,13 @@ class TsMuxer : public ModuleDynI {
 			// send the whole access unit in one burst
 			sendTsPacket(pid, pes, true);
 
-			while(pes.len > 0)
+			while(pes.len > 0) {
+				// long bursts on other PIDs mustn't delay the PCR
+				if(pid != PCR_PID && pcrDue())
+					sendPcr();
+
 				sendTsPacket(pid, pes, false);
+			}
 
 			// can only check the timings if we actually have a PCR
 			assert(m_pcrOffset != INT64_MAX);
@@ -294,12 +362,28 @@ class TsMuxer : public ModuleDynI {
 			}
 		}
 
+		bool pcrDue() const {
+			return m_pcrOffset != INT64_MAX && time() >= m_nextPcr;
+		}
+
+		// a packet only carrying a PCR
+		void sendPcr() {
+			SpanC sp {};
+			sendTsPacket(PCR_PID, sp, 0);
+		}
+
 		// send bytes from 'unit' and update its span.
 		void sendTsPacket(int pid, SpanC& unit, int pusi) {
 			auto const payload_flag = unit.len > 0;
-			auto data = serializeTsPacket(pid, unit, pusi);
+			auto const pcrFlag = pid == PCR_PID && pcrDue();
+			if(pcrFlag)
+				m_nextPcr = time() + msToTime(m_cfg.pcrIntervalInMs);
+
+			post(serializeTsPacket(pid, unit, pusi, pcrFlag), pid, payload_flag);
+		}
 
-			// deliver it to the output
+		// deliver a packet to the output
+		void post(std::shared_ptr<DataRaw> data, int pid, bool payload_flag) {
 			data->set(PresentationTime { time() });
 			m_output->post(data);
 
@@ -307,13 +391,9 @@ class TsMuxer : public ModuleDynI {
 
 			if(payload_flag)
 				m_cc[pid] = (m_cc[pid] + 1) % 16;
-
-			// advance time
-			m_patTimer--;
-			m_pmtTimer--;
 		}
 
-		std::shared_ptr<DataRaw> serializeTsPacket(int pid, SpanC& unit, int pusi) const {
+		std::shared_ptr<DataRaw> serializeTsPacket(int pid, SpanC& unit, int pusi, bool pcrFlag) const {
 			auto buf = m_output->allocData<DataRaw>(TS_PACKET_SIZE);
 
 			auto pkt = buf->buffer->data();
@@ -330,10 +410,11 @@ class TsMuxer : public ModuleDynI {
 			w.u(2, 0); // scrambling control
 			w.u(1, adaptation_field_flag); // adaptation_field_control: bit #0
 			w.u(1, unit.len > 0 ? 1 : 0); // adaptation_field_control: bit #1
-			w.u(4, m_cc[pid]); // continuity counter
+			// continuity counter: only incremented by the packets with a payload
+			w.u(4, unit.len > 0 ? m_cc[pid] : (m_cc[pid] + 15) % 16);
 
 			if(adaptation_field_flag)
-				writeAdaptationField(w, pid == PCR_PID);
+				writeAdaptationField(w, pcrFlag);
 
 			// write the actual TS payload
 			auto payloadStart = pkt.ptr + w.offset();
@@ -376,10 +457,11 @@ class TsMuxer : public ModuleDynI {
 			w.u(1, 0); // Adaptation field extension flag
 
 			if(pcrFlag) {
-				auto const pcrBase = (uint64_t)(pcr() * 90000 / IClock::Rate);
-				w.u(33, pcrBase & 0x1FFFFFFFF);
+				auto const PCR_WRAP = (1LL << 33) * 300;
+				auto const pcr = (pcr27() % PCR_WRAP + PCR_WRAP) % PCR_WRAP;
+				w.u(33, pcr / 300); // program_clock_reference_base
 				w.u(6, -1); // reserved
-				w.u(9, 0); // pcr 27Mhz (x300)
+				w.u(9, pcr % 300); // program_clock_reference_extension
 			}
 
 			auto len = w.offset() - adaptationFieldStart.offset();
@@ -390,13 +472,23 @@ class TsMuxer : public ModuleDynI {
 			return m_pcrOffset + time();
 		}
 
+		// full precision PCR, in 27MHz units
+		int64_t pcr27() const {
+			return m_pcrOffset * PCR_PER_TICK + m_idleTime + packetTime(m_packetCount);
+		}
+
 		int64_t time() const {
-			return IClock::Rate * (m_packetCount * TS_PACKET_SIZE * 8) / m_cfg.muxRate;
+			return (m_idleTime + packetTime(m_packetCount)) / PCR_PER_TICK;
+		}
+
+		// time to send 'packetCount' packets at the mux rate, in 27MHz units
+		int64_t packetTime(int64_t packetCount) const {
+			auto const bits = packetCount * TS_PACKET_SIZE * 8;
+			return (bits / m_cfg.muxRate) * PCR_HZ + (bits % m_cfg.muxRate) * PCR_HZ / m_cfg.muxRate;
 		}
 
-		int64_t timeToPackets(int64_t timeInMs) const {
-			auto const pktFreq = Fraction(m_cfg.muxRate, TS_PACKET_SIZE * 8);
-			return (int64_t)(pktFreq * timeInMs) / 1000;
+		static int64_t msToTime(int64_t timeInMs) {
+			return timeInMs * IClock::Rate / 1000;
 		}
 };
 
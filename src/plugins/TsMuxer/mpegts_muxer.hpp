@@ -1,6 +1,10 @@
 #pragma once
 
 struct TsMuxerConfig {
-	int muxRate; // in bps
-};
+	int muxRate; // in bps. In VBR mode, this is the peak rate.
+
+	// VBR: no NULL packets. The idle time is skipped, so the PCR follows the DTS schedule.
+	bool vbr = false;
 
+	int pcrIntervalInMs = 20;
+};
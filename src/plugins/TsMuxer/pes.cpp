@@ -23,11 +23,11 @@ int indexOf(const int(&haystack)[N], int needle) {
 };
 
 void insertAdtsHeadersIfNeeded(BitWriter& w, Data data) {
-	auto meta = safe_cast<const MetadataPkt>(data->getMetadata());
+	auto meta = metadata_cast<const MetadataPkt>(data->getMetadata());
 	assert(meta);
 
 	if(meta->codec == "aac_raw") {
-		auto audio = safe_cast<const MetadataPktAudio>(meta);
+		auto audio = metadata_cast<const MetadataPktAudio>(meta);
 
 		// ISO/IEC 13818-1 Table 35
 		static const int frequencies[] = {
@@ -66,8 +66,8 @@ PesPacket createPesPacket(int streamId, Data data) {
 
 	PesPacket pkt;
 	pkt.data.resize(au.len + 256);
-	pkt.dts = dts;
-	pkt.tts = dts - IClock::Rate * 3;
+	pkt.dts = data->get<DecodingTime>().time;
+	pkt.tts = pkt.dts - IClock::Rate * 3;
 
 	auto w = BitWriter  {
 		{ pkt.data.data(), pkt.data.size() }
@@ -4,8 +4,8 @@
 #include <vector>
 
 struct PesPacket {
-	int64_t dts;
-	int64_t tts; // transmit time stamp
+	int64_t dts; // in IClock::Rate
+	int64_t tts; // transmit time stamp, in IClock::Rate
 	std::vector<uint8_t> data;
 };
 
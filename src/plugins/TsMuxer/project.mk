@@ -4,5 +4,5 @@ TARGETS+=$(BIN)/TsMuxer.smd
 $(BIN)/TsMuxer.smd: \
   $(BIN)/$(PLUG_DIR)/mpegts_muxer.cpp.o\
   $(BIN)/$(PLUG_DIR)/pes.cpp.o\
-  $(BIN)/$(PLUG_DIR)/crc.cpp.o\
+  $(BIN)/$(SRC)/lib_media/common/crc.cpp.o\
 
@@ -9,7 +9,10 @@
 #include "lib_media/in/file.hpp"
 #include "lib_media/out/null.hpp"
 #include "lib_utils/tools.hpp"
+#include "lib_utils/profiler.hpp"
+#include "lib_utils/format.hpp"
 #include <algorithm> //std::min
+#include <vector>
 
 #include "plugins/TsMuxer/mpegts_muxer.hpp"
 
@@ -126,6 +129,92 @@ std::shared_ptr<DataBase> getTestH264Frame() {
 
 	return r;
 }
+
+// 'frames' H.264 + MP3 frames at 25fps, starting at 10s
+std::vector<uint8_t> muxTestStream(TsMuxerConfig cfg, int frames, int videoFrameSize, int audioFrameSize) {
+	auto videoMeta = make_shared<MetadataPktVideo>();
+	videoMeta->codec = "h264_annexb";
+	videoMeta->bitrate = videoFrameSize * 8 * 25;
+
+	auto audioMeta = make_shared<MetadataPktAudio>();
+	audioMeta->codec = "mp3";
+	audioMeta->bitrate = audioFrameSize * 8 * 25;
+
+	auto mux = loadModule("TsMuxer", &NullHost, &cfg);
+
+	std::vector<uint8_t> ts;
+	ConnectOutput(mux->getOutput(0), [&](Data data) {
+		auto pkt = data->data();
+		ts.insert(ts.end(), pkt.ptr, pkt.ptr + pkt.len);
+	});
+
+	mux->getInput(0)->connect();
+	mux->getInput(1)->connect();
+
+	for(int i=0; i < frames; ++i) {
+		auto const pts = IClock::Rate * 10 + i * (IClock::Rate / 25);
+		int idx = 0;
+		for(auto meta : std::vector<std::shared_ptr<const MetadataPkt>> { videoMeta, audioMeta }) {
+			auto frame = make_shared<DataRaw>(idx == 0 ? videoFrameSize : audioFrameSize);
+			memset(frame->buffer->data().ptr, 0, frame->buffer->data().len);
+			frame->setMetadata(meta);
+			frame->set(PresentationTime{pts});
+			frame->set(DecodingTime{pts});
+			mux->getInput(idx++)->push(frame);
+		}
+	}
+	mux->flush();
+
+	return ts;
+}
+
+// one H.264 stream and 'numStreams - 1' MP3 streams (e.g. audio languages), at 25fps, starting at 10s
+std::vector<uint8_t> muxManyStreams(TsMuxerConfig cfg, int numStreams, int frames) {
+	auto videoMeta = make_shared<MetadataPktVideo>();
+	videoMeta->codec = "h264_annexb";
+	videoMeta->bitrate = 1000 * 8 * 25;
+
+	auto audioMeta = make_shared<MetadataPktAudio>();
+	audioMeta->codec = "mp3";
+	audioMeta->bitrate = 200 * 8 * 25;
+
+	auto mux = loadModule("TsMuxer", &NullHost, &cfg);
+
+	std::vector<uint8_t> ts;
+	ConnectOutput(mux->getOutput(0), [&](Data data) {
+		auto pkt = data->data();
+		ts.insert(ts.end(), pkt.ptr, pkt.ptr + pkt.len);
+	});
+
+	for(int k=0; k < numStreams; ++k)
+		mux->getInput(k)->connect();
+
+	for(int i=0; i < frames; ++i) {
+		auto const pts = IClock::Rate * 10 + i * (IClock::Rate / 25);
+		for(int k=0; k < numStreams; ++k) {
+			auto frame = make_shared<DataRaw>(k == 0 ? 1000 : 200);
+			memset(frame->buffer->data().ptr, 0, frame->buffer->data().len);
+			frame->setMetadata(k == 0 ? std::shared_ptr<const MetadataPkt>(videoMeta) : audioMeta);
+			frame->set(PresentationTime{pts});
+			frame->set(DecodingTime{pts});
+			mux->getInput(k)->push(frame);
+		}
+	}
+	mux->flush();
+
+	return ts;
+}
+
+// PTS/DTS, in 90kHz units
+int64_t readTimestamp(uint8_t const* p) {
+	return ((int64_t)(p[0] & 0x0e) << 29) | (p[1] << 22) | ((p[2] & 0xfe) << 14) | (p[3] << 7) | (p[4] >> 1);
+}
+
+// in 27MHz units
+int64_t readPcr(uint8_t const* p) {
+	auto const base = ((int64_t)p[0] << 25) | (p[1] << 17) | (p[2] << 9) | (p[3] << 1) | (p[4] >> 7);
+	return base * 300 + (((p[4] & 1) << 8) | p[5]);
+}
 }
 
 unittest("TsMuxer: audio simple: mp3") {
@@ -241,3 +330,110 @@ unittest("TsMuxer: flush without feeding") {
 	ASSERT_EQUALS(0, picCount);
 }
 
+unittest("TsMuxer: CBR and VBR: PCR interval, and PCR follows the DTS") {
+	for(bool vbr : { false, true }) {
+		TsMuxerConfig cfg;
+		cfg.muxRate = 1000 * 1000;
+		cfg.vbr = vbr;
+		cfg.pcrIntervalInMs = 30;
+		auto const ts = muxTestStream(cfg, 100, 1000, 200);
+
+		auto const packetTime = 188 * 8 * 27000000LL / cfg.muxRate;
+		int nullPackets = 0;
+		int64_t lastPcr = -1;
+		int pesCount = 0;
+		for(size_t offset = 0; offset < ts.size(); offset += 188) {
+			auto pkt = &ts[offset];
+			auto const pid = ((pkt[1] & 0x1f) << 8) | pkt[2];
+			auto payload = pkt + 4;
+			if(pkt[3] & 0x20) {
+				if(pkt[4] >= 7 && (pkt[5] & 0x10)) {
+					auto const pcr = readPcr(pkt + 6);
+					if(lastPcr >= 0) {
+						ASSERT(pcr > lastPcr);
+						// the PAT and the PMT may go first
+						ASSERT(pcr - lastPcr <= 27000 * cfg.pcrIntervalInMs + 3 * packetTime);
+					}
+					lastPcr = pcr;
+				}
+				payload += 1 + pkt[4];
+			}
+
+			if(pid == 0x1fff)
+				nullPackets++;
+
+			// the video PES are sent before their DTS, with at most 3s of buffering
+			if(pid == 256 && (pkt[1] & 0x40)) {
+				auto const dts = readTimestamp(payload + 14) * 300;
+				ASSERT(lastPcr >= 0);
+				ASSERT(lastPcr < dts);
+				ASSERT(dts - lastPcr <= 27000000LL * 3 + 27000 * cfg.pcrIntervalInMs);
+				pesCount++;
+			}
+		}
+
+		ASSERT(pesCount >= 90);
+		ASSERT_EQUALS(vbr, nullPackets == 0);
+	}
+}
+
+unittest("TsMuxer: 32 streams, interleaved by DTS") {
+	auto const NUM_STREAMS = 32;
+
+	TsMuxerConfig cfg;
+	cfg.muxRate = 10 * 1000 * 1000;
+	auto const ts = muxManyStreams(cfg, NUM_STREAMS, 100);
+
+	std::vector<int> pesCount(NUM_STREAMS);
+	int64_t lastPts = -1;
+	int pmtStreams = 0;
+	for(size_t offset = 0; offset < ts.size(); offset += 188) {
+		auto pkt = &ts[offset];
+		auto const pid = ((pkt[1] & 0x1f) << 8) | pkt[2];
+		auto payload = pkt + 4;
+		if(pkt[3] & 0x20)
+			payload += 1 + pkt[4];
+
+		if(pid == 4096 && !pmtStreams) {
+			auto const sectionLength = ((payload[2] & 0x0f) << 8) | payload[3];
+			pmtStreams = (sectionLength - 13) / 5;
+		}
+
+		// the PES are sent in DTS order, whatever their stream
+		if(pid >= 256 && pid < 256 + NUM_STREAMS && (pkt[1] & 0x40)) {
+			auto const pts = readTimestamp(payload + 9);
+			ASSERT(pts >= lastPts);
+			lastPts = pts;
+			pesCount[pid - 256]++;
+		}
+	}
+
+	ASSERT_EQUALS(NUM_STREAMS, pmtStreams);
+	for(auto count : pesCount)
+		ASSERT(count >= 90);
+}
+
+secondclasstest("TsMuxer: perf test, per-packet cost vs stream count") {
+	for(int numStreams : { 2, 8, 32 }) {
+		TsMuxerConfig cfg;
+		cfg.muxRate = 10 * 1000 * 1000;
+		cfg.vbr = true;
+
+		Tools::Profiler p(format("Mux 1 minute of %s streams", numStreams));
+		muxManyStreams(cfg, numStreams, 25 * 60);
+	}
+}
+
+secondclasstest("TsMuxer: perf test, VBR vs 5Mbps CBR on a low bitrate input") {
+	auto const FRAMES = 25 * 60;
+
+	for(bool vbr : { false, true }) {
+		TsMuxerConfig cfg;
+		cfg.muxRate = 5 * 1000 * 1000;
+		cfg.vbr = vbr;
+
+		// 1 minute of 200kbps video + 64kbps audio
+		Tools::Profiler p(format("Mux 1 minute at 264kbps, %s", vbr ? "VBR" : "5Mbps CBR"));
+		muxTestStream(cfg, FRAMES, 1000, 320);
+	}
+}
@@ -1,11 +1,31 @@
 #pragma once
 
 #include <cstddef>
+#include <cstdint>
 #include <memory>
 
 struct IOutputSocket {
 	virtual ~IOutputSocket() = default;
 	virtual void send(uint8_t const* data, size_t len) = 0;
+
+	// Kernel pacing (SO_TXTIME): returns false if the platform or the
+	// outgoing interface's qdisc can't schedule the datagrams.
+	virtual bool enableTxTime() {
+		return false;
+	}
+
+	// 'txTimeInNs' is on the steady clock (CLOCK_MONOTONIC).
+	// The socket converts it to the clock of the qdisc.
+	virtual void sendAt(uint8_t const* data, size_t len, int64_t txTimeInNs) {
+		(void)txTimeInNs;
+		send(data, len);
+	}
+
+	// Datagrams the qdisc dropped since the last call,
+	// because their transmit time was invalid or already passed.
+	virtual int64_t getTxTimeDrops() {
+		return 0;
+	}
 };
 
 std::unique_ptr<IOutputSocket> createOutputSocket(const char* address, int port);
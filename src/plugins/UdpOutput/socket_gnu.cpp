@@ -10,6 +10,15 @@
 #include <errno.h>
 #include <string.h> // strerror
 
+#ifdef __linux__
+#include <ifaddrs.h>
+#include <net/if.h> // if_nametoindex
+#include <linux/errqueue.h> // sock_extended_err
+#include <linux/net_tstamp.h> // sock_txtime
+#include <linux/rtnetlink.h>
+#include <time.h> // CLOCK_MONOTONIC, CLOCK_TAI
+#endif
+
 using namespace std;
 
 // increasing this value increases throughput
@@ -18,6 +27,101 @@ using namespace std;
 static auto const SEND_BUFFER_SIZE = 2 * 1024 * 1024;
 
 namespace {
+
+#ifdef __linux__
+// index of the interface the kernel routes 'dstAddr' through, or 0.
+int getOutgoingInterface(sockaddr_in const& dstAddr) {
+	auto s = socket(AF_INET, SOCK_DGRAM, 0);
+	if(s < 0)
+		return 0;
+
+	sockaddr_in localAddr {};
+	socklen_t len = sizeof(localAddr);
+	auto const ok = connect(s, (sockaddr const*)&dstAddr, sizeof(dstAddr)) == 0
+	    && getsockname(s, (sockaddr*)&localAddr, &len) == 0;
+	close(s);
+	if(!ok)
+		return 0;
+
+	ifaddrs* addrs = nullptr;
+	if(getifaddrs(&addrs))
+		return 0;
+
+	int r = 0;
+	for(auto a = addrs; a; a = a->ifa_next) {
+		if(a->ifa_addr && a->ifa_addr->sa_family == AF_INET
+		    && ((sockaddr_in*)a->ifa_addr)->sin_addr.s_addr == localAddr.sin_addr.s_addr) {
+			r = if_nametoindex(a->ifa_name);
+			break;
+		}
+	}
+
+	freeifaddrs(addrs);
+	return r;
+}
+
+// The clock the SO_TXTIME timestamps must be on, or -1 if the interface's qdiscs can't schedule the datagrams.
+// SO_TXTIME is silently ignored unless the interface has a 'fq' or 'etf' qdisc.
+// 'fq' uses CLOCK_MONOTONIC. 'etf' only supports CLOCK_TAI, and drops the datagrams
+// whose socket is on another clock. With both, a datagram could reach either: not supported.
+int getTxTimeClock(int ifIndex) {
+	auto s = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if(s < 0)
+		return -1;
+
+	struct {
+		nlmsghdr hdr;
+		tcmsg tc;
+	} req {};
+	req.hdr.nlmsg_len = sizeof(req);
+	req.hdr.nlmsg_type = RTM_GETQDISC;
+	req.hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	req.tc.tcm_family = AF_UNSPEC;
+
+	bool fq = false, etf = false;
+	bool done = send(s, &req, sizeof(req), 0) < 0;
+	uint8_t buf[16 * 1024];
+
+	while(!done) {
+		auto n = recv(s, buf, sizeof(buf), 0);
+		if(n <= 0)
+			break;
+
+		for(auto hdr = (nlmsghdr*)buf; NLMSG_OK(hdr, n); hdr = NLMSG_NEXT(hdr, n)) {
+			if(hdr->nlmsg_type == NLMSG_DONE || hdr->nlmsg_type == NLMSG_ERROR) {
+				done = true;
+				break;
+			}
+
+			auto tc = (tcmsg*)NLMSG_DATA(hdr);
+			if(hdr->nlmsg_type != RTM_NEWQDISC || tc->tcm_ifindex != ifIndex)
+				continue;
+
+			// multiqueue devices have a 'mq' root with one child qdisc per queue
+			int attrLen = hdr->nlmsg_len - NLMSG_LENGTH(sizeof(*tc));
+			for(auto attr = TCA_RTA(tc); RTA_OK(attr, attrLen); attr = RTA_NEXT(attr, attrLen)) {
+				if(attr->rta_type == TCA_KIND) {
+					auto kind = (char const*)RTA_DATA(attr);
+					fq |= !strcmp(kind, "fq");
+					etf |= !strcmp(kind, "etf");
+				}
+			}
+		}
+	}
+
+	close(s);
+	if(fq == etf)
+		return -1;
+	return etf ? CLOCK_TAI : CLOCK_MONOTONIC;
+}
+
+int64_t nowInNs(clockid_t clock) {
+	timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+#endif
+
 struct Socket : IOutputSocket {
 	Socket(const char* address, int port) {
 		m_socket = socket(AF_INET, SOCK_DGRAM, 0);
@@ -50,6 +154,26 @@ struct Socket : IOutputSocket {
 		close(m_socket);
 	}
 
+	bool enableTxTime() override {
+#ifdef __linux__
+		auto const clock = getTxTimeClock(getOutgoingInterface(m_dstAddr));
+		if(clock < 0)
+			return false;
+
+		// the dropped datagrams are reported on the error queue
+		sock_txtime cfg {};
+		cfg.clockid = clock;
+		cfg.flags = SOF_TXTIME_REPORT_ERRORS;
+		if(setsockopt(m_socket, SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg)) != 0)
+			return false;
+
+		m_txTimeClock = clock;
+		return true;
+#else
+		return false;
+#endif
+	}
+
 	void send(const uint8_t* buffer, size_t len) override {
 		if(::sendto(m_socket, buffer, len, 0, (sockaddr*)&m_dstAddr, sizeof(m_dstAddr)) < 0) {
 			char msg[256];
@@ -58,6 +182,61 @@ struct Socket : IOutputSocket {
 		}
 	}
 
+#ifdef __linux__
+	void sendAt(const uint8_t* buffer, size_t len, int64_t txTimeInNs) override {
+		iovec iov { (void*)buffer, len };
+
+		uint8_t control[CMSG_SPACE(sizeof(uint64_t))] {};
+		msghdr msg {};
+		msg.msg_name = &m_dstAddr;
+		msg.msg_namelen = sizeof(m_dstAddr);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		auto cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_TXTIME;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+		// on the qdisc's clock. The TAI offset is read each time, as it follows the clock adjustments.
+		if(m_txTimeClock != CLOCK_MONOTONIC)
+			txTimeInNs += nowInNs(m_txTimeClock) - nowInNs(CLOCK_MONOTONIC);
+		uint64_t const txTime = txTimeInNs;
+		memcpy(CMSG_DATA(cmsg), &txTime, sizeof(txTime));
+
+		if(::sendmsg(m_socket, &msg, 0) < 0) {
+			char errMsg[256];
+			sprintf(errMsg, "UDP send %d bytes failed: %s", (int)len, strerror(errno));
+			throw runtime_error(errMsg);
+		}
+	}
+
+	int64_t getTxTimeDrops() override {
+		int64_t r = 0;
+		while(true) {
+			uint8_t control[256];
+			msghdr msg {};
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			if(::recvmsg(m_socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+				break;
+
+			for(auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+				if(cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR)
+					continue;
+				sock_extended_err err;
+				memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+				if(err.ee_origin == SO_EE_ORIGIN_TXTIME)
+					r++;
+			}
+		}
+		return r;
+	}
+
+	clockid_t m_txTimeClock = CLOCK_MONOTONIC;
+#endif
+
 	int m_socket = -1;
 	sockaddr_in m_dstAddr {};
 };
@@ -1,27 +1,101 @@
 #include "udp_output.hpp"
 #include "lib_modules/utils/factory.hpp" // registerModule
 #include "lib_modules/utils/helper.hpp"
+#include "lib_media/common/attributes.hpp" // PresentationTime
+#include "lib_utils/log_sink.hpp" // Info, Warning
+#include "lib_utils/format.hpp"
 #include "lib_utils/tools.hpp" // enforce
 #include "socket.hpp"
+#include <chrono>
+#include <cstdlib> // abs
+#include <thread>
 
 using namespace Modules;
 
 namespace {
 
+// how far in advance datagrams are handed to the kernel, with SO_TXTIME
+auto const TXTIME_LEAD_IN_NS = 2 * 1000 * 1000LL;
+
+// how often the SO_TXTIME drops are checked, in datagrams
+auto const TXTIME_CHECK_PERIOD = 64;
+
+// the user-space pacer spins for the last part of the wait: sleep_for() overshoots
+auto const SPIN_IN_NS = 200 * 1000LL;
+
+// beyond this, the timestamps are considered discontinuous
+auto const RESYNC_THRESHOLD_IN_NS = 1000 * 1000 * 1000LL;
+
+int64_t nowInNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int64_t clockToNs(int64_t time) {
+	return (time / IClock::Rate) * 1000000000LL + (time % IClock::Rate) * 1000000000LL / IClock::Rate;
+}
+
+void waitUntil(int64_t targetInNs) {
+	auto const delay = targetInNs - nowInNs();
+	if(delay > SPIN_IN_NS)
+		std::this_thread::sleep_for(std::chrono::nanoseconds(delay - SPIN_IN_NS));
+	while(nowInNs() < targetInNs) {
+	}
+}
+
 struct UdpOutput : ModuleS {
 	UdpOutput(KHost* host, UdpOutputConfig const& config)
-		: m_host(host) {
+		: m_host(host), m_paced(config.paced) {
 		char buffer[256];
 		sprintf(buffer, "%d.%d.%d.%d", config.ipAddr[0], config.ipAddr[1], config.ipAddr[2], config.ipAddr[3]);
 		m_socket = createOutputSocket(buffer, config.port);
+
+		if(m_paced) {
+			m_txTime = m_socket->enableTxTime();
+			m_host->log(Info, m_txTime ? "Pacing with SO_TXTIME" : "SO_TXTIME not supported by the qdisc: pacing in user-space");
+		}
 	}
 
 	void processOne(Data data) override {
-		m_socket->send(data->data().ptr, data->data().len);
+		auto const buf = data->data();
+
+		if(!m_paced) {
+			m_socket->send(buf.ptr, buf.len);
+			return;
+		}
+
+		auto const time = clockToNs(data->get<PresentationTime>().time);
+		auto const now = nowInNs();
+
+		if(m_origin == INT64_MIN || std::abs(m_origin + time - now) > RESYNC_THRESHOLD_IN_NS) {
+			if(m_origin != INT64_MIN)
+				m_host->log(Warning, format("timestamp discontinuity (%s ms): resyncing", (m_origin + time - now) / 1000000).c_str());
+			m_origin = now - time;
+		}
+
+		auto const txTime = m_origin + time;
+
+		if(m_txTime) {
+			waitUntil(txTime - TXTIME_LEAD_IN_NS);
+			m_socket->sendAt(buf.ptr, buf.len, txTime);
+
+			if(++m_sentAt % TXTIME_CHECK_PERIOD == 0) {
+				if(auto const drops = m_socket->getTxTimeDrops()) {
+					m_host->log(Warning, format("SO_TXTIME: the qdisc dropped %s datagrams: pacing in user-space", drops).c_str());
+					m_txTime = false;
+				}
+			}
+		} else {
+			waitUntil(txTime);
+			m_socket->send(buf.ptr, buf.len);
+		}
 	}
 
 	KHost* const m_host;
 	std::unique_ptr<IOutputSocket> m_socket;
+	bool const m_paced;
+	bool m_txTime = false;
+	int64_t m_sentAt = 0; // with SO_TXTIME
+	int64_t m_origin = INT64_MIN; // steady clock time of the timestamp zero, in ns
 };
 
 IModule* createObject(KHost* host, void* va) {
@@ -34,4 +108,3 @@ IModule* createObject(KHost* host, void* va) {
 auto const registered = Factory::registerModule("UdpOutput", &createObject);
 
 }
-
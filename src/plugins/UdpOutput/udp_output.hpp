@@ -3,5 +3,8 @@
 struct UdpOutputConfig {
 	int ipAddr[4];
 	int port;
-};
 
+	// send each datagram at the time given by its PresentationTime.
+	// Uses SO_TXTIME when the qdisc supports it, a user-space pacer otherwise.
+	bool paced = false;
+};
@@ -0,0 +1,205 @@
+#include "tests/tests.hpp"
+#include "lib_modules/modules.hpp"
+#include "lib_modules/utils/loader.hpp"
+#include "lib_media/common/attributes.hpp"
+#include "lib_utils/format.hpp"
+#include "plugins/RegulatorMono/regulator_mono.hpp"
+#include "../udp_output.hpp"
+#include <algorithm> // sort
+#include <climits> // INT64_MAX
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h> // timeval
+#include <unistd.h>
+
+using namespace Tests;
+using namespace Modules;
+
+namespace {
+
+auto const DATAGRAM_SIZE = 7 * 188;
+auto const NUM_DATAGRAMS = 300;
+auto const INTERVAL = IClock::Rate / 2000; // 500us: ~21Mbps
+
+// Captures the datagrams on the loopback, with kernel receive timestamps.
+struct LocalCapture {
+	LocalCapture() {
+		m_socket = socket(AF_INET, SOCK_DGRAM, 0);
+		ASSERT(m_socket >= 0);
+
+		int one = 1;
+		setsockopt(m_socket, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+		int size = 8 * 1024 * 1024;
+		setsockopt(m_socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+		timeval timeout { 2, 0 };
+		setsockopt(m_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+		sockaddr_in addr {};
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		ASSERT(bind(m_socket, (sockaddr*)&addr, sizeof(addr)) == 0);
+
+		socklen_t len = sizeof(addr);
+		getsockname(m_socket, (sockaddr*)&addr, &len);
+		port = ntohs(addr.sin_port);
+
+		m_thread = std::thread([this]() {
+			capture();
+		});
+	}
+
+	~LocalCapture() {
+		m_thread.join();
+		close(m_socket);
+	}
+
+	// wait for all the datagrams, returns the inter-arrival times in ns
+	std::vector<int64_t> intervals() {
+		m_thread.join();
+		m_thread = std::thread([]() {});
+		std::vector<int64_t> r;
+		for(size_t i=1; i < m_times.size(); ++i)
+			r.push_back(m_times[i] - m_times[i-1]);
+		return r;
+	}
+
+	int port = 0;
+
+private:
+	void capture() {
+		uint8_t buf[2048];
+		uint8_t control[256];
+		while((int)m_times.size() < NUM_DATAGRAMS) {
+			iovec iov { buf, sizeof(buf) };
+			msghdr msg {};
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			if(recvmsg(m_socket, &msg, 0) < 0)
+				break;
+
+			for(auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+				if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_TIMESTAMPNS) {
+					timespec ts;
+					memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+					m_times.push_back(ts.tv_sec * 1000000000LL + ts.tv_nsec);
+				}
+			}
+		}
+	}
+
+	int m_socket = -1;
+	std::vector<int64_t> m_times;
+	std::thread m_thread;
+};
+
+std::shared_ptr<IModule> createSender(int port, bool paced) {
+	UdpOutputConfig cfg {};
+	cfg.ipAddr[0] = 127;
+	cfg.ipAddr[3] = 1;
+	cfg.port = port;
+	cfg.paced = paced;
+	return loadModule("UdpOutput", &NullHost, &cfg);
+}
+
+void send(IModule* dst, int64_t start = 0) {
+	for(int i=0; i < NUM_DATAGRAMS; ++i) {
+		auto data = std::make_shared<DataRaw>(DATAGRAM_SIZE);
+		memset(data->buffer->data().ptr, 0, DATAGRAM_SIZE);
+		data->set(PresentationTime{ start + i * INTERVAL });
+		data->set(DecodingTime{ start + i * INTERVAL });
+		dst->getInput(0)->push(data);
+	}
+}
+
+struct Jitter {
+	int64_t p50, p99, max; // deviation from the expected interval, in ns
+};
+
+Jitter measureJitter(std::vector<int64_t> intervals) {
+	auto const expected = INTERVAL * 1000000000LL / IClock::Rate;
+	for(auto& i : intervals)
+		i = std::abs(i - expected);
+	std::sort(intervals.begin(), intervals.end());
+	return { intervals[intervals.size() / 2], intervals[intervals.size() * 99 / 100], intervals.back() };
+}
+
+void reportJitter(std::string name, Jitter j) {
+	Report(name + " jitter p50", j.p50 / 1000.0, "us");
+	Report(name + " jitter p99", j.p99 / 1000.0, "us");
+	Report(name + " jitter max", j.max / 1000.0, "us");
+}
+
+unittest("UdpOutput: paced, inter-departure jitter on loopback") {
+	LocalCapture capture;
+	auto sender = createSender(capture.port, true);
+	send(sender.get());
+
+	auto const intervals = capture.intervals();
+	ASSERT_EQUALS(NUM_DATAGRAMS - 1, (int)intervals.size());
+
+	int64_t total = 0;
+	for(auto i : intervals)
+		total += i;
+	auto const expected = (NUM_DATAGRAMS - 1) * INTERVAL * 1000000000LL / IClock::Rate;
+	ASSERT(total >= expected * 95 / 100 && total <= expected * 110 / 100);
+
+	auto const jitter = measureJitter(intervals);
+	ASSERT(jitter.p50 < 100 * 1000);
+}
+
+unittest("UdpOutput: unpaced sends immediately") {
+	LocalCapture capture;
+	auto sender = createSender(capture.port, false);
+	send(sender.get());
+
+	auto const intervals = capture.intervals();
+	ASSERT_EQUALS(NUM_DATAGRAMS - 1, (int)intervals.size());
+
+	int64_t total = 0;
+	for(auto i : intervals)
+		total += i;
+	ASSERT(total < (NUM_DATAGRAMS - 1) * INTERVAL * 1000000000LL / IClock::Rate / 2);
+}
+
+secondclasstest("UdpOutput: perf test, paced vs RegulatorMono jitter") {
+	// best of a few runs: the tail is dominated by the scheduling noise
+	auto const RUNS = 3;
+	Jitter paced { 0, INT64_MAX, 0 }, regulated { 0, INT64_MAX, 0 };
+	for(int run=0; run < RUNS; ++run) {
+		{
+			LocalCapture capture;
+			auto sender = createSender(capture.port, true);
+			send(sender.get());
+			auto const j = measureJitter(capture.intervals());
+			if(j.p99 < paced.p99)
+				paced = j;
+		}
+		{
+			LocalCapture capture;
+			auto sender = createSender(capture.port, false);
+			RegulatorMonoConfig cfg;
+			auto regulator = loadModule("RegulatorMono", &NullHost, &cfg);
+			ConnectOutputToInput(regulator->getOutput(0), sender->getInput(0));
+			// the regulator schedules on the clock: start the timestamps now
+			send(regulator.get(), fractionToClock(cfg.clock->now()));
+			auto const j = measureJitter(capture.intervals());
+			if(j.p99 < regulated.p99)
+				regulated = j;
+		}
+	}
+	reportJitter("UdpOutput paced", paced);
+	reportJitter("RegulatorMono", regulated);
+
+	// pacing in the output is at least as tight as an upstream regulator
+	ASSERT(paced.p50 < 100 * 1000);
+	ASSERT(paced.p99 <= regulated.p99 + 100 * 1000);
+}
+}
+#endif
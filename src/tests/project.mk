@@ -17,3 +17,15 @@ EXE_OTHER_SRCS+=$(shell find src $(SRC) -path "*/unittests/*.cpp" | sort)
 TARGETS+=$(BIN)/unittests.exe
 $(BIN)/unittests.exe: $(EXE_OTHER_SRCS:%=$(BIN)/%.o)
 TESTS_DIR+=$(CURDIR)/$(SRC)/tests
+
+#---------------------------------------------------------------
+# allocations.exe : counts the heap allocations on the packet hot paths.
+# It replaces the global operator new, so it can't be linked into unittests.exe.
+#---------------------------------------------------------------
+EXE_ALLOCATIONS_SRCS:=\
+  $(MYDIR)/allocations.cpp\
+  $(LIB_MODULES_SRCS)\
+  $(LIB_UTILS_SRCS)
+
+TARGETS+=$(BIN)/allocations.exe
+$(BIN)/allocations.exe: $(EXE_ALLOCATIONS_SRCS:%=$(BIN)/%.o)
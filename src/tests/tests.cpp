@@ -136,6 +136,10 @@ int RegisterTest(void (*fn)(), const char* testName, int type, const char* filen
 	return 0;
 }
 
+void Report(std::string name, double value, const char* unit) {
+	std::cout << "[" << name << "] " << value << " " << unit << std::endl;
+}
+
 void GetFuzzTestData(uint8_t const*& ptr, size_t& len) {
 	ptr = fuzzBuffer;
 	len = sizeof fuzzBuffer;
@@ -48,6 +48,9 @@ void Fail(char const* file, int line, const char* msg);
 void FailAssertEquals(char const* file, int line, std::string caption, std::string expected, std::string actual);
 void GetFuzzTestData(uint8_t const*& ptr, size_t& len);
 
+// prints a measured figure, in the format of Tools::Profiler
+void Report(std::string name, double value, const char* unit);
+
 template<typename T>
 std::string ToString(T const& val) {
 	std::stringstream ss;